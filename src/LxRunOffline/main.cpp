@@ -1,8 +1,15 @@
 #include <boost/program_options.hpp>
+#include <LxRunOffline/async.h>
+#include <LxRunOffline/batch.h>
+#include <LxRunOffline/diff.h>
 #include <LxRunOffline/error.h>
+#include <LxRunOffline/ext4.h>
 #include <LxRunOffline/fs.h>
+#include <LxRunOffline/manifest.h>
+#include <LxRunOffline/move.h>
 #include <LxRunOffline/reg.h>
 #include <LxRunOffline/shortcut.h>
+#include <LxRunOffline/transform.h>
 #include <LxRunOffline/utils.h>
 #include "config.h"
 
@@ -15,307 +22,848 @@ static void check_running(crwstr name) {
 	}
 }
 
-#ifdef __MINGW32__
-//extern "C"
-#endif
-int wmain(int argc, wchar_t **argv) {
-	const auto out_mode = _setmode(_fileno(stdout), _O_U16TEXT);
-	const auto err_mode = _setmode(_fileno(stderr), _O_U16TEXT);
-	if (out_mode == -1 || err_mode == -1) {
-		log_warning(L"Failed to set output mode to UTF-16.");
+// The disk of a distro can't change while differencing disks are based on it, so actions that would change, move or
+// remove it are refused.
+static void check_no_children(crwstr name) {
+	const auto children = list_distro_children(name);
+	if (!children.empty()) {
+		throw lro_error::from_other(err_msg::err_has_children, { name, boost::join(children, L", ") });
 	}
+}
 
-	wstr name;
-	po::options_description desc("Options");
-	desc.add_options()(",n", po::wvalue<wstr>(&name)->required(), "Name of the distribution");
+// Called when a child of "parent" no longer depends on its disk. The disk is made writable again after the last one.
+static void release_parent(crwstr parent) {
+	if (parent.empty() || !list_distro_children(parent).empty()) return;
+	try {
+		unlock_wsl2_disk(get_distro_dir(parent));
+	} catch (const lro_error &e) {
+		log_warning(e.format());
+	}
+}
+
+// For actions that turn a differencing disk into a standalone one.
+static void detach_parent(crwstr name) {
+	const auto parent = get_distro_parent(name);
+	set_distro_parent(name, L"");
+	release_parent(parent);
+}
+
+static std::unique_ptr<fs_reader> open_distro_reader(crwstr name, const bool wsl2) {
+	if (wsl2) {
+		// The filesystem can't be read consistently while the VM has it mounted.
+		check_running(name);
+		return std::make_unique<ext4_reader>(get_distro_dir(name) + L"\\ext4.vhdx");
+	}
+	return select_wsl_reader(get_distro_version(name), get_distro_dir(name));
+}
+
+// Starts a detached LxRunOffline process that deletes the directory. Returns false if it can't be started.
+static bool spawn_delete(crwstr dir, const uint32_t jobs) {
+	wchar_t ep[MAX_PATH];
+	if (!GetModuleFileName(nullptr, ep, MAX_PATH)) return false;
+	auto cmd = L'"' + wstr(ep) + L"\" delete-dir -d \"" + dir + L"\" -j " + std::to_wstring(jobs);
+	STARTUPINFO si = {};
+	si.cb = sizeof si;
+	PROCESS_INFORMATION pi;
+	if (!CreateProcess(
+		ep, cmd.data(), nullptr, nullptr, false,
+		DETACHED_PROCESS | CREATE_NEW_PROCESS_GROUP, nullptr, nullptr, &si, &pi
+	)) {
+		return false;
+	}
+	CloseHandle(pi.hThread);
+	CloseHandle(pi.hProcess);
+	return true;
+}
+
+static int run_action(const int argc, wchar_t **argv, po::options_description &desc, std::wostream &out);
+
+// Runs the commands of the "batch" action and writes a line of result for each one. Returns whether all succeeded.
+static bool run_batch(FILE *in, const uint32_t jobs) {
+	std::mutex out_mutex;
+	std::atomic<bool> failed = false;
+	const auto report = [&](crwstr id, const int status, crwstr output, crwstr error) {
+		if (status) failed = true;
+		const std::lock_guard<std::mutex> lock(out_mutex);
+		std::wcout << format_batch_result(id, status, output, error) << std::endl;
+	};
+	batch_runner runner(jobs, [&](const batch_command &cmd) {
+		std::vector<wchar_t *> argv { const_cast<wchar_t *>(L"LxRunOffline.exe") };
+		for (const auto &a : cmd.args) argv.push_back(const_cast<wchar_t *>(a.c_str()));
+		po::options_description desc("Options");
+		std::wostringstream out;
+		int status = 1;
+		wstr error;
+		try {
+			if (!wcscmp(argv[1], L"batch")) throw lro_error::from_other(err_msg::err_invalid_action, { argv[1] });
+			check_batch_command(cmd);
+			status = run_action(static_cast<int>(argv.size()), argv.data(), desc, out);
+		} catch (const lro_error &e) {
+			error = e.format();
+		} catch (const po::error &e) {
+			error = from_utf8(e.what());
+		} catch (const std::exception &e) {
+			error = from_utf8(e.what());
+		}
+		// Also printed and written to the file given by "--log", like the error of a single command.
+		if (!error.empty()) log_error(cmd.id + L": " + error);
+		report(cmd.id, status, out.str(), error);
+	});
+	std::string line;
+	char buf[4096];
+	while (fgets(buf, sizeof buf, in)) {
+		line += buf;
+		if (line.back() != '\n' && !feof(in)) continue;
+		while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.pop_back();
+		if (line.find_first_not_of(" \t") != std::string::npos) {
+			try {
+				runner.submit(parse_batch_command(from_utf8(line.c_str())));
+			} catch (const lro_error &e) {
+				report(L"null", 1, L"", e.format());
+			}
+		}
+		line.clear();
+	}
+	runner.wait();
+	return !failed;
+}
+
+// Adds a rule such as "1000:1001" to a map of IDs.
+static void add_id_mapping(std::map<uint32_t, uint32_t> &ids, crwstr rule) {
+	static const std::wregex re(L"(\\d{1,10}):(\\d{1,10})");
+	std::wsmatch m;
+	if (!std::regex_match(rule, m, re)) throw lro_error::from_other(err_msg::err_id_map, { rule });
+	const auto from = std::stoull(m[1].str()), to = std::stoull(m[2].str());
+	if (from > UINT32_MAX || to > UINT32_MAX) throw lro_error::from_other(err_msg::err_id_map, { rule });
+	ids[static_cast<uint32_t>(from)] = static_cast<uint32_t>(to);
+}
+
+// Reads a mapping table with lines such as "uid 1000:1001" or "gid 1000:1001". Text after "#" is ignored.
+static void read_id_mappings(crwstr file, std::map<uint32_t, uint32_t> &uids, std::map<uint32_t, uint32_t> &gids) {
+	const unique_ptr_del<FILE *> f(_wfopen(file.c_str(), L"rb"), &fclose_safe);
+	if (!f.get()) throw lro_error::from_win32_last(err_msg::err_open_file, { file });
+	char buf[256];
+	while (fgets(buf, sizeof buf, f.get())) {
+		auto line = from_utf8(buf);
+		line.erase(std::min(line.find(L'#'), line.size()));
+		boost::trim(line);
+		if (line.empty()) continue;
+		if (!line.compare(0, 4, L"uid ")) add_id_mapping(uids, boost::trim_copy(line.substr(4)));
+		else if (!line.compare(0, 4, L"gid ")) add_id_mapping(gids, boost::trim_copy(line.substr(4)));
+		else throw lro_error::from_other(err_msg::err_id_map, { line });
+	}
+}
+
+// Runs a reader through the transform rules, if there are any.
+static void run_transformed(fs_reader &reader, fs_writer &writer, const std::vector<transform_rule> &rules) {
+	if (rules.empty()) {
+		reader.run(writer);
+	} else {
+		transform_writer tw(writer, rules);
+		reader.run(tw);
+	}
+}
+
+static int run_action(const int argc, wchar_t **argv, po::options_description &desc, std::wostream &out) {
+	wstr name, log_path;
+	desc.add_options()
+		(",n", po::wvalue<wstr>(&name), "Name of the distribution")
+		("log", po::wvalue<wstr>(&log_path), "Also write all warnings to this file, including the ones left out of "
+			"the summary printed at the end.");
+	std::vector<wstr> transform_args;
+	wstr transform_file;
+	const auto add_transform_options = [&] {
+		desc.add_options()
+			("transform", po::wvalue<std::vector<wstr>>(&transform_args)->composing(),
+				"A rule changing the files on the way, such as \"drop /usr/share/doc\", \"move <path> <path>\", "
+				"\"mode <path> <octal>\", \"owner <path> <uid>:<gid>\", \"content <path> <file>\" or "
+				"\"text <path> <text>\". A path matches everything below it, and \"*\" in it matches part of a file "
+				"name. Rules apply in order. This argument can be repeated.")
+			("transform-file", po::wvalue<wstr>(&transform_file),
+				"A file with a transform rule on each line. Its rules apply before those given by \"--transform\".");
+	};
+	const auto load_transform_rules = [&] {
+		std::vector<transform_rule> rules;
+		if (!transform_file.empty()) rules = read_transform_rules(transform_file);
+		for (crwstr r : transform_args) rules.push_back(parse_transform_rule(r));
+		return rules;
+	};
 	po::variables_map vm;
-	auto parse_args = [&]() {
+	auto parse_args = [&](const bool need_name = true) {
 		po::store(po::parse_command_line(argc - 1, argv + 1, desc), vm);
 		po::notify(vm);
+		if (need_name && name.empty()) throw po::required_option("-n");
+		if (!log_path.empty()) set_log_file(log_path);
 	};
 
-	try {
-		if (get_win_build() < 17134) {
-			throw lro_error::from_other(err_msg::err_version_old, { L"1803", L"17134" });
+	if (argc < 2) {
+		throw lro_error::from_other(err_msg::err_no_action, {});
+	} else if (!wcscmp(argv[1], L"version")) {
+		out << L"LxRunOffline " << LXRUNOFFLINE_VERSION_STR << '\n';
+	} else if (!wcscmp(argv[1], L"l") || !wcscmp(argv[1], L"list")) {
+		for (crwstr s : list_distros()) {
+			out << s << '\n';
 		}
-		if (argc < 2) {
-			throw lro_error::from_other(err_msg::err_no_action, {});
-		} else if (!wcscmp(argv[1], L"version")) {
-			std::wcout << L"LxRunOffline " << LXRUNOFFLINE_VERSION_STR << '\n';
-		} else if (!wcscmp(argv[1], L"l") || !wcscmp(argv[1], L"list")) {
-			for (crwstr s : list_distros()) {
-				std::wcout << s << '\n';
-			}
-		} else if (!wcscmp(argv[1], L"gd") || !wcscmp(argv[1], L"get-default")) {
-			std::wcout << get_default_distro() << '\n';
-		} else if (!wcscmp(argv[1], L"sd") || !wcscmp(argv[1], L"set-default")) {
-			parse_args();
-			set_default_distro(name);
-		} else if (!wcscmp(argv[1], L"i") || !wcscmp(argv[1], L"install")) {
-			wstr dir, file, root, conf_path;
-			uint32_t ver;
-			bool shortcut;
-			desc.add_options()
-				(",d", po::wvalue<wstr>(&dir)->required(), "The directory to install the distribution into.")
-				(",f", po::wvalue<wstr>(&file)->required(),
-					"The tar file containing the root filesystem of the distribution to be installed. If a file of the "
-					"same name with a .xml extension exists and \"-c\" isn't specified, that file will be imported as "
-					"a config file.")
-				(",r", po::wvalue<wstr>(&root), "The directory in the tar file to extract. This argument is optional.")
-				(",c", po::wvalue<wstr>(&conf_path), "The config file to use. This argument is optional.")
-				(",v", po::wvalue<uint32_t>(&ver)->default_value(get_win_build() >= 17763 ? 2 : 1),
-					"The version of filesystem to use, latest available one if not specified.")
-				(",s", po::bool_switch(&shortcut), "Create a shortcut for this distribution on Desktop.");
-			parse_args();
-			reg_config conf;
-			if (!conf_path.empty()) conf.load_file(conf_path);
-			else {
-				try {
-					conf.load_file(file + L".xml");
-				} catch (const lro_error &e) {
-					if (e.msg_code == err_msg::err_open_file) {
-						if (e.err_code != HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) {
-							log_warning(e.format());
-						}
-					} else throw;
-				}
+	} else if (!wcscmp(argv[1], L"gd") || !wcscmp(argv[1], L"get-default")) {
+		out << get_default_distro() << '\n';
+	} else if (!wcscmp(argv[1], L"sd") || !wcscmp(argv[1], L"set-default")) {
+		parse_args();
+		set_default_distro(name);
+	} else if (!wcscmp(argv[1], L"i") || !wcscmp(argv[1], L"install")) {
+		wstr dir, file, root, conf_path, manifest_path;
+		std::vector<wstr> also;
+		uint32_t ver;
+		uint64_t disk_size;
+		bool shortcut, wsl2, prescan;
+		desc.add_options()
+			(",d", po::wvalue<wstr>(&dir)->required(), "The directory to install the distribution into.")
+			(",f", po::wvalue<wstr>(&file)->required(),
+				"The tar file containing the root filesystem of the distribution to be installed, or \"-\" to read "
+				"it from standard input. If a file of the same name with a .xml extension exists and \"-c\" isn't "
+				"specified, that file will be imported as a config file.")
+			(",r", po::wvalue<wstr>(&root), "The directory in the tar file to extract. This argument is optional.")
+			(",c", po::wvalue<wstr>(&conf_path), "The config file to use. This argument is optional.")
+			(",v", po::wvalue<uint32_t>(&ver)->default_value(get_win_build() >= 17763 ? 2 : 1),
+				"The version of filesystem to use, latest available one if not specified.")
+			(",s", po::bool_switch(&shortcut), "Create a shortcut for this distribution on Desktop.")
+			("wsl2", po::bool_switch(&wsl2),
+				"Install as a WSL2 distribution by writing its virtual disk directly. This is implied by a config "
+				"file exported from a WSL2 distribution.")
+			("disk-size", po::wvalue<uint64_t>(&disk_size)->default_value(256),
+				"The size of the virtual disk of a WSL2 distribution in GiB.")
+			("manifest", po::wvalue<wstr>(&manifest_path),
+				"Write a manifest of the installed files to this path, which can be used by the \"verify\" action. "
+				"This argument is optional.")
+			("also", po::wvalue<std::vector<wstr>>(&also)->composing(),
+				"Also install the same files as another distribution, given as \"<name>=<directory>\". The tar file is "
+				"only read once for all of them. This argument can be repeated.")
+			("prescan", po::bool_switch(&prescan),
+				"Read the headers of the tar file first, and stop before installing anything if there isn't enough "
+				"free space.");
+		add_transform_options();
+		parse_args();
+		const auto rules = load_transform_rules();
+		std::vector<std::pair<wstr, wstr>> targets { { name, dir } };
+		for (crwstr s : also) {
+			const auto p = s.find(L'=');
+			if (p == 0 || p == wstr::npos || p + 1 == s.size()) throw po::invalid_option_value(s);
+			targets.emplace_back(s.substr(0, p), s.substr(p + 1));
+		}
+		reg_config conf;
+		if (!conf_path.empty()) conf.load_file(conf_path);
+		else if (file != L"-") {
+			try {
+				conf.load_file(file + L".xml");
+			} catch (const lro_error &e) {
+				if (e.msg_code == err_msg::err_open_file) {
+					if (e.err_code != HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) {
+						log_warning(e.format());
+					}
+				} else throw;
 			}
-			register_distro(name, dir, ver);
-			conf.configure_distro(name, config_all);
-			auto writer = select_wsl_writer(ver, dir);
-			archive_reader(file, root).run(*writer);
-			if (shortcut) {
-				wchar_t *s;
-				auto hr = SHGetKnownFolderPath(FOLDERID_Desktop, 0, nullptr, &s);
-				if (FAILED(hr)) throw lro_error::from_hresult(err_msg::err_create_shortcut, {}, hr);
-				unique_ptr_del<wchar_t *> dp(s, &CoTaskMemFree);
-				create_shortcut(name, dp.get() + (L'\\' + name + L".lnk"), L"");
+		}
+		if (wsl2) conf.set_wsl2(true);
+		scan_result scan {};
+		if (prescan && file == L"-") {
+			log_warning(L"Standard input can't be scanned before installing.");
+		} else if (prescan) {
+			scan = scan_archive(file, root);
+			std::vector<wstr> dirs;
+			for (const auto &t : targets) dirs.push_back(t.second);
+			check_free_space(dirs, scan);
+		}
+		for (const auto &t : targets) {
+			register_distro(t.first, t.second, conf.is_wsl2() ? 2 : ver);
+			conf.configure_distro(t.first, config_all);
+		}
+		const auto install = [&](fs_writer &writer) {
+			archive_reader reader(file, root);
+			if (manifest_path.empty()) {
+				run_transformed(reader, writer, rules);
+			} else {
+				manifest_writer mw(writer, manifest_path);
+				run_transformed(reader, mw, rules);
+				mw.close();
 			}
-			log_warning(
-				L"Love this tool? Would you like to make a donation: "
-				"https://github.com/DDoSolitary/LxRunOffline/blob/master/README.md#donation"
-			);
-		} else if (!wcscmp(argv[1], L"ui") || !wcscmp(argv[1], L"uninstall")) {
-			parse_args();
-			check_running(name);
-			auto dir = get_distro_dir(name);
+		};
+		std::vector<std::unique_ptr<fs_writer>> writers;
+		for (const auto &t : targets) {
+			if (conf.is_wsl2()) {
+				auto writer = create_wsl2_writer(t.second, disk_size << 30);
+				writer->check_space(scan);
+				writers.push_back(std::move(writer));
+			} else writers.push_back(select_wsl_writer(ver, t.second));
+		}
+		if (writers.size() == 1) {
+			install(*writers[0]);
+		} else {
+			std::vector<fs_writer *> pw;
+			for (const auto &w : writers) pw.push_back(w.get());
+			tee_writer tw(pw);
+			install(tw);
+			tw.close();
+		}
+		if (conf.is_wsl2()) {
+			for (const auto &w : writers) static_cast<ext4_writer &>(*w).close();
+		}
+		if (shortcut) {
+			wchar_t *s;
+			auto hr = SHGetKnownFolderPath(FOLDERID_Desktop, 0, nullptr, &s);
+			if (FAILED(hr)) throw lro_error::from_hresult(err_msg::err_create_shortcut, {}, hr);
+			unique_ptr_del<wchar_t *> dp(s, &CoTaskMemFree);
+			for (const auto &t : targets) create_shortcut(t.first, dp.get() + (L'\\' + t.first + L".lnk"), L"");
+		}
+		log_warning(
+			L"Love this tool? Would you like to make a donation: "
+			"https://github.com/DDoSolitary/LxRunOffline/blob/master/README.md#donation"
+		);
+	} else if (!wcscmp(argv[1], L"ui") || !wcscmp(argv[1], L"uninstall")) {
+		uint32_t jobs;
+		bool background;
+		desc.add_options()
+			("background", po::bool_switch(&background),
+				"Move the installation directory aside and delete it in a separate low-priority process, "
+				"instead of waiting for it to be deleted. If that fails, the error is written to a file named "
+				"after the directory with a .log extension.")
+			(",j", po::wvalue<uint32_t>(&jobs)->default_value(0),
+				"Number of directories to delete in parallel, number of processors if not specified.");
+		parse_args();
+		check_running(name);
+		check_no_children(name);
+		const auto parent = get_distro_parent(name);
+		auto dir = get_distro_dir(name);
+		while (!dir.empty() && dir.back() == L'\\') dir.pop_back();
+		if (background) {
+			// Renaming within the same directory is atomic, so the distro is either still there or completely
+			// gone when this returns.
+			const auto trash = dir + L".deleting-" + std::to_wstring(GetTickCount64());
+			if (!move_directory(dir, trash)) throw lro_error::from_win32_last(err_msg::err_delete_dir, { dir });
 			unregister_distro(name);
-			delete_directory(dir);
-		} else if (!wcscmp(argv[1], L"rg") || !wcscmp(argv[1], L"register")) {
-			wstr dir, conf_path;
-			desc.add_options()
-				(",d", po::wvalue<wstr>(&dir)->required(), "The directory containing the distribution.")
-				(",c", po::wvalue<wstr>(&conf_path), "The config file to use. This argument is optional.");
-			parse_args();
-			const auto is_wsl2 = detect_wsl2(dir);
-			reg_config conf(is_wsl2);
-			if (!conf_path.empty()) conf.load_file(conf_path);
-			register_distro(name, dir, is_wsl2 ? 2 : detect_version(dir));
-			conf.configure_distro(name, config_all);
-		} else if (!wcscmp(argv[1], L"ur") || !wcscmp(argv[1], L"unregister")) {
-			parse_args();
+			if (!spawn_delete(trash, jobs)) delete_directory(trash, jobs);
+		} else {
 			unregister_distro(name);
-		} else if (!wcscmp(argv[1], L"m") || !wcscmp(argv[1], L"move")) {
-			wstr dir;
-			desc.add_options()(",d", po::wvalue<wstr>(&dir)->required(), "The directory to move the distribution to.");
-			parse_args();
-			check_running(name);
-			auto sp = get_distro_dir(name);
-			if (!move_directory(sp, dir)) {
+			delete_directory(dir, jobs);
+		}
+		release_parent(parent);
+	} else if (!wcscmp(argv[1], L"delete-dir")) {
+		// The worker started by "uninstall --background". It isn't listed in the help.
+		wstr dir;
+		uint32_t jobs;
+		desc.add_options()
+			(",d", po::wvalue<wstr>(&dir)->required(), "The directory to delete.")
+			(",j", po::wvalue<uint32_t>(&jobs)->default_value(0), "Number of directories to delete in parallel.");
+		parse_args(false);
+		SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+		try {
+			delete_directory(dir, jobs);
+		} catch (const lro_error &e) {
+			// The worker is detached from the console, so the error is left next to the directory instead.
+			const unique_ptr_del<FILE *> f(_wfopen((dir + L".log").c_str(), L"wb"), &fclose_safe);
+			if (f) fputs(to_utf8(L"[ERROR] " + e.format()).get(), f.get());
+			throw;
+		}
+	} else if (!wcscmp(argv[1], L"rg") || !wcscmp(argv[1], L"register")) {
+		wstr dir, conf_path;
+		desc.add_options()
+			(",d", po::wvalue<wstr>(&dir)->required(), "The directory containing the distribution.")
+			(",c", po::wvalue<wstr>(&conf_path), "The config file to use. This argument is optional.");
+		parse_args();
+		const auto is_wsl2 = detect_wsl2(dir);
+		reg_config conf(is_wsl2);
+		if (!conf_path.empty()) conf.load_file(conf_path);
+		register_distro(name, dir, is_wsl2 ? 2 : detect_version(dir));
+		conf.configure_distro(name, config_all);
+	} else if (!wcscmp(argv[1], L"ur") || !wcscmp(argv[1], L"unregister")) {
+		parse_args();
+		// The links to the children are recorded by ID, which changes when it's registered again.
+		check_no_children(name);
+		unregister_distro(name);
+	} else if (!wcscmp(argv[1], L"m") || !wcscmp(argv[1], L"move")) {
+		wstr dir, backup;
+		uint32_t window;
+		bool prescan;
+		desc.add_options()
+			(",d", po::wvalue<wstr>(&dir)->required(), "The directory to move the distribution to.")
+			("backup", po::wvalue<wstr>(&backup),
+				"Also export the distribution to this tar file, like the \"export\" action. When a WSL1 distribution "
+				"is copied to another volume, its files are read only once for both. This argument is optional.")
+			("window", po::wvalue<uint32_t>(&window)->default_value(0),
+				"When moving a WSL1 distribution to another volume, delete each file as soon as its copy is on "
+				"disk, keeping at most this many MiB copied but not yet deleted. If the move fails, the files are "
+				"left split between both directories. By default, nothing is deleted until everything is copied.")
+			("prescan", po::bool_switch(&prescan),
+				"When the distribution has to be copied to another volume, scan it first and stop before copying "
+				"anything if there isn't enough free space.");
+		parse_args();
+		check_running(name);
+		check_no_children(name);
+		reg_config conf;
+		conf.load_distro(name, config_all);
+		auto sp = get_distro_dir(name);
+		auto exported = false;
+		if (!move_directory(sp, dir)) {
+			scan_result scan {};
+			if (prescan) {
+				scan = conf.is_wsl2() ? scan_wsl2_disk(sp) : scan_wsl(get_distro_version(name), sp);
+				auto need = scan;
+				// Files are deleted while copying, so only the window has to fit.
+				if (window) need.bytes = std::min(need.bytes, static_cast<uint64_t>(window) << 20);
+				check_free_space(dir, need);
+			}
+			if (conf.is_wsl2()) {
+				copy_wsl2_disk(sp, dir);
+			} else {
 				auto ver = get_distro_version(name);
 				auto writer = select_wsl_writer(ver, dir);
-				select_wsl_reader(ver, sp)->run_checked(*writer);
-				delete_directory(sp);
+				auto reader = select_wsl_reader(ver, sp);
+				reader->total_bytes = scan.bytes;
+				std::unique_ptr<move_writer> mw;
+				if (window) {
+					mw = std::make_unique<move_writer>(
+						*writer, *select_wsl_path(ver, sp), static_cast<uint64_t>(window) << 20
+					);
+				}
+				fs_writer &target = mw ? static_cast<fs_writer &>(*mw) : *writer;
+				if (backup.empty()) {
+					reader->run_checked(target);
+				} else {
+					archive_writer aw(backup);
+					tee_writer tw({ &target, &aw });
+					reader->run_checked(tw);
+					tw.close();
+					exported = true;
+				}
+				if (mw) mw->close();
 			}
-			set_distro_dir(name, dir);
-		} else if (!wcscmp(argv[1], L"d") || !wcscmp(argv[1], L"duplicate")) {
-			wstr new_name, dir, conf_path;
-			uint32_t ver;
-			desc.add_options()
-				(",d", po::wvalue<wstr>(&dir)->required(), "The directory to copy the distribution to.")
-				(",N", po::wvalue<wstr>(&new_name)->required(), "Name of the new distribution.")
-				(",c", po::wvalue<wstr>(&conf_path), "The config file to use. This argument is optional.")
-				(",v", po::wvalue<uint32_t>(&ver)->default_value(-1),
-					"The version of filesystem to use, same as source if not specified.");
-			parse_args();
-			reg_config conf;
-			conf.load_distro(name, config_all);
-			auto is_wsl2 = conf.is_wsl2();
-			if (!conf_path.empty()) conf.load_file(conf_path);
-			is_wsl2 |= conf.is_wsl2();
-			if (is_wsl2 && ~ver) throw lro_error::from_other(err_msg::err_wsl2_unsupported, { L"-v" });
-			auto ov = get_distro_version(name);
-			auto nv = ~ver ? ver : ov;
-			register_distro(new_name, dir, nv);
-			conf.configure_distro(new_name, config_all);
+			delete_directory(sp);
+			// The copy of a differencing disk includes the data of its parent.
+			if (conf.is_wsl2()) detach_parent(name);
+		}
+		set_distro_dir(name, dir);
+		if (!backup.empty()) {
+			// Nothing has been read if the directory could be renamed or the virtual disk was copied as a whole.
+			if (!exported) {
+				archive_writer aw(backup);
+				open_distro_reader(name, conf.is_wsl2())->run(aw);
+			}
+			conf.save_file(backup + L".xml");
+		}
+	} else if (!wcscmp(argv[1], L"d") || !wcscmp(argv[1], L"duplicate")) {
+		wstr new_name, dir, conf_path;
+		uint32_t ver;
+		uint64_t disk_size;
+		bool wsl2, differencing, prescan;
+		desc.add_options()
+			(",d", po::wvalue<wstr>(&dir)->required(), "The directory to copy the distribution to.")
+			(",N", po::wvalue<wstr>(&new_name)->required(), "Name of the new distribution.")
+			(",c", po::wvalue<wstr>(&conf_path), "The config file to use. This argument is optional.")
+			(",v", po::wvalue<uint32_t>(&ver)->default_value(-1),
+				"The version of filesystem to use, same as source if not specified.")
+			("wsl2", po::bool_switch(&wsl2),
+				"Convert the copy to a WSL2 distribution by writing its virtual disk directly.")
+			("disk-size", po::wvalue<uint64_t>(&disk_size)->default_value(256),
+				"The size of the virtual disk in GiB when converting to WSL2. A WSL2 distribution keeps the size of "
+				"its disk.")
+			("differencing", po::bool_switch(&differencing),
+				"Create the virtual disk of the copy as a differencing disk based on that of the source, which is "
+				"made read-only. The source can't be run, moved, compacted or removed until every such copy is "
+				"flattened or uninstalled. Only supported for WSL2 distributions.")
+			("prescan", po::bool_switch(&prescan),
+				"Scan the distribution first, and stop before copying anything if there isn't enough free space.");
+		parse_args();
+		reg_config conf;
+		conf.load_distro(name, config_all);
+		const auto src_wsl2 = conf.is_wsl2();
+		if (!conf_path.empty()) conf.load_file(conf_path);
+		const auto is_wsl2 = src_wsl2 || wsl2 || conf.is_wsl2();
+		if (is_wsl2 && ~ver) throw lro_error::from_other(err_msg::err_wsl2_unsupported, { L"-v" });
+		if (differencing && !src_wsl2) {
+			throw lro_error::from_other(err_msg::err_wsl2_required, { L"--differencing" });
+		}
+		conf.set_wsl2(is_wsl2);
+		auto ov = get_distro_version(name);
+		auto nv = ~ver ? ver : ov;
+		if (src_wsl2) check_running(name);
+		const auto sp = get_distro_dir(name);
+		scan_result scan {};
+		// A differencing disk starts out empty.
+		if (prescan && !differencing) {
+			scan = src_wsl2 ? scan_wsl2_disk(sp) : scan_wsl(ov, sp);
+			check_free_space(dir, scan);
+		}
+		register_distro(new_name, dir, is_wsl2 ? 2 : nv);
+		conf.configure_distro(new_name, config_all);
+		if (differencing) {
+			create_differencing_wsl2_disk(sp, dir);
+			set_distro_parent(new_name, name);
+		} else if (src_wsl2) {
+			copy_wsl2_disk(sp, dir);
+		} else if (is_wsl2) {
+			const auto writer = create_wsl2_writer(dir, disk_size << 30);
+			writer->check_space(scan);
+			const auto reader = select_wsl_reader(ov, sp);
+			reader->total_bytes = scan.bytes;
+			reader->run(*writer);
+			writer->close();
+		} else {
 			auto writer = select_wsl_writer(nv, dir);
-			select_wsl_reader(ov, get_distro_dir(name))->run_checked(*writer);
-		} else if (!wcscmp(argv[1], L"e") || !wcscmp(argv[1], L"export")) {
-			wstr file;
-			desc.add_options()(
-				",f", po::wvalue<wstr>(&file)->required(),
-				"Path to the .tar.gz file to export to. A config file will also be exported to this file name with a "
-				".xml extension."
-			);
-			parse_args();
+			const auto reader = select_wsl_reader(ov, sp);
+			reader->total_bytes = scan.bytes;
+			reader->run_checked(*writer);
+		}
+	} else if (!wcscmp(argv[1], L"e") || !wcscmp(argv[1], L"export")) {
+		wstr file, manifest_path;
+		desc.add_options()
+			(",f", po::wvalue<wstr>(&file)->required(),
+				"Path to the tar file to export to. The compression format is chosen by the file extension, which can "
+				"be .tar.gz (.tgz), .tar.xz, .tar.zst, .tar.bz2, .tar.lz4 or .tar. A config file will also be "
+				"exported to this file name with a .xml extension. \"-\" writes a .tar.gz to standard output without a "
+				"config file.")
+			("manifest", po::wvalue<wstr>(&manifest_path),
+				"Write a manifest of the exported files to this path, which can be used by the \"verify\" action. "
+				"This argument is optional.");
+		add_transform_options();
+		parse_args();
+		const auto rules = load_transform_rules();
+		reg_config conf;
+		conf.load_distro(name, config_all);
+		const auto reader = open_distro_reader(name, conf.is_wsl2());
+		archive_writer writer(file);
+		if (manifest_path.empty()) {
+			run_transformed(*reader, writer, rules);
+		} else {
+			manifest_writer mw(writer, manifest_path);
+			run_transformed(*reader, mw, rules);
+			mw.close();
+		}
+		if (file != L"-") conf.save_file(file + L".xml");
+	} else if (!wcscmp(argv[1], L"cv") || !wcscmp(argv[1], L"convert")) {
+		wstr file, root, output;
+		desc.add_options()
+			(",f", po::wvalue<wstr>(&file)->required(),
+				"The tar file to convert, or \"-\" to read it from standard input.")
+			(",r", po::wvalue<wstr>(&root), "The directory in the tar file to convert. This argument is optional.")
+			(",o", po::wvalue<wstr>(&output)->required(),
+				"Path to the tar file to write. The compression format is chosen by the file extension, which can be "
+				".tar.gz (.tgz), .tar.xz, .tar.zst, .tar.bz2, .tar.lz4 or .tar. \"-\" writes a .tar.gz to standard "
+				"output.");
+		add_transform_options();
+		parse_args(false);
+		const auto rules = load_transform_rules();
+		archive_writer writer(output);
+		async_writer aw(writer);
+		archive_reader reader(file, root);
+		run_transformed(reader, aw, rules);
+		aw.close();
+	} else if (!wcscmp(argv[1], L"vf") || !wcscmp(argv[1], L"verify")) {
+		wstr file;
+		uint32_t jobs;
+		desc.add_options()
+			(",f", po::wvalue<wstr>(&file)->required(), "The manifest file to verify against.")
+			(",j", po::wvalue<uint32_t>(&jobs)->default_value(0),
+				"Number of files to hash in parallel, number of processors if not specified.");
+		parse_args();
+		reg_config conf;
+		conf.load_distro(name, config_flags);
+		if (conf.is_wsl2()) throw lro_error::from_other(err_msg::err_wsl2_unsupported, { L"verify" });
+		const auto cnt = verify_manifest(
+			get_distro_version(name), get_distro_dir(name), file, jobs,
+			[&](crwstr kind, crwstr path) { out << kind << L'\t' << path << L'\n'; }
+		);
+		if (cnt) throw lro_error::from_other(err_msg::err_verify_failed, { std::to_wstring(cnt) });
+	} else if (!wcscmp(argv[1], L"df") || !wcscmp(argv[1], L"diff")) {
+		wstr other, file, root;
+		uint32_t jobs;
+		desc.add_options()
+			(",N", po::wvalue<wstr>(&other), "Name of the distribution to compare with.")
+			(",f", po::wvalue<wstr>(&file), "The tar file to compare with, if \"-N\" isn't specified.")
+			(",r", po::wvalue<wstr>(&root), "The directory in the tar file to compare. This argument is optional.")
+			(",j", po::wvalue<uint32_t>(&jobs)->default_value(0),
+				"Number of files to hash in parallel, number of processors if not specified.");
+		parse_args();
+		if (other.empty() == file.empty()) throw po::error("exactly one of \"-N\" and \"-f\" must be specified");
+		auto load_distro = [](crwstr n) {
 			reg_config conf;
-			conf.load_distro(name, config_all);
-			if (conf.is_wsl2()) throw lro_error::from_other(err_msg::err_wsl2_unsupported, { L"export" });
-			archive_writer writer(file);
-			select_wsl_reader(get_distro_version(name), get_distro_dir(name))->run(writer);
-			conf.save_file(file + L".xml");
-		} else if (!wcscmp(argv[1], L"r") || !wcscmp(argv[1], L"run")) {
-			wstr cmd;
-			bool no_cwd;
-			desc.add_options()
-				(",c", po::wvalue<wstr>(&cmd), "The command to run. Launch default shell if not specified.")
-				(",w", po::bool_switch(&no_cwd), "Don't use the working directory in Windows for the Linux process.");
-			parse_args();
-			auto hw = LoadLibraryEx(L"wslapi.dll", nullptr, LOAD_LIBRARY_SEARCH_SYSTEM32);
-			if (hw == INVALID_HANDLE_VALUE) throw lro_error::from_win32_last(err_msg::err_no_wslapi, {});
+			conf.load_distro(n, config_flags);
+			if (conf.is_wsl2()) throw lro_error::from_other(err_msg::err_wsl2_unsupported, { L"diff" });
+			return diff_source::from_distro(get_distro_version(n), get_distro_dir(n));
+		};
+		const auto a = load_distro(name);
+		const auto b = other.empty() ? diff_source::from_archive(file, root) : load_distro(other);
+		diff_trees(a, b, jobs, [&](wchar_t status, crwstr path, crwstr fields) {
+			out << status << L'\t' << path;
+			if (!fields.empty()) out << L'\t' << fields;
+			out << L'\n';
+		});
+	} else if (!wcscmp(argv[1], L"cp") || !wcscmp(argv[1], L"compact")) {
+		uint32_t jobs;
+		bool copy;
+		desc.add_options()
+			("copy", po::bool_switch(&copy),
+				"Copy the blocks in use to a new virtual disk that replaces the old one, instead of moving them "
+				"within the existing file.")
+			(",j", po::wvalue<uint32_t>(&jobs)->default_value(0),
+				"Number of blocks to copy in parallel, number of processors if not specified.");
+		parse_args();
+		reg_config conf;
+		conf.load_distro(name, config_flags);
+		if (!conf.is_wsl2()) throw lro_error::from_other(err_msg::err_wsl2_required, { L"compact" });
+		check_running(name);
+		check_no_children(name);
+		const auto sizes = compact_wsl2_disk(get_distro_dir(name) + L"\\ext4.vhdx", copy, jobs);
+		// The copy of a differencing disk includes the data of its parent.
+		if (copy) detach_parent(name);
+		out << L"Virtual disk size: " << (sizes.first >> 20) << L" MiB -> "
+			<< (sizes.second >> 20) << L" MiB\n";
+	} else if (!wcscmp(argv[1], L"fl") || !wcscmp(argv[1], L"flatten")) {
+		uint32_t jobs;
+		desc.add_options()
+			(",j", po::wvalue<uint32_t>(&jobs)->default_value(0),
+				"Number of blocks to copy in parallel, number of processors if not specified.");
+		parse_args();
+		reg_config conf;
+		conf.load_distro(name, config_flags);
+		if (!conf.is_wsl2()) throw lro_error::from_other(err_msg::err_wsl2_required, { L"flatten" });
+		check_running(name);
+		check_no_children(name);
+		const auto sizes = flatten_wsl2_disk(get_distro_dir(name) + L"\\ext4.vhdx", jobs);
+		detach_parent(name);
+		out << L"Virtual disk size: " << (sizes.first >> 20) << L" MiB -> "
+			<< (sizes.second >> 20) << L" MiB\n";
+	} else if (!wcscmp(argv[1], L"r") || !wcscmp(argv[1], L"run")) {
+		wstr cmd;
+		bool no_cwd;
+		desc.add_options()
+			(",c", po::wvalue<wstr>(&cmd), "The command to run. Launch default shell if not specified.")
+			(",w", po::bool_switch(&no_cwd), "Don't use the working directory in Windows for the Linux process.");
+		parse_args();
+		// WSL can't mount a read-only disk.
+		check_no_children(name);
+		auto hw = LoadLibraryEx(L"wslapi.dll", nullptr, LOAD_LIBRARY_SEARCH_SYSTEM32);
+		if (hw == INVALID_HANDLE_VALUE) throw lro_error::from_win32_last(err_msg::err_no_wslapi, {});
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-function-type"
-			auto launch = reinterpret_cast<HRESULT(__stdcall *)(PCWSTR, PCWSTR, BOOL, DWORD *)>(
-				GetProcAddress(hw, "WslLaunchInteractive")
-			);
+		auto launch = reinterpret_cast<HRESULT(__stdcall *)(PCWSTR, PCWSTR, BOOL, DWORD *)>(
+			GetProcAddress(hw, "WslLaunchInteractive")
+		);
 #pragma GCC diagnostic pop
-			if (!launch) throw lro_error::from_win32_last(err_msg::err_no_wslapi, {});
-			DWORD code;
-			auto hr = launch(name.c_str(), cmd.empty() ? nullptr : cmd.c_str(), !no_cwd, &code);
-			if (FAILED(hr)) throw lro_error::from_hresult(err_msg::err_launch_distro, { name }, hr);
-			return code;
-		} else if (!wcscmp(argv[1], L"di") || !wcscmp(argv[1], L"get-dir")) {
-			parse_args();
-			std::wcout << get_distro_dir(name);
-		} else if (!wcscmp(argv[1], L"gv") || !wcscmp(argv[1], L"get-version")) {
-			parse_args();
-			std::wcout << get_distro_version(name);
-		} else if (!wcscmp(argv[1], L"ge") || !wcscmp(argv[1], L"get-env")) {
-			parse_args();
-			reg_config conf;
-			conf.load_distro(name, config_env);
-			for (crwstr s : conf.env) {
-				std::wcout << s << '\n';
-			}
-		} else if (!wcscmp(argv[1], L"se") || !wcscmp(argv[1], L"set-env")) {
-			reg_config conf;
-			desc.add_options()(
-				",v", po::wvalue<std::vector<wstr>>(&conf.env)->required(),
-				"Environment variables to be set. This argument can be specified multiple times."
-			);
-			parse_args();
-			conf.configure_distro(name, config_env);
-		} else if (!wcscmp(argv[1], L"ae") || !wcscmp(argv[1], L"add-env")) {
-			wstr env;
-			bool force;
-			desc.add_options()
-				(",v", po::wvalue<wstr>(&env)->required(), "The environment variable to add.")
-				(",f", po::bool_switch(&force), "Overwrite if the environment variable already exists.");
-			parse_args();
-			auto p = env.find(L'=');
-			if (p == wstr::npos) throw lro_error::from_other(err_msg::err_invalid_env, { env });
-			auto env_name = env.substr(0, p + 1);
-			reg_config conf;
-			conf.load_distro(name, config_env);
-			auto it = std::find_if(conf.env.begin(), conf.env.end(), [&](crwstr s) {
-				return !s.compare(0, env_name.size(), env_name);
-			});
-			if (it != conf.env.end()) {
-				if (force) conf.env.erase(it);
-				else throw lro_error::from_other(err_msg::err_env_exists, { *it });
-			}
-			conf.env.push_back(env);
-			conf.configure_distro(name, config_env);
-		} else if (!wcscmp(argv[1], L"re") || !wcscmp(argv[1], L"remove-env")) {
-			wstr env_name;
-			desc.add_options()(
-				",v", po::wvalue<wstr>(&env_name)->required(),
-				"Name of the environment variable to remove."
-			);
-			parse_args();
-			reg_config conf;
-			conf.load_distro(name, config_env);
-			auto it = std::find_if(conf.env.begin(), conf.env.end(), [&](crwstr s) {
-				return !s.compare(0, env_name.size() + 1, env_name + L"=");
-			});
-			if (it == conf.env.end()) throw lro_error::from_other(err_msg::err_env_not_found, { env_name });
-			conf.env.erase(it);
-			conf.configure_distro(name, config_env);
-		} else if (!wcscmp(argv[1], L"gu") || !wcscmp(argv[1], L"get-uid")) {
-			parse_args();
-			reg_config conf;
-			conf.load_distro(name, config_uid);
-			std::wcout << conf.uid;
-		} else if (!wcscmp(argv[1], L"su") || !wcscmp(argv[1], L"set-uid")) {
-			reg_config conf;
-			desc.add_options()(",v", po::wvalue<uint32_t>(&conf.uid)->required(), "UID to be set.");
-			parse_args();
-			conf.configure_distro(name, config_uid);
-		} else if (!wcscmp(argv[1], L"gk") || !wcscmp(argv[1], L"get-kernelcmd")) {
-			parse_args();
-			reg_config conf;
-			conf.load_distro(name, config_kernel_cmd);
-			std::wcout << conf.kernel_cmd;
-		} else if (!wcscmp(argv[1], L"sk") || !wcscmp(argv[1], L"set-kernelcmd")) {
-			reg_config conf;
-			desc.add_options()(",v", po::wvalue<wstr>(&conf.kernel_cmd)->required(), "Kernel command line to be set.");
-			parse_args();
-			conf.configure_distro(name, config_kernel_cmd);
-		} else if (!wcscmp(argv[1], L"gf") || !wcscmp(argv[1], L"get-flags")) {
-			parse_args();
-			reg_config conf;
-			conf.load_distro(name, config_flags);
-			std::wcout << conf.get_flags();
-		} else if (!wcscmp(argv[1], L"sf") || !wcscmp(argv[1], L"set-flags")) {
-			uint32_t flags;
-			desc.add_options()(",v", po::wvalue<uint32_t>(&flags)->required(), "Flags to be set.");
-			parse_args();
-			reg_config conf;
-			conf.load_distro(name, config_flags);
-			conf.set_flags(flags);
-			conf.configure_distro(name, config_flags);
-		} else if (!wcscmp(argv[1], L"s") || !wcscmp(argv[1], L"shortcut")) {
-			wstr fp, ip;
-			desc.add_options()
-				(",f", po::wvalue<wstr>(&fp)->required(),
-					"Path to the shortcut to be created, including the \".lnk\" suffix.")
-				(",i", po::wvalue<wstr>(&ip), "Path to the icon file for the shortcut. This argument is optional.");
-			parse_args();
-			create_shortcut(name, fp, ip);
-		} else if (!wcscmp(argv[1], L"ec") || !wcscmp(argv[1], L"export-config")) {
-			wstr file;
-			desc.add_options()(",f", po::wvalue<wstr>(&file)->required(), "Path to the XML file to export to.");
-			parse_args();
-			reg_config conf;
-			conf.load_distro(name, config_all);
-			conf.save_file(file);
-		} else if (!wcscmp(argv[1], L"ic") || !wcscmp(argv[1], L"import-config")) {
-			wstr file;
-			desc.add_options()(",f", po::wvalue<wstr>(&file)->required(), "The XML file to import from.");
-			parse_args();
-			reg_config conf;
-			conf.load_file(file);
-			conf.configure_distro(name, config_all);
-		} else if (!wcscmp(argv[1], L"sm") || !wcscmp(argv[1], L"summary")) {
-			parse_args();
-			reg_config conf;
-			conf.load_distro(name, config_all);
-			std::wcout
-				<< L"                        Name: " << name << '\n'
-				<< L"                 WSL version: " << (conf.is_wsl2() ? 2 : 1) << '\n'
-				<< L"          Filesystem version: " << get_distro_version(name) << '\n'
-				<< L"      Installation directory: " << get_distro_dir(name) << '\n'
-				<< L"     UID of the default user: " << conf.uid << '\n'
-				<< L"         Configuration flags: " << conf.get_flags() << '\n'
-				<< L" Default kernel command line: " << conf.kernel_cmd << '\n'
-				<< L"       Environment variables: ";
-			for (size_t i = 0; i < conf.env.size(); i++) {
-				if (i > 0) std::wcout << L"                              ";
-				std::wcout << conf.env[i] << '\n';
-			}
-		} else {
-			throw lro_error::from_other(err_msg::err_invalid_action, { argv[1] });
+		if (!launch) throw lro_error::from_win32_last(err_msg::err_no_wslapi, {});
+		DWORD code;
+		auto hr = launch(name.c_str(), cmd.empty() ? nullptr : cmd.c_str(), !no_cwd, &code);
+		if (FAILED(hr)) throw lro_error::from_hresult(err_msg::err_launch_distro, { name }, hr);
+		return code;
+	} else if (!wcscmp(argv[1], L"di") || !wcscmp(argv[1], L"get-dir")) {
+		parse_args();
+		out << get_distro_dir(name);
+	} else if (!wcscmp(argv[1], L"gv") || !wcscmp(argv[1], L"get-version")) {
+		parse_args();
+		out << get_distro_version(name);
+	} else if (!wcscmp(argv[1], L"ge") || !wcscmp(argv[1], L"get-env")) {
+		parse_args();
+		reg_config conf;
+		conf.load_distro(name, config_env);
+		for (crwstr s : conf.env) {
+			out << s << '\n';
+		}
+	} else if (!wcscmp(argv[1], L"se") || !wcscmp(argv[1], L"set-env")) {
+		reg_config conf;
+		desc.add_options()(
+			",v", po::wvalue<std::vector<wstr>>(&conf.env)->required(),
+			"Environment variables to be set. This argument can be specified multiple times."
+		);
+		parse_args();
+		conf.configure_distro(name, config_env);
+	} else if (!wcscmp(argv[1], L"ae") || !wcscmp(argv[1], L"add-env")) {
+		wstr env;
+		bool force;
+		desc.add_options()
+			(",v", po::wvalue<wstr>(&env)->required(), "The environment variable to add.")
+			(",f", po::bool_switch(&force), "Overwrite if the environment variable already exists.");
+		parse_args();
+		auto p = env.find(L'=');
+		if (p == wstr::npos) throw lro_error::from_other(err_msg::err_invalid_env, { env });
+		auto env_name = env.substr(0, p + 1);
+		reg_config conf;
+		conf.load_distro(name, config_env);
+		auto it = std::find_if(conf.env.begin(), conf.env.end(), [&](crwstr s) {
+			return !s.compare(0, env_name.size(), env_name);
+		});
+		if (it != conf.env.end()) {
+			if (force) conf.env.erase(it);
+			else throw lro_error::from_other(err_msg::err_env_exists, { *it });
+		}
+		conf.env.push_back(env);
+		conf.configure_distro(name, config_env);
+	} else if (!wcscmp(argv[1], L"re") || !wcscmp(argv[1], L"remove-env")) {
+		wstr env_name;
+		desc.add_options()(
+			",v", po::wvalue<wstr>(&env_name)->required(),
+			"Name of the environment variable to remove."
+		);
+		parse_args();
+		reg_config conf;
+		conf.load_distro(name, config_env);
+		auto it = std::find_if(conf.env.begin(), conf.env.end(), [&](crwstr s) {
+			return !s.compare(0, env_name.size() + 1, env_name + L"=");
+		});
+		if (it == conf.env.end()) throw lro_error::from_other(err_msg::err_env_not_found, { env_name });
+		conf.env.erase(it);
+		conf.configure_distro(name, config_env);
+	} else if (!wcscmp(argv[1], L"gu") || !wcscmp(argv[1], L"get-uid")) {
+		parse_args();
+		reg_config conf;
+		conf.load_distro(name, config_uid);
+		out << conf.uid;
+	} else if (!wcscmp(argv[1], L"su") || !wcscmp(argv[1], L"set-uid")) {
+		reg_config conf;
+		desc.add_options()(",v", po::wvalue<uint32_t>(&conf.uid)->required(), "UID to be set.");
+		parse_args();
+		conf.configure_distro(name, config_uid);
+	} else if (!wcscmp(argv[1], L"ri") || !wcscmp(argv[1], L"remap-ids")) {
+		std::vector<wstr> uid_rules, gid_rules;
+		wstr file;
+		uint32_t jobs;
+		desc.add_options()
+			("uid", po::wvalue<std::vector<wstr>>(&uid_rules),
+				"Change the owner of files owned by one UID to another, in the form \"1000:1001\". Can be repeated.")
+			("gid", po::wvalue<std::vector<wstr>>(&gid_rules),
+				"Change the group of files owned by one GID to another, in the form \"1000:1001\". Can be repeated.")
+			(",f", po::wvalue<wstr>(&file),
+				"A file with a mapping on each line, such as \"uid 1000:1001\" or \"gid 1000:1001\".")
+			(",j", po::wvalue<uint32_t>(&jobs)->default_value(0),
+				"Number of directories to process in parallel, number of processors if not specified.");
+		parse_args();
+		std::map<uint32_t, uint32_t> uids, gids;
+		if (!file.empty()) read_id_mappings(file, uids, gids);
+		for (const auto &r : uid_rules) add_id_mapping(uids, r);
+		for (const auto &r : gid_rules) add_id_mapping(gids, r);
+		reg_config conf;
+		conf.load_distro(name, config_flags);
+		if (conf.is_wsl2()) throw lro_error::from_other(err_msg::err_wsl2_unsupported, { L"remap-ids" });
+		check_running(name);
+		out << remap_ids(get_distro_version(name), get_distro_dir(name), uids, gids, jobs) << L" files changed.\n";
+	} else if (!wcscmp(argv[1], L"ug") || !wcscmp(argv[1], L"upgrade")) {
+		bool rollback;
+		uint32_t jobs;
+		desc.add_options()
+			("rollback", po::bool_switch(&rollback), "Undo an upgrade that was interrupted.")
+			(",j", po::wvalue<uint32_t>(&jobs)->default_value(0),
+				"Number of directories to process in parallel, number of processors if not specified.");
+		parse_args();
+		reg_config conf;
+		conf.load_distro(name, config_flags);
+		if (conf.is_wsl2()) throw lro_error::from_other(err_msg::err_wsl2_unsupported, { L"upgrade" });
+		check_running(name);
+		const auto dir = get_distro_dir(name);
+		if (rollback) rollback_wsl_upgrade(dir, jobs);
+		else if (!upgrade_wsl_fs(get_distro_version(name), dir, jobs, [&] { set_distro_version(name, 2); })) {
+			log_warning(L"The distribution is already using filesystem version 2.");
+		}
+	} else if (!wcscmp(argv[1], L"gk") || !wcscmp(argv[1], L"get-kernelcmd")) {
+		parse_args();
+		reg_config conf;
+		conf.load_distro(name, config_kernel_cmd);
+		out << conf.kernel_cmd;
+	} else if (!wcscmp(argv[1], L"sk") || !wcscmp(argv[1], L"set-kernelcmd")) {
+		reg_config conf;
+		desc.add_options()(",v", po::wvalue<wstr>(&conf.kernel_cmd)->required(), "Kernel command line to be set.");
+		parse_args();
+		conf.configure_distro(name, config_kernel_cmd);
+	} else if (!wcscmp(argv[1], L"gf") || !wcscmp(argv[1], L"get-flags")) {
+		parse_args();
+		reg_config conf;
+		conf.load_distro(name, config_flags);
+		out << conf.get_flags();
+	} else if (!wcscmp(argv[1], L"sf") || !wcscmp(argv[1], L"set-flags")) {
+		uint32_t flags;
+		desc.add_options()(",v", po::wvalue<uint32_t>(&flags)->required(), "Flags to be set.");
+		parse_args();
+		reg_config conf;
+		conf.load_distro(name, config_flags);
+		conf.set_flags(flags);
+		conf.configure_distro(name, config_flags);
+	} else if (!wcscmp(argv[1], L"s") || !wcscmp(argv[1], L"shortcut")) {
+		wstr fp, ip;
+		desc.add_options()
+			(",f", po::wvalue<wstr>(&fp)->required(),
+				"Path to the shortcut to be created, including the \".lnk\" suffix.")
+			(",i", po::wvalue<wstr>(&ip), "Path to the icon file for the shortcut. This argument is optional.");
+		parse_args();
+		create_shortcut(name, fp, ip);
+	} else if (!wcscmp(argv[1], L"ec") || !wcscmp(argv[1], L"export-config")) {
+		wstr file;
+		desc.add_options()(",f", po::wvalue<wstr>(&file)->required(), "Path to the XML file to export to.");
+		parse_args();
+		reg_config conf;
+		conf.load_distro(name, config_all);
+		conf.save_file(file);
+	} else if (!wcscmp(argv[1], L"ic") || !wcscmp(argv[1], L"import-config")) {
+		wstr file;
+		desc.add_options()(",f", po::wvalue<wstr>(&file)->required(), "The XML file to import from.");
+		parse_args();
+		reg_config conf;
+		conf.load_file(file);
+		conf.configure_distro(name, config_all);
+	} else if (!wcscmp(argv[1], L"sm") || !wcscmp(argv[1], L"summary")) {
+		parse_args();
+		reg_config conf;
+		conf.load_distro(name, config_all);
+		out
+			<< L"                        Name: " << name << '\n'
+			<< L"                 WSL version: " << (conf.is_wsl2() ? 2 : 1) << '\n'
+			<< L"          Filesystem version: " << get_distro_version(name) << '\n'
+			<< L"      Installation directory: " << get_distro_dir(name) << '\n'
+			<< L"     UID of the default user: " << conf.uid << '\n'
+			<< L"         Configuration flags: " << conf.get_flags() << '\n'
+			<< L" Default kernel command line: " << conf.kernel_cmd << '\n'
+			<< L"       Environment variables: ";
+		for (size_t i = 0; i < conf.env.size(); i++) {
+			if (i > 0) out << L"                              ";
+			out << conf.env[i] << '\n';
+		}
+	} else if (!wcscmp(argv[1], L"batch")) {
+		wstr file;
+		uint32_t jobs;
+		desc.add_options()
+			(",f", po::wvalue<wstr>(&file),
+				"The file to read commands from, one JSON array of arguments, or object with the array in \"args\" "
+				"and an optional \"id\", per line. Standard input is used if not specified.")
+			(",j", po::wvalue<uint32_t>(&jobs)->default_value(1),
+				"Number of commands to run at the same time. Commands on the same distribution never run together.");
+		parse_args(false);
+		unique_ptr_del<FILE *> f(stdin, [](FILE *) {});
+		if (!file.empty()) {
+			f = unique_ptr_del<FILE *>(_wfopen(file.c_str(), L"rb"), &fclose_safe);
+			if (!f.get()) throw lro_error::from_win32_last(err_msg::err_open_file, { file });
+		}
+		return run_batch(f.get(), jobs) ? 0 : 1;
+	} else {
+		throw lro_error::from_other(err_msg::err_invalid_action, { argv[1] });
+	}
+	return 0;
+}
+
+#ifdef __MINGW32__
+//extern "C"
+#endif
+int wmain(int argc, wchar_t **argv) {
+	const auto out_mode = _setmode(_fileno(stdout), _O_U16TEXT);
+	const auto err_mode = _setmode(_fileno(stderr), _O_U16TEXT);
+	if (out_mode == -1 || err_mode == -1) {
+		log_warning(L"Failed to set output mode to UTF-16.");
+	}
+
+	po::options_description desc("Options");
+	// Skipped files are only summarized, as printing a line for each one can take longer than the action itself.
+	// The log outlives the try block, so that the errors reported below also reach the file given by "--log".
+	warning_log log;
+	try {
+		// A single action often looks up the same distro several times, and a batch even more so.
+		reg_cache cache;
+		if (get_win_build() < 17134) {
+			throw lro_error::from_other(err_msg::err_version_old, { L"1803", L"17134" });
 		}
+		return run_action(argc, argv, desc, std::wcout);
 	} catch (const lro_error &e) {
 		log_error(e.format());
 		if (e.msg_code == err_msg::err_no_action || e.msg_code == err_msg::err_invalid_action) {
@@ -324,12 +872,17 @@ int wmain(int argc, wchar_t **argv) {
     gd, get-default    Get the default distribution, which is used by bash.exe.
     sd, set-default    Set the default distribution, which is used by bash.exe.
     i, install         Install a new distribution.
-    ui, uninstall      Uninstall a distribution.
+    ui, uninstall      Uninstall a distribution, optionally deleting its files in the background.
     rg, register       Register an existing installation directory.
     ur, unregister     Unregister a distribution but not delete the installation directory.
     m, move            Move a distribution to a new directory.
     d, duplicate       Duplicate an existing distribution in a new directory.
-    e, export          Export a distribution's filesystem to a .tar.gz file, which can be imported by the "install" command.
+    e, export          Export a distribution's filesystem to a tar file, which can be imported by the "install" command.
+    cv, convert        Convert a tar file to another compression format, optionally extracting a directory from it.
+    vf, verify         Check a distribution against a manifest written by the "install" or "export" command.
+    df, diff           List the differences between a distribution and another distribution or a tar file.
+    cp, compact        Shrink the virtual disk of a WSL2 distribution by freeing the space its filesystem doesn't use.
+    fl, flatten        Merge the differencing virtual disk of a WSL2 distribution with its base into a standalone disk.
     r, run             Run a command in a distribution.
     di, get-dir        Get the installation directory of a distribution.
     gv, get-version    Get the filesystem version of a distribution.
@@ -339,6 +892,8 @@ int wmain(int argc, wchar_t **argv) {
     re, remove-env     Remove from the default environment variables of a distribution.
     gu, get-uid        Get the UID of the default user of a distribution.
     su, set-uid        Set the UID of the default user of a distribution.
+    ri, remap-ids      Change the owners and groups of all files in a WSL1 distribution without starting it.
+    ug, upgrade        Upgrade the filesystem of a WSL1 distribution to version 2 in place.
     gk, get-kernelcmd  Get the default kernel command line of a distribution.
     sk, set-kernelcmd  Set the default kernel command line of a distribution.
     gf, get-flags      Get some flags of a distribution. See https://docs.microsoft.com/en-us/previous-versions/windows/desktop/api/wslapi/ne-wslapi-wsl_distribution_flags for details.
@@ -347,6 +902,7 @@ int wmain(int argc, wchar_t **argv) {
     ec, export-config  Export configuration of a distribution to an XML file.
     ic, import-config  Import configuration of a distribution from an XML file.
     sm, summary        Get general information of a distribution.
+    batch              Run commands read from a file or standard input, writing a JSON result for each one.
     version            Get version information about this LxRunOffline.exe.
 )";
 		}
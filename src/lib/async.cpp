@@ -0,0 +1,168 @@
+#include "pch.h"
+#include "async.h"
+
+static constexpr size_t data_chunk_size = 1 << 20;
+
+async_writer::async_writer(fs_writer &inner, const size_t max_queued) : inner(inner), max_queued(max_queued) {
+	path = inner.path->clone();
+	target_path = inner.target_path->clone();
+	worker = std::thread(&async_writer::run, this);
+}
+
+async_writer::~async_writer() {
+	if (!worker.joinable()) return;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		aborted = true;
+	}
+	cv_pop.notify_all();
+	worker.join();
+}
+
+void async_writer::push(op &&o) {
+	const auto size = o.data.size() + sizeof(op);
+	std::unique_lock<std::mutex> lock(mutex);
+	cv_push.wait(lock, [&] { return error || queued < max_queued; });
+	if (error) std::rethrow_exception(error);
+	queued += size;
+	queue.push_back(std::move(o));
+	lock.unlock();
+	cv_pop.notify_one();
+}
+
+void async_writer::flush_data() {
+	if (data_buf.empty()) return;
+	op o { op_type::data, {}, {}, false, {}, {}, std::move(data_buf) };
+	data_buf.clear();
+	push(std::move(o));
+}
+
+bool async_writer::write_new_file(const file_attr *attr) {
+	op o { op_type::new_file, path->data, {}, attr != nullptr, {}, {}, {} };
+	if (attr) {
+		o.attr = *attr;
+		if (attr->symlink) o.symlink = attr->symlink;
+	}
+	push(std::move(o));
+	return true;
+}
+
+void async_writer::write_file_data(const char *buf, const uint32_t size) {
+	if (size) {
+		data_buf.insert(data_buf.end(), buf, buf + size);
+		if (data_buf.size() >= data_chunk_size) flush_data();
+	} else {
+		flush_data();
+		push({ op_type::data, {}, {}, false, {}, {}, {} });
+	}
+}
+
+void async_writer::write_hard_link() {
+	push({ op_type::hard_link, path->data, target_path->data, false, {}, {}, {} });
+}
+
+// This is only called before anything is written, so the worker can't be using the inner writer at the same time.
+void async_writer::check_path(const file_path &source_path) const {
+	inner.check_path(source_path);
+}
+
+void async_writer::apply(op &o, bool &skip) {
+	switch (o.type) {
+	case op_type::new_file:
+		inner.path->data = std::move(o.path);
+		if (o.has_attr) {
+			o.attr.symlink = o.attr.symlink ? o.symlink.c_str() : nullptr;
+			skip = !inner.write_new_file(&o.attr);
+		} else {
+			skip = !inner.write_new_file(nullptr);
+		}
+		break;
+	case op_type::data:
+		if (skip) break;
+		if (o.data.empty()) inner.write_file_data(nullptr, 0);
+		else inner.write_file_data(o.data.data(), static_cast<uint32_t>(o.data.size()));
+		break;
+	case op_type::hard_link:
+		inner.path->data = std::move(o.path);
+		inner.target_path->data = std::move(o.target_path);
+		inner.write_hard_link();
+		break;
+	}
+}
+
+void async_writer::run() {
+	auto skip = false;
+	try {
+		while (true) {
+			std::unique_lock<std::mutex> lock(mutex);
+			cv_pop.wait(lock, [&] { return aborted || finishing || !queue.empty(); });
+			if (aborted || queue.empty()) return;
+			auto o = std::move(queue.front());
+			queue.pop_front();
+			queued -= o.data.size() + sizeof(op);
+			lock.unlock();
+			cv_push.notify_one();
+			apply(o, skip);
+		}
+	} catch (...) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			error = std::current_exception();
+		}
+		cv_push.notify_all();
+	}
+}
+
+void async_writer::close() {
+	flush_data();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		finishing = true;
+	}
+	cv_pop.notify_all();
+	worker.join();
+	if (error) std::rethrow_exception(error);
+}
+
+tee_writer::tee_writer(const std::vector<fs_writer *> &inner, const size_t max_queued) : active(inner.size()) {
+	path = std::make_unique<linux_path>();
+	target_path = std::make_unique<linux_path>();
+	for (const auto w : inner) writers.push_back(std::make_unique<async_writer>(*w, max_queued));
+}
+
+bool tee_writer::write_new_file(const file_attr *attr) {
+	auto any = false;
+	for (size_t i = 0; i < writers.size(); i++) {
+		active[i] = path->convert(*writers[i]->path) && writers[i]->write_new_file(attr);
+		any = any || active[i];
+	}
+	return any;
+}
+
+void tee_writer::write_file_data(const char *buf, const uint32_t size) {
+	for (size_t i = 0; i < writers.size(); i++) {
+		if (active[i]) writers[i]->write_file_data(buf, size);
+	}
+}
+
+void tee_writer::write_hard_link() {
+	for (const auto &w : writers) {
+		if (path->convert(*w->path) && target_path->convert(*w->target_path)) w->write_hard_link();
+	}
+}
+
+void tee_writer::check_path(const file_path &source_path) const {
+	for (const auto &w : writers) w->check_path(source_path);
+}
+
+void tee_writer::close() {
+	std::exception_ptr error;
+	for (const auto &w : writers) {
+		try {
+			w->close();
+		} catch (...) {
+			if (!error) error = std::current_exception();
+		}
+	}
+	if (error) std::rethrow_exception(error);
+}
@@ -0,0 +1,246 @@
+#include "pch.h"
+#include "batch.h"
+#include "error.h"
+
+namespace {
+	// Just enough JSON for batch commands. Values that aren't needed are checked and skipped.
+	class json_reader {
+		crwstr s;
+		size_t pos = 0;
+	public:
+		explicit json_reader(crwstr s) : s(s) {}
+
+		[[noreturn]] void fail(crwstr reason) const {
+			throw lro_error::from_other(
+				err_msg::err_batch_command,
+				{ (boost::wformat(L"%1% at offset %2%") % reason % pos).str() }
+			);
+		}
+
+		void skip_space() {
+			while (pos < s.size() && (s[pos] == L' ' || s[pos] == L'\t' || s[pos] == L'\r' || s[pos] == L'\n')) pos++;
+		}
+
+		wchar_t peek() {
+			skip_space();
+			return pos < s.size() ? s[pos] : 0;
+		}
+
+		void expect(const wchar_t c) {
+			if (peek() != c) fail(wstr(L"expected '") + c + L'\'');
+			pos++;
+		}
+
+		bool at_end() {
+			return peek() == 0;
+		}
+
+		wstr read_string() {
+			expect(L'"');
+			wstr res;
+			while (true) {
+				if (pos >= s.size()) fail(L"unterminated string");
+				auto c = s[pos++];
+				if (c == L'"') return res;
+				if (c < 0x20) fail(L"control character in string");
+				if (c == L'\\') {
+					if (pos >= s.size()) fail(L"unterminated string");
+					switch (s[pos++]) {
+					case L'"': c = L'"'; break;
+					case L'\\': c = L'\\'; break;
+					case L'/': c = L'/'; break;
+					case L'b': c = L'\b'; break;
+					case L'f': c = L'\f'; break;
+					case L'n': c = L'\n'; break;
+					case L'r': c = L'\r'; break;
+					case L't': c = L'\t'; break;
+					case L'u': {
+						if (pos + 4 > s.size()) fail(L"invalid escape");
+						c = 0;
+						for (auto i = 0; i < 4; i++) {
+							const auto h = s[pos++];
+							c <<= 4;
+							if (h >= L'0' && h <= L'9') c |= h - L'0';
+							else if (h >= L'a' && h <= L'f') c |= h - L'a' + 10;
+							else if (h >= L'A' && h <= L'F') c |= h - L'A' + 10;
+							else fail(L"invalid escape");
+						}
+						break;
+					}
+					default:
+						fail(L"invalid escape");
+					}
+				}
+				res += c;
+			}
+		}
+
+		std::vector<wstr> read_string_array() {
+			std::vector<wstr> res;
+			expect(L'[');
+			if (peek() == L']') {
+				pos++;
+				return res;
+			}
+			while (true) {
+				res.push_back(read_string());
+				if (peek() == L']') break;
+				expect(L',');
+			}
+			pos++;
+			return res;
+		}
+
+		// Returns the text of the value.
+		wstr skip_value() {
+			const auto c = peek();
+			const auto start = pos;
+			if (c == L'"') {
+				read_string();
+			} else if (c == L'[' || c == L'{') {
+				pos++;
+				const auto close = c == L'[' ? L']' : L'}';
+				if (peek() != close) {
+					while (true) {
+						if (c == L'{') {
+							read_string();
+							expect(L':');
+						}
+						skip_value();
+						if (peek() == close) break;
+						expect(L',');
+					}
+				}
+				pos++;
+			} else {
+				while (pos < s.size() && (iswalnum(s[pos]) || s[pos] == L'-' || s[pos] == L'+' || s[pos] == L'.')) pos++;
+				const auto v = s.substr(start, pos - start);
+				const auto is_number = !v.empty() && (iswdigit(v[0]) || v[0] == L'-');
+				if (!is_number && v != L"true" && v != L"false" && v != L"null") fail(L"invalid value");
+			}
+			return s.substr(start, pos - start);
+		}
+	};
+}
+
+batch_command parse_batch_command(crwstr line) {
+	json_reader r(line);
+	batch_command cmd { L"null", {} };
+	if (r.peek() == L'[') {
+		cmd.args = r.read_string_array();
+	} else {
+		auto has_args = false;
+		r.expect(L'{');
+		if (r.peek() != L'}') {
+			while (true) {
+				const auto key = r.read_string();
+				r.expect(L':');
+				if (key == L"args") {
+					cmd.args = r.read_string_array();
+					has_args = true;
+				} else if (key == L"id") {
+					cmd.id = r.skip_value();
+				} else {
+					r.skip_value();
+				}
+				if (r.peek() == L'}') break;
+				r.expect(L',');
+			}
+		}
+		r.expect(L'}');
+		if (!has_args) r.fail(L"\"args\" not found");
+	}
+	if (!r.at_end()) r.fail(L"unexpected data");
+	if (cmd.args.empty()) r.fail(L"no action");
+	return cmd;
+}
+
+void check_batch_command(const batch_command &cmd) {
+	for (crwstr a : cmd.args) {
+		const auto short_opt = a.size() == 3 && a[0] == L'-' && a[1] != L'-' && a[2] == L'-';
+		if (a == L"-" || short_opt || boost::ends_with(a, L"=-")) {
+			throw lro_error::from_other(
+				err_msg::err_batch_command,
+				{ L"standard input or output (\"" + a + L"\") can't be used by a command of a batch" }
+			);
+		}
+	}
+}
+
+static void write_string(std::wstringstream &ss, crwstr s) {
+	ss << L'"';
+	for (const auto c : s) {
+		if (c == L'"' || c == L'\\') ss << L'\\' << c;
+		else if (c == L'\n') ss << L"\\n";
+		else if (c == L'\r') ss << L"\\r";
+		else if (c == L'\t') ss << L"\\t";
+		else if (c < 0x20 || c > 0x7e) {
+			ss << L"\\u" << std::hex << std::setw(4) << std::setfill(L'0') << static_cast<uint32_t>(c) << std::dec;
+		} else ss << c;
+	}
+	ss << L'"';
+}
+
+wstr format_batch_result(crwstr id, const int status, crwstr output, crwstr error) {
+	std::wstringstream ss;
+	ss << L"{\"id\":" << id << L",\"status\":" << status << L",\"output\":";
+	write_string(ss, output);
+	ss << L",\"error\":";
+	write_string(ss, error);
+	ss << L'}';
+	return ss.str();
+}
+
+// The values given to "-n" and "-N", both as separate arguments and in the "-nname" form, and the names in the
+// "<name>=<directory>" values of "--also", which can be abbreviated like other long options.
+static std::vector<wstr> get_distro_names(const std::vector<wstr> &args) {
+	std::vector<wstr> res;
+	for (size_t i = 1; i < args.size(); i++) {
+		const auto &a = args[i];
+		if (!a.compare(0, 2, L"--")) {
+			const auto eq = a.find(L'=');
+			const auto opt = a.substr(2, eq == wstr::npos ? wstr::npos : eq - 2);
+			if (opt.empty() || wstr(L"also").compare(0, opt.size(), opt)) continue;
+			wstr value;
+			if (eq != wstr::npos) value = a.substr(eq + 1);
+			else if (i + 1 < args.size()) value = args[++i];
+			res.push_back(value.substr(0, value.find(L'=')));
+		} else if (!a.compare(0, 2, L"-n") || !a.compare(0, 2, L"-N")) {
+			if (a.size() > 2) res.push_back(a.substr(2));
+			else if (i + 1 < args.size()) res.push_back(args[++i]);
+		}
+	}
+	return res;
+}
+
+batch_runner::batch_runner(const uint32_t jobs, std::function<void(const batch_command &)> run)
+	: run(std::move(run)), pool(jobs, static_cast<size_t>(jobs ? jobs : task_pool::default_thread_count()) * 4) {}
+
+void batch_runner::submit(batch_command cmd) {
+	auto names = get_distro_names(cmd.args);
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [&] {
+			if (barrier) return false;
+			if (names.empty()) return running == 0;
+			return std::none_of(names.begin(), names.end(), [&](crwstr n) { return busy.count(n) > 0; });
+		});
+		busy.insert(names.begin(), names.end());
+		running++;
+		barrier = names.empty();
+	}
+	pool.submit([this, cmd = std::move(cmd), names = std::move(names)] {
+		run(cmd);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (crwstr n : names) busy.erase(busy.find(n));
+			running--;
+			barrier = false;
+		}
+		cv.notify_all();
+	});
+}
+
+void batch_runner::wait() {
+	pool.wait();
+}
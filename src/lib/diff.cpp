@@ -0,0 +1,273 @@
+#include "pch.h"
+#include "diff.h"
+#include "error.h"
+#include "parallel.h"
+#include "utils.h"
+
+struct diff_change {
+	wchar_t status;
+	std::string path;
+	std::vector<const wchar_t *> fields;
+	manifest_entry a, b;
+	bool check_content;
+};
+
+static const size_t sorter_run_size = 1 << 18, change_window_size = 1 << 10;
+
+class diff_collector : public fs_writer {
+	entry_sorter &sorter;
+	const bool hash_inline;
+	linux_path lp;
+	manifest_entry entry;
+	content_hash hash;
+	bool pending;
+public:
+	diff_collector(std::unique_ptr<file_path>, std::unique_ptr<file_path>, bool, entry_sorter &);
+	bool write_new_file(const file_attr *) override;
+	void write_file_data(const char *, uint32_t) override;
+	void write_hard_link() override;
+	void check_path(const file_path &) const override;
+};
+
+static wstr new_temp_file() {
+	wchar_t dir[MAX_PATH + 1], name[MAX_PATH + 1];
+	if (!GetTempPath(MAX_PATH + 1, dir)) throw lro_error::from_win32_last(err_msg::err_create_file, { L"%TEMP%" });
+	if (!GetTempFileName(dir, L"lro", 0, name)) throw lro_error::from_win32_last(err_msg::err_create_file, { dir });
+	return name;
+}
+
+entry_sorter::entry_sorter() : pos(0), peek(), peeked(false) {}
+
+entry_sorter::~entry_sorter() {
+	inputs.clear();
+	for (crwstr r : runs) DeleteFile(r.c_str());
+}
+
+void entry_sorter::spill() {
+	std::stable_sort(buf.begin(), buf.end(), [](const manifest_entry &x, const manifest_entry &y) {
+		return x.path < y.path;
+	});
+	runs.push_back(new_temp_file());
+	manifest_output output(runs.back());
+	for (const auto &e : buf) output.write(e);
+	output.close();
+	buf.clear();
+}
+
+void entry_sorter::add(manifest_entry &&e) {
+	buf.push_back(std::move(e));
+	if (buf.size() == sorter_run_size) spill();
+}
+
+void entry_sorter::finish() {
+	if (runs.empty()) {
+		std::stable_sort(buf.begin(), buf.end(), [](const manifest_entry &x, const manifest_entry &y) {
+			return x.path < y.path;
+		});
+		return;
+	}
+	if (!buf.empty()) spill();
+	buf.shrink_to_fit();
+	heads.resize(runs.size());
+	for (size_t i = 0; i < runs.size(); i++) {
+		inputs.push_back(std::make_unique<manifest_input>(runs[i]));
+		if (inputs[i]->read(heads[i])) heap.push_back(i);
+	}
+	std::make_heap(heap.begin(), heap.end(), [this](const size_t x, const size_t y) {
+		return heads[x].path > heads[y].path || (heads[x].path == heads[y].path && x > y);
+	});
+}
+
+bool entry_sorter::next_raw(manifest_entry &e) {
+	if (inputs.empty()) {
+		if (pos == buf.size()) return false;
+		e = std::move(buf[pos++]);
+		return true;
+	}
+	if (heap.empty()) return false;
+	// Runs are written in the order entries are added, so ties are broken by the run index to keep the last one.
+	const auto cmp = [this](const size_t x, const size_t y) {
+		return heads[x].path > heads[y].path || (heads[x].path == heads[y].path && x > y);
+	};
+	std::pop_heap(heap.begin(), heap.end(), cmp);
+	const auto i = heap.back();
+	e = std::move(heads[i]);
+	if (inputs[i]->read(heads[i])) std::push_heap(heap.begin(), heap.end(), cmp);
+	else heap.pop_back();
+	return true;
+}
+
+bool entry_sorter::next(manifest_entry &e) {
+	if (!peeked && !next_raw(peek)) return false;
+	e = std::move(peek);
+	while ((peeked = next_raw(peek)) && peek.path == e.path) e = std::move(peek);
+	return true;
+}
+
+diff_collector::diff_collector(
+	std::unique_ptr<file_path> p, std::unique_ptr<file_path> tp, const bool hash_inline, entry_sorter &sorter
+) : sorter(sorter), hash_inline(hash_inline), entry(), pending(false) {
+	path = std::move(p);
+	target_path = std::move(tp);
+}
+
+bool diff_collector::write_new_file(const file_attr *attr) {
+	if (!attr || !get_manifest_path(*path, lp, entry.path)) return false;
+	const auto type = attr->mode & AE_IFMT;
+	entry.link_target.clear();
+	entry.mode = attr->mode;
+	entry.uid = attr->uid;
+	entry.gid = attr->gid;
+	entry.size = type == AE_IFREG ? attr->size : 0;
+	entry.mt = attr->mt;
+	entry.hash = type == AE_IFLNK ? hash_content(attr->symlink, strlen(attr->symlink)) : 0;
+	if (type == AE_IFREG && hash_inline) {
+		hash.reset();
+		pending = true;
+		return true;
+	}
+	sorter.add(std::move(entry));
+	return false;
+}
+
+void diff_collector::write_file_data(const char *buf, const uint32_t size) {
+	if (!pending) return;
+	if (size) {
+		hash.update(buf, size);
+	} else {
+		entry.hash = hash.digest();
+		sorter.add(std::move(entry));
+		pending = false;
+	}
+}
+
+void diff_collector::write_hard_link() {
+	if (!get_manifest_path(*path, lp, entry.path) || !get_manifest_path(*target_path, lp, entry.link_target)) return;
+	entry.mode = entry.uid = entry.gid = 0;
+	entry.size = 0;
+	entry.mt = {};
+	entry.hash = 0;
+	sorter.add(std::move(entry));
+}
+
+void diff_collector::check_path(const file_path &) const {}
+
+diff_source::diff_source(std::unique_ptr<fs_reader> reader, const uint32_t version, wstr dir)
+	: reader(std::move(reader)), version(version), dir(std::move(dir)) {
+	if (!this->dir.empty()) proto = select_wsl_path(version, this->dir);
+}
+
+diff_source diff_source::from_distro(const uint32_t version, crwstr dir) {
+	return diff_source(select_wsl_reader(version, dir), version, dir);
+}
+
+diff_source diff_source::from_archive(crwstr file, crwstr root) {
+	return diff_source(std::make_unique<archive_reader>(file, root), 0, L"");
+}
+
+void diff_source::collect(entry_sorter &sorter) const {
+	// Contents of archives can only be read while streaming, so they are always hashed. Files in a distribution are
+	// only hashed later if their metadata isn't enough to tell whether they have changed.
+	if (proto) {
+		diff_collector c(proto->clone(), proto->clone(), false, sorter);
+		reader->run(c);
+	} else {
+		diff_collector c(std::make_unique<linux_path>(), std::make_unique<linux_path>(), true, sorter);
+		reader->run(c);
+	}
+	sorter.finish();
+}
+
+uint64_t diff_source::hash_entry(const manifest_entry &e) const {
+	if (!proto) return e.hash;
+	const auto p = proto->clone();
+	linux_path(e.path, "").convert(*p);
+	return hash_file(p->data, e.size);
+}
+
+static bool compare_entries(diff_change &c) {
+	const auto &a = c.a, &b = c.b;
+	if (!a.link_target.empty() || !b.link_target.empty()) {
+		if (a.link_target != b.link_target) c.fields.push_back(L"link");
+		return !c.fields.empty();
+	}
+	const auto type = a.mode & AE_IFMT;
+	if (type != (b.mode & AE_IFMT)) {
+		c.fields.push_back(L"type");
+		return true;
+	}
+	if (a.mode != b.mode) c.fields.push_back(L"mode");
+	if (a.uid != b.uid || a.gid != b.gid) c.fields.push_back(L"owner");
+	// Timestamps of WSL filesystem version 2 are stored as NTFS timestamps, which have a resolution of 100ns.
+	const auto mt_changed = a.mt.sec != b.mt.sec || a.mt.nsec / 100 != b.mt.nsec / 100;
+	if (mt_changed) c.fields.push_back(L"mtime");
+	if (type == AE_IFLNK && a.hash != b.hash) c.fields.push_back(L"symlink");
+	if (type == AE_IFREG) {
+		if (a.size != b.size) c.fields.push_back(L"size");
+		else c.check_content = mt_changed;
+	}
+	return !c.fields.empty() || c.check_content;
+}
+
+uint64_t diff_trees(
+	const diff_source &a, const diff_source &b, const uint32_t thread_count,
+	const std::function<void(wchar_t, crwstr, crwstr)> &report
+) {
+	entry_sorter sa, sb;
+	{
+		task_pool walkers(2);
+		walkers.submit([&] { a.collect(sa); });
+		walkers.submit([&] { b.collect(sb); });
+		walkers.wait();
+	}
+
+	uint64_t cnt = 0;
+	// Hashing tasks keep references to the changes in the window, so it must never be reallocated.
+	std::vector<diff_change> window;
+	window.reserve(change_window_size);
+	task_pool pool(thread_count);
+	const auto flush = [&] {
+		pool.wait();
+		for (auto &c : window) {
+			if (c.status == L'M' && c.fields.empty()) continue;
+			wstr fields;
+			for (const auto f : c.fields) {
+				if (!fields.empty()) fields += L',';
+				fields += f;
+			}
+			report(c.status, from_utf8(c.path.c_str()), fields);
+			cnt++;
+		}
+		window.clear();
+	};
+	manifest_entry ea, eb;
+	auto ha = sa.next(ea), hb = sb.next(eb);
+	while (ha || hb) {
+		diff_change c { L'M', {}, {}, {}, {}, false };
+		if (!hb || (ha && ea.path < eb.path)) {
+			c.status = L'D';
+			c.path = std::move(ea.path);
+			ha = sa.next(ea);
+		} else if (!ha || eb.path < ea.path) {
+			c.status = L'A';
+			c.path = std::move(eb.path);
+			hb = sb.next(eb);
+		} else {
+			c.path = ea.path;
+			c.a = std::move(ea);
+			c.b = std::move(eb);
+			ha = sa.next(ea);
+			hb = sb.next(eb);
+			if (!compare_entries(c)) continue;
+		}
+		window.push_back(std::move(c));
+		if (window.back().check_content) {
+			pool.submit([&a, &b, &c = window.back()] {
+				if (a.hash_entry(c.a) != b.hash_entry(c.b)) c.fields.push_back(L"content");
+			});
+		}
+		if (window.size() == change_window_size) flush();
+	}
+	flush();
+	return cnt;
+}
@@ -55,7 +55,23 @@ static const wstr msg_table[] = {
 	L"Installing to the root directory \"%1%\" is known to cause issues.",
 	L"The configuration flags are invalid.",
 	L"The action/argument \"%1%\" doesn't support WSL2.",
-	L"Copying or moving into a subdirectory of the source directory is not allowed."
+	L"Copying or moving into a subdirectory of the source directory is not allowed.",
+	L"The manifest file \"%1%\" is invalid.",
+	L"Found %1% difference(s) between the distribution and the manifest.",
+	L"The virtual disk \"%1%\" is invalid or unsupported: %2%",
+	L"The ext4 filesystem in \"%1%\" is invalid or unsupported: %2%",
+	L"There isn't enough space in the ext4 filesystem in \"%1%\" for more %2%.",
+	L"The action/argument \"%1%\" only supports WSL2 distros.",
+	L"Couldn't set attributes of the file \"%1%\".",
+	L"Invalid batch command: %1%",
+	L"Invalid ID mapping: %1%",
+	L"Invalid transform rule: %1%",
+	L"Couldn't rename \"%1%\" to \"%2%\".",
+	L"The upgrade journal \"%1%\" is invalid.",
+	L"There is no upgrade in \"%1%\" that can be rolled back.",
+	L"There isn't enough free space on \"%1%\": about %2% MiB are needed, but only %3% MiB are available.",
+	L"The extension of \"%1%\" isn't known, so the archive is compressed with gzip.",
+	L"The virtual disks of these distributions are based on \"%1%\", so it can't be changed or removed: %2%"
 };
 
 lro_error::lro_error(const err_msg msg_code, std::vector<wstr> msg_args, const HRESULT err_code)
@@ -0,0 +1,1218 @@
+#include "pch.h"
+#include "error.h"
+#include "ext4.h"
+#include "hash.h"
+#include "parallel.h"
+#include "utils.h"
+
+static const uint32_t incompat_filetype = 0x2, incompat_recover = 0x4, incompat_meta_bg = 0x10,
+	incompat_extents = 0x40, incompat_64bit = 0x80, incompat_mmp = 0x100, incompat_flex_bg = 0x200,
+	incompat_csum_seed = 0x2000, incompat_largedir = 0x4000, incompat_inline_data = 0x8000;
+static const uint32_t incompat_supported = incompat_filetype | incompat_meta_bg | incompat_extents | incompat_64bit
+	| incompat_mmp | incompat_flex_bg | incompat_csum_seed | incompat_largedir | incompat_inline_data;
+static const uint32_t compat_sparse_super2 = 0x200, ro_compat_sparse_super = 0x1, ro_compat_gdt_csum = 0x10,
+	ro_compat_metadata_csum = 0x400;
+static const uint16_t bg_inode_uninit = 0x1, bg_block_uninit = 0x2, bg_inode_zeroed = 0x4;
+
+static const uint32_t inode_flag_extents = 0x80000, inode_flag_inline_data = 0x10000000;
+static const uint16_t extent_magic = 0xF30A;
+static const uint32_t xattr_magic = 0xEA020000;
+static const uint8_t xattr_index_system = 7;
+
+template<typename T>
+static T get(const char *p) {
+	T v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static unix_time get_time(const char *base, const std::vector<char> &extra, const size_t extra_off) {
+	unix_time t { static_cast<uint64_t>(static_cast<int64_t>(get<int32_t>(base))), 0 };
+	if (extra_off + 4 <= extra.size()) {
+		const auto e = get<uint32_t>(extra.data() + extra_off);
+		t.sec += static_cast<uint64_t>(e & 3) << 32;
+		t.nsec = e >> 2;
+	}
+	return t;
+}
+
+static bool is_power_of(uint32_t x, const uint32_t base) {
+	while (x > 1 && x % base == 0) x /= base;
+	return x == 1;
+}
+
+ext4_volume::ext4_volume(pio_file &disk) : disk(disk) {
+	char sb[1024];
+	disk.read(1024, sb, sizeof sb);
+	if (get<uint16_t>(sb + 0x38) != 0xEF53) fail(L"the superblock isn't found");
+	const auto log_block_size = get<uint32_t>(sb + 0x18);
+	if (log_block_size > 6) fail(L"the block size is invalid");
+	block_size = 1024u << log_block_size;
+	const auto incompat = get<uint32_t>(sb + 0x60);
+	if (incompat & incompat_recover) {
+		fail(L"the journal needs to be recovered. Starting and stopping the distro once may help.");
+	}
+	if (incompat & ~incompat_supported) fail(L"some of the features used by the filesystem aren't supported");
+	const auto is_64bit = (incompat & incompat_64bit) != 0;
+	blocks_count = get<uint32_t>(sb + 0x4);
+	if (is_64bit) blocks_count |= static_cast<uint64_t>(get<uint32_t>(sb + 0x150)) << 32;
+	first_data_block = get<uint32_t>(sb + 0x14);
+	blocks_per_group = get<uint32_t>(sb + 0x20);
+	inodes_per_group = get<uint32_t>(sb + 0x28);
+	inode_size = get<uint32_t>(sb + 0x4C) ? get<uint16_t>(sb + 0x58) : 128;
+	if (!blocks_per_group || !inodes_per_group || inode_size < 128 || inode_size > block_size) {
+		fail(L"the superblock is corrupted");
+	}
+	group_count = static_cast<uint32_t>((blocks_count - first_data_block + blocks_per_group - 1) / blocks_per_group);
+	reserved_gdt_blocks = get<uint16_t>(sb + 0xCE);
+	meta_bg = (incompat & incompat_meta_bg) != 0;
+	sparse_super = (get<uint32_t>(sb + 0x64) & ro_compat_sparse_super) != 0;
+	uninit_bg = (get<uint32_t>(sb + 0x64) & (ro_compat_gdt_csum | ro_compat_metadata_csum)) != 0;
+	sparse_super2 = (get<uint32_t>(sb + 0x5C) & compat_sparse_super2) != 0;
+	backup_groups[0] = get<uint32_t>(sb + 0x24C);
+	backup_groups[1] = get<uint32_t>(sb + 0x250);
+	// Only the meta_bg layout depends on the locations of backup superblocks, and the two features are never used
+	// together by mke2fs.
+	if (meta_bg && sparse_super2) fail(L"meta_bg with sparse_super2 isn't supported");
+	const uint32_t desc_size = is_64bit ? std::max<uint16_t>(get<uint16_t>(sb + 0xFE), 32) : 32;
+	read_group_descriptors(desc_size, meta_bg ? get<uint32_t>(sb + 0x104) : UINT64_MAX);
+}
+
+bool ext4_volume::has_super(const uint64_t group) const {
+	if (sparse_super2) return !group || group == backup_groups[0] || group == backup_groups[1];
+	return group <= 1 || !sparse_super || is_power_of(group, 3) || is_power_of(group, 5) || is_power_of(group, 7);
+}
+
+void ext4_volume::read_group_descriptors(const uint32_t desc_size, const uint64_t first_meta_bg) {
+	// The descriptors follow the block holding the primary superblock.
+	const auto sb_block = block_size == 1024 ? 1u : 0u;
+	const auto descs_per_block = block_size / desc_size;
+	const auto desc_blocks = (group_count + descs_per_block - 1) / descs_per_block;
+	std::vector<char> buf(block_size);
+	inode_tables.resize(group_count);
+	block_bitmaps.resize(group_count);
+	inode_bitmaps.resize(group_count);
+	group_flags.resize(group_count);
+	const auto get64 = [&](const char *pd, const size_t lo, const size_t hi) {
+		auto v = static_cast<uint64_t>(get<uint32_t>(pd + lo));
+		if (desc_size >= 64) v |= static_cast<uint64_t>(get<uint32_t>(pd + hi)) << 32;
+		if (v >= blocks_count) fail(L"a group descriptor is corrupted");
+		return v;
+	};
+	for (uint32_t i = 0; i < desc_blocks; i++) {
+		uint64_t block;
+		if (!meta_bg || i < first_meta_bg) {
+			block = sb_block + 1 + i;
+		} else {
+			const auto g = static_cast<uint64_t>(i) * descs_per_block;
+			block = first_data_block + g * blocks_per_group + (has_super(g) ? 1 : 0);
+		}
+		desc_locations.push_back(block);
+		disk.read(block * block_size, buf.data(), block_size);
+		for (uint32_t j = 0; j < descs_per_block && i * descs_per_block + j < group_count; j++) {
+			const auto pd = buf.data() + j * desc_size;
+			const auto g = i * descs_per_block + j;
+			block_bitmaps[g] = get64(pd, 0x0, 0x20);
+			inode_bitmaps[g] = get64(pd, 0x4, 0x24);
+			inode_tables[g] = get64(pd, 0x8, 0x28);
+			group_flags[g] = get<uint16_t>(pd + 0x12);
+		}
+	}
+}
+
+void ext4_volume::fail(crwstr reason) const {
+	throw lro_error::from_other(err_msg::err_ext4, { disk.name(), reason });
+}
+
+uint32_t ext4_volume::get_block_size() const {
+	return block_size;
+}
+
+std::vector<bool> ext4_volume::read_block_bitmap() const {
+	std::vector<bool> used(blocks_count);
+	const auto mark = [&](const uint64_t start, const uint64_t cnt) {
+		for (auto b = start; b < std::min(start + cnt, blocks_count); b++) used[b] = true;
+	};
+	mark(0, first_data_block + 1);
+	const auto itable_blocks = (static_cast<uint64_t>(inodes_per_group) * inode_size + block_size - 1) / block_size;
+	std::vector<char> buf(block_size);
+	for (uint32_t g = 0; g < group_count; g++) {
+		const auto start = first_data_block + static_cast<uint64_t>(g) * blocks_per_group;
+		const auto cnt = std::min<uint64_t>(blocks_per_group, blocks_count - start);
+		if (uninit_bg && group_flags[g] & bg_block_uninit) {
+			// The kernel initializes such a bitmap with only the group's own metadata marked. Backups of the meta_bg
+			// descriptors are hard to locate, so those groups are kept as a whole.
+			if (meta_bg) mark(start, cnt);
+			else if (has_super(g)) mark(start, 1 + desc_locations.size() + reserved_gdt_blocks);
+		} else {
+			disk.read(block_bitmaps[g] * block_size, buf.data(), block_size);
+			for (uint64_t i = 0; i < cnt; i++) {
+				if (buf[i / 8] >> (i % 8) & 1) used[start + i] = true;
+			}
+		}
+		mark(block_bitmaps[g], 1);
+		mark(inode_bitmaps[g], 1);
+		mark(inode_tables[g], itable_blocks);
+	}
+	for (const auto b : desc_locations) mark(b, 1);
+	return used;
+}
+
+ext4_inode ext4_volume::read_inode(const uint32_t ino) const {
+	if (!ino || ino > static_cast<uint64_t>(inodes_per_group) * group_count) {
+		fail(L"the inode number " + std::to_wstring(ino) + L" is out of range");
+	}
+	std::vector<char> buf(inode_size);
+	const auto idx = ino - 1;
+	disk.read(
+		inode_tables[idx / inodes_per_group] * block_size + static_cast<uint64_t>(idx % inodes_per_group) * inode_size,
+		buf.data(), inode_size
+	);
+	const auto p = buf.data();
+	ext4_inode inode {};
+	inode.ino = ino;
+	inode.mode = get<uint16_t>(p);
+	inode.uid = get<uint16_t>(p + 0x2) | static_cast<uint32_t>(get<uint16_t>(p + 0x78)) << 16;
+	inode.gid = get<uint16_t>(p + 0x18) | static_cast<uint32_t>(get<uint16_t>(p + 0x7A)) << 16;
+	inode.size = get<uint32_t>(p + 0x4) | static_cast<uint64_t>(get<uint32_t>(p + 0x6C)) << 32;
+	inode.links = get<uint16_t>(p + 0x1A);
+	inode.blocks = get<uint32_t>(p + 0x1C) | static_cast<uint64_t>(get<uint16_t>(p + 0x74)) << 32;
+	inode.flags = get<uint32_t>(p + 0x20);
+	inode.file_acl = get<uint32_t>(p + 0x68) | static_cast<uint64_t>(get<uint16_t>(p + 0x76)) << 32;
+	memcpy(inode.block, p + 0x28, sizeof inode.block);
+	inode.extra.assign(p + 128, p + inode_size);
+	// The offsets of the extra timestamps are relative to the end of the base inode.
+	inode.at = get_time(p + 0x8, inode.extra, 0xC);
+	inode.ct = get_time(p + 0xC, inode.extra, 0x4);
+	inode.mt = get_time(p + 0x10, inode.extra, 0x8);
+	if (!inode.extra.empty()) {
+		const auto extra_isize = get<uint16_t>(inode.extra.data());
+		if (extra_isize > inode.extra.size()) fail(L"the inode " + std::to_wstring(ino) + L" is corrupted");
+		// Timestamps beyond i_extra_isize aren't valid.
+		if (extra_isize < 0x8) inode.ct.nsec = 0, inode.ct.sec = static_cast<uint64_t>(get<int32_t>(p + 0xC));
+		if (extra_isize < 0xC) inode.mt.nsec = 0, inode.mt.sec = static_cast<uint64_t>(get<int32_t>(p + 0x10));
+		if (extra_isize < 0x10) inode.at.nsec = 0, inode.at.sec = static_cast<uint64_t>(get<int32_t>(p + 0x8));
+	}
+	return inode;
+}
+
+void ext4_volume::read_extent_node(
+	const char *node, const size_t size, const int depth, std::vector<ext4_extent> &res
+) const {
+	if (size < 12 || get<uint16_t>(node) != extent_magic) fail(L"an extent tree is corrupted");
+	const auto cnt = get<uint16_t>(node + 2);
+	const auto node_depth = get<uint16_t>(node + 6);
+	if (12 + cnt * 12u > size || (depth >= 0 && node_depth != depth) || node_depth > 5) {
+		fail(L"an extent tree is corrupted");
+	}
+	std::vector<char> child;
+	for (uint32_t i = 0; i < cnt; i++) {
+		const auto pe = node + 12 + i * 12;
+		if (node_depth == 0) {
+			auto len = get<uint16_t>(pe + 4);
+			const auto uninit = len > 32768;
+			if (uninit) len -= 32768;
+			res.push_back({
+				get<uint32_t>(pe),
+				get<uint32_t>(pe + 8) | static_cast<uint64_t>(get<uint16_t>(pe + 6)) << 32,
+				len, uninit
+			});
+		} else {
+			const auto leaf = get<uint32_t>(pe + 4) | static_cast<uint64_t>(get<uint16_t>(pe + 8)) << 32;
+			if (leaf >= blocks_count) fail(L"an extent tree is corrupted");
+			child.resize(block_size);
+			disk.read(leaf * block_size, child.data(), block_size);
+			read_extent_node(child.data(), block_size, node_depth - 1, res);
+		}
+	}
+}
+
+std::vector<ext4_extent> ext4_volume::read_extents(const ext4_inode &inode) const {
+	std::vector<ext4_extent> res;
+	if (has_inline_data(inode)) return res;
+	if (inode.flags & inode_flag_extents) {
+		read_extent_node(inode.block, sizeof inode.block, -1, res);
+		return res;
+	}
+	// Files created by ext2/3 map their blocks with direct and indirect block pointers instead.
+	const auto ptrs_per_block = block_size / 4;
+	const auto total = (inode.size + block_size - 1) / block_size;
+	uint64_t logical = 0;
+	const auto add = [&](const uint32_t physical) {
+		if (physical) {
+			if (!res.empty() && !res.back().uninit && res.back().logical + res.back().length == logical
+				&& res.back().physical + res.back().length == physical && res.back().length < 32768) {
+				res.back().length++;
+			} else {
+				res.push_back({ logical, physical, 1, false });
+			}
+		}
+		logical++;
+	};
+	std::function<void(uint32_t, int)> walk = [&](const uint32_t block, const int level) {
+		if (!block) {
+			uint64_t skip = 1;
+			for (auto i = 0; i <= level; i++) skip *= ptrs_per_block;
+			logical += skip;
+			return;
+		}
+		std::vector<uint32_t> ptrs(ptrs_per_block);
+		disk.read(static_cast<uint64_t>(block) * block_size, reinterpret_cast<char *>(ptrs.data()), block_size);
+		for (const auto p : ptrs) {
+			if (logical >= total) return;
+			if (level) walk(p, level - 1);
+			else add(p);
+		}
+	};
+	for (auto i = 0; i < 12 && logical < total; i++) add(get<uint32_t>(inode.block + i * 4));
+	for (auto i = 0; i < 3 && logical < total; i++) walk(get<uint32_t>(inode.block + 48 + i * 4), i);
+	return res;
+}
+
+void ext4_volume::read_data(
+	const ext4_inode &inode, const std::vector<ext4_extent> &extents, const uint64_t offset, char *buf, size_t size
+) const {
+	if (has_inline_data(inode)) {
+		const auto data = read_inline_data(inode);
+		if (offset > data.size() || size > data.size() - offset) fail(L"the inline data is corrupted");
+		memcpy(buf, data.data() + offset, size);
+		return;
+	}
+	if (!size) return;
+	memset(buf, 0, size);
+	const auto end = offset + size;
+	auto it = std::upper_bound(
+		extents.begin(), extents.end(), offset / block_size,
+		[](const uint64_t b, const ext4_extent &e) { return b < e.logical; }
+	);
+	if (it != extents.begin()) --it;
+	for (; it != extents.end() && it->logical * block_size < end; ++it) {
+		const auto start = std::max(offset, it->logical * block_size);
+		const auto stop = std::min(end, (it->logical + it->length) * block_size);
+		if (start >= stop || it->uninit) continue;
+		if (it->physical + it->length > blocks_count) fail(L"an extent is out of range");
+		disk.read(it->physical * block_size + (start - it->logical * block_size), buf + (start - offset), stop - start);
+	}
+}
+
+std::vector<char> ext4_volume::read_file(const ext4_inode &inode) const {
+	if (has_inline_data(inode)) {
+		auto data = read_inline_data(inode);
+		if (data.size() < inode.size) fail(L"the inline data is corrupted");
+		data.resize(inode.size);
+		return data;
+	}
+	std::vector<char> data(inode.size);
+	read_data(inode, read_extents(inode), 0, data.data(), data.size());
+	return data;
+}
+
+bool ext4_volume::has_inline_data(const ext4_inode &inode) const {
+	return (inode.flags & inode_flag_inline_data) != 0;
+}
+
+// Inline data starts in i_block and continues in the value of the "system.data" extended attribute.
+std::vector<char> ext4_volume::read_inline_data(const ext4_inode &inode) const {
+	std::vector<char> data(inode.block, inode.block + sizeof inode.block), rest;
+	if (read_xattr(inode, xattr_index_system, "data", rest)) data.insert(data.end(), rest.begin(), rest.end());
+	return data;
+}
+
+static bool find_xattr(
+	const char *entries, const char *end, const char *value_base, const size_t value_limit,
+	const uint8_t name_index, const std::string &name, std::vector<char> &value
+) {
+	for (auto p = entries; p + 16 <= end && get<uint32_t>(p); p += (16 + static_cast<uint8_t>(p[0]) + 3) / 4 * 4) {
+		const auto name_len = static_cast<uint8_t>(p[0]);
+		if (p + 16 + name_len > end) return false;
+		if (static_cast<uint8_t>(p[1]) != name_index || name.compare(0, std::string::npos, p + 16, name_len)) {
+			continue;
+		}
+		// Values stored in separate inodes are only used for large attributes that are never looked up here.
+		if (get<uint32_t>(p + 4)) return false;
+		const auto off = get<uint16_t>(p + 2);
+		const auto size = get<uint32_t>(p + 8);
+		if (off > value_limit || size > value_limit - off) return false;
+		value.assign(value_base + off, value_base + off + size);
+		return true;
+	}
+	return false;
+}
+
+bool ext4_volume::read_xattr(
+	const ext4_inode &inode, const uint8_t name_index, const std::string &name, std::vector<char> &value
+) const {
+	if (inode.extra.size() >= 2) {
+		const auto extra_isize = get<uint16_t>(inode.extra.data());
+		if (extra_isize + 4u <= inode.extra.size() && get<uint32_t>(inode.extra.data() + extra_isize) == xattr_magic) {
+			const auto entries = inode.extra.data() + extra_isize + 4;
+			const auto end = inode.extra.data() + inode.extra.size();
+			if (find_xattr(entries, end, entries, end - entries, name_index, name, value)) return true;
+		}
+	}
+	if (!inode.file_acl) return false;
+	if (inode.file_acl >= blocks_count) fail(L"the inode " + std::to_wstring(inode.ino) + L" is corrupted");
+	std::vector<char> buf(block_size);
+	disk.read(inode.file_acl * block_size, buf.data(), block_size);
+	if (get<uint32_t>(buf.data()) != xattr_magic) return false;
+	return find_xattr(buf.data() + 32, buf.data() + block_size, buf.data(), block_size, name_index, name, value);
+}
+
+static void parse_dir_block(
+	const ext4_volume &volume, const char *p, const size_t size, const uint32_t block_size,
+	std::vector<ext4_dir_entry> &res
+) {
+	for (size_t pos = 0; pos + 8 <= size;) {
+		const auto ino = get<uint32_t>(p + pos);
+		uint32_t rec_len = get<uint16_t>(p + pos + 4);
+		if (rec_len == 65535 || rec_len == 0) rec_len = block_size;
+		else rec_len = (rec_len & 65532) | (rec_len & 3) << 16;
+		const auto name_len = static_cast<uint8_t>(p[pos + 6]);
+		if (rec_len < 8 || pos + rec_len > size || 8u + name_len > rec_len) volume.fail(L"a directory is corrupted");
+		if (ino && name_len) {
+			std::string name(p + pos + 8, name_len);
+			if (name != "." && name != "..") res.push_back({ std::move(name), ino });
+		}
+		pos += rec_len;
+	}
+}
+
+std::vector<ext4_dir_entry> ext4_volume::read_dir(const ext4_inode &inode) const {
+	std::vector<ext4_dir_entry> res;
+	if (has_inline_data(inode)) {
+		// The first 4 bytes hold the inode number of the parent directory, and the entries in i_block and in the
+		// extended attribute are two separate lists.
+		parse_dir_block(*this, inode.block + 4, sizeof inode.block - 4, block_size, res);
+		std::vector<char> rest;
+		if (read_xattr(inode, xattr_index_system, "data", rest)) {
+			parse_dir_block(*this, rest.data(), rest.size(), block_size, res);
+		}
+		return res;
+	}
+	const auto data = read_file(inode);
+	for (size_t off = 0; off + block_size <= data.size(); off += block_size) {
+		parse_dir_block(*this, data.data() + off, block_size, block_size, res);
+	}
+	return res;
+}
+
+ext4_reader::ext4_reader(pio_file &disk) : volume(disk) {}
+
+ext4_reader::ext4_reader(crwstr vhdx_path)
+	: file(std::make_unique<win_pio_file>(vhdx_path, false, false)),
+	vhdx(std::make_unique<vhdx_file>(*file)), volume(*vhdx) {}
+
+namespace {
+	struct ext4_pending {
+		std::string path, symlink, link_target;
+		ext4_inode inode;
+		std::future<std::vector<char>> data;
+		size_t prefetch_size;
+	};
+}
+
+void ext4_reader::run(fs_writer &writer) {
+	static const uint64_t prefetch_max = 1 << 22, window_max_bytes = 1 << 27, chunk_size = 1 << 22;
+	static const size_t window_max_entries = 1024;
+	task_pool pool;
+	std::deque<ext4_pending> window;
+	uint64_t window_bytes = 0;
+	std::map<uint32_t, std::string> links;
+	std::vector<char> buf;
+
+	// Names are passed to the writer in the UTF-8 form they're stored in.
+	linux_path lp, target_lp;
+	const auto to_linux_path = [](linux_path &res, const std::string &p) -> linux_path & {
+		// The root directory has an empty path, which would otherwise be skipped.
+		if (p.empty()) res = linux_path();
+		else res.assign_utf8(p.data(), p.size(), "");
+		return res;
+	};
+	const auto write_data = [&](const char *p, uint64_t size) {
+		for (; size; size -= std::min<uint64_t>(size, 1 << 20), p += 1 << 20) {
+			writer.write_file_data(p, static_cast<uint32_t>(std::min<uint64_t>(size, 1 << 20)));
+		}
+	};
+	const auto consume = [&] {
+		auto &e = window.front();
+		const auto &inode = e.inode;
+		if (!e.link_target.empty()) {
+			if (to_linux_path(lp, e.path).convert(*writer.path)
+				&& to_linux_path(target_lp, e.link_target).convert(*writer.target_path)) {
+				writer.write_hard_link();
+			}
+		} else if (to_linux_path(lp, e.path).convert(*writer.path)) {
+			const auto type = inode.mode & AE_IFMT;
+			file_attr attr {
+				inode.mode, inode.uid, inode.gid, type == AE_IFREG ? inode.size : 0,
+				inode.at, inode.mt, inode.ct, 0, 0, type == AE_IFLNK ? e.symlink.c_str() : nullptr
+			};
+			if (type == AE_IFCHR || type == AE_IFBLK) {
+				const auto old_dev = get<uint32_t>(inode.block), new_dev = get<uint32_t>(inode.block + 4);
+				attr.dev_major = old_dev ? (old_dev >> 8) & 0xFF : (new_dev & 0xFFF00) >> 8;
+				attr.dev_minor = old_dev ? old_dev & 0xFF : (new_dev & 0xFF) | ((new_dev >> 12) & 0xFFF00);
+			}
+			if (writer.write_new_file(&attr) && type == AE_IFREG) {
+				if (e.data.valid()) {
+					const auto data = e.data.get();
+					write_data(data.data(), data.size());
+				} else {
+					const auto extents = volume.read_extents(inode);
+					buf.resize(chunk_size);
+					for (uint64_t off = 0; off < inode.size; off += chunk_size) {
+						const auto cnt = static_cast<size_t>(std::min(chunk_size, inode.size - off));
+						volume.read_data(inode, extents, off, buf.data(), cnt);
+						write_data(buf.data(), cnt);
+					}
+				}
+				writer.write_file_data(nullptr, 0);
+			}
+		}
+		window_bytes -= e.prefetch_size;
+		window.pop_front();
+	};
+	const auto push = [&](std::string path, ext4_inode &&inode) {
+		ext4_pending e { std::move(path), {}, {}, std::move(inode), {}, 0 };
+		const auto type = e.inode.mode & AE_IFMT;
+		if (type != AE_IFDIR && e.inode.links > 1) {
+			const auto it = links.find(e.inode.ino);
+			if (it != links.end()) e.link_target = it->second;
+			else links[e.inode.ino] = e.path;
+		}
+		if (e.link_target.empty() && type == AE_IFLNK) {
+			const auto ea_blocks = e.inode.file_acl ? volume.get_block_size() / 512 : 0;
+			if (volume.has_inline_data(e.inode) || e.inode.blocks > ea_blocks) {
+				const auto data = volume.read_file(e.inode);
+				e.symlink.assign(data.begin(), data.end());
+			} else {
+				if (e.inode.size >= sizeof e.inode.block) volume.fail(L"a symlink is corrupted");
+				e.symlink.assign(e.inode.block, static_cast<size_t>(e.inode.size));
+			}
+		} else if (e.link_target.empty() && type == AE_IFREG && e.inode.size <= prefetch_max) {
+			auto promise = std::make_shared<std::promise<std::vector<char>>>();
+			e.data = promise->get_future();
+			e.prefetch_size = static_cast<size_t>(e.inode.size);
+			pool.submit([this, promise, inode = e.inode] {
+				try {
+					promise->set_value(volume.read_file(inode));
+				} catch (...) {
+					promise->set_exception(std::current_exception());
+				}
+			});
+		}
+		window_bytes += e.prefetch_size;
+		window.push_back(std::move(e));
+		while (window.size() > window_max_entries || window_bytes > window_max_bytes) consume();
+	};
+	std::function<void(const std::string &, const ext4_inode &)> visit = [&](
+		const std::string &dir_path, const ext4_inode &dir
+	) {
+		for (auto &de : volume.read_dir(dir)) {
+			auto inode = volume.read_inode(de.ino);
+			auto p = dir_path + de.name;
+			if ((inode.mode & AE_IFMT) == AE_IFDIR) {
+				const auto copy = inode;
+				push(p + '/', std::move(inode));
+				visit(p + '/', copy);
+			} else {
+				push(std::move(p), std::move(inode));
+			}
+		}
+	};
+	auto root = volume.read_inode(2);
+	const auto root_copy = root;
+	push("", std::move(root));
+	visit("", root_copy);
+	while (!window.empty()) consume();
+}
+
+static const uint32_t w_block_size = 4096, w_inode_size = 256, w_desc_size = 64;
+static const uint32_t w_blocks_per_group = w_block_size * 8, w_log_groups_per_flex = 4;
+static const uint32_t root_ino = 2, journal_ino = 8, lost_found_ino = 11, first_ino = 11;
+static const uint32_t max_links = 65000, max_extent_len = 32768;
+static const size_t data_buffer_size = 1 << 22;
+
+template<typename T>
+static void put(char *p, const T v) {
+	memcpy(p, &v, sizeof v);
+}
+
+static void put_be32(char *p, const uint32_t v) {
+	const unsigned char b[] = {
+		static_cast<unsigned char>(v >> 24), static_cast<unsigned char>(v >> 16),
+		static_cast<unsigned char>(v >> 8), static_cast<unsigned char>(v)
+	};
+	memcpy(p, b, sizeof b);
+}
+
+// The low 32 bits are stored as a signed value, and the epoch bits in the extra field extend it past 2038.
+static void put_time(char *inode, const size_t base_off, const size_t extra_off, const unix_time &t) {
+	const auto epoch = (t.sec - static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(t.sec)))) >> 32;
+	put(inode + base_off, static_cast<uint32_t>(t.sec));
+	put(inode + extra_off, static_cast<uint32_t>(epoch & 3) | t.nsec << 2);
+}
+
+static void new_uuid(char *buf) {
+	GUID g;
+	const auto hr = CoCreateGuid(&g);
+	if (FAILED(hr)) throw lro_error::from_hresult(err_msg::err_create_guid, {}, hr);
+	memcpy(buf, &g, sizeof g);
+}
+
+static bool is_zero(const char *p, const size_t size) {
+	return std::all_of(p, p + size, [](const char c) { return c == 0; });
+}
+
+static uint8_t dir_file_type(const uint32_t mode) {
+	switch (mode & AE_IFMT) {
+	case AE_IFREG: return 1;
+	case AE_IFDIR: return 2;
+	case AE_IFCHR: return 3;
+	case AE_IFBLK: return 4;
+	case AE_IFIFO: return 5;
+	case AE_IFSOCK: return 6;
+	case AE_IFLNK: return 7;
+	default: return 0;
+	}
+}
+
+// The journal sizes chosen by mke2fs for filesystems of different sizes.
+static uint32_t default_journal_blocks(const uint64_t blocks) {
+	if (blocks < 32768) return 1024;
+	if (blocks < 256 * 1024) return 4096;
+	if (blocks < 512 * 1024) return 8192;
+	if (blocks < 4096 * 1024) return 16384;
+	if (blocks < 8192 * 1024) return 32768;
+	if (blocks < 16384 * 1024) return 65536;
+	if (blocks < 32768 * 1024) return 131072;
+	return 262144;
+}
+
+ext4_writer::ext4_writer(pio_file &disk) : disk(disk) {
+	init();
+}
+
+ext4_writer::ext4_writer(crwstr vhdx_path, const uint64_t disk_size)
+	: file(std::make_unique<win_pio_file>(vhdx_path, true, true)),
+	vhdx((vhdx_file::create(*file, disk_size), std::make_unique<vhdx_file>(*file))), disk(*vhdx) {
+	init();
+}
+
+// The layout is the superblock, the group descriptors, all block bitmaps, all inode bitmaps, all inode tables and
+// the journal, followed by file data. flex_bg allows group metadata to be stored outside of its group, and there are
+// no backup superblocks, so every block after the journal is free for data.
+void ext4_writer::init() {
+	path = std::make_unique<linux_path>();
+	target_path = std::make_unique<linux_path>();
+	blocks_count = disk.size() / w_block_size;
+	group_count = static_cast<uint32_t>((blocks_count + w_blocks_per_group - 1) / w_blocks_per_group);
+	// One inode for every 16 KiB, which is the default of mke2fs.
+	inodes_per_group = w_blocks_per_group / 4;
+	if (static_cast<uint64_t>(inodes_per_group) * group_count > UINT32_MAX) {
+		throw lro_error::from_other(err_msg::err_ext4, { disk.name(), L"the disk is too large" });
+	}
+	gdt_blocks = (group_count * w_desc_size + w_block_size - 1) / w_block_size;
+	itable_blocks = inodes_per_group * w_inode_size / w_block_size;
+	journal_blocks = default_journal_blocks(blocks_count);
+	next_block = 1 + gdt_blocks + static_cast<uint64_t>(group_count) * (2 + itable_blocks);
+	if (next_block + journal_blocks + 1024 > blocks_count) {
+		throw lro_error::from_other(err_msg::err_ext4, { disk.name(), L"the disk is too small" });
+	}
+	cur_ino = 0;
+	cur_written = 0;
+	closed = false;
+	buf.reserve(data_buffer_size);
+
+	nodes.resize(first_ino - 1);
+	auto &root = get_node(root_ino);
+	root.mode = AE_IFDIR | 0755;
+	root.links = 2;
+	root.parent = root_ino;
+	dirs[root_ino];
+	paths[""] = root_ino;
+
+	auto &journal = get_node(journal_ino);
+	journal.mode = AE_IFREG | 0600;
+	journal.links = 1;
+	journal.count = journal_blocks;
+	journal.size = static_cast<uint64_t>(journal_blocks) * w_block_size;
+	journal.start = alloc_blocks(journal_blocks);
+	new_uuid(uuid);
+	// An empty journal only needs its superblock, which is stored in big-endian.
+	char jsb[1024] = {};
+	put_be32(jsb, 0xC03B3998);
+	put_be32(jsb + 0x4, 4);
+	put_be32(jsb + 0xC, w_block_size);
+	put_be32(jsb + 0x10, journal_blocks);
+	put_be32(jsb + 0x14, 1);
+	put_be32(jsb + 0x18, 1);
+	memcpy(jsb + 0x30, uuid, sizeof uuid);
+	put_be32(jsb + 0x40, 1);
+	disk.write(journal.start * w_block_size, jsb, sizeof jsb);
+
+	const auto lf = alloc_inode(AE_IFDIR | 0700);
+	auto &lost_found = get_node(lf);
+	lost_found.links = 2;
+	lost_found.parent = root_ino;
+	get_node(root_ino).links++;
+	dirs[lf];
+	dirs[root_ino].push_back({ "lost+found", lf });
+	paths["lost+found"] = lf;
+}
+
+void ext4_writer::fail_full(crwstr what) const {
+	throw lro_error::from_other(err_msg::err_ext4_full, { disk.name(), what });
+}
+
+void ext4_writer::check_space(const scan_result &scan) const {
+	// Each entry takes an inode, and at least a block for its data, directory entries or extents.
+	if (scan.entries > static_cast<uint64_t>(inodes_per_group) * group_count - nodes.size()) fail_full(L"files");
+	if ((scan.bytes + w_block_size - 1) / w_block_size + scan.entries > blocks_count - next_block) fail_full(L"data");
+}
+
+uint64_t ext4_writer::alloc_blocks(const uint64_t count) {
+	if (count > blocks_count - next_block) fail_full(L"data");
+	const auto start = next_block;
+	next_block += count;
+	return start;
+}
+
+uint32_t ext4_writer::alloc_inode(const uint32_t mode) {
+	if (nodes.size() >= static_cast<uint64_t>(inodes_per_group) * group_count) fail_full(L"files");
+	nodes.push_back({ mode, 0, 0, 1, 0, 0, 0, 0, 0, {}, {}, {} });
+	return static_cast<uint32_t>(nodes.size());
+}
+
+ext4_writer::node &ext4_writer::get_node(const uint32_t ino) {
+	return nodes[ino - 1];
+}
+
+// Archives don't always contain the parent directories of their files, so missing ones are created like tar does.
+uint32_t ext4_writer::find_dir(const std::string &p) {
+	const auto it = paths.find(p);
+	if (it != paths.end()) {
+		if ((get_node(it->second).mode & AE_IFMT) != AE_IFDIR) {
+			throw lro_error::from_other(err_msg::err_create_dir, { from_utf8(p.c_str()) });
+		}
+		return it->second;
+	}
+	const auto sp = p.rfind('/');
+	const auto parent = sp == std::string::npos ? root_ino : find_dir(p.substr(0, sp));
+	const auto ino = alloc_inode(AE_IFDIR | 0755);
+	auto &n = get_node(ino);
+	n.links = 2;
+	n.parent = parent;
+	get_node(parent).links++;
+	dirs[ino];
+	dirs[parent].push_back({ sp == std::string::npos ? p : p.substr(sp + 1), ino });
+	paths.emplace(p, ino);
+	return ino;
+}
+
+static std::string strip_slash(file_path &p) {
+	auto s = static_cast<linux_path &>(p).get_utf8();
+	if (!s.empty() && s.back() == '/') s.pop_back();
+	return s;
+}
+
+bool ext4_writer::write_new_file(const file_attr *attr) {
+	if (!check_attr(attr, false, true)) return false;
+	const auto type = attr->mode & AE_IFMT;
+	auto p = strip_slash(*path);
+	const auto set_attr = [attr](node &n) {
+		n.mode = attr->mode;
+		n.uid = attr->uid;
+		n.gid = attr->gid;
+		n.at = attr->at;
+		n.mt = attr->mt;
+		n.ct = attr->ct;
+	};
+	const auto it = paths.find(p);
+	if (it != paths.end()) {
+		auto &n = get_node(it->second);
+		if (type != AE_IFDIR || (n.mode & AE_IFMT) != AE_IFDIR) {
+			throw lro_error::from_other(err_msg::err_create_file, { path->data });
+		}
+		set_attr(n);
+		return true;
+	}
+	const auto sp = p.rfind('/');
+	auto name = sp == std::string::npos ? p : p.substr(sp + 1);
+	if (name.size() > 255) throw lro_error::from_other(err_msg::err_create_file, { path->data });
+	const auto parent = sp == std::string::npos ? root_ino : find_dir(p.substr(0, sp));
+	const auto ino = alloc_inode(attr->mode);
+	auto &n = get_node(ino);
+	set_attr(n);
+	n.parent = parent;
+	if (type == AE_IFDIR) {
+		n.links = 2;
+		dirs[ino];
+		get_node(parent).links++;
+	} else if (type == AE_IFREG) {
+		n.size = attr->size;
+		n.count = (attr->size + w_block_size - 1) / w_block_size;
+		n.start = alloc_blocks(n.count);
+		cur_ino = ino;
+		cur_written = 0;
+	} else if (type == AE_IFLNK) {
+		n.size = strlen(attr->symlink);
+		if (n.size < sizeof ext4_inode::block) {
+			fast_links[ino] = attr->symlink;
+		} else {
+			n.count = (n.size + w_block_size - 1) / w_block_size;
+			n.start = alloc_blocks(n.count);
+			disk.write(n.start * w_block_size, attr->symlink, static_cast<size_t>(n.size));
+		}
+	} else if (type == AE_IFCHR || type == AE_IFBLK) {
+		n.dev = attr->dev_major < 256 && attr->dev_minor < 256
+			? attr->dev_major << 8 | attr->dev_minor
+			: (attr->dev_minor & 0xFF) | attr->dev_major << 8 | (attr->dev_minor & ~0xFFu) << 12;
+	}
+	dirs[parent].push_back({ std::move(name), ino });
+	paths.emplace(std::move(p), ino);
+	return true;
+}
+
+void ext4_writer::write_file_data(const char *data, const uint32_t size) {
+	if (!cur_ino) return;
+	if (!size) {
+		end_file();
+		return;
+	}
+	if (cur_written + buf.size() + size > get_node(cur_ino).size) {
+		throw lro_error::from_other(err_msg::err_write_file, { path->data });
+	}
+	buf.insert(buf.end(), data, data + size);
+	if (buf.size() >= data_buffer_size) flush_data();
+}
+
+// The disk is zeroed when it's created, so blocks that are entirely zero are skipped. This keeps sparse files from
+// taking up space in the VHDX.
+void ext4_writer::flush_data() {
+	const auto base = get_node(cur_ino).start * w_block_size + cur_written;
+	for (size_t pos = 0; pos < buf.size();) {
+		while (pos < buf.size() && is_zero(buf.data() + pos, std::min<size_t>(w_block_size, buf.size() - pos))) {
+			pos += w_block_size;
+		}
+		const auto start = pos;
+		while (pos < buf.size() && !is_zero(buf.data() + pos, std::min<size_t>(w_block_size, buf.size() - pos))) {
+			pos += w_block_size;
+		}
+		if (start < buf.size()) disk.write(base + start, buf.data() + start, std::min(pos, buf.size()) - start);
+	}
+	cur_written += buf.size();
+	buf.clear();
+}
+
+// The blocks of a file are planned from the size in its attributes, so less data than that is an error rather than
+// leaving zeros at the end.
+void ext4_writer::end_file() {
+	flush_data();
+	const auto ino = cur_ino;
+	cur_ino = 0;
+	if (cur_written != get_node(ino).size) throw lro_error::from_other(err_msg::err_write_file, { path->data });
+}
+
+void ext4_writer::write_hard_link() {
+	if (!check_target_ignored()) return;
+	auto p = strip_slash(*path);
+	const auto it = paths.find(strip_slash(*target_path));
+	if (p.empty() || it == paths.end() || paths.count(p)
+		|| (get_node(it->second).mode & AE_IFMT) == AE_IFDIR || get_node(it->second).links >= max_links) {
+		throw lro_error::from_other(err_msg::err_hard_link, { path->data, target_path->data });
+	}
+	const auto ino = it->second;
+	const auto sp = p.rfind('/');
+	const auto parent = sp == std::string::npos ? root_ino : find_dir(p.substr(0, sp));
+	get_node(ino).links++;
+	dirs[parent].push_back({ sp == std::string::npos ? p : p.substr(sp + 1), ino });
+	paths.emplace(std::move(p), ino);
+}
+
+void ext4_writer::check_path(const file_path &) const {}
+
+std::unique_ptr<ext4_writer> create_wsl2_writer(crwstr dir, const uint64_t disk_size) {
+	const wsl_v2_path p(dir);
+	create_recursive(p.data);
+	return std::make_unique<ext4_writer>(p.data + L"ext4.vhdx", disk_size);
+}
+
+void ext4_writer::close() {
+	if (closed) return;
+	if (cur_ino) end_file();
+	write_dirs();
+	write_inodes();
+	write_metadata();
+	disk.flush();
+	closed = true;
+}
+
+// Directories are allocated one after another, so their blocks are gathered and written in large chunks.
+void ext4_writer::write_dirs() {
+	std::vector<char> data;
+	uint64_t data_start = next_block;
+	const auto flush = [&] {
+		disk.write(data_start * w_block_size, data.data(), data.size());
+		data_start += data.size() / w_block_size;
+		data.clear();
+	};
+	for (uint32_t ino = 1; ino <= nodes.size(); ino++) {
+		const auto it = dirs.find(ino);
+		if (it == dirs.end()) continue;
+		auto &n = get_node(ino);
+		const auto first = data.size();
+		size_t last_entry = 0;
+		const auto add = [&](const std::string &name, const uint32_t child) {
+			const auto rec_len = (8 + name.size() + 3) / 4 * 4;
+			const auto used = (data.size() - first) % w_block_size;
+			if (used && used + rec_len > w_block_size) {
+				put(data.data() + last_entry + 4, static_cast<uint16_t>(data.size() - last_entry + w_block_size - used));
+				data.resize(data.size() + w_block_size - used);
+			}
+			last_entry = data.size();
+			data.resize(data.size() + rec_len);
+			const auto pe = data.data() + last_entry;
+			put(pe, child);
+			put(pe + 4, static_cast<uint16_t>(rec_len));
+			pe[6] = static_cast<char>(name.size());
+			pe[7] = static_cast<char>(dir_file_type(get_node(child).mode));
+			memcpy(pe + 8, name.data(), name.size());
+		};
+		add(".", ino);
+		add("..", n.parent);
+		for (const auto &c : it->second) add(c.name, c.ino);
+		const auto end = (data.size() - first + w_block_size - 1) / w_block_size * w_block_size + first;
+		put(data.data() + last_entry + 4, static_cast<uint16_t>(end - last_entry));
+		data.resize(end);
+		// lost+found is preallocated so that fsck can reconnect files without allocating blocks.
+		if (ino == lost_found_ino) {
+			while (data.size() - first < 4 * w_block_size) {
+				data.resize(data.size() + w_block_size);
+				put(data.data() + data.size() - w_block_size + 4, static_cast<uint16_t>(w_block_size));
+			}
+		}
+		n.count = (data.size() - first) / w_block_size;
+		n.size = n.count * w_block_size;
+		n.start = alloc_blocks(n.count);
+		std::vector<child>().swap(it->second);
+		if (data.size() >= data_buffer_size) flush();
+	}
+	if (!data.empty()) flush();
+}
+
+// Files are contiguous, so their extents only need to be split at the maximum extent length. Files with more than
+// four extents get a tree with leaves and index nodes stored in newly allocated blocks.
+void ext4_writer::write_extents(char *inode, const node &n) {
+	static const uint16_t per_block = (w_block_size - 12) / 12;
+	std::vector<std::array<char, 12>> level;
+	for (uint64_t l = 0; l < n.count; l += max_extent_len) {
+		std::array<char, 12> e {};
+		const auto physical = n.start + l;
+		put(e.data(), static_cast<uint32_t>(l));
+		put(e.data() + 4, static_cast<uint16_t>(std::min<uint64_t>(max_extent_len, n.count - l)));
+		put(e.data() + 6, static_cast<uint16_t>(physical >> 32));
+		put(e.data() + 8, static_cast<uint32_t>(physical));
+		level.push_back(e);
+	}
+	const auto put_header = [](char *p, const size_t entries, const uint16_t max, const uint16_t depth) {
+		put(p, extent_magic);
+		put(p + 2, static_cast<uint16_t>(entries));
+		put(p + 4, max);
+		put(p + 6, depth);
+	};
+	uint16_t depth = 0;
+	uint64_t tree_blocks = 0;
+	std::vector<char> block(w_block_size);
+	while (level.size() > 4) {
+		std::vector<std::array<char, 12>> parent;
+		for (size_t i = 0; i < level.size(); i += per_block) {
+			const auto cnt = std::min<size_t>(per_block, level.size() - i);
+			std::fill(block.begin(), block.end(), 0);
+			put_header(block.data(), cnt, per_block, depth);
+			for (size_t j = 0; j < cnt; j++) memcpy(block.data() + 12 + j * 12, level[i + j].data(), 12);
+			const auto b = alloc_blocks(1);
+			disk.write(b * w_block_size, block.data(), block.size());
+			tree_blocks++;
+			std::array<char, 12> e {};
+			memcpy(e.data(), level[i].data(), 4);
+			put(e.data() + 4, static_cast<uint32_t>(b));
+			put(e.data() + 8, static_cast<uint16_t>(b >> 32));
+			parent.push_back(e);
+		}
+		level = std::move(parent);
+		depth++;
+	}
+	put_header(inode + 0x28, level.size(), 4, depth);
+	for (size_t i = 0; i < level.size(); i++) memcpy(inode + 0x28 + 12 + i * 12, level[i].data(), 12);
+	put(inode + 0x20, inode_flag_extents);
+	const auto sectors = (n.count + tree_blocks) * (w_block_size / 512);
+	put(inode + 0x1C, static_cast<uint32_t>(sectors));
+	put(inode + 0x74, static_cast<uint16_t>(sectors >> 32));
+}
+
+void ext4_writer::write_inodes() {
+	const auto itable_base = 1 + gdt_blocks + 2ull * group_count;
+	std::vector<char> table;
+	for (uint32_t g = 0; static_cast<uint64_t>(g) * inodes_per_group < nodes.size(); g++) {
+		const auto first = static_cast<size_t>(g) * inodes_per_group;
+		const auto last = std::min<size_t>(nodes.size(), first + inodes_per_group);
+		table.assign((last - first) * w_inode_size, 0);
+		for (auto i = first; i < last; i++) {
+			const auto &n = nodes[i];
+			if (!n.mode) continue;
+			const auto ino = static_cast<uint32_t>(i + 1);
+			const auto p = table.data() + (i - first) * w_inode_size;
+			const auto type = n.mode & AE_IFMT;
+			put(p, static_cast<uint16_t>(n.mode));
+			put(p + 0x2, static_cast<uint16_t>(n.uid));
+			put(p + 0x78, static_cast<uint16_t>(n.uid >> 16));
+			put(p + 0x18, static_cast<uint16_t>(n.gid));
+			put(p + 0x7A, static_cast<uint16_t>(n.gid >> 16));
+			put(p + 0x4, static_cast<uint32_t>(n.size));
+			put(p + 0x6C, static_cast<uint32_t>(n.size >> 32));
+			// Directories with too many subdirectories have their link count set to 1, as allowed by dir_nlink.
+			put(p + 0x1A, static_cast<uint16_t>(n.links > max_links ? 1 : n.links));
+			put(p + 0x80, static_cast<uint16_t>(32));
+			put_time(p, 0x8, 0x8C, n.at);
+			put_time(p, 0xC, 0x84, n.ct);
+			put_time(p, 0x10, 0x88, n.mt);
+			put_time(p, 0x90, 0x94, n.ct);
+			if (type == AE_IFREG || type == AE_IFDIR || (type == AE_IFLNK && n.count)) {
+				write_extents(p, n);
+			} else if (type == AE_IFLNK) {
+				const auto &target = fast_links[ino];
+				memcpy(p + 0x28, target.data(), target.size());
+			} else if (type == AE_IFCHR || type == AE_IFBLK) {
+				put(p + (n.dev >> 16 ? 0x2C : 0x28), n.dev);
+			}
+		}
+		disk.write((itable_base + static_cast<uint64_t>(g) * itable_blocks) * w_block_size, table.data(), table.size());
+	}
+}
+
+void ext4_writer::write_metadata() {
+	const uint64_t bb_base = 1 + gdt_blocks, ib_base = bb_base + group_count, itable_base = ib_base + group_count;
+	const uint64_t used_inodes = nodes.size(), inodes_count = static_cast<uint64_t>(inodes_per_group) * group_count;
+	std::vector<uint32_t> used_dirs(group_count);
+	for (size_t i = 0; i < nodes.size(); i++) {
+		if ((nodes[i].mode & AE_IFMT) == AE_IFDIR) used_dirs[i / inodes_per_group]++;
+	}
+	const auto set_bits = [](char *bitmap, const uint64_t from, const uint64_t to) {
+		for (auto i = from; i < to; i++) bitmap[i / 8] |= static_cast<char>(1 << (i % 8));
+	};
+
+	// Blocks and inodes are both used from the start, so only the groups at the beginning have bitmaps to write.
+	// fsck also expects the block bitmap of the last group to be initialized.
+	std::vector<char> bitmaps;
+	const auto last_group = group_count - 1;
+	const auto block_bitmap = [&](const uint32_t g) {
+		bitmaps.resize(bitmaps.size() + w_block_size);
+		const auto first = static_cast<uint64_t>(g) * w_blocks_per_group;
+		const auto group_blocks = std::min<uint64_t>(w_blocks_per_group, blocks_count - first);
+		const auto bitmap = bitmaps.data() + bitmaps.size() - w_block_size;
+		if (next_block > first) set_bits(bitmap, 0, std::min(group_blocks, next_block - first));
+		set_bits(bitmap, group_blocks, w_blocks_per_group);
+	};
+	const auto used_groups = static_cast<uint32_t>((next_block + w_blocks_per_group - 1) / w_blocks_per_group);
+	for (uint32_t g = 0; g < used_groups; g++) block_bitmap(g);
+	disk.write(bb_base * w_block_size, bitmaps.data(), bitmaps.size());
+	if (used_groups <= last_group) {
+		bitmaps.clear();
+		block_bitmap(last_group);
+		disk.write((bb_base + last_group) * w_block_size, bitmaps.data(), bitmaps.size());
+	}
+	bitmaps.clear();
+	for (uint32_t g = 0; static_cast<uint64_t>(g) * inodes_per_group < used_inodes; g++) {
+		bitmaps.resize(bitmaps.size() + w_block_size);
+		const auto bitmap = bitmaps.data() + bitmaps.size() - w_block_size;
+		set_bits(bitmap, 0, std::min<uint64_t>(inodes_per_group, used_inodes - static_cast<uint64_t>(g) * inodes_per_group));
+		set_bits(bitmap, inodes_per_group, w_block_size * 8);
+	}
+	disk.write(ib_base * w_block_size, bitmaps.data(), bitmaps.size());
+
+	std::vector<char> gdt(static_cast<size_t>(gdt_blocks) * w_block_size);
+	for (uint32_t g = 0; g < group_count; g++) {
+		const auto first_block = static_cast<uint64_t>(g) * w_blocks_per_group;
+		const auto first_inode = static_cast<uint64_t>(g) * inodes_per_group;
+		const auto group_blocks = std::min<uint64_t>(w_blocks_per_group, blocks_count - first_block);
+		const auto used_b = next_block > first_block ? std::min(group_blocks, next_block - first_block) : 0;
+		const auto used_i = used_inodes > first_inode ? std::min<uint64_t>(inodes_per_group, used_inodes - first_inode) : 0;
+		const auto free_b = static_cast<uint32_t>(group_blocks - used_b);
+		const auto free_i = static_cast<uint32_t>(inodes_per_group - used_i);
+		const auto bb = bb_base + g, ib = ib_base + g, it = itable_base + static_cast<uint64_t>(g) * itable_blocks;
+		const auto pd = gdt.data() + static_cast<size_t>(g) * w_desc_size;
+		put(pd, static_cast<uint32_t>(bb));
+		put(pd + 0x20, static_cast<uint32_t>(bb >> 32));
+		put(pd + 0x4, static_cast<uint32_t>(ib));
+		put(pd + 0x24, static_cast<uint32_t>(ib >> 32));
+		put(pd + 0x8, static_cast<uint32_t>(it));
+		put(pd + 0x28, static_cast<uint32_t>(it >> 32));
+		put(pd + 0xC, static_cast<uint16_t>(free_b));
+		put(pd + 0x2C, static_cast<uint16_t>(free_b >> 16));
+		put(pd + 0xE, static_cast<uint16_t>(free_i));
+		put(pd + 0x2E, static_cast<uint16_t>(free_i >> 16));
+		put(pd + 0x10, static_cast<uint16_t>(used_dirs[g]));
+		put(pd + 0x30, static_cast<uint16_t>(used_dirs[g] >> 16));
+		put(pd + 0x12, static_cast<uint16_t>(bg_inode_zeroed | (used_b || g == last_group ? 0 : bg_block_uninit) | (used_i ? 0 : bg_inode_uninit)));
+		put(pd + 0x1C, static_cast<uint16_t>(free_i));
+		put(pd + 0x32, static_cast<uint16_t>(free_i >> 16));
+		const auto le_group = g;
+		auto crc = crc16(uuid, sizeof uuid, 0xFFFF);
+		crc = crc16(reinterpret_cast<const char *>(&le_group), sizeof le_group, crc);
+		crc = crc16(pd, 0x1E, crc);
+		crc = crc16(pd + 0x20, w_desc_size - 0x20, crc);
+		put(pd + 0x1E, crc);
+	}
+	disk.write(w_block_size, gdt.data(), gdt.size());
+
+	const auto now = static_cast<uint32_t>(std::time(nullptr));
+	const auto free_blocks = blocks_count - next_block;
+	char sb[1024] = {};
+	put(sb, static_cast<uint32_t>(inodes_count));
+	put(sb + 0x4, static_cast<uint32_t>(blocks_count));
+	put(sb + 0x150, static_cast<uint32_t>(blocks_count >> 32));
+	put(sb + 0xC, static_cast<uint32_t>(free_blocks));
+	put(sb + 0x158, static_cast<uint32_t>(free_blocks >> 32));
+	put(sb + 0x10, static_cast<uint32_t>(inodes_count - used_inodes));
+	put(sb + 0x18, static_cast<uint32_t>(2));
+	put(sb + 0x1C, static_cast<uint32_t>(2));
+	put(sb + 0x20, w_blocks_per_group);
+	put(sb + 0x24, w_blocks_per_group);
+	put(sb + 0x28, inodes_per_group);
+	put(sb + 0x30, now);
+	put(sb + 0x36, static_cast<uint16_t>(0xFFFF));
+	put(sb + 0x38, static_cast<uint16_t>(0xEF53));
+	put(sb + 0x3A, static_cast<uint16_t>(1));
+	put(sb + 0x3C, static_cast<uint16_t>(1));
+	put(sb + 0x40, now);
+	put(sb + 0x4C, static_cast<uint32_t>(1));
+	put(sb + 0x54, first_ino);
+	put(sb + 0x58, static_cast<uint16_t>(w_inode_size));
+	// has_journal, ext_attr, dir_index and sparse_super2
+	put(sb + 0x5C, static_cast<uint32_t>(0x4 | 0x8 | 0x20 | compat_sparse_super2));
+	put(sb + 0x60, incompat_filetype | incompat_extents | incompat_64bit | incompat_flex_bg);
+	// sparse_super, large_file, huge_file, gdt_csum, dir_nlink and extra_isize
+	put(sb + 0x64, static_cast<uint32_t>(ro_compat_sparse_super | 0x2 | 0x8 | 0x10 | 0x20 | 0x40));
+	memcpy(sb + 0x68, uuid, sizeof uuid);
+	put(sb + 0xE0, journal_ino);
+	new_uuid(sb + 0xEC);
+	sb[0xFC] = 1;
+	// The superblock keeps a copy of the block map of the journal inode, which is read back from the inode table.
+	sb[0xFD] = 1;
+	disk.read(itable_base * w_block_size + (journal_ino - 1) * w_inode_size + 0x28, sb + 0x10C, 60);
+	put(sb + 0x10C + 60, static_cast<uint32_t>(get_node(journal_ino).size >> 32));
+	put(sb + 0x10C + 64, static_cast<uint32_t>(get_node(journal_ino).size));
+	put(sb + 0xFE, static_cast<uint16_t>(w_desc_size));
+	put(sb + 0x100, static_cast<uint32_t>(0xC));
+	put(sb + 0x108, now);
+	put(sb + 0x15C, static_cast<uint16_t>(32));
+	put(sb + 0x15E, static_cast<uint16_t>(32));
+	put(sb + 0x160, static_cast<uint32_t>(1));
+	sb[0x174] = static_cast<char>(w_log_groups_per_flex);
+	disk.write(1024, sb, sizeof sb);
+}
+
+void copy_wsl2_disk(crwstr source_dir, crwstr target_dir, const uint32_t thread_count) {
+	const wsl_v2_path sp(source_dir), tp(target_dir);
+	create_recursive(tp.data);
+	win_pio_file in(sp.data + L"ext4.vhdx", false, false);
+	vhdx_file source(in);
+	win_pio_file out(tp.data + L"ext4.vhdx", true, true);
+	source.copy_to(out, nullptr, thread_count);
+}
+
+scan_result scan_wsl2_disk(crwstr dir) {
+	const win_pio_file f(wsl_v2_path(dir).data + L"ext4.vhdx", false, false);
+	return { 1, f.size() };
+}
+
+static void set_read_only(crwstr path, const bool value) {
+	const auto attr = GetFileAttributes(path.c_str());
+	const auto new_attr = value ? attr | FILE_ATTRIBUTE_READONLY : attr & ~FILE_ATTRIBUTE_READONLY;
+	if (attr == INVALID_FILE_ATTRIBUTES || !SetFileAttributes(path.c_str(), new_attr)) {
+		throw lro_error::from_win32_last(err_msg::err_set_attr, { path });
+	}
+}
+
+void create_differencing_wsl2_disk(crwstr parent_dir, crwstr dir) {
+	const wsl_v2_path pp(parent_dir), p(dir);
+	create_recursive(p.data);
+	const auto parent_path = pp.data + L"ext4.vhdx";
+	{
+		win_pio_file in(parent_path, false, false);
+		vhdx_file parent(in);
+		win_pio_file out(p.data + L"ext4.vhdx", true, true);
+		vhdx_file::create_differencing(out, parent);
+	}
+	set_read_only(parent_path, true);
+}
+
+void unlock_wsl2_disk(crwstr dir) {
+	set_read_only(wsl_v2_path(dir).data + L"ext4.vhdx", false);
+}
+
+// The new disk is written next to the old one, which is only replaced once the copy is complete.
+static std::pair<uint64_t, uint64_t> rewrite_disk(
+	crwstr vhdx_path, const std::function<void(vhdx_file &, pio_file &)> &copy
+) {
+	const auto tmp_path = vhdx_path + L".tmp";
+	uint64_t old_size, new_size;
+	try {
+		win_pio_file file(vhdx_path, false, false);
+		old_size = file.size();
+		vhdx_file vhdx(file);
+		win_pio_file out(tmp_path, true, true);
+		copy(vhdx, out);
+		new_size = out.size();
+	} catch (...) {
+		DeleteFile(tmp_path.c_str());
+		throw;
+	}
+	if (!MoveFileEx(tmp_path.c_str(), vhdx_path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		const auto err = GetLastError();
+		DeleteFile(tmp_path.c_str());
+		throw lro_error::from_win32(err_msg::err_create_file, { vhdx_path }, err);
+	}
+	return { old_size, new_size };
+}
+
+std::pair<uint64_t, uint64_t> flatten_wsl2_disk(crwstr vhdx_path, const uint32_t thread_count) {
+	return rewrite_disk(vhdx_path, [&](vhdx_file &vhdx, pio_file &out) {
+		vhdx.copy_to(out, nullptr, thread_count);
+	});
+}
+
+// Returns whether each block of the disk holds no block used by the filesystem.
+static std::vector<bool> find_unused_blocks(vhdx_file &vhdx) {
+	const ext4_volume volume(vhdx);
+	const auto used = volume.read_block_bitmap();
+	const uint64_t fs_block_size = volume.get_block_size(), block_size = vhdx.get_block_size();
+	std::vector<bool> res(vhdx.get_block_count(), true);
+	for (uint64_t block = 0; block < res.size(); block++) {
+		const auto end = std::min((block + 1) * block_size, vhdx.size());
+		for (auto b = block * block_size / fs_block_size; b * fs_block_size < end; b++) {
+			// Parts of the disk beyond the end of the filesystem are kept as they are.
+			if (b >= used.size() || used[b]) {
+				res[block] = false;
+				break;
+			}
+		}
+	}
+	return res;
+}
+
+std::pair<uint64_t, uint64_t> compact_wsl2_disk(crwstr vhdx_path, const bool copy, const uint32_t thread_count) {
+	if (copy) {
+		return rewrite_disk(vhdx_path, [&](vhdx_file &vhdx, pio_file &out) {
+			const auto unused = find_unused_blocks(vhdx);
+			vhdx.copy_to(out, [&](const uint64_t block) { return unused[block]; }, thread_count);
+		});
+	}
+	win_pio_file file(vhdx_path, true, false);
+	const auto old_size = file.size();
+	vhdx_file vhdx(file);
+	const auto unused = find_unused_blocks(vhdx);
+	vhdx.compact([&](const uint64_t block) { return unused[block]; }, thread_count);
+	vhdx.flush();
+	return { old_size, file.size() };
+}
@@ -2,6 +2,7 @@
 #include "error.h"
 #include "fs.h"
 #include "ntdll.h"
+#include "parallel.h"
 #include "utils.h"
 
 enum class enum_dir_type {
@@ -25,8 +26,6 @@ struct lxattrb {
 	uint64_t ctime;
 };
 
-static IO_STATUS_BLOCK iostat;
-
 static bool check_archive(archive *pa, const int stat) {
 	if (stat == ARCHIVE_OK) return true;
 	if (stat == ARCHIVE_EOF) return false;
@@ -41,7 +40,7 @@ static bool check_archive(archive *pa, const int stat) {
 	throw lro_error::from_other(err_msg::err_archive, { ss.str() });
 }
 
-static unique_ptr_del<HANDLE> open_file(crwstr path, const bool is_dir, const bool create, const bool no_share = false) {
+unique_ptr_del<HANDLE> open_file(crwstr path, const bool is_dir, const bool create, const bool no_share) {
 	const auto h = CreateFile(
 		path.c_str(),
 		MAXIMUM_ALLOWED, no_share ? 0 : FILE_SHARE_READ, nullptr,
@@ -55,7 +54,37 @@ static unique_ptr_del<HANDLE> open_file(crwstr path, const bool is_dir, const bo
 	return unique_ptr_del<HANDLE>(h, &CloseHandle);
 }
 
-static void create_recursive(crwstr path) {
+// Opens or creates the entry of "path" starting at "name_pos" relative to the handle of its directory, which spares the
+// kernel from parsing the whole path again. Returns how the entry was opened in "result" if it's given.
+static unique_ptr_del<HANDLE> open_file_at(
+	const HANDLE hd, crwstr path, const size_t name_pos, const bool is_dir, const ULONG disposition,
+	ULONG_PTR *result = nullptr
+) {
+	const auto name_len = path.size() - name_pos - (is_dir && path.back() == L'\\' ? 1 : 0);
+	UNICODE_STRING name;
+	name.Buffer = const_cast<wchar_t *>(path.c_str() + name_pos);
+	name.Length = name.MaximumLength = static_cast<USHORT>(name_len * sizeof(wchar_t));
+	OBJECT_ATTRIBUTES oa;
+	InitializeObjectAttributes(&oa, &name, OBJ_CASE_INSENSITIVE, hd, nullptr);
+	IO_STATUS_BLOCK ios;
+	HANDLE h;
+	const auto stat = NtCreateFile(
+		&h, MAXIMUM_ALLOWED | SYNCHRONIZE, &oa, &ios, nullptr, FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, disposition,
+		FILE_SYNCHRONOUS_IO_NONALERT | (is_dir
+			? FILE_DIRECTORY_FILE | FILE_OPEN_FOR_BACKUP_INTENT
+			: FILE_NON_DIRECTORY_FILE | FILE_OPEN_REPARSE_POINT),
+		nullptr, 0
+	);
+	if (stat) {
+		const auto create = disposition != FILE_OPEN;
+		if (is_dir) throw lro_error::from_nt(create ? err_msg::err_create_dir : err_msg::err_open_dir, { path }, stat);
+		throw lro_error::from_nt(create ? err_msg::err_create_file : err_msg::err_open_file, { path }, stat);
+	}
+	if (result) *result = ios.Information;
+	return unique_ptr_del<HANDLE>(h, &CloseHandle);
+}
+
+void create_recursive(crwstr path) {
 	for (auto i = path.find(L'\\', 7); i != wstr::npos; i = path.find(L'\\', i + 1)) {
 		auto p = path.substr(0, i);
 		if (!CreateDirectory(p.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS) {
@@ -64,7 +93,7 @@ static void create_recursive(crwstr path) {
 	}
 }
 
-static uint64_t get_file_size(const HANDLE hf) {
+uint64_t get_file_size(const HANDLE hf) {
 	LARGE_INTEGER sz;
 	if (!GetFileSizeEx(hf, &sz)) throw lro_error::from_win32_last(err_msg::err_file_size, {});
 	return sz.QuadPart;
@@ -87,14 +116,15 @@ static void grant_delete_child(const HANDLE hf) {
 }
 
 static void set_cs_info(const HANDLE hd) {
+	IO_STATUS_BLOCK ios;
 	FILE_CASE_SENSITIVE_INFORMATION info = {};
-	auto stat = NtQueryInformationFile(hd, &iostat, &info, sizeof info, FileCaseSensitiveInformation);
+	auto stat = NtQueryInformationFile(hd, &ios, &info, sizeof info, FileCaseSensitiveInformation);
 	if (!stat && (info.Flags & FILE_CS_FLAG_CASE_SENSITIVE_DIR)) return;
 	info.Flags = FILE_CS_FLAG_CASE_SENSITIVE_DIR;
-	stat = NtSetInformationFile(hd, &iostat, &info, sizeof info, FileCaseSensitiveInformation);
+	stat = NtSetInformationFile(hd, &ios, &info, sizeof info, FileCaseSensitiveInformation);
 	if (stat == STATUS_ACCESS_DENIED) {
 		grant_delete_child(hd);
-		stat = NtSetInformationFile(hd, &iostat, &info, sizeof info, FileCaseSensitiveInformation);
+		stat = NtSetInformationFile(hd, &ios, &info, sizeof info, FileCaseSensitiveInformation);
 	}
 	if (stat) throw lro_error::from_nt(err_msg::err_set_cs, {}, stat);
 }
@@ -109,8 +139,9 @@ static T get_ea(const HANDLE hf, const char *name) {
 	pgi->NextEntryOffset = 0;
 	pgi->EaNameLength = nl;
 	strcpy(pgi->EaName, name);
+	IO_STATUS_BLOCK ios;
 	const auto stat = NtQueryEaFile(
-		hf, &iostat,
+		hf, &ios,
 		pi.get(), static_cast<uint32_t>(il), true,
 		pgi.get(), static_cast<uint32_t>(gil), nullptr, true
 	);
@@ -137,73 +168,180 @@ static void set_ea(const HANDLE hf, const char *name, const T &data) {
 #pragma GCC diagnostic ignored "-Wstringop-overflow"
 	memcpy(pi->EaName + nl + 1, &data, sizeof(T));
 #pragma GCC diagnostic pop
-	const auto stat = NtSetEaFile(hf, &iostat, pi.get(), il);
+	IO_STATUS_BLOCK ios;
+	const auto stat = NtSetEaFile(hf, &ios, pi.get(), il);
 	if (stat) throw lro_error::from_nt(err_msg::err_set_ea, { from_utf8(name) }, stat);
 }
 
+// Reads several EAs of the same type with a single query.
+template<typename T, size_t N>
+static std::array<T, N> get_eas(const HANDLE hf, const std::array<const char *, N> &names) {
+	const auto align = [](const size_t n) { return (n + 3) & ~static_cast<size_t>(3); };
+	size_t gil = 0, il = 0;
+	for (const auto n : names) {
+		gil += align(FIELD_OFFSET(FILE_GET_EA_INFORMATION, EaName) + strlen(n) + 1);
+		il += align(FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) + strlen(n) + 1 + sizeof(T));
+	}
+	std::vector<uint32_t> gb(gil / 4), ib(il / 4);
+	auto pg = reinterpret_cast<char *>(gb.data());
+	for (size_t i = 0; i < N; i++) {
+		const auto pgi = reinterpret_cast<FILE_GET_EA_INFORMATION *>(pg);
+		const auto nl = static_cast<uint8_t>(strlen(names[i]));
+		const auto el = static_cast<uint32_t>(align(FIELD_OFFSET(FILE_GET_EA_INFORMATION, EaName) + nl + 1));
+		pgi->NextEntryOffset = i + 1 < N ? el : 0;
+		pgi->EaNameLength = nl;
+		memcpy(pgi->EaName, names[i], nl + 1);
+		pg += el;
+	}
+	IO_STATUS_BLOCK ios;
+	const auto stat = NtQueryEaFile(
+		hf, &ios,
+		ib.data(), static_cast<uint32_t>(il), false,
+		gb.data(), static_cast<uint32_t>(gil), nullptr, true
+	);
+	if (stat) throw lro_error::from_nt(err_msg::err_get_ea, {}, stat);
+	std::array<T, N> res = {};
+	auto pi = reinterpret_cast<const char *>(ib.data());
+	for (size_t i = 0; i < N; i++) {
+		const auto pfi = reinterpret_cast<const FILE_FULL_EA_INFORMATION *>(pi);
+		if (pfi->EaValueLength != sizeof(T) || (i + 1 < N && !pfi->NextEntryOffset)) {
+			throw lro_error::from_other(err_msg::err_invalid_ea, { from_utf8(names[i]) });
+		}
+		memcpy(&res[i], pfi->EaName + pfi->EaNameLength + 1, sizeof(T));
+		pi += pfi->NextEntryOffset;
+	}
+	return res;
+}
+
+struct ea_value {
+	const char *name;
+	const void *data;
+	uint16_t size;
+};
+
+// Writes several EAs with a single call. An EA without data is removed.
+static void set_ea_list(const HANDLE hf, const std::vector<ea_value> &values) {
+	const auto entry_size = [](const ea_value &v) {
+		const auto n = FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) + strlen(v.name) + 1 + v.size;
+		return (n + 3) & ~static_cast<size_t>(3);
+	};
+	size_t il = 0;
+	for (const auto &v : values) il += entry_size(v);
+	std::vector<uint32_t> ib(il / 4);
+	auto pi = reinterpret_cast<char *>(ib.data());
+	for (size_t i = 0; i < values.size(); i++) {
+		const auto &v = values[i];
+		const auto pfi = reinterpret_cast<FILE_FULL_EA_INFORMATION *>(pi);
+		const auto nl = static_cast<uint8_t>(strlen(v.name));
+		const auto el = static_cast<uint32_t>(entry_size(v));
+		pfi->NextEntryOffset = i + 1 < values.size() ? el : 0;
+		pfi->Flags = 0;
+		pfi->EaNameLength = nl;
+		pfi->EaValueLength = v.size;
+		memcpy(pfi->EaName, v.name, nl + 1);
+		if (v.size) memcpy(pfi->EaName + nl + 1, v.data, v.size);
+		pi += el;
+	}
+	IO_STATUS_BLOCK ios;
+	const auto stat = NtSetEaFile(hf, &ios, ib.data(), static_cast<uint32_t>(il));
+	if (stat) throw lro_error::from_nt(err_msg::err_set_ea, { from_utf8(values[0].name) }, stat);
+}
+
 static void find_close_safe(const HANDLE hs) {
 	if (hs != INVALID_HANDLE_VALUE) FindClose(hs);
 }
 
-static void enum_directory(file_path &path, const bool rootfs_first, std::function<void(enum_dir_type)> action) {
-	std::function<void(bool)> enum_rec;
-	enum_rec = [&](const bool is_root) {
-		try {
-			const auto hf = open_file(path.data, true, false);
-			if (get_win_build() <= 20206) {
-				set_cs_info(hf.get());
+static void time_u2f(const unix_time &ut, LARGE_INTEGER &ft) {
+	ft.QuadPart = ut.sec * 10000000 + ut.nsec / 100 + 116444736000000000;
+}
+
+static void time_f2u(const LARGE_INTEGER &ft, unix_time &ut) {
+	const auto t = ft.QuadPart - 116444736000000000;
+	ut.sec = static_cast<uint64_t>(t / 10000000);
+	ut.nsec = static_cast<uint32_t>(t % 10000000 * 100);
+}
+
+// Queries a handle for what a directory listing tells about an entry, where the listing isn't available or up to date.
+static dir_entry_info query_entry_info(const HANDLE hf, crwstr path) {
+	FILE_BASIC_INFO bi;
+	FILE_STANDARD_INFO si;
+	if (!GetFileInformationByHandleEx(hf, FileBasicInfo, &bi, sizeof bi)
+		|| !GetFileInformationByHandleEx(hf, FileStandardInfo, &si, sizeof si)) {
+
+		throw lro_error::from_win32_last(err_msg::err_file_info, { path });
+	}
+	dir_entry_info info { static_cast<uint64_t>(si.EndOfFile.QuadPart), {}, {}, {}, true };
+	time_f2u(bi.LastAccessTime, info.at);
+	time_f2u(bi.LastWriteTime, info.mt);
+	time_f2u(bi.ChangeTime, info.ct);
+	return info;
+}
+
+// Directories are listed through their handles in large batches, which also return the sizes and times of the entries.
+// The handle of a directory is passed along when entering it, so that it doesn't have to be opened again, and with each
+// of its files, so that they can be opened relative to it.
+static void enum_directory(
+	file_path &path, const bool rootfs_first,
+	const std::function<void(enum_dir_type, HANDLE, const dir_entry_info &)> &action
+) {
+	std::function<void(HANDLE, size_t, bool, const dir_entry_info *)> enum_rec;
+	enum_rec = [&](const HANDLE parent, const size_t name_pos, const bool is_root, const dir_entry_info *entry) {
+		const auto hd = parent
+			? open_file_at(parent, path.data, name_pos, true, FILE_OPEN)
+			: open_file(path.data, true, false);
+		if (get_win_build() <= 20206) {
+			try {
+				set_cs_info(hd.get());
+			} catch (lro_error &e) {
+				if (e.msg_code == err_msg::err_set_cs) e.msg_args.push_back(path.data);
+				throw;
 			}
-		} catch (lro_error &e) {
-			if (e.msg_code == err_msg::err_set_cs) e.msg_args.push_back(path.data);
-			throw;
 		}
-		action(enum_dir_type::enter);
+		action(enum_dir_type::enter, hd.get(), entry ? *entry : query_entry_info(hd.get(), path.data));
 		const auto os = path.data.size();
 		if (is_root) {
 			path.data += L"rootfs\\";
-			enum_rec(false);
+			enum_rec(hd.get(), os, false, nullptr);
 			path.data.resize(os);
 		}
-		WIN32_FIND_DATA data;
-		path.data += L'*';
-		const unique_ptr_del<HANDLE> hs(FindFirstFile(path.data.c_str(), &data), &find_close_safe);
-		path.data.resize(os);
-		if (hs.get() == INVALID_HANDLE_VALUE) {
-			throw lro_error::from_win32_last(err_msg::err_enum_dir, { path.data });
-		}
-		while (true) {
-			if (wcscmp(data.cFileName, L".") != 0 && wcscmp(data.cFileName, L"..") != 0
-				&& (!is_root || wcscmp(data.cFileName, L"rootfs") != 0)) {
-
-				path.data += data.cFileName;
-				if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-					path.data += L'\\';
-					enum_rec(false);
-				} else {
-					action(enum_dir_type::file);
-				}
-				path.data.resize(os);
-			}
-			if (!FindNextFile(hs.get(), &data)) {
-				if (GetLastError() == ERROR_NO_MORE_FILES) {
-					action(enum_dir_type::exit);
-					return;
+		// Entries are aligned to 8 bytes.
+		std::vector<uint64_t> buf(1 << 13);
+		auto cls = FileIdBothDirectoryRestartInfo;
+		while (GetFileInformationByHandleEx(hd.get(), cls, buf.data(), static_cast<uint32_t>(buf.size() * 8))) {
+			cls = FileIdBothDirectoryInfo;
+			auto pi = reinterpret_cast<const FILE_ID_BOTH_DIR_INFO *>(buf.data());
+			while (true) {
+				const wstr name(pi->FileName, pi->FileNameLength / sizeof(wchar_t));
+				if (name != L"." && name != L".." && (!is_root || name != L"rootfs")) {
+					const auto attrs = pi->FileAttributes;
+					// EaSize holds the reparse tag instead for entries with a reparse point.
+					dir_entry_info info {
+						static_cast<uint64_t>(pi->EndOfFile.QuadPart), {}, {}, {},
+						pi->EaSize != 0 || (attrs & FILE_ATTRIBUTE_REPARSE_POINT) != 0
+					};
+					time_f2u(pi->LastAccessTime, info.at);
+					time_f2u(pi->LastWriteTime, info.mt);
+					time_f2u(pi->ChangeTime, info.ct);
+					path.data += name;
+					if (attrs & FILE_ATTRIBUTE_DIRECTORY) {
+						path.data += L'\\';
+						enum_rec(hd.get(), os, false, &info);
+					} else {
+						action(enum_dir_type::file, hd.get(), info);
+					}
+					path.data.resize(os);
 				}
-				throw lro_error::from_win32_last(err_msg::err_enum_dir, { path.data });
+				if (!pi->NextEntryOffset) break;
+				const auto next = reinterpret_cast<const char *>(pi) + pi->NextEntryOffset;
+				pi = reinterpret_cast<const FILE_ID_BOTH_DIR_INFO *>(next);
 			}
 		}
+		if (GetLastError() != ERROR_NO_MORE_FILES) {
+			throw lro_error::from_win32_last(err_msg::err_enum_dir, { path.data });
+		}
+		action(enum_dir_type::exit, nullptr, {});
 	};
-	enum_rec(rootfs_first);
-}
-
-static void time_u2f(const unix_time &ut, LARGE_INTEGER &ft) {
-	ft.QuadPart = ut.sec * 10000000 + ut.nsec / 100 + 116444736000000000;
-}
-
-static void time_f2u(const LARGE_INTEGER &ft, unix_time &ut) {
-	const auto t = ft.QuadPart - 116444736000000000;
-	ut.sec = static_cast<uint64_t>(t / 10000000);
-	ut.nsec = static_cast<uint32_t>(t % 10000000 * 100);
+	enum_rec(nullptr, 0, rootfs_first, nullptr);
 }
 
 bool fs_writer::check_attr(const file_attr *attr, const bool allow_null, const bool allow_sock) {
@@ -211,11 +349,11 @@ bool fs_writer::check_attr(const file_attr *attr, const bool allow_null, const b
 		const auto type = attr->mode & AE_IFMT;
 		if (type == AE_IFREG || type == AE_IFLNK || type == AE_IFCHR || type == AE_IFBLK || type == AE_IFDIR || type == AE_IFIFO) return true;
 		if (type == AE_IFSOCK && allow_sock) return true;
-		log_warning((boost::wformat(L"Ignoring an unsupported file \"%1%\" of type %2$07o.") % path->data % type).str());
+		log_skipped(skip_reason::unsupported_type, path->data, type);
 	} else if (allow_null) {
 		return true;
 	} else {
-		log_warning((boost::wformat(L"Ignoring the file \"%1%\" which doesn't have WSL attributes.") % path->data).str());
+		log_skipped(skip_reason::no_attr, path->data);
 	}
 	ignored_files.insert(path->data);
 	return false;
@@ -223,27 +361,250 @@ bool fs_writer::check_attr(const file_attr *attr, const bool allow_null, const b
 
 bool fs_writer::check_target_ignored() {
 	if (ignored_files.find(target_path->data) != ignored_files.end()) {
-		log_warning((boost::wformat(L"Ignoring the hard link \"%1%\" whose target has been ignored.") % path->data).str());
+		log_skipped(skip_reason::ignored_target, path->data);
 		ignored_files.insert(path->data);
 		return false;
 	}
 	return true;
 }
 
+// The compression filter is chosen by the file extension. Gzip is used with a warning if none of them matches, so that
+// the archives written by older versions can still be named freely.
+static void add_archive_filter(archive *pa, crwstr archive_path) {
+	const std::pair<std::initializer_list<const wchar_t *>, int (*)(archive *)> filters[] = {
+		{ { L".tar.gz", L".tgz" }, &archive_write_add_filter_gzip },
+		{ { L".tar.xz", L".txz" }, &archive_write_add_filter_xz },
+		{ { L".tar.zst", L".tzst" }, &archive_write_add_filter_zstd },
+		{ { L".tar.bz2", L".tbz2" }, &archive_write_add_filter_bzip2 },
+		{ { L".tar.lz4" }, &archive_write_add_filter_lz4 },
+		{ { L".tar" }, &archive_write_add_filter_none }
+	};
+	for (const auto &f : filters) {
+		for (const auto ext : f.first) {
+			if (!boost::iends_with(archive_path, ext)) continue;
+			check_archive(pa, f.second(pa));
+			// Multi-threaded compression is only supported by some filters in recent versions of libarchive, so
+			// failures are ignored.
+			archive_write_set_filter_option(
+				pa, nullptr, "threads", std::to_string(std::thread::hardware_concurrency()).c_str()
+			);
+			return;
+		}
+	}
+	if (archive_path != L"-") {
+		log_warning(lro_error::from_other(err_msg::err_archive_ext, { archive_path }).format());
+	}
+	check_archive(pa, archive_write_add_filter_gzip(pa));
+}
+
+// Standard input or output used as the archive file, which can be neither mapped nor seeked. A worker thread moves data
+// between the pipe and a few large blocks, so that the pipe keeps flowing while libarchive is busy compressing or
+// decompressing. Errors of the worker are passed to libarchive, which fails with them on its next call.
+class archive_pipe {
+	static constexpr size_t block_size = 1 << 22, block_count = 4;
+	const HANDLE hf;
+	const bool is_write;
+	unique_ptr_del<HANDLE> thread_handle;
+	std::mutex mutex;
+	std::condition_variable cv;
+	// When reading, the worker fills free blocks and queues them as ready. When writing, "cur" is filled and queued as
+	// ready, and the worker returns the blocks it has written to the free ones.
+	std::deque<std::vector<char>> ready, free_blocks;
+	std::vector<char> cur;
+	bool has_cur = false, eof = false, done = false, stopped = false;
+	wstr error;
+	std::thread worker;
+
+	void fail(crwstr msg) {
+		const std::lock_guard<std::mutex> lock(mutex);
+		error = msg;
+		cv.notify_all();
+	}
+
+	static int report(archive *pa, const archive_pipe *pp) {
+		const auto msg = to_utf8(pp->error);
+		archive_set_error(pa, EIO, "%s", msg.get());
+		return ARCHIVE_FATAL;
+	}
+
+	// Returns false at the end of the input.
+	bool read_block(std::vector<char> &b) const {
+		b.resize(block_size);
+		size_t n = 0;
+		DWORD rc;
+		while (n < b.size()) {
+			if (!ReadFile(hf, b.data() + n, static_cast<uint32_t>(b.size() - n), &rc, nullptr)) {
+				// The other end of a pipe being closed is the end of the input.
+				if (GetLastError() != ERROR_BROKEN_PIPE) {
+					throw lro_error::from_win32_last(err_msg::err_read_file, { L"-" });
+				}
+				rc = 0;
+			}
+			if (!rc) break;
+			n += rc;
+		}
+		b.resize(n);
+		return n;
+	}
+
+	void write_block(const std::vector<char> &b) const {
+		for (size_t n = 0; n < b.size();) {
+			DWORD wc;
+			if (!WriteFile(hf, b.data() + n, static_cast<uint32_t>(b.size() - n), &wc, nullptr)) {
+				throw lro_error::from_win32_last(err_msg::err_write_file, { L"-" });
+			}
+			n += wc;
+		}
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			auto &from = is_write ? ready : free_blocks;
+			cv.wait(lock, [&] { return !from.empty() || done; });
+			// Whatever is left to write is still written after "done", but reading stops right away.
+			if (from.empty() || (done && !is_write)) return;
+			auto b = std::move(from.front());
+			from.pop_front();
+			lock.unlock();
+			auto more = true;
+			try {
+				if (is_write) write_block(b);
+				else more = read_block(b);
+			} catch (const lro_error &e) {
+				// A read cancelled by the destructor isn't an error.
+				if (e.err_code != HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED)) fail(e.format());
+				return;
+			}
+			lock.lock();
+			if (is_write) {
+				free_blocks.push_back(std::move(b));
+			} else {
+				if (!b.empty()) ready.push_back(std::move(b));
+				eof = !more;
+			}
+			cv.notify_all();
+			if (eof) return;
+		}
+	}
+
+	static la_ssize_t read(archive *pa, void *data, const void **buf) {
+		const auto pp = static_cast<archive_pipe *>(data);
+		std::unique_lock<std::mutex> lock(pp->mutex);
+		if (pp->has_cur) {
+			pp->free_blocks.push_back(std::move(pp->cur));
+			pp->has_cur = false;
+			pp->cv.notify_all();
+		}
+		pp->cv.wait(lock, [&] { return !pp->ready.empty() || pp->eof || !pp->error.empty(); });
+		if (!pp->error.empty()) return report(pa, pp);
+		if (pp->ready.empty()) return 0;
+		pp->cur = std::move(pp->ready.front());
+		pp->ready.pop_front();
+		pp->has_cur = true;
+		*buf = pp->cur.data();
+		return static_cast<la_ssize_t>(pp->cur.size());
+	}
+
+	static la_ssize_t write(archive *pa, void *data, const void *buf, const size_t size) {
+		const auto pp = static_cast<archive_pipe *>(data);
+		std::unique_lock<std::mutex> lock(pp->mutex);
+		if (!pp->error.empty()) return report(pa, pp);
+		const auto p = static_cast<const char *>(buf);
+		pp->cur.insert(pp->cur.end(), p, p + size);
+		if (pp->cur.size() >= block_size) {
+			pp->cv.wait(lock, [&] { return !pp->free_blocks.empty() || !pp->error.empty(); });
+			if (!pp->error.empty()) return report(pa, pp);
+			pp->ready.push_back(std::move(pp->cur));
+			pp->cur = std::move(pp->free_blocks.front());
+			pp->free_blocks.pop_front();
+			pp->cur.clear();
+			pp->cv.notify_all();
+		}
+		return static_cast<la_ssize_t>(size);
+	}
+
+	static int close(archive *pa, void *data) {
+		const auto pp = static_cast<archive_pipe *>(data);
+		pp->finish();
+		return pp->error.empty() ? ARCHIVE_OK : report(pa, pp);
+	}
+
+	void finish() {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (done) return;
+		if (is_write && !cur.empty()) ready.push_back(std::move(cur));
+		done = true;
+		cv.notify_all();
+		// The worker might be waiting for input that will never be used. A cancel only affects a read that has already
+		// started, so it's repeated until the worker has stopped.
+		while (!is_write && thread_handle && !stopped) {
+			CancelSynchronousIo(thread_handle.get());
+			cv.wait_for(lock, std::chrono::milliseconds(10));
+		}
+		lock.unlock();
+		worker.join();
+	}
+
+public:
+	archive_pipe(const HANDLE hf, const bool is_write)
+		: hf(hf), is_write(is_write), thread_handle(nullptr, &CloseHandle) {
+		for (size_t i = 0; i < block_count; i++) {
+			free_blocks.emplace_back();
+			free_blocks.back().reserve(block_size);
+		}
+		if (is_write) {
+			cur = std::move(free_blocks.front());
+			free_blocks.pop_front();
+		}
+		worker = std::thread([this] {
+			{
+				const std::lock_guard<std::mutex> lock(mutex);
+				HANDLE ht;
+				if (DuplicateHandle(
+					GetCurrentProcess(), GetCurrentThread(), GetCurrentProcess(), &ht, 0, false, DUPLICATE_SAME_ACCESS
+				)) thread_handle.reset(ht);
+			}
+			run();
+			const std::lock_guard<std::mutex> lock(mutex);
+			stopped = true;
+			cv.notify_all();
+		});
+	}
+
+	archive_pipe(const archive_pipe &) = delete;
+	archive_pipe &operator=(const archive_pipe &) = delete;
+
+	~archive_pipe() {
+		finish();
+	}
+
+	void open(archive *pa) {
+		if (is_write) check_archive(pa, archive_write_open(pa, this, nullptr, &write, &close));
+		else check_archive(pa, archive_read_open(pa, this, nullptr, &read, nullptr));
+	}
+};
+
 archive_writer::archive_writer(crwstr archive_path)
 	: pa(archive_write_new(), &archive_write_free), pe(archive_entry_new(), &archive_entry_free) {
 	path = std::make_unique<linux_path>();
 	target_path = std::make_unique<linux_path>();
 	check_archive(pa.get(), archive_write_set_format_gnutar(pa.get()));
-	check_archive(pa.get(), archive_write_add_filter_gzip(pa.get()));
-	check_archive(pa.get(), archive_write_open_filename_w(pa.get(), archive_path.c_str()));
+	add_archive_filter(pa.get(), archive_path);
+	if (archive_path == L"-") {
+		pipe = std::make_unique<archive_pipe>(GetStdHandle(STD_OUTPUT_HANDLE), true);
+		pipe->open(pa.get());
+	} else {
+		check_archive(pa.get(), archive_write_open_filename_w(pa.get(), archive_path.c_str()));
+	}
 }
 
+archive_writer::~archive_writer() = default;
+
 bool archive_writer::write_new_file(const file_attr *attr) {
 	if (!check_attr(attr, false, false) || path->data.empty()) return false;
-	const auto up = to_utf8(path->data);
 	const auto type = attr->mode & AE_IFMT;
-	archive_entry_set_pathname(pe.get(), up.get());
+	archive_entry_set_pathname(pe.get(), static_cast<linux_path &>(*path).get_utf8().c_str());
 	archive_entry_set_uid(pe.get(), attr->uid);
 	archive_entry_set_gid(pe.get(), attr->gid);
 	archive_entry_set_mode(pe.get(), static_cast<unsigned short>(attr->mode));
@@ -272,10 +633,8 @@ void archive_writer::write_file_data(const char *buf, const uint32_t size) {
 
 void archive_writer::write_hard_link() {
 	if (!check_target_ignored()) return;
-	const auto up = to_utf8(path->data);
-	archive_entry_set_pathname(pe.get(), up.get());
-	const auto ut = to_utf8(target_path->data);
-	archive_entry_set_hardlink(pe.get(), ut.get());
+	archive_entry_set_pathname(pe.get(), static_cast<linux_path &>(*path).get_utf8().c_str());
+	archive_entry_set_hardlink(pe.get(), static_cast<linux_path &>(*target_path).get_utf8().c_str());
 	check_archive(pa.get(), archive_write_header(pa.get(), pe.get()));
 	archive_entry_clear(pe.get());
 }
@@ -291,19 +650,62 @@ void wsl_writer::write_data(const HANDLE hf, const char *buf, const uint32_t siz
 	}
 }
 
+// Closes the directories that aren't ancestors of the current entry, and opens the ones missing in between, which is
+// only needed if they weren't written right before their contents. Directories that don't exist at all are created like
+// tar does, as sources don't always contain them, and transform rules may move entries to new places.
+HANDLE wsl_writer::open_parent(size_t &name_pos) {
+	const auto &p = path->data;
+	name_pos = p.rfind(L'\\', p.size() - 2) + 1;
+	const auto is_ancestor = [&](crwstr dir) {
+		return dir.size() <= name_pos && !p.compare(0, dir.size(), dir);
+	};
+	while (!dirs.empty() && !is_ancestor(dirs.back().first)) {
+		auto d = std::move(dirs.back());
+		dirs.pop_back();
+		close_dir(d.second.get(), d.first);
+	}
+	if (dirs.empty()) {
+		const auto base = p.substr(0, path->base_len);
+		dirs.emplace_back(base, open_file(base, true, false));
+	}
+	while (dirs.back().first.size() < name_pos) {
+		const auto pos = dirs.back().first.size();
+		auto dir = p.substr(0, p.find(L'\\', pos) + 1);
+		ULONG_PTR res;
+		auto hd = open_file_at(dirs.back().second.get(), dir, pos, true, FILE_OPEN_IF, &res);
+		if (res == FILE_CREATED) {
+			static const file_attr attr { AE_IFDIR | 0755, 0, 0, 0, {}, {}, {}, 0, 0, nullptr };
+			write_attr(hd.get(), &attr, dir);
+			set_cs_info(hd.get());
+			implied_dirs.insert(dir);
+		}
+		dirs.emplace_back(std::move(dir), std::move(hd));
+	}
+	return dirs.back().second.get();
+}
+
+void wsl_writer::close_dir(HANDLE, crwstr) {}
+
+void wsl_writer::close_dirs() {
+	while (!dirs.empty()) {
+		auto d = std::move(dirs.back());
+		dirs.pop_back();
+		close_dir(d.second.get(), d.first);
+	}
+}
+
 bool wsl_writer::write_new_file(const file_attr *attr) {
 	if (!check_attr(attr, true, true)) return false;
 	const auto type = attr ? attr->mode & AE_IFMT : AE_IFREG;
 	const auto is_dir = type == AE_IFDIR;
-	if (is_dir) {
-		if (!CreateDirectory(path->data.c_str(), nullptr)) {
-			const auto e = lro_error::from_win32_last(err_msg::err_create_dir, { path->data });
-			if (GetLastError() != ERROR_ALREADY_EXISTS) throw lro_error(e);
-			log_warning(e.format());
-		}
+	size_t name_pos;
+	const auto hd = open_parent(name_pos);
+	ULONG_PTR res;
+	auto hf = open_file_at(hd, path->data, name_pos, is_dir, is_dir ? FILE_OPEN_IF : FILE_CREATE, &res);
+	if (is_dir && res == FILE_OPENED && !implied_dirs.erase(path->data)) {
+		log_warning(lro_error::from_win32(err_msg::err_create_dir, { path->data }, ERROR_ALREADY_EXISTS).format());
 	}
-	auto hf = open_file(path->data, is_dir, !is_dir);
-	write_attr(hf.get(), attr);
+	write_attr(hf.get(), attr, path->data);
 	if (type == AE_IFREG) {
 		hf_data = std::move(hf);
 	} else if (type == AE_IFDIR) {
@@ -313,6 +715,7 @@ bool wsl_writer::write_new_file(const file_attr *attr) {
 			e.msg_args.push_back(path->data);
 			throw;
 		}
+		dirs.emplace_back(path->data, std::move(hf));
 	}
 	return true;
 }
@@ -322,11 +725,30 @@ void wsl_writer::write_file_data(const char *buf, const uint32_t size) {
 	else hf_data.reset();
 }
 
+// Only the new name is resolved relative to its directory, as the target may be anywhere in the tree.
 void wsl_writer::write_hard_link() {
 	if (!check_target_ignored()) return;
-	if (!CreateHardLink(path->data.c_str(), target_path->data.c_str(), nullptr)) {
+	size_t name_pos;
+	const auto hd = open_parent(name_pos);
+	const auto ht = CreateFile(
+		target_path->data.c_str(),
+		FILE_WRITE_ATTRIBUTES | SYNCHRONIZE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+		OPEN_EXISTING, FILE_FLAG_OPEN_REPARSE_POINT, nullptr
+	);
+	if (ht == INVALID_HANDLE_VALUE) {
 		throw lro_error::from_win32_last(err_msg::err_hard_link, { path->data, target_path->data });
 	}
+	const unique_ptr_del<HANDLE> hf(ht, &CloseHandle);
+	const auto nl = static_cast<uint32_t>((path->data.size() - name_pos) * sizeof(wchar_t));
+	const auto il = static_cast<uint32_t>(FIELD_OFFSET(FILE_LINK_INFORMATION, FileName) + nl);
+	const auto pi = create_fam_struct<FILE_LINK_INFORMATION>(il);
+	pi->ReplaceIfExists = FALSE;
+	pi->RootDirectory = hd;
+	pi->FileNameLength = nl;
+	memcpy(pi->FileName, path->data.c_str() + name_pos, nl);
+	IO_STATUS_BLOCK ios;
+	const auto stat = NtSetInformationFile(hf.get(), &ios, pi.get(), il, FileLinkInformation);
+	if (stat) throw lro_error::from_nt(err_msg::err_hard_link, { path->data, target_path->data }, stat);
 }
 
 void wsl_writer::check_path(const file_path &sp) const {
@@ -346,7 +768,7 @@ wsl_v1_writer::wsl_v1_writer(crwstr base_path) {
 	create_recursive(path->data);
 }
 
-void wsl_v1_writer::write_attr(const HANDLE hf, const file_attr *attr) {
+void wsl_v1_writer::write_attr(const HANDLE hf, const file_attr *attr, crwstr path) {
 	if (!attr) return;
 	try {
 		set_ea(hf, "LXATTRB", lxattrb {
@@ -357,7 +779,7 @@ void wsl_v1_writer::write_attr(const HANDLE hf, const file_attr *attr) {
 			attr->at.sec, attr->mt.sec, attr->ct.sec
 		});
 	} catch (lro_error &e) {
-		e.msg_args.push_back(path->data);
+		e.msg_args.push_back(path);
 		throw;
 	}
 	if ((attr->mode & AE_IFMT) == AE_IFLNK) {
@@ -371,53 +793,47 @@ wsl_v2_writer::wsl_v2_writer(crwstr base_path) {
 	create_recursive(path->data);
 }
 
-void wsl_v2_writer::real_write_attr(const HANDLE hf, const file_attr &attr, crwstr path) {
+// The reparse tag WSL marks special files of a type with in filesystem version 2, or 0 if there is none.
+static uint32_t get_lx_reparse_tag(const uint32_t type) {
+	if (type == AE_IFLNK) return IO_REPARSE_TAG_LX_SYMLINK;
+	if (type == AE_IFSOCK) return IO_REPARSE_TAG_AF_UNIX;
+	if (type == AE_IFCHR) return IO_REPARSE_TAG_LX_CHR;
+	if (type == AE_IFBLK) return IO_REPARSE_TAG_LX_BLK;
+	if (type == AE_IFIFO) return IO_REPARSE_TAG_LX_FIFO;
+	return 0;
+}
+
+static void write_v2_attr(const HANDLE hf, const file_attr &attr, crwstr path) {
 	const auto type = attr.mode & AE_IFMT;
 
 	try {
-		set_ea(hf, "$LXUID", attr.uid);
-		set_ea(hf, "$LXGID", attr.gid);
-		set_ea(hf, "$LXMOD", attr.mode);
-		if (type == AE_IFCHR || type == AE_IFBLK) {
-			set_ea(hf, "$LXDEV", static_cast<uint64_t>(attr.dev_minor) << 32 | attr.dev_major);
-		}
+		const auto dev = static_cast<uint64_t>(attr.dev_minor) << 32 | attr.dev_major;
+		std::vector<ea_value> eas {
+			{ "$LXUID", &attr.uid, sizeof(attr.uid) },
+			{ "$LXGID", &attr.gid, sizeof(attr.gid) },
+			{ "$LXMOD", &attr.mode, sizeof(attr.mode) }
+		};
+		if (type == AE_IFCHR || type == AE_IFBLK) eas.push_back({ "$LXDEV", &dev, sizeof(dev) });
+		set_ea_list(hf, eas);
 	} catch (lro_error &e) {
 		e.msg_args.push_back(path);
 		throw;
 	}
 
-	unique_ptr_del<REPARSE_DATA_BUFFER *> pb = nullptr;
-	const auto hl = FIELD_OFFSET(REPARSE_DATA_BUFFER, DataBuffer);
-	if (type == AE_IFLNK) {
+	if (const auto tag = get_lx_reparse_tag(type)) {
+		const auto hl = FIELD_OFFSET(REPARSE_DATA_BUFFER, DataBuffer);
 		const uint32_t v = 2;
-		const auto pl = strlen(attr.symlink);
-		const auto dl = static_cast<uint16_t>(pl + sizeof(v));
+		const auto pl = type == AE_IFLNK ? strlen(attr.symlink) : 0;
+		const auto dl = static_cast<uint16_t>(type == AE_IFLNK ? pl + sizeof(v) : 0);
 		const auto bl = static_cast<uint32_t>(hl + dl);
-		pb = create_fam_struct<REPARSE_DATA_BUFFER>(bl);
-		pb->ReparseTag = IO_REPARSE_TAG_LX_SYMLINK;
+		const auto pb = create_fam_struct<REPARSE_DATA_BUFFER>(bl);
+		pb->ReparseTag = tag;
 		pb->ReparseDataLength = dl;
-		memcpy(pb->DataBuffer, &v, sizeof(v));
-		memcpy(pb->DataBuffer + sizeof(v), attr.symlink, pl);
-	} else if (type == AE_IFSOCK) {
-		pb = create_fam_struct<REPARSE_DATA_BUFFER>(hl);
-		pb->ReparseTag = IO_REPARSE_TAG_AF_UNIX;
-		pb->ReparseDataLength = 0;
-	} else if (type == AE_IFCHR) {
-		pb = create_fam_struct<REPARSE_DATA_BUFFER>(hl);
-		pb->ReparseTag = IO_REPARSE_TAG_LX_CHR;
-		pb->ReparseDataLength = 0;
-	} else if (type == AE_IFBLK) {
-		pb = create_fam_struct<REPARSE_DATA_BUFFER>(hl);
-		pb->ReparseTag = IO_REPARSE_TAG_LX_BLK;
-		pb->ReparseDataLength = 0;
-	} else if (type == AE_IFIFO) {
-		pb = create_fam_struct<REPARSE_DATA_BUFFER>(hl);
-		pb->ReparseTag = IO_REPARSE_TAG_LX_FIFO;
-		pb->ReparseDataLength = 0;
-	}
-	if (pb) {
 		pb->Reserved = 0;
-		const auto bl = hl + pb->ReparseDataLength;
+		if (type == AE_IFLNK) {
+			memcpy(pb->DataBuffer, &v, sizeof(v));
+			memcpy(pb->DataBuffer + sizeof(v), attr.symlink, pl);
+		}
 		DWORD cnt;
 		if (!DeviceIoControl(hf, FSCTL_SET_REPARSE_POINT,
 			pb.get(), bl, nullptr, 0, &cnt, nullptr)) {
@@ -425,7 +841,10 @@ void wsl_v2_writer::real_write_attr(const HANDLE hf, const file_attr &attr, crws
 			throw lro_error::from_win32_last(err_msg::err_set_reparse, { path });
 		}
 	}
+}
 
+// Kept apart from the other attributes, as anything written to a file or into a directory afterwards changes them.
+static void set_v2_times(const HANDLE hf, const file_attr &attr, crwstr path) {
 	FILE_BASIC_INFO info;
 	time_u2f(attr.at, info.LastAccessTime);
 	time_u2f(attr.mt, info.LastWriteTime);
@@ -437,26 +856,23 @@ void wsl_v2_writer::real_write_attr(const HANDLE hf, const file_attr &attr, crws
 	}
 }
 
-void wsl_v2_writer::write_attr(const HANDLE hf, const file_attr *attr) {
+// The times of a directory are set each time it's closed, as creating its entries would change them, and the source
+// may go back to it later.
+void wsl_v2_writer::write_attr(const HANDLE hf, const file_attr *attr, crwstr path) {
 	if (!attr) return;
-	if ((attr->mode & AE_IFMT) == AE_IFDIR) {
-		while (!dir_attr.empty()) {
-			auto p = dir_attr.top();
-			if (!path->data.compare(0, p.first.size(), p.first)) break;
-			dir_attr.pop();
-			real_write_attr(open_file(p.first, true, false).get(), p.second, p.first);
-		}
-		dir_attr.push(std::make_pair(path->data, *attr));
-	} else real_write_attr(hf, *attr, path->data);
+	write_v2_attr(hf, *attr, path);
+	if ((attr->mode & AE_IFMT) == AE_IFDIR) dir_attr[path] = *attr;
+	else set_v2_times(hf, *attr, path);
+}
+
+void wsl_v2_writer::close_dir(const HANDLE hd, crwstr dir_path) {
+	const auto it = dir_attr.find(dir_path);
+	if (it != dir_attr.end()) set_v2_times(hd, it->second, dir_path);
 }
 
 wsl_v2_writer::~wsl_v2_writer() {
 	try {
-		while (!dir_attr.empty()) {
-			auto p = dir_attr.top();
-			dir_attr.pop();
-			real_write_attr(open_file(p.first, true, false).get(), p.second, p.first);
-		}
+		close_dirs();
 	} catch (const lro_error &e) {
 		log_error(e.format());
 	} catch (const std::exception &e) {
@@ -470,34 +886,128 @@ wsl_legacy_writer::wsl_legacy_writer(crwstr base_path) {
 	create_recursive(path->data);
 }
 
+// The whole archive is mapped into memory and handed to libarchive in large blocks, so uncompressed tar data is passed
+// to the writer straight from the mapped view. Pages ahead of the current position are prefetched explicitly because
+// the read-ahead of the cache manager doesn't apply to mapped views.
+class archive_mapping {
+	static constexpr uint64_t block_size = 1 << 24, prefetch_size = 1 << 26;
+	unique_ptr_del<HANDLE> hm;
+	unique_ptr_del<void *> view;
+	const uint64_t size;
+	uint64_t pos = 0, prefetched = 0;
+
+	archive_mapping(unique_ptr_del<HANDLE> &&hm, unique_ptr_del<void *> &&view, const uint64_t size)
+		: hm(std::move(hm)), view(std::move(view)), size(size) {}
+
+	void prefetch() {
+		if (prefetched >= size || (prefetched > pos && prefetched - pos >= prefetch_size / 2)) return;
+		const auto start = std::max(prefetched, pos);
+		WIN32_MEMORY_RANGE_ENTRY range {
+			static_cast<char *>(view.get()) + start,
+			static_cast<size_t>(std::min(size - start, prefetch_size))
+		};
+		// This is only a hint, so failures are ignored.
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+		prefetched = start + range.NumberOfBytes;
+	}
+
+	static la_ssize_t read(archive *, void *data, const void **buf) {
+		const auto pm = static_cast<archive_mapping *>(data);
+		pm->prefetch();
+		const auto cnt = std::min(pm->size - pm->pos, block_size);
+		*buf = static_cast<const char *>(pm->view.get()) + pm->pos;
+		pm->pos += cnt;
+		return static_cast<la_ssize_t>(cnt);
+	}
+
+	static la_int64_t skip(archive *, void *data, const la_int64_t request) {
+		const auto pm = static_cast<archive_mapping *>(data);
+		const auto cnt = std::min(pm->size - pm->pos, static_cast<uint64_t>(request));
+		pm->pos += cnt;
+		return static_cast<la_int64_t>(cnt);
+	}
+
+	static la_int64_t seek(archive *, void *data, const la_int64_t offset, const int whence) {
+		const auto pm = static_cast<archive_mapping *>(data);
+		int64_t base;
+		if (whence == SEEK_SET) base = 0;
+		else if (whence == SEEK_CUR) base = static_cast<int64_t>(pm->pos);
+		else if (whence == SEEK_END) base = static_cast<int64_t>(pm->size);
+		else return ARCHIVE_FATAL;
+		if (base + offset < 0 || static_cast<uint64_t>(base + offset) > pm->size) return ARCHIVE_FATAL;
+		pm->pos = base + offset;
+		return static_cast<la_int64_t>(pm->pos);
+	}
+
+public:
+	// Returns nullptr if the file can't be mapped, e.g. when it's empty or too large for the address space.
+	static std::unique_ptr<archive_mapping> create(const HANDLE hf, const uint64_t size) {
+		if (!size || size > std::numeric_limits<size_t>::max()) return nullptr;
+		const auto hmb = CreateFileMapping(hf, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!hmb) return nullptr;
+		unique_ptr_del<HANDLE> hm(hmb, &CloseHandle);
+		const auto vb = MapViewOfFile(hm.get(), FILE_MAP_READ, 0, 0, 0);
+		if (!vb) return nullptr;
+		unique_ptr_del<void *> view(vb, &UnmapViewOfFile);
+		return std::unique_ptr<archive_mapping>(new archive_mapping(std::move(hm), std::move(view), size));
+	}
+
+	void open(archive *pa) {
+		check_archive(pa, archive_read_set_callback_data(pa, this));
+		check_archive(pa, archive_read_set_read_callback(pa, &read));
+		check_archive(pa, archive_read_set_skip_callback(pa, &skip));
+		check_archive(pa, archive_read_set_seek_callback(pa, &seek));
+		check_archive(pa, archive_read_open1(pa));
+	}
+};
+
 archive_reader::archive_reader(wstr archive_path, wstr root_path)
 	: archive_path(std::move(archive_path)), root_path(std::move(root_path)) {}
 
 void archive_reader::run(fs_writer &writer) {
-	auto as = get_file_size(open_file(archive_path, false, false).get());
+	unique_ptr_del<HANDLE> hf(nullptr, &CloseHandle);
+	uint64_t as = 0;
+	std::unique_ptr<archive_mapping> pm;
+	std::unique_ptr<archive_pipe> pp;
+	if (archive_path == L"-") {
+		pp = std::make_unique<archive_pipe>(GetStdHandle(STD_INPUT_HANDLE), false);
+	} else {
+		hf = open_file(archive_path, false, false);
+		as = get_file_size(hf.get());
+		pm = archive_mapping::create(hf.get(), as);
+	}
 	unique_ptr_del<archive *> pa(archive_read_new(), &archive_read_free);
 	check_archive(pa.get(), archive_read_support_filter_all(pa.get()));
 	check_archive(pa.get(), archive_read_support_format_all(pa.get()));
-	check_archive(pa.get(), archive_read_open_filename_w(pa.get(), archive_path.c_str(), BUFSIZ));
+	if (pp) pp->open(pa.get());
+	else if (pm) pm->open(pa.get());
+	else check_archive(pa.get(), archive_read_open_filename_w(pa.get(), archive_path.c_str(), 1 << 20));
 	linux_path p;
 	if (p.convert(*writer.path)) {
 		file_attr attr { 0040755, 0, 0, 0, {}, {}, {}, 0, 0, nullptr };
 		writer.write_new_file(&attr);
 	}
 	archive_entry *pe;
+	const auto root_utf8 = to_utf8(root_path);
+	const std::string root(root_utf8.get());
+	linux_path tp;
 	while (check_archive(pa.get(), archive_read_next_header(pa.get(), &pe))) {
-		print_progress(static_cast<double>(archive_filter_bytes(pa.get(), -1)) / as);
+		if (pp) print_progress_bytes(archive_filter_bytes(pa.get(), 0));
+		else print_progress(static_cast<double>(archive_filter_bytes(pa.get(), -1)) / as);
 		auto up = archive_entry_pathname(pe);
 		auto wp = archive_entry_pathname_w(pe);
-		if (up) p = linux_path(from_utf8(up), root_path);
-		else if (wp) p = linux_path(wp, root_path);
-		else throw lro_error::from_other(err_msg::err_convert_encoding, {});
+		if (up) {
+			p.assign_utf8(up, strlen(up), root);
+		} else if (wp) {
+			p = linux_path(wp, root_path);
+		} else {
+			throw lro_error::from_other(err_msg::err_convert_encoding, {});
+		}
 		if (!p.convert(*writer.path)) continue;
 		auto utp = archive_entry_hardlink(pe);
 		auto wtp = archive_entry_hardlink_w(pe);
 		if (utp || wtp) {
-			linux_path tp;
-			if (utp) tp = linux_path(from_utf8(utp), root_path);
+			if (utp) tp.assign_utf8(utp, strlen(utp), root);
 			else tp = linux_path(wtp, root_path);
 			if (tp.convert(*writer.target_path)) writer.write_hard_link();
 			continue;
@@ -555,7 +1065,8 @@ void wsl_reader::run(fs_writer &writer) {
 	std::map<uint64_t, std::unique_ptr<file_path>> id_map;
 	char buf[BUFSIZ];
 	auto is_root = true;
-	enum_directory(*path, is_legacy(), [&](const enum_dir_type t) {
+	uint64_t read_bytes = 0;
+	enum_directory(*path, is_legacy(), [&](const enum_dir_type t, const HANDLE hd, const dir_entry_info &entry) {
 		if (t == enum_dir_type::exit) return;
 		if (t == enum_dir_type::enter && is_root) {
 			is_root = false;
@@ -563,8 +1074,10 @@ void wsl_reader::run(fs_writer &writer) {
 		}
 		if (!path->convert(*writer.path)) return;
 		const auto dir = t == enum_dir_type::enter;
-		const auto hf = open_file(path->data, dir, false);
+		unique_ptr_del<HANDLE> hf(nullptr, &CloseHandle);
+		auto ei = entry;
 		if (!dir) {
+			hf = open_file_at(hd, path->data, path->data.rfind(L'\\') + 1, false, FILE_OPEN);
 			BY_HANDLE_FILE_INFORMATION info;
 			if (!GetFileInformationByHandle(hf.get(), &info)) {
 				throw lro_error::from_win32_last(err_msg::err_file_info, { path->data });
@@ -575,9 +1088,12 @@ void wsl_reader::run(fs_writer &writer) {
 					if (id_map[id]->convert(*writer.target_path)) writer.write_hard_link();
 					return;
 				} else id_map[id] = path->clone();
+				// The listing only keeps up with changes made through the name they were made with.
+				ei = query_entry_info(hf.get(), path->data);
+				ei.has_eas = entry.has_eas;
 			}
 		}
-		const auto attr = read_attr(hf.get());
+		const auto attr = read_attr(dir ? hd : hf.get(), ei);
 		if (dir) writer.write_new_file(attr.get());
 		else {
 			const auto type = attr ? attr->mode & AE_IFMT : AE_IFREG;
@@ -586,7 +1102,7 @@ void wsl_reader::run(fs_writer &writer) {
 				tb = read_symlink_data(hf.get());
 				if (attr && tb) attr->symlink = tb.get();
 				else {
-					log_warning((boost::wformat(L"Ignoring an invalid symlink \"%1%\".") % path->data).str());
+					log_skipped(skip_reason::invalid_symlink, path->data);
 					return;
 				}
 			}
@@ -598,7 +1114,9 @@ void wsl_reader::run(fs_writer &writer) {
 						throw lro_error::from_win32_last(err_msg::err_read_file, { path->data });
 					}
 					writer.write_file_data(buf, rc);
+					read_bytes += rc;
 				} while (rc);
+				if (total_bytes) print_progress(std::min(1.0, static_cast<double>(read_bytes) / total_bytes));
 			}
 		}
 	});
@@ -613,11 +1131,12 @@ wsl_v1_reader::wsl_v1_reader(crwstr base) {
 	path = std::make_unique<wsl_v1_path>(base);
 }
 
-std::unique_ptr<file_attr> wsl_v1_reader::read_attr(const HANDLE hf) const {
+std::unique_ptr<file_attr> wsl_v1_reader::read_attr(const HANDLE hf, const dir_entry_info &entry) const {
+	if (!entry.has_eas) return nullptr;
 	try {
 		const auto ea = get_ea<lxattrb>(hf, "LXATTRB");
 		return std::make_unique<file_attr>(file_attr {
-			ea.mode, ea.uid, ea.gid, get_file_size(hf),
+			ea.mode, ea.uid, ea.gid, entry.size,
 			{ ea.atime, ea.atime_nsec },
 			{ ea.mtime, ea.mtime_nsec },
 			{ ea.ctime, ea.ctime_nsec },
@@ -631,37 +1150,44 @@ std::unique_ptr<file_attr> wsl_v1_reader::read_attr(const HANDLE hf) const {
 	}
 }
 
-std::unique_ptr<char[]> wsl_v1_reader::read_symlink_data(const HANDLE hf) const {
+// Symlinks are stored as files containing their targets in filesystem versions 0 and 1.
+static std::unique_ptr<char[]> read_v1_symlink(const HANDLE hf, crwstr path) {
 	uint64_t sz;
 	try {
 		sz = get_file_size(hf);
 	} catch (lro_error &e) {
-		e.msg_args.push_back(path->data);
+		e.msg_args.push_back(path);
 		throw;
 	}
-	if (sz > 65536) throw lro_error::from_other(err_msg::err_symlink_length, { path->data, std::to_wstring(sz) });
+	if (sz > 65536) throw lro_error::from_other(err_msg::err_symlink_length, { path, std::to_wstring(sz) });
 	auto buf = std::make_unique<char[]>(sz + 1);
 	DWORD rc;
 	for (uint32_t off = 0; off < sz; off += rc) {
 		if (!ReadFile(hf, buf.get() + off, static_cast<uint32_t>(sz - off), &rc, nullptr)) {
-			throw lro_error::from_win32_last(err_msg::err_read_file, { path->data });
+			throw lro_error::from_win32_last(err_msg::err_read_file, { path });
 		}
 	}
 	buf[sz] = 0;
 	return buf;
 }
 
+std::unique_ptr<char[]> wsl_v1_reader::read_symlink_data(const HANDLE hf) const {
+	return read_v1_symlink(hf, path->data);
+}
+
 wsl_v2_reader::wsl_v2_reader(crwstr base) {
 	path = std::make_unique<wsl_v2_path>(base);
 }
 
-std::unique_ptr<file_attr> wsl_v2_reader::read_attr(const HANDLE hf) const {
+std::unique_ptr<file_attr> wsl_v2_reader::read_attr(const HANDLE hf, const dir_entry_info &entry) const {
+	if (!entry.has_eas) return nullptr;
 	std::unique_ptr<file_attr> attr(new file_attr);
 	try {
-		attr->uid = get_ea<uint32_t>(hf, "$LXUID");
-		attr->gid = get_ea<uint32_t>(hf, "$LXGID");
-		attr->mode = get_ea<uint32_t>(hf, "$LXMOD");
-		attr->size = get_file_size(hf);
+		const auto ids = get_eas<uint32_t, 3>(hf, { "$LXUID", "$LXGID", "$LXMOD" });
+		attr->uid = ids[0];
+		attr->gid = ids[1];
+		attr->mode = ids[2];
+		attr->size = entry.size;
 		const auto type = attr->mode & AE_IFMT;
 		if (type == AE_IFCHR || type == AE_IFBLK) {
 			const auto dev = get_ea<uint64_t>(hf, "$LXDEV");
@@ -673,13 +1199,9 @@ std::unique_ptr<file_attr> wsl_v2_reader::read_attr(const HANDLE hf) const {
 		e.msg_args.push_back(path->data);
 		throw;
 	}
-	FILE_BASIC_INFO info;
-	if (!GetFileInformationByHandleEx(hf, FileBasicInfo, &info, sizeof info)) {
-		throw lro_error::from_win32_last(err_msg::err_get_ft, { path->data });
-	}
-	time_f2u(info.LastAccessTime, attr->at);
-	time_f2u(info.LastWriteTime, attr->mt);
-	time_f2u(info.ChangeTime, attr->ct);
+	attr->at = entry.at;
+	attr->mt = entry.mt;
+	attr->ct = entry.ct;
 	return attr;
 }
 
@@ -756,19 +1278,532 @@ std::unique_ptr<wsl_reader> select_wsl_reader(const uint32_t version, crwstr pat
 	throw lro_error::from_other(err_msg::err_fs_version, { std::to_wstring(version) });
 }
 
+std::unique_ptr<file_path> select_wsl_path(const uint32_t version, crwstr path) {
+	if (version == 0) return std::make_unique<wsl_legacy_path>(path);
+	if (version == 1) return std::make_unique<wsl_v1_path>(path);
+	if (version == 2) return std::make_unique<wsl_v2_path>(path);
+	throw lro_error::from_other(err_msg::err_fs_version, { std::to_wstring(version) });
+}
+
+scan_result scan_archive(crwstr archive_path, crwstr root_path) {
+	const auto hf = open_file(archive_path, false, false);
+	const auto pm = archive_mapping::create(hf.get(), get_file_size(hf.get()));
+	unique_ptr_del<archive *> pa(archive_read_new(), &archive_read_free);
+	check_archive(pa.get(), archive_read_support_filter_all(pa.get()));
+	check_archive(pa.get(), archive_read_support_format_all(pa.get()));
+	// The mapping can be seeked, so formats with an index such as zip are read from it.
+	if (pm) pm->open(pa.get());
+	else check_archive(pa.get(), archive_read_open_filename_w(pa.get(), archive_path.c_str(), 1 << 20));
+	const auto root_utf8 = to_utf8(root_path);
+	const std::string root(root_utf8.get());
+	linux_path p, out;
+	scan_result res {};
+	archive_entry *pe;
+	while (check_archive(pa.get(), archive_read_next_header(pa.get(), &pe))) {
+		const auto up = archive_entry_pathname(pe);
+		const auto wp = archive_entry_pathname_w(pe);
+		if (up) p.assign_utf8(up, strlen(up), root);
+		else if (wp) p = linux_path(wp, root_path);
+		else throw lro_error::from_other(err_msg::err_convert_encoding, {});
+		if (p.convert(out)) {
+			res.entries++;
+			if (archive_entry_filetype(pe) == AE_IFREG) res.bytes += archive_entry_size(pe);
+		}
+		check_archive(pa.get(), archive_read_data_skip(pa.get()));
+	}
+	return res;
+}
+
+scan_result scan_wsl(const uint32_t version, crwstr path, const uint32_t thread_count) {
+	auto root = wsl_v2_path(path).data;
+	// The base directory of a legacy distro holds the root's subdirectories as well.
+	if (version) root += L"rootfs\\";
+	std::atomic<uint64_t> entries { 0 }, bytes { 0 };
+	task_pool pool(thread_count);
+	std::function<void(const wstr &)> visit;
+	visit = [&](const wstr &d) {
+		WIN32_FIND_DATA data;
+		const unique_ptr_del<HANDLE> hs(FindFirstFileEx(
+			(d + L'*').c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH
+		), &find_close_safe);
+		if (hs.get() == INVALID_HANDLE_VALUE) {
+			throw lro_error::from_win32_last(err_msg::err_enum_dir, { d });
+		}
+		uint64_t cnt = 0, size = 0;
+		do {
+			if (wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0) continue;
+			cnt++;
+			if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+				size += static_cast<uint64_t>(data.nFileSizeHigh) << 32 | data.nFileSizeLow;
+			} else if (!(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+				pool.submit([&visit, p = d + data.cFileName + L'\\'] { visit(p); });
+			}
+		} while (FindNextFile(hs.get(), &data));
+		if (GetLastError() != ERROR_NO_MORE_FILES) {
+			throw lro_error::from_win32_last(err_msg::err_enum_dir, { d });
+		}
+		entries += cnt;
+		bytes += size;
+	};
+	pool.submit([&visit, root] { visit(root); });
+	pool.wait();
+	return { entries, bytes };
+}
+
+void check_free_space(crwstr path, const scan_result &scan) {
+	check_free_space(std::vector<wstr> { path }, scan);
+}
+
+void check_free_space(const std::vector<wstr> &paths, const scan_result &scan) {
+	// The number of copies going to each volume, by its lowercase mount point.
+	std::map<wstr, std::pair<wstr, uint64_t>> volumes;
+	for (crwstr p : paths) {
+		wchar_t vol[MAX_PATH + 1];
+		// The check is only a shortcut for failing early, so it's left out if the volume can't be queried.
+		if (!GetVolumePathName(get_full_path(p).c_str(), vol, MAX_PATH + 1)) continue;
+		auto &v = volumes[boost::to_lower_copy(wstr(vol))];
+		v.first = vol;
+		v.second++;
+	}
+	for (const auto &p : volumes) {
+		const auto &vol = p.second.first;
+		DWORD spc, bps, fc, tc;
+		ULARGE_INTEGER avail;
+		if (!GetDiskFreeSpace(vol.c_str(), &spc, &bps, &fc, &tc)
+			|| !GetDiskFreeSpaceEx(vol.c_str(), &avail, nullptr, nullptr)) {
+
+			continue;
+		}
+		// Each entry is assumed to waste up to a cluster, which also covers its record in the MFT.
+		const auto need = (scan.bytes + scan.entries * spc * bps) * p.second.second;
+		if (need > avail.QuadPart) {
+			throw lro_error::from_other(err_msg::err_disk_space, {
+				vol, std::to_wstring((need + (1 << 20) - 1) >> 20), std::to_wstring(avail.QuadPart >> 20)
+			});
+		}
+	}
+}
+
 bool move_directory(crwstr source_path, crwstr target_path) {
 	return MoveFile(source_path.c_str(), target_path.c_str());
 }
 
-void delete_directory(crwstr path) {
-	wsl_v2_path p(path);
-	enum_directory(p, false, [&](const enum_dir_type t) {
-		if (t == enum_dir_type::enter) return;
-		const auto dir = t == enum_dir_type::exit;
-		if (!(dir ? RemoveDirectory : DeleteFile)(p.data.c_str())) {
-			throw lro_error::from_win32_last(dir ? err_msg::err_delete_dir : err_msg::err_delete_file, { p.data });
+namespace {
+	struct delete_node {
+		wstr path;
+		std::shared_ptr<delete_node> parent;
+		// The subdirectories still being deleted, plus one for the enumeration of this directory itself.
+		std::atomic<size_t> pending { 1 };
+	};
+}
+
+void delete_directory(crwstr path, const uint32_t thread_count) {
+	const auto root = std::make_shared<delete_node>();
+	root->path = wsl_v2_path(path).data;
+	task_pool pool(thread_count);
+	// Removes a directory once everything in it is gone, and then its parent if it was the last one pending.
+	const auto finish = [](std::shared_ptr<delete_node> node) {
+		while (node && --node->pending == 0) {
+			if (!RemoveDirectory(node->path.c_str())) {
+				throw lro_error::from_win32_last(err_msg::err_delete_dir, { node->path });
+			}
+			node = node->parent;
 		}
-	});
+	};
+	std::function<void(std::shared_ptr<delete_node>)> visit;
+	visit = [&](const std::shared_ptr<delete_node> &node) {
+		if (get_win_build() <= 20206) {
+			try {
+				set_cs_info(open_file(node->path, true, false).get());
+			} catch (lro_error &e) {
+				if (e.msg_code == err_msg::err_set_cs) e.msg_args.push_back(node->path);
+				throw;
+			}
+		}
+		WIN32_FIND_DATA data;
+		const unique_ptr_del<HANDLE> hs(FindFirstFile((node->path + L'*').c_str(), &data), &find_close_safe);
+		if (hs.get() == INVALID_HANDLE_VALUE) {
+			throw lro_error::from_win32_last(err_msg::err_enum_dir, { node->path });
+		}
+		do {
+			if (wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0) continue;
+			auto p = node->path + data.cFileName;
+			if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+				if (!DeleteFile(p.c_str())) throw lro_error::from_win32_last(err_msg::err_delete_file, { p });
+			} else if (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) {
+				// Junctions are removed without following them.
+				if (!RemoveDirectory(p.c_str())) throw lro_error::from_win32_last(err_msg::err_delete_dir, { p });
+			} else {
+				const auto child = std::make_shared<delete_node>();
+				child->path = std::move(p) + L'\\';
+				child->parent = node;
+				++node->pending;
+				pool.submit([&visit, child] { visit(child); });
+			}
+		} while (FindNextFile(hs.get(), &data));
+		if (GetLastError() != ERROR_NO_MORE_FILES) {
+			throw lro_error::from_win32_last(err_msg::err_enum_dir, { node->path });
+		}
+		finish(node);
+	};
+	pool.submit([&visit, root] { visit(root); });
+	pool.wait();
+}
+
+// Calls "action" for everything in a directory ending with a backslash, which is walked in parallel. Junctions are left
+// out. "action" may rename an entry and update the path it's given, before the contents of the entry are visited.
+static void walk_parallel(crwstr dir, const uint32_t thread_count, const std::function<void(wstr &, bool)> &action) {
+	task_pool pool(thread_count);
+	std::function<void(const wstr &)> visit;
+	visit = [&](const wstr &d) {
+		// Entries are collected first, as one renamed while the directory is being enumerated might show up again.
+		std::vector<std::pair<wstr, bool>> entries;
+		WIN32_FIND_DATA data;
+		{
+			const unique_ptr_del<HANDLE> hs(FindFirstFile((d + L'*').c_str(), &data), &find_close_safe);
+			if (hs.get() == INVALID_HANDLE_VALUE) {
+				throw lro_error::from_win32_last(err_msg::err_enum_dir, { d });
+			}
+			do {
+				if (wcscmp(data.cFileName, L".") == 0 || wcscmp(data.cFileName, L"..") == 0) continue;
+				const auto is_dir = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+				if (is_dir && (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) continue;
+				entries.emplace_back(d + data.cFileName, is_dir);
+			} while (FindNextFile(hs.get(), &data));
+			if (GetLastError() != ERROR_NO_MORE_FILES) {
+				throw lro_error::from_win32_last(err_msg::err_enum_dir, { d });
+			}
+		}
+		for (auto &e : entries) {
+			action(e.first, e.second);
+			if (e.second) pool.submit([&visit, p = std::move(e.first) + L'\\'] { visit(p); });
+		}
+	};
+	pool.submit([&visit, dir] { visit(dir); });
+	pool.wait();
+}
+
+static bool map_id(const std::map<uint32_t, uint32_t> &m, uint32_t &id) {
+	const auto it = m.find(id);
+	if (it == m.end() || it->second == id) return false;
+	id = it->second;
+	return true;
+}
+
+uint64_t remap_ids(
+	const uint32_t version, crwstr path,
+	const std::map<uint32_t, uint32_t> &uids, const std::map<uint32_t, uint32_t> &gids, const uint32_t thread_count
+) {
+	if (version > 2) throw lro_error::from_other(err_msg::err_fs_version, { std::to_wstring(version) });
+	std::atomic<uint64_t> changed { 0 };
+	// Files with several links are only mapped once, otherwise chained mappings such as 1000:1001 and 1001:1002
+	// would be applied to them more than once.
+	std::set<uint64_t> linked;
+	std::mutex linked_mtx;
+	const auto remap = [&](crwstr p, const bool dir) {
+		const auto hf = open_file(p, dir, false);
+		if (!dir) {
+			BY_HANDLE_FILE_INFORMATION info;
+			if (!GetFileInformationByHandle(hf.get(), &info)) {
+				throw lro_error::from_win32_last(err_msg::err_file_info, { p });
+			}
+			if (info.nNumberOfLinks > 1) {
+				const auto id = info.nFileIndexLow + (static_cast<uint64_t>(info.nFileIndexHigh) << 32);
+				std::lock_guard<std::mutex> lock(linked_mtx);
+				if (!linked.insert(id).second) return;
+			}
+		}
+		try {
+			if (version == 2) {
+				auto ids = get_eas<uint32_t, 2>(hf.get(), { "$LXUID", "$LXGID" });
+				if (map_id(uids, ids[0]) | map_id(gids, ids[1])) {
+					set_ea_list(hf.get(), {
+						{ "$LXUID", &ids[0], sizeof(ids[0]) },
+						{ "$LXGID", &ids[1], sizeof(ids[1]) }
+					});
+					++changed;
+				}
+			} else {
+				auto ea = get_ea<lxattrb>(hf.get(), "LXATTRB");
+				if (map_id(uids, ea.uid) | map_id(gids, ea.gid)) {
+					set_ea(hf.get(), "LXATTRB", ea);
+					++changed;
+				}
+			}
+		} catch (lro_error &e) {
+			if (e.msg_code == err_msg::err_invalid_ea) {
+				log_skipped(skip_reason::no_attr, p);
+				return;
+			}
+			e.msg_args.push_back(p);
+			throw;
+		}
+	};
+	auto root = wsl_v2_path(path).data;
+	// The base directory of a legacy distro holds the root's subdirectories but isn't a part of it.
+	if (version) {
+		root += L"rootfs\\";
+		remap(root, true);
+	}
+	walk_parallel(root, thread_count, [&](wstr &p, const bool dir) { remap(p, dir); });
+	return changed;
+}
+
+namespace {
+	// The journal of an in-place upgrade, kept in the distro directory. Its first line is "upgrade <old version>", and
+	// every rename is recorded as "rename <from>\t<to>" and flushed to disk before it's made. "commit" marks the point
+	// from which the old attributes are being removed. Lines are UTF-8, and an incomplete last line is ignored.
+	class upgrade_journal {
+		const wstr path;
+		unique_ptr_del<HANDLE> hf;
+		std::mutex mutex;
+	public:
+		uint32_t version = 0;
+		bool committed = false;
+		std::vector<std::pair<wstr, wstr>> renames;
+		// The length of the complete lines.
+		uint64_t size = 0;
+
+		explicit upgrade_journal(wstr path) : path(std::move(path)), hf(nullptr, &CloseHandle) {}
+
+		// Returns false if there isn't a journal, or if it was interrupted before its first line was complete.
+		bool load() {
+			unique_ptr_del<HANDLE> hr(nullptr, &CloseHandle);
+			try {
+				hr = open_file(path, false, false);
+			} catch (const lro_error &e) {
+				if (e.err_code == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) return false;
+				throw;
+			}
+			std::string buf(get_file_size(hr.get()), 0);
+			DWORD rc;
+			if (!ReadFile(hr.get(), buf.data(), static_cast<uint32_t>(buf.size()), &rc, nullptr) || rc != buf.size()) {
+				throw lro_error::from_win32_last(err_msg::err_read_file, { path });
+			}
+			wstr line;
+			for (size_t end; (end = buf.find('\n', size)) != std::string::npos; size = end + 1) {
+				from_utf8(buf.data() + size, end - size, line);
+				const auto tab = line.find(L'\t');
+				if (!size) {
+					if (line != L"upgrade 0" && line != L"upgrade 1") break;
+					version = line.back() - L'0';
+				} else if (line == L"commit") {
+					committed = true;
+				} else if (!line.compare(0, 7, L"rename ") && tab != wstr::npos) {
+					renames.emplace_back(line.substr(7, tab - 7), line.substr(tab + 1));
+				} else break;
+			}
+			if (buf.find('\n', size) != std::string::npos) {
+				throw lro_error::from_other(err_msg::err_upgrade_journal, { path });
+			}
+			return size != 0;
+		}
+
+		// Opens the journal for writing after its last complete line.
+		void open() {
+			const auto h = CreateFile(
+				path.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr
+			);
+			if (h == INVALID_HANDLE_VALUE) throw lro_error::from_win32_last(err_msg::err_create_file, { path });
+			hf.reset(h);
+			LARGE_INTEGER pos;
+			pos.QuadPart = size;
+			if (!SetFilePointerEx(hf.get(), pos, nullptr, FILE_BEGIN) || !SetEndOfFile(hf.get())) {
+				throw lro_error::from_win32_last(err_msg::err_write_file, { path });
+			}
+		}
+
+		void write(crwstr line) {
+			std::string s;
+			to_utf8(line.c_str(), line.size(), s);
+			s += '\n';
+			const std::lock_guard<std::mutex> lock(mutex);
+			DWORD wc;
+			if (!WriteFile(hf.get(), s.data(), static_cast<uint32_t>(s.size()), &wc, nullptr)
+				|| !FlushFileBuffers(hf.get())) {
+
+				throw lro_error::from_win32_last(err_msg::err_write_file, { path });
+			}
+		}
+
+		void rename(crwstr from, crwstr to) {
+			write(L"rename " + from + L'\t' + to);
+			if (!MoveFile(from.c_str(), to.c_str())) {
+				throw lro_error::from_win32_last(err_msg::err_rename, { from, to });
+			}
+		}
+
+		void remove() {
+			hf.reset();
+			if (!DeleteFile(path.c_str())) throw lro_error::from_win32_last(err_msg::err_delete_file, { path });
+		}
+	};
+
+	const wchar_t *const legacy_mounts[] = { L"home", L"root", L"mnt" };
+}
+
+// Adds the version 2 attributes of an entry next to the version 1 ones, which are still there for a rollback.
+static void add_v2_attr(crwstr path, const bool is_dir) {
+	const auto hf = open_file(path, is_dir, false);
+	lxattrb ea;
+	try {
+		ea = get_ea<lxattrb>(hf.get(), "LXATTRB");
+	} catch (lro_error &e) {
+		if (e.msg_code == err_msg::err_invalid_ea) {
+			log_skipped(skip_reason::no_attr, path);
+			return;
+		}
+		e.msg_args.push_back(path);
+		throw;
+	}
+	file_attr attr {
+		ea.mode, ea.uid, ea.gid, 0,
+		{ ea.atime, ea.atime_nsec }, { ea.mtime, ea.mtime_nsec }, { ea.ctime, ea.ctime_nsec },
+		ea.rdev >> 20, ea.rdev & 0xfffff, nullptr
+	};
+	std::unique_ptr<char[]> target;
+	if ((ea.mode & AE_IFMT) == AE_IFLNK) {
+		target = read_v1_symlink(hf.get(), path);
+		attr.symlink = target.get();
+	}
+	write_v2_attr(hf.get(), attr, path);
+	// Set again after the commit, but already close if the upgrade is interrupted before that's done for the entry.
+	set_v2_times(hf.get(), attr, path);
+}
+
+// Removes what's left of version 1 once the upgrade has been committed, and then sets the times, which everything done
+// to the entry or in its directory before has changed.
+static void remove_v1_attr(crwstr path, const bool is_dir) {
+	const auto hf = open_file(path, is_dir, false);
+	lxattrb ea;
+	try {
+		ea = get_ea<lxattrb>(hf.get(), "LXATTRB");
+		// The target of a symlink is in its reparse point now.
+		if ((ea.mode & AE_IFMT) == AE_IFLNK) {
+			FILE_END_OF_FILE_INFO info {};
+			if (!SetFileInformationByHandle(hf.get(), FileEndOfFileInfo, &info, sizeof(info))) {
+				throw lro_error::from_win32_last(err_msg::err_write_file, { path });
+			}
+		}
+		set_ea_list(hf.get(), { { "LXATTRB", nullptr, 0 } });
+	} catch (lro_error &e) {
+		// Already done before the upgrade was interrupted, or skipped when adding the new attributes.
+		if (e.msg_code == err_msg::err_invalid_ea) return;
+		if (e.msg_code == err_msg::err_get_ea || e.msg_code == err_msg::err_set_ea) e.msg_args.push_back(path);
+		throw;
+	}
+	file_attr attr {};
+	attr.at = { ea.atime, ea.atime_nsec };
+	attr.mt = { ea.mtime, ea.mtime_nsec };
+	attr.ct = { ea.ctime, ea.ctime_nsec };
+	set_v2_times(hf.get(), attr, path);
+}
+
+static void remove_v2_attr(crwstr path, const bool is_dir) {
+	const auto hf = open_file(path, is_dir, false);
+	uint32_t type;
+	try {
+		type = get_ea<uint32_t>(hf.get(), "$LXMOD") & AE_IFMT;
+	} catch (lro_error &e) {
+		if (e.msg_code == err_msg::err_invalid_ea) return;
+		e.msg_args.push_back(path);
+		throw;
+	}
+	if (const auto tag = get_lx_reparse_tag(type)) {
+		const auto hl = FIELD_OFFSET(REPARSE_DATA_BUFFER, DataBuffer);
+		const auto pb = create_fam_struct<REPARSE_DATA_BUFFER>(hl);
+		pb->ReparseTag = tag;
+		pb->ReparseDataLength = 0;
+		pb->Reserved = 0;
+		DWORD cnt;
+		if (!DeviceIoControl(hf.get(), FSCTL_DELETE_REPARSE_POINT, pb.get(), hl, nullptr, 0, &cnt, nullptr)
+			&& GetLastError() != ERROR_NOT_A_REPARSE_POINT) {
+
+			throw lro_error::from_win32_last(err_msg::err_set_reparse, { path });
+		}
+	}
+	std::vector<ea_value> eas { { "$LXUID", nullptr, 0 }, { "$LXGID", nullptr, 0 }, { "$LXMOD", nullptr, 0 } };
+	if (type == AE_IFCHR || type == AE_IFBLK) eas.push_back({ "$LXDEV", nullptr, 0 });
+	try {
+		set_ea_list(hf.get(), eas);
+	} catch (lro_error &e) {
+		e.msg_args.push_back(path);
+		throw;
+	}
+}
+
+bool upgrade_wsl_fs(
+	uint32_t version, crwstr path, const uint32_t thread_count, const std::function<void()> &on_commit
+) {
+	const auto base = wsl_v2_path(path).data, rootfs = base + L"rootfs\\";
+	upgrade_journal journal(base + L"upgrade.journal");
+	const auto resumed = journal.load();
+	if (resumed) version = journal.version;
+	else if (version == 2) return false;
+	if (version > 1) throw lro_error::from_other(err_msg::err_fs_version, { std::to_wstring(version) });
+	journal.open();
+	if (!resumed) journal.write(L"upgrade " + std::to_wstring(version));
+	if (!journal.committed) {
+		if (version == 0) {
+			// The mount points in the root are moved aside, to be deleted after the commit.
+			for (const auto d : legacy_mounts) {
+				const auto from = base + d, to = rootfs + d;
+				if (GetFileAttributes(from.c_str()) == INVALID_FILE_ATTRIBUTES) continue;
+				if (GetFileAttributes(to.c_str()) != INVALID_FILE_ATTRIBUTES) {
+					journal.rename(to, base + L"upgrade-old-" + d);
+				}
+				journal.rename(from, to);
+			}
+		}
+		const wsl_v1_path names(path);
+		// Names renamed before the upgrade was interrupted might contain '#' now, but mustn't be decoded again.
+		std::set<wstr> renamed;
+		for (const auto &r : journal.renames) renamed.insert(r.second);
+		add_v2_attr(rootfs, true);
+		walk_parallel(rootfs, thread_count, [&](wstr &p, const bool is_dir) {
+			// Only names with escaped characters are encoded differently.
+			if (p.find(L'#', p.rfind(L'\\')) != wstr::npos && !renamed.count(p)) {
+				auto from = names;
+				wsl_v2_path to(path);
+				from.data = p;
+				if (!from.convert(to)) throw lro_error::from_other(err_msg::err_transform_path, { p });
+				journal.rename(p, to.data);
+				p = std::move(to.data);
+			}
+			add_v2_attr(p, is_dir);
+		});
+		journal.write(L"commit");
+	}
+	on_commit();
+	remove_v1_attr(rootfs, true);
+	walk_parallel(rootfs, thread_count, &remove_v1_attr);
+	if (version == 0) {
+		for (const auto d : legacy_mounts) {
+			const auto old = base + L"upgrade-old-" + d;
+			if (GetFileAttributes(old.c_str()) != INVALID_FILE_ATTRIBUTES) delete_directory(old, thread_count);
+		}
+	}
+	journal.remove();
+	return true;
+}
+
+void rollback_wsl_upgrade(crwstr path, const uint32_t thread_count) {
+	const auto base = wsl_v2_path(path).data, rootfs = base + L"rootfs\\";
+	upgrade_journal journal(base + L"upgrade.journal");
+	if (!journal.load() || journal.committed) {
+		throw lro_error::from_other(err_msg::err_upgrade_rollback, { path });
+	}
+	remove_v2_attr(rootfs, true);
+	walk_parallel(rootfs, thread_count, &remove_v2_attr);
+	// Renames that haven't been made, or have already been undone, are skipped.
+	for (auto it = journal.renames.rbegin(); it != journal.renames.rend(); ++it) {
+		if (!MoveFile(it->second.c_str(), it->first.c_str())
+			&& GetLastError() != ERROR_FILE_NOT_FOUND && GetLastError() != ERROR_PATH_NOT_FOUND) {
+
+			throw lro_error::from_win32_last(err_msg::err_rename, { it->second, it->first });
+		}
+	}
+	journal.remove();
 }
 
 bool check_in_use(crwstr path) {
@@ -0,0 +1,149 @@
+#include "pch.h"
+#include "hash.h"
+
+static const uint64_t
+	prime1 = 0x9E3779B185EBCA87ull,
+	prime2 = 0xC2B2AE3D27D4EB4Full,
+	prime3 = 0x165667B19E3779F9ull,
+	prime4 = 0x85EBCA77C2B2AE63ull,
+	prime5 = 0x27D4EB2F165667C5ull;
+
+static uint64_t rotl(const uint64_t x, const int r) {
+	return x << r | x >> (64 - r);
+}
+
+static uint64_t read64(const unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+static uint64_t xxh_round(const uint64_t acc, const uint64_t input) {
+	return rotl(acc + input * prime2, 31) * prime1;
+}
+
+static uint64_t merge_round(const uint64_t acc, const uint64_t val) {
+	return (acc ^ xxh_round(0, val)) * prime1 + prime4;
+}
+
+static void process_stripes(uint64_t *acc, const unsigned char *p, const size_t cnt) {
+	auto a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+	for (size_t i = 0; i < cnt; i++, p += 32) {
+		a0 = xxh_round(a0, read64(p));
+		a1 = xxh_round(a1, read64(p + 8));
+		a2 = xxh_round(a2, read64(p + 16));
+		a3 = xxh_round(a3, read64(p + 24));
+	}
+	acc[0] = a0;
+	acc[1] = a1;
+	acc[2] = a2;
+	acc[3] = a3;
+}
+
+content_hash::content_hash() {
+	reset();
+}
+
+void content_hash::reset() {
+	acc[0] = prime1 + prime2;
+	acc[1] = prime2;
+	acc[2] = 0;
+	acc[3] = 0 - prime1;
+	total_len = 0;
+	buf_len = 0;
+}
+
+void content_hash::update(const char *data, size_t size) {
+	auto p = reinterpret_cast<const unsigned char *>(data);
+	total_len += size;
+	if (buf_len) {
+		const auto n = std::min(size, sizeof buf - buf_len);
+		memcpy(buf + buf_len, p, n);
+		buf_len += n;
+		p += n;
+		size -= n;
+		if (buf_len < sizeof buf) return;
+		process_stripes(acc, buf, 1);
+		buf_len = 0;
+	}
+	const auto cnt = size / 32;
+	process_stripes(acc, p, cnt);
+	p += cnt * 32;
+	size -= cnt * 32;
+	memcpy(buf, p, size);
+	buf_len = size;
+}
+
+uint64_t content_hash::digest() const {
+	uint64_t h;
+	if (total_len >= 32) {
+		h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+		for (auto a : acc) h = merge_round(h, a);
+	} else {
+		h = acc[2] + prime5;
+	}
+	h += total_len;
+	auto p = buf;
+	auto n = buf_len;
+	for (; n >= 8; n -= 8, p += 8) {
+		h ^= xxh_round(0, read64(p));
+		h = rotl(h, 27) * prime1 + prime4;
+	}
+	if (n >= 4) {
+		h ^= read32(p) * prime1;
+		h = rotl(h, 23) * prime2 + prime3;
+		n -= 4;
+		p += 4;
+	}
+	for (; n; n--, p++) {
+		h ^= *p * prime5;
+		h = rotl(h, 11) * prime1;
+	}
+	h ^= h >> 33;
+	h *= prime2;
+	h ^= h >> 29;
+	h *= prime3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t hash_content(const char *data, const size_t size) {
+	content_hash h;
+	h.update(data, size);
+	return h.digest();
+}
+
+uint32_t crc32c(const char *data, const size_t size, uint32_t crc) {
+	static const auto table = [] {
+		std::array<uint32_t, 256> t {};
+		for (uint32_t i = 0; i < 256; i++) {
+			auto c = i;
+			for (auto j = 0; j < 8; j++) c = c & 1 ? c >> 1 ^ 0x82F63B78u : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ crc >> 8;
+	return ~crc;
+}
+
+uint16_t crc16(const char *data, const size_t size, uint16_t crc) {
+	static const auto table = [] {
+		std::array<uint16_t, 256> t {};
+		for (uint16_t i = 0; i < 256; i++) {
+			uint16_t c = i;
+			for (auto j = 0; j < 8; j++) c = c & 1 ? c >> 1 ^ 0xA001 : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+	for (size_t i = 0; i < size; i++) crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ crc >> 8;
+	return crc;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "pch.h"
+#include "fs.h"
+
+// Runs another writer on a worker thread, so that reading (e.g. decompressing) and writing (e.g. compressing) overlap.
+// File data is copied into a queue of bounded size. Because the inner writer runs later, write_new_file can't tell
+// whether it will skip a file; data of skipped files is dropped by the worker instead.
+class async_writer : public fs_writer {
+	enum class op_type { new_file, data, hard_link };
+	struct op {
+		op_type type;
+		wstr path, target_path;
+		bool has_attr;
+		file_attr attr;
+		std::string symlink;
+		std::vector<char> data;
+	};
+	fs_writer &inner;
+	const size_t max_queued;
+	std::mutex mutex;
+	std::condition_variable cv_push, cv_pop;
+	std::deque<op> queue;
+	size_t queued = 0;
+	bool finishing = false, aborted = false;
+	std::exception_ptr error;
+	std::vector<char> data_buf;
+	std::thread worker;
+	void push(op &&);
+	void flush_data();
+	void run();
+	void apply(op &, bool &);
+public:
+	explicit async_writer(fs_writer &, size_t max_queued = 1 << 26);
+	~async_writer() override;
+	bool write_new_file(const file_attr *) override;
+	void write_file_data(const char *, uint32_t) override;
+	void write_hard_link() override;
+	void check_path(const file_path &) const override;
+	// Waits for the inner writer to finish and rethrows the error it failed with, if any.
+	void close();
+};
+
+// Passes everything to several writers, so that e.g. a tar file can be installed as several distros while being read
+// only once. Each writer runs on its own worker through an async_writer holding up to "max_queued" bytes, so a slow
+// writer only holds up the others once its queue is full. Paths are converted to the path type of each writer.
+class tee_writer : public fs_writer {
+	std::vector<std::unique_ptr<async_writer>> writers;
+	std::vector<bool> active;
+public:
+	explicit tee_writer(const std::vector<fs_writer *> &, size_t max_queued = 1 << 24);
+	bool write_new_file(const file_attr *) override;
+	void write_file_data(const char *, uint32_t) override;
+	void write_hard_link() override;
+	void check_path(const file_path &) const override;
+	// Waits for all writers to finish and rethrows the first error any of them failed with.
+	void close();
+};
@@ -0,0 +1,34 @@
+#pragma once
+#include "pch.h"
+#include "parallel.h"
+
+// A line of input of the "batch" action. It's either a JSON array of arguments, or a JSON object with such an array
+// in "args" and an optional "id" of any type, which is echoed back as is in the result.
+struct batch_command {
+	wstr id;
+	std::vector<wstr> args;
+};
+
+batch_command parse_batch_command(crwstr line);
+// Standard input and output belong to the batch itself, so a command can't use "-" as a file, whether it's given as a
+// separate argument, as "-f-" or as "--file=-".
+void check_batch_command(const batch_command &cmd);
+// A single line of JSON. Characters outside ASCII are escaped, so the result doesn't depend on the output encoding.
+wstr format_batch_result(crwstr id, int status, crwstr output, crwstr error);
+
+// Runs batch commands on a task pool, in input order as far as they depend on each other. Commands naming the same
+// distro with "-n" or "-N" run one after another. Commands naming none, like "list", run alone after all earlier ones.
+class batch_runner {
+	const std::function<void(const batch_command &)> run;
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::multiset<wstr> busy;
+	size_t running = 0;
+	bool barrier = false;
+	task_pool pool;
+public:
+	batch_runner(uint32_t jobs, std::function<void(const batch_command &)> run);
+	// Waits until the command doesn't depend on any running one and hands it to a worker. "run" mustn't throw.
+	void submit(batch_command cmd);
+	void wait();
+};
@@ -0,0 +1,45 @@
+#pragma once
+#include "pch.h"
+#include "fs.h"
+#include "manifest.h"
+
+// Sorts manifest entries by path, spilling sorted runs to temporary files once too many entries are buffered, so that
+// trees of any size can be merge-joined in bounded memory. When a path is added more than once, the last one wins.
+class entry_sorter {
+	std::vector<manifest_entry> buf;
+	std::vector<wstr> runs;
+	std::vector<std::unique_ptr<manifest_input>> inputs;
+	std::vector<manifest_entry> heads;
+	std::vector<size_t> heap;
+	size_t pos;
+	manifest_entry peek;
+	bool peeked;
+	void spill();
+	bool next_raw(manifest_entry &);
+public:
+	entry_sorter();
+	entry_sorter(const entry_sorter &) = delete;
+	entry_sorter &operator=(const entry_sorter &) = delete;
+	~entry_sorter();
+	void add(manifest_entry &&);
+	void finish();
+	bool next(manifest_entry &);
+};
+
+class diff_source {
+	std::unique_ptr<fs_reader> reader;
+	std::unique_ptr<file_path> proto;
+	const uint32_t version;
+	const wstr dir;
+	diff_source(std::unique_ptr<fs_reader>, uint32_t, wstr);
+public:
+	static diff_source from_distro(uint32_t version, crwstr dir);
+	static diff_source from_archive(crwstr file, crwstr root);
+	void collect(entry_sorter &) const;
+	[[nodiscard]] uint64_t hash_entry(const manifest_entry &) const;
+};
+
+uint64_t diff_trees(
+	const diff_source &a, const diff_source &b, uint32_t thread_count,
+	const std::function<void(wchar_t, crwstr, crwstr)> &report
+);
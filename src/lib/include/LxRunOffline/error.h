@@ -55,7 +55,23 @@ enum class err_msg {
 	err_root_dir,
 	err_invalid_flags,
 	err_wsl2_unsupported,
-	err_copy_subdir
+	err_copy_subdir,
+	err_manifest,
+	err_verify_failed,
+	err_vhdx,
+	err_ext4,
+	err_ext4_full,
+	err_wsl2_required,
+	err_set_attr,
+	err_batch_command,
+	err_id_map,
+	err_transform_rule,
+	err_rename,
+	err_upgrade_journal,
+	err_upgrade_rollback,
+	err_disk_space,
+	err_archive_ext,
+	err_has_children
 };
 
 class lro_error : public std::exception {
@@ -0,0 +1,151 @@
+#pragma once
+#include "pch.h"
+#include "fs.h"
+#include "pio.h"
+#include "vhdx.h"
+
+struct ext4_inode {
+	uint32_t ino, mode, uid, gid, flags, links;
+	uint64_t size, blocks, file_acl;
+	unix_time at, mt, ct;
+	char block[60];
+	// The extra fields and in-inode extended attributes following the 128-byte base inode.
+	std::vector<char> extra;
+};
+
+struct ext4_extent {
+	uint64_t logical, physical;
+	uint32_t length;
+	bool uninit;
+};
+
+struct ext4_dir_entry {
+	std::string name;
+	uint32_t ino;
+};
+
+// Read access to an ext4 filesystem that takes up a whole disk, which is how WSL2 formats its ext4.vhdx.
+// All methods are const and may be called from several threads at the same time.
+class ext4_volume {
+	pio_file &disk;
+	uint32_t block_size, inodes_per_group, inode_size, group_count, blocks_per_group, first_data_block;
+	uint32_t reserved_gdt_blocks, backup_groups[2];
+	bool meta_bg, sparse_super, sparse_super2, uninit_bg;
+	uint64_t blocks_count;
+	std::vector<uint64_t> inode_tables, block_bitmaps, inode_bitmaps, desc_locations;
+	std::vector<uint16_t> group_flags;
+	[[nodiscard]] bool has_super(uint64_t group) const;
+	void read_group_descriptors(uint32_t desc_size, uint64_t first_meta_bg);
+	void read_extent_node(const char *node, size_t size, int depth, std::vector<ext4_extent> &res) const;
+	[[nodiscard]] std::vector<char> read_inline_data(const ext4_inode &) const;
+public:
+	explicit ext4_volume(pio_file &disk);
+	[[noreturn]] void fail(crwstr reason) const;
+	[[nodiscard]] uint32_t get_block_size() const;
+	// Whether each block of the filesystem is in use. The metadata of a group counts as used even if its block bitmap
+	// hasn't been initialized.
+	[[nodiscard]] std::vector<bool> read_block_bitmap() const;
+	[[nodiscard]] ext4_inode read_inode(uint32_t ino) const;
+	// Returns the mapped extents of a file in logical order. Holes aren't included.
+	[[nodiscard]] std::vector<ext4_extent> read_extents(const ext4_inode &) const;
+	// Reads file data, filling holes and uninitialized extents with zeros.
+	void read_data(
+		const ext4_inode &, const std::vector<ext4_extent> &, uint64_t offset, char *buf, size_t size
+	) const;
+	[[nodiscard]] std::vector<char> read_file(const ext4_inode &) const;
+	// Directory entries other than "." and "..". Hashed directories are read linearly, as their index blocks look
+	// like empty directory blocks.
+	[[nodiscard]] std::vector<ext4_dir_entry> read_dir(const ext4_inode &) const;
+	// Returns false if the extended attribute doesn't exist.
+	bool read_xattr(const ext4_inode &, uint8_t name_index, const std::string &name, std::vector<char> &value) const;
+	[[nodiscard]] bool has_inline_data(const ext4_inode &) const;
+};
+
+// Reads the ext4 filesystem of a WSL2 distro without starting its VM.
+// Contents of small files are read ahead on a task pool while earlier entries are passed to the writer.
+class ext4_reader : public fs_reader {
+	std::unique_ptr<pio_file> file;
+	std::unique_ptr<vhdx_file> vhdx;
+	ext4_volume volume;
+public:
+	explicit ext4_reader(pio_file &disk);
+	explicit ext4_reader(crwstr vhdx_path);
+	void run(fs_writer &) override;
+};
+
+// Builds a new ext4 filesystem on an empty disk, such as a newly created ext4.vhdx for WSL2.
+// Blocks are handed out in the order entries arrive, so each file takes up one contiguous run sized from its
+// attributes and its data is written through in large sequential writes. Directories and the inode table are kept in
+// memory until close(). Block groups that are never used are left uninitialized, so they aren't written at all.
+class ext4_writer : public fs_writer {
+	struct node {
+		uint32_t mode, uid, gid, links, parent, dev;
+		uint64_t size, start, count;
+		unix_time at, mt, ct;
+	};
+	struct child {
+		std::string name;
+		uint32_t ino;
+	};
+
+	std::unique_ptr<pio_file> file;
+	std::unique_ptr<vhdx_file> vhdx;
+	pio_file &disk;
+	uint32_t group_count, inodes_per_group, gdt_blocks, itable_blocks, journal_blocks;
+	uint64_t blocks_count, next_block;
+	char uuid[16];
+	std::vector<node> nodes;
+	std::unordered_map<uint32_t, std::vector<child>> dirs;
+	std::unordered_map<uint32_t, std::string> fast_links;
+	std::unordered_map<std::string, uint32_t> paths;
+	uint32_t cur_ino;
+	uint64_t cur_written;
+	std::vector<char> buf;
+	bool closed;
+
+	void init();
+	uint64_t alloc_blocks(uint64_t count);
+	uint32_t alloc_inode(uint32_t mode);
+	[[nodiscard]] node &get_node(uint32_t ino);
+	uint32_t find_dir(const std::string &path);
+	void flush_data();
+	void end_file();
+	void write_dirs();
+	void write_extents(char *inode, const node &n);
+	void write_inodes();
+	void write_metadata();
+	[[noreturn]] void fail_full(crwstr what) const;
+public:
+	explicit ext4_writer(pio_file &disk);
+	// Creates a dynamic VHDX of the given virtual size and formats it.
+	ext4_writer(crwstr vhdx_path, uint64_t disk_size);
+	bool write_new_file(const file_attr *) override;
+	void write_file_data(const char *, uint32_t) override;
+	void write_hard_link() override;
+	void check_path(const file_path &) const override;
+	// Fails early if the scanned files clearly won't fit into the filesystem.
+	void check_space(const scan_result &) const;
+	// Writes the directories, inodes and group metadata. The filesystem isn't valid until this is called.
+	void close();
+};
+
+// Creates the ext4.vhdx of a new WSL2 distro in the given directory.
+std::unique_ptr<ext4_writer> create_wsl2_writer(crwstr dir, uint64_t disk_size);
+// Copies the ext4.vhdx of a WSL2 distro into another directory. Only the blocks stored in the source are copied, so the
+// copy stays as sparse as the source.
+void copy_wsl2_disk(crwstr source_dir, crwstr target_dir, uint32_t thread_count = 0);
+// The size of the ext4.vhdx of a WSL2 distro as a scan_result, which is at least what copy_wsl2_disk writes.
+scan_result scan_wsl2_disk(crwstr dir);
+
+// Creates the ext4.vhdx of a new WSL2 distro as a differencing disk on top of the one in "parent_dir". Since any change
+// to the parent would invalidate the new disk, the parent is made read-only.
+void create_differencing_wsl2_disk(crwstr parent_dir, crwstr dir);
+// Makes the ext4.vhdx in "dir" writable again, once no differencing disk is based on it.
+void unlock_wsl2_disk(crwstr dir);
+// Merges a differencing ext4.vhdx with its parents into a standalone disk that replaces it. Returns the sizes of the
+// file before and after.
+std::pair<uint64_t, uint64_t> flatten_wsl2_disk(crwstr vhdx_path, uint32_t thread_count = 0);
+// Frees the parts of a WSL2 ext4.vhdx that its filesystem no longer uses and shrinks the file. With "copy", the blocks
+// still in use are written to a new file that then replaces the old one, instead of being moved around in place.
+// Returns the sizes of the file before and after.
+std::pair<uint64_t, uint64_t> compact_wsl2_disk(crwstr vhdx_path, bool copy, uint32_t thread_count = 0);
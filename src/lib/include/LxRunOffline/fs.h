@@ -29,22 +29,37 @@ public:
 	virtual void check_path(const file_path &) const = 0;
 };
 
+class archive_pipe;
+
+// Writes to standard output if the path is "-".
 class archive_writer : public fs_writer {
+	// Closing the archive flushes the pipe, so it's destroyed after the archive.
+	std::unique_ptr<archive_pipe> pipe;
 	unique_ptr_del<archive *> pa;
 	unique_ptr_del<archive_entry *> pe;
 public:
 	explicit archive_writer(crwstr);
+	~archive_writer() override;
 	bool write_new_file(const file_attr *) override;
 	void write_file_data(const char *, uint32_t) override;
 	void write_hard_link() override;
 	void check_path(const file_path &) const override;
 };
 
+// Entries are created relative to the handle of their parent directory, so the kernel doesn't parse the whole path
+// again for each of them. The directories along the path of the last entry are kept open for this.
 class wsl_writer : public fs_writer {
+	std::vector<std::pair<wstr, unique_ptr_del<HANDLE>>> dirs;
+	// Directories created because an entry below them came first, which the source may still write later.
+	std::set<wstr> implied_dirs;
+	HANDLE open_parent(size_t &name_pos);
 protected:
 	unique_ptr_del<HANDLE> hf_data;
 	void write_data(HANDLE, const char *, uint32_t) const;
-	virtual void write_attr(HANDLE, const file_attr *) = 0;
+	virtual void write_attr(HANDLE, const file_attr *, crwstr path) = 0;
+	// Called before the handle of a directory is closed, which happens once an entry outside of it is written.
+	virtual void close_dir(HANDLE, crwstr path);
+	void close_dirs();
 	wsl_writer();
 public:
 	bool write_new_file(const file_attr *) override;
@@ -56,16 +71,16 @@ public:
 class wsl_v1_writer : public wsl_writer {
 protected:
 	wsl_v1_writer() = default;
-	void write_attr(HANDLE, const file_attr *) override;
+	void write_attr(HANDLE, const file_attr *, crwstr path) override;
 public:
 	explicit wsl_v1_writer(crwstr);
 };
 
 class wsl_v2_writer : public wsl_writer {
-	std::stack<std::pair<wstr, file_attr>> dir_attr;
-	static void real_write_attr(HANDLE, const file_attr &, crwstr);
+	std::map<wstr, file_attr> dir_attr;
 protected:
-	void write_attr(HANDLE, const file_attr *) override;
+	void write_attr(HANDLE, const file_attr *, crwstr path) override;
+	void close_dir(HANDLE, crwstr path) override;
 public:
 	explicit wsl_v2_writer(crwstr);
 	~wsl_v2_writer() override;
@@ -82,6 +97,7 @@ public:
 	virtual void run(fs_writer &writer) = 0;
 };
 
+// Reads from standard input if the path is "-". Progress is then shown as the amount of uncompressed data read.
 class archive_reader : public fs_reader {
 	const wstr archive_path, root_path;
 public:
@@ -89,13 +105,23 @@ public:
 	void run(fs_writer &) override;
 };
 
+// What the listing of a directory tells about an entry, so that readers don't have to query each file for it.
+struct dir_entry_info {
+	uint64_t size;
+	unix_time at, mt, ct;
+	// False if the entry has no extended attributes, and so none of the attributes of WSL.
+	bool has_eas;
+};
+
 class wsl_reader : public fs_reader {
 protected:
 	std::unique_ptr<file_path> path;
-	virtual std::unique_ptr<file_attr> read_attr(HANDLE) const = 0;
+	virtual std::unique_ptr<file_attr> read_attr(HANDLE, const dir_entry_info &) const = 0;
 	virtual std::unique_ptr<char[]> read_symlink_data(HANDLE) const = 0;
 	[[nodiscard]] virtual bool is_legacy() const;
 public:
+	// Progress is shown if this is set, e.g. from scan_wsl.
+	uint64_t total_bytes = 0;
 	void run(fs_writer &) override;
 	void run_checked(fs_writer &);
 };
@@ -103,7 +129,7 @@ public:
 class wsl_v1_reader : public wsl_reader {
 protected:
 	wsl_v1_reader() = default;
-	std::unique_ptr<file_attr> read_attr(HANDLE) const override;
+	std::unique_ptr<file_attr> read_attr(HANDLE, const dir_entry_info &) const override;
 	std::unique_ptr<char[]> read_symlink_data(HANDLE) const override;
 public:
 	explicit wsl_v1_reader(crwstr);
@@ -111,7 +137,7 @@ public:
 
 class wsl_v2_reader : public wsl_reader {
 protected:
-	std::unique_ptr<file_attr> read_attr(HANDLE) const override;
+	std::unique_ptr<file_attr> read_attr(HANDLE, const dir_entry_info &) const override;
 	std::unique_ptr<char[]> read_symlink_data(HANDLE) const override;
 public:
 	explicit wsl_v2_reader(crwstr);
@@ -124,10 +150,47 @@ public:
 	explicit wsl_legacy_reader(crwstr);
 };
 
+unique_ptr_del<HANDLE> open_file(crwstr path, bool is_dir, bool create, bool no_share = false);
+uint64_t get_file_size(HANDLE hf);
+// Creates all missing directories along a normalized path ending with a backslash, such as the data of a wsl_path.
+void create_recursive(crwstr path);
 uint32_t detect_version(crwstr path);
 bool detect_wsl2(crwstr path);
 std::unique_ptr<wsl_writer> select_wsl_writer(uint32_t version, crwstr path);
 std::unique_ptr<wsl_reader> select_wsl_reader(uint32_t version, crwstr path);
+std::unique_ptr<file_path> select_wsl_path(uint32_t version, crwstr path);
+// The totals found by scanning a source before copying it, so that a lack of space shows up before anything is written.
+struct scan_result {
+	uint64_t entries, bytes;
+};
+
+// Only reads the headers of an archive and skips the data of each file, or uses the index of formats that have one.
+// Standard input can't be scanned, as it can't be read again afterwards.
+scan_result scan_archive(crwstr archive_path, crwstr root_path);
+// Walks a WSL1 distro in parallel, only reading the metadata returned by directory enumeration.
+scan_result scan_wsl(uint32_t version, crwstr path, uint32_t thread_count = 0);
+// Throws err_disk_space if the volume of "path" is estimated not to have enough free space for the scanned files.
+void check_free_space(crwstr path, const scan_result &);
+// Checks several copies of the scanned files at once, where the ones on the same volume all need space on it.
+void check_free_space(const std::vector<wstr> &paths, const scan_result &);
 bool move_directory(crwstr source_path, crwstr target_path);
-void delete_directory(crwstr path);
+// Deletes a directory tree. Subdirectories are deleted in parallel, and each directory is removed as soon as its
+// contents are gone.
+void delete_directory(crwstr path, uint32_t thread_count = 0);
+// Changes the owners and groups of all files in a WSL1 distro by rewriting their extended attributes in place, without
+// opening any file data. Directories are walked in parallel. IDs missing from the maps are kept. Returns the number of
+// files changed.
+uint64_t remap_ids(
+	uint32_t version, crwstr path,
+	const std::map<uint32_t, uint32_t> &uids, const std::map<uint32_t, uint32_t> &gids, uint32_t thread_count = 0
+);
+// Upgrades a legacy or version 1 distro to filesystem version 2 in place. The new attributes are added next to the old
+// ones and every rename is recorded in a journal in the distro directory, so an interrupted upgrade can be resumed by
+// calling this again, or rolled back. "on_commit" is called once the new attributes are complete, before the old ones
+// are removed. Returns false if the distro is already version 2.
+bool upgrade_wsl_fs(
+	uint32_t version, crwstr path, uint32_t thread_count, const std::function<void()> &on_commit
+);
+// Undoes an upgrade that was interrupted before it was committed.
+void rollback_wsl_upgrade(crwstr path, uint32_t thread_count = 0);
 bool check_in_use(crwstr path);
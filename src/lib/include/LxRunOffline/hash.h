@@ -0,0 +1,25 @@
+#pragma once
+#include "pch.h"
+
+// XXH64 of the content, computed with plain scalar code. Its four 64-bit lanes are independent of each other within
+// each 32-byte stripe, so their multiplications can overlap in the pipeline.
+class content_hash {
+	uint64_t acc[4];
+	uint64_t total_len;
+	unsigned char buf[32];
+	size_t buf_len;
+public:
+	content_hash();
+	void update(const char *data, size_t size);
+	[[nodiscard]] uint64_t digest() const;
+	void reset();
+};
+
+uint64_t hash_content(const char *data, size_t size);
+
+// CRC-32C (Castagnoli) as used by the checksums of VHDX and ext4 metadata.
+uint32_t crc32c(const char *data, size_t size, uint32_t crc = 0);
+
+// CRC-16 with the reflected 0x8005 polynomial and no inversion, as used by ext4 group descriptors without
+// metadata_csum.
+uint16_t crc16(const char *data, size_t size, uint16_t crc);
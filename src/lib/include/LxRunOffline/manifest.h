@@ -0,0 +1,62 @@
+#pragma once
+#include "pch.h"
+#include "fs.h"
+#include "hash.h"
+#include "path.h"
+
+struct manifest_entry {
+	std::string path, link_target;
+	uint32_t mode, uid, gid;
+	uint64_t size;
+	unix_time mt;
+	uint64_t hash;
+};
+
+class manifest_output {
+	unique_ptr_del<FILE *> f;
+	const wstr path;
+	std::string buf;
+	void flush();
+public:
+	explicit manifest_output(wstr);
+	void write(const manifest_entry &);
+	void close();
+};
+
+class manifest_input {
+	unique_ptr_del<FILE *> f;
+	const wstr path;
+	uint64_t read_varint();
+	void read_string(std::string &);
+public:
+	explicit manifest_input(wstr);
+	bool read(manifest_entry &);
+};
+
+// Converts a path to the UTF-8 form used in manifests, which is relative to the root filesystem and has no trailing
+// slash. Returns false for the root directory itself and for files outside it. "buf" is used as scratch space.
+bool get_manifest_path(const file_path &p, linux_path &buf, std::string &res);
+uint64_t hash_file(crwstr path, uint64_t size_hint);
+
+// Forwards everything to another writer and records what has been written in a manifest.
+// Contents of regular files are hashed while they are streamed to the inner writer.
+class manifest_writer : public fs_writer {
+	fs_writer &inner;
+	manifest_output output;
+	linux_path lp;
+	manifest_entry entry;
+	content_hash hash;
+	bool pending;
+public:
+	manifest_writer(fs_writer &, crwstr);
+	bool write_new_file(const file_attr *) override;
+	void write_file_data(const char *, uint32_t) override;
+	void write_hard_link() override;
+	void check_path(const file_path &) const override;
+	void close();
+};
+
+uint64_t verify_manifest(
+	uint32_t version, crwstr dir, crwstr manifest_path, uint32_t thread_count,
+	const std::function<void(crwstr, crwstr)> &report
+);
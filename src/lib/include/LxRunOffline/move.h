@@ -0,0 +1,43 @@
+#pragma once
+#include "pch.h"
+#include "fs.h"
+
+// Forwards everything to the writer of a move across volumes and deletes each source file as soon as its copy has been
+// flushed to disk, so that the move needs little more free space than "window" instead of a second copy of the distro.
+// Copied files are flushed and deleted in batches on a worker thread while the next files are being copied. Copying
+// waits while more than "window" bytes have been copied but not yet deleted, except for the file being copied.
+// Files with several names are deleted after everything has been copied. Directories are left in place and have to be
+// removed afterwards, which is cheap once they are empty.
+class move_writer : public fs_writer {
+	struct entry {
+		wstr source, target;
+		uint64_t size;
+		bool flush;
+	};
+	fs_writer &inner;
+	const wstr source_base;
+	const uint64_t window;
+	std::mutex mutex;
+	std::condition_variable cv_batch, cv_done;
+	std::deque<std::vector<entry>> batches;
+	std::vector<entry> batch;
+	std::vector<wstr> deferred;
+	uint64_t batch_size = 0, outstanding = 0;
+	entry last;
+	bool has_last = false, finishing = false;
+	std::exception_ptr error;
+	std::thread worker;
+	static void delete_source(crwstr path);
+	void end_entry();
+	void submit();
+	void run();
+public:
+	move_writer(fs_writer &, const file_path &source, uint64_t window = 1 << 30);
+	~move_writer() override;
+	bool write_new_file(const file_attr *) override;
+	void write_file_data(const char *, uint32_t) override;
+	void write_hard_link() override;
+	void check_path(const file_path &) const override;
+	// Waits until every copied file has been deleted from the source and rethrows the error the worker failed with.
+	void close();
+};
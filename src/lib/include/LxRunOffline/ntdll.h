@@ -6,6 +6,7 @@
 #define IO_REPARSE_TAG_LX_FIFO (0x80000024L)
 #define IO_REPARSE_TAG_LX_CHR (0x80000025L)
 #define IO_REPARSE_TAG_LX_BLK (0x80000026L)
+#define FileLinkInformation (FILE_INFORMATION_CLASS)11
 #define FileCaseSensitiveInformation (FILE_INFORMATION_CLASS)71
 
 struct FILE_CASE_SENSITIVE_INFORMATION {
@@ -26,6 +27,13 @@ struct FILE_FULL_EA_INFORMATION {
 	USHORT EaValueLength;
 	CHAR EaName[1];
 };
+
+struct FILE_LINK_INFORMATION {
+	BOOLEAN ReplaceIfExists;
+	HANDLE RootDirectory;
+	ULONG FileNameLength;
+	WCHAR FileName[1];
+};
 #endif
 
 struct REPARSE_DATA_BUFFER {
@@ -0,0 +1,27 @@
+#pragma once
+#include "pch.h"
+
+// A fixed set of worker threads consuming a FIFO of tasks.
+// If max_queued is non-zero, submit() blocks while that many tasks are waiting, which bounds the memory held by
+// queued work. Tasks that submit other tasks must use an unbounded pool, otherwise the workers may deadlock.
+// The first exception thrown by a task is rethrown by wait(), and the tasks that haven't been started are dropped.
+class task_pool {
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mtx;
+	std::condition_variable cv_task, cv_space, cv_idle;
+	const size_t max_queued;
+	size_t running;
+	bool stopping;
+	std::exception_ptr error;
+	void worker();
+public:
+	explicit task_pool(uint32_t thread_count = 0, size_t max_queued = 0);
+	task_pool(const task_pool &) = delete;
+	task_pool &operator=(const task_pool &) = delete;
+	~task_pool();
+	void submit(std::function<void()> task);
+	void wait();
+	[[nodiscard]] uint32_t size() const;
+	static uint32_t default_thread_count();
+};
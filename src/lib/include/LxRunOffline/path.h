@@ -32,12 +32,22 @@ public:
 	[[nodiscard]] virtual std::unique_ptr<file_path> clone() const = 0;
 };
 
+// Also keeps the UTF-8 form used by tar files and ext4, so that readers and writers using UTF-8 can pass paths along
+// without converting them back and forth. The UTF-8 form is tied to the contents of "data" rather than to how it has
+// been changed, so code only knowing about "data" can still modify it freely.
 class linux_path : public file_path {
 	bool skip;
 	prefix_matcher matcher;
+	std::string utf8;
+	wstr utf8_for;
 public:
 	linux_path();
 	linux_path(crwstr, crwstr);
+	linux_path(const std::string &, const std::string &);
+	// Same as the constructor taking UTF-8, but reuses the buffers of this object.
+	void assign_utf8(const char *path, size_t len, const std::string &root_path);
+	// Returns the UTF-8 form of "data", which is only converted again if "data" has changed since.
+	const std::string &get_utf8();
 	bool append(wchar_t) override;
 	bool convert(file_path &) const override;
 	void reset() override;
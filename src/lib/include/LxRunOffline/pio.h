@@ -0,0 +1,44 @@
+#pragma once
+#include "pch.h"
+
+// Random access to a file or a virtual disk. Reads and writes never move a shared file pointer, so they may be issued
+// from several threads at the same time. Reading past the end is an error.
+class pio_file {
+public:
+	virtual ~pio_file() = default;
+	[[nodiscard]] virtual crwstr name() const = 0;
+	[[nodiscard]] virtual uint64_t size() const = 0;
+	virtual void resize(uint64_t size) = 0;
+	virtual void read(uint64_t offset, char *buf, size_t size) = 0;
+	virtual void write(uint64_t offset, const char *buf, size_t size) = 0;
+	virtual void flush() = 0;
+};
+
+class win_pio_file : public pio_file {
+	const wstr path;
+	unique_ptr_del<HANDLE> hf;
+	void transfer(uint64_t offset, char *buf, size_t size, bool is_write);
+public:
+	win_pio_file(wstr path, bool writable, bool create);
+	[[nodiscard]] crwstr name() const override;
+	[[nodiscard]] uint64_t size() const override;
+	void resize(uint64_t size) override;
+	void read(uint64_t offset, char *buf, size_t size) override;
+	void write(uint64_t offset, const char *buf, size_t size) override;
+	void flush() override;
+};
+
+class memory_pio_file : public pio_file {
+	const wstr file_name;
+	std::vector<char> data;
+	mutable std::mutex mtx;
+public:
+	explicit memory_pio_file(wstr name = L"<memory>", std::vector<char> data = {});
+	[[nodiscard]] crwstr name() const override;
+	[[nodiscard]] uint64_t size() const override;
+	void resize(uint64_t size) override;
+	void read(uint64_t offset, char *buf, size_t size) override;
+	void write(uint64_t offset, const char *buf, size_t size) override;
+	void flush() override;
+	[[nodiscard]] const std::vector<char> &contents() const;
+};
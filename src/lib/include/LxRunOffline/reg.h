@@ -1,6 +1,52 @@
 #pragma once
 #include "pch.h"
 
+typedef std::variant<uint32_t, wstr, std::vector<wstr>> reg_value;
+
+// Storage of the Lxss key and its subkeys. Paths are relative to HKEY_CURRENT_USER. Errors are reported the way the
+// registry reports them, e.g. a missing value throws err_get_key_value with ERROR_FILE_NOT_FOUND.
+class reg_backend {
+public:
+	virtual ~reg_backend() = default;
+	// Names of the direct subkeys. The key is created if it doesn't exist.
+	virtual std::vector<wstr> list_keys(crwstr path) = 0;
+	// All values of a key. Values of types other than reg_value holds are left out.
+	virtual std::map<wstr, reg_value> get_values(crwstr path) = 0;
+	virtual reg_value get_value(crwstr path, crwstr value_name) = 0;
+	virtual void set_value(crwstr path, crwstr value_name, const reg_value &value) = 0;
+	virtual void create_key(crwstr path) = 0;
+	// Deletes a key with all its subkeys.
+	virtual void delete_key(crwstr path) = 0;
+	virtual void delete_value(crwstr path, crwstr value_name) = 0;
+};
+
+// Keeps keys in memory, so that tests don't need the registry. Key paths are compared exactly.
+class memory_reg_backend : public reg_backend {
+	std::map<wstr, std::map<wstr, reg_value>> keys;
+public:
+	std::vector<wstr> list_keys(crwstr path) override;
+	std::map<wstr, reg_value> get_values(crwstr path) override;
+	reg_value get_value(crwstr path, crwstr value_name) override;
+	void set_value(crwstr path, crwstr value_name, const reg_value &value) override;
+	void create_key(crwstr path) override;
+	void delete_key(crwstr path) override;
+	void delete_value(crwstr path, crwstr value_name) override;
+};
+
+// Makes the functions below use another backend. nullptr switches back to the registry.
+void set_reg_backend(reg_backend *backend);
+
+// While one of these exists, the distros under Lxss are read once into an index, and lookups by name or ID are
+// answered from memory. Anything written through the functions below drops the index, so it's read again on the next
+// lookup. Changes made by other processes in the meantime aren't seen, so this is meant for a single command.
+class reg_cache {
+public:
+	reg_cache();
+	reg_cache(const reg_cache &) = delete;
+	reg_cache &operator=(const reg_cache &) = delete;
+	~reg_cache();
+};
+
 std::vector<wstr> list_distros();
 wstr get_default_distro();
 void set_default_distro(crwstr name);
@@ -9,6 +55,14 @@ void unregister_distro(crwstr name);
 wstr get_distro_dir(crwstr name);
 void set_distro_dir(crwstr name, crwstr value);
 uint32_t get_distro_version(crwstr name);
+void set_distro_version(crwstr name, uint32_t version);
+// The distro that a distro with a differencing virtual disk is based on, which is recorded by its ID so that the link
+// survives moving or renaming it. Returns an empty string if there is none, or if the parent is no longer registered.
+wstr get_distro_parent(crwstr name);
+// An empty parent removes the link.
+void set_distro_parent(crwstr name, crwstr parent);
+// The distros whose recorded parent is the given one.
+std::vector<wstr> list_distro_children(crwstr name);
 
 enum config_item_flags {
 	config_env = 1,
@@ -34,4 +88,5 @@ public:
 	[[nodiscard]] uint32_t get_flags() const;
 	void set_flags(uint32_t value);
 	[[nodiscard]] bool is_wsl2() const;
+	void set_wsl2(bool value);
 };
@@ -0,0 +1,49 @@
+#pragma once
+#include "pch.h"
+#include "fs.h"
+
+enum class transform_type {
+	drop,
+	move,
+	mode,
+	owner,
+	content
+};
+
+// A rule applied to the entries passing through a transform_writer. Patterns are Linux paths that match the entry
+// itself and everything below it, and "*" in them matches any part of a single file name.
+struct transform_rule {
+	transform_type type;
+	// Stored like the data of a linux_path, without the leading and trailing slashes.
+	wstr pattern, target;
+	uint32_t mode, uid, gid;
+	std::string content;
+};
+
+// Parses one of:
+//   drop <pattern>              Leaves out the matching entries.
+//   move <path> <path>          Moves a file or directory, with everything in it, to another path.
+//   mode <pattern> <octal>      Sets the permission bits, keeping the file type.
+//   owner <pattern> <uid>:<gid> Sets the owner and group.
+//   content <pattern> <file>    Replaces the contents of matching regular files with those of a local file.
+//   text <pattern> <text>       Same as "content", but with the rest of the line followed by a line feed.
+transform_rule parse_transform_rule(crwstr rule);
+// Reads a rule from each line of a UTF-8 file. Empty lines and lines starting with "#" are ignored.
+std::vector<transform_rule> read_transform_rules(crwstr path);
+
+// Changes entries on their way from a reader to another writer according to a list of rules, which apply in order and
+// see the path as moved by earlier ones. Entries no rule matches are passed on as they are.
+class transform_writer : public fs_writer {
+	fs_writer &inner;
+	const std::vector<transform_rule> &rules;
+	linux_path out_path, out_target;
+	file_attr out_attr;
+	const std::string *content;
+	[[nodiscard]] bool apply_path(const transform_rule &, const wstr *&, linux_path &) const;
+public:
+	transform_writer(fs_writer &inner, const std::vector<transform_rule> &rules);
+	bool write_new_file(const file_attr *) override;
+	void write_file_data(const char *, uint32_t) override;
+	void write_hard_link() override;
+	void check_path(const file_path &) const override;
+};
@@ -5,9 +5,40 @@ uint32_t get_win_build();
 void log_warning(crwstr msg);
 void log_error(crwstr msg);
 void print_progress(double progress);
+// Shows how much has been processed instead, for input of unknown size.
+void print_progress_bytes(uint64_t bytes);
+
+enum class skip_reason {
+	unsupported_type,
+	no_attr,
+	ignored_target,
+	invalid_symlink
+};
+
+// Warns that a file has been skipped. While a warning_log exists, this only adds an entry to a lock-free queue, which
+// is written to the log file in the background. Otherwise the warning is printed right away.
+void log_skipped(skip_reason reason, crwstr path, uint32_t type = 0);
+// Writes all warnings to a UTF-8 file as well, while a warning_log exists.
+void set_log_file(crwstr path);
+
+// Collects the warnings of log_skipped while it exists, and prints the first "examples" of each kind followed by how
+// many more there have been when it's destroyed. Nothing may call log_skipped at that point anymore.
+class warning_log {
+public:
+	explicit warning_log(size_t examples = 5);
+	warning_log(const warning_log &) = delete;
+	warning_log &operator=(const warning_log &) = delete;
+	~warning_log();
+};
+
 wstr from_utf8(const char *s);
 std::unique_ptr<char[]> to_utf8(wstr s);
+// Convert into a buffer kept by the caller, so that converting a path for each file doesn't allocate every time. Runs
+// of ASCII are converted 16 bytes at a time. Invalid input throws err_convert_encoding, as with the functions above.
+void from_utf8(const char *s, size_t len, wstr &out);
+void to_utf8(const wchar_t *s, size_t len, std::string &out);
 wstr get_full_path(crwstr path);
+void fclose_safe(FILE *f);
 
 // Flexible array member (FAM) is widely used in Windows SDK headers. However, it is not part of the C++ standard but
 // supported as a Microsoft-specific compiler extension by Visual C++. As a result, it is impossible to use C++ language
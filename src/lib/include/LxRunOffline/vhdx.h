@@ -0,0 +1,81 @@
+#pragma once
+#include "pch.h"
+#include "pio.h"
+
+// The virtual disk stored in a dynamic or differencing VHDX file, as used by WSL2 for ext4.vhdx.
+// The whole BAT is kept in memory, so looking up a block never touches the file. Reads and writes may be issued from
+// several threads at the same time: blocks that aren't present read as zeros without any I/O, and writing to them
+// allocates a new payload block at the end of the file.
+// Blocks missing from a differencing disk are read from its parent. Writing to them copies the whole block from the
+// parent first, so blocks written by this class are always fully present and no sector bitmaps are written.
+// Metadata updates aren't journaled through the VHDX log, and files with a non-empty log are rejected.
+class vhdx_file : public pio_file {
+	pio_file &file;
+	uint64_t disk_size, bat_offset, file_end, metadata_end;
+	uint32_t block_size, sector_size, chunk_ratio;
+	uint64_t block_count, entry_count;
+	std::unique_ptr<std::atomic<uint64_t>[]> bat;
+	uint32_t header_slot;
+	uint64_t header_seq;
+	char header[4096];
+	std::mutex alloc_mtx;
+	std::atomic<bool> header_updated;
+	bool has_parent;
+	std::map<wstr, wstr> parent_locator;
+	std::unique_ptr<pio_file> parent_file;
+	std::unique_ptr<vhdx_file> own_parent;
+	vhdx_file *parent;
+
+	void load_headers();
+	void load_regions();
+	void load_metadata(uint64_t offset, uint32_t length);
+	void open_parent(vhdx_file *given);
+	void update_header();
+	[[nodiscard]] uint64_t bat_index(uint64_t block) const;
+	uint64_t allocate_block(uint64_t block);
+	void write_bat();
+	void read_partial(uint64_t block, uint64_t entry, uint32_t in, char *buf, size_t size);
+	static void create(
+		pio_file &file, uint64_t disk_size, uint32_t block_size, uint32_t sector_size, const vhdx_file *parent
+	);
+	[[noreturn]] void fail(crwstr reason) const;
+public:
+	static const uint32_t default_block_size = 1 << 25;
+
+	// The parent of a differencing disk is opened from the paths stored in it, unless it's given.
+	explicit vhdx_file(pio_file &file, vhdx_file *parent = nullptr);
+	vhdx_file(const vhdx_file &) = delete;
+	vhdx_file &operator=(const vhdx_file &) = delete;
+	// Writes the structures of an empty dynamic VHDX to "file", which should be empty.
+	static void create(
+		pio_file &file, uint64_t disk_size, uint32_t block_size = default_block_size, uint32_t sector_size = 512
+	);
+	// Writes an empty differencing VHDX to "file" whose contents are initially those of "parent". Any later change to
+	// the parent invalidates it.
+	static void create_differencing(pio_file &file, const vhdx_file &parent);
+
+	[[nodiscard]] crwstr name() const override;
+	[[nodiscard]] uint64_t size() const override;
+	// The size of a virtual disk is fixed when it's created.
+	void resize(uint64_t size) override;
+	void read(uint64_t offset, char *buf, size_t size) override;
+	void write(uint64_t offset, const char *buf, size_t size) override;
+	void flush() override;
+
+	[[nodiscard]] uint32_t get_block_size() const;
+	[[nodiscard]] uint32_t get_sector_size() const;
+	[[nodiscard]] uint64_t get_block_count() const;
+	// Whether the payload block has data stored in the file or in the parents of a differencing disk. Blocks that aren't
+	// present read as zeros.
+	[[nodiscard]] bool is_block_present(uint64_t block) const;
+	[[nodiscard]] bool is_differencing() const;
+	// Drops the present blocks for which "unused" returns true, moves the blocks at the end of the file into the space
+	// they took up and shrinks the file. Returns the number of blocks dropped.
+	// Blocks are copied before the BAT points to them, so an interrupted run leaves a valid file. No other I/O may be
+	// issued at the same time. Differencing disks aren't supported.
+	uint64_t compact(const std::function<bool(uint64_t)> &unused, uint32_t thread_count = 0);
+	// Writes a new dynamic VHDX of the same geometry to "target" and copies the present blocks into it, up to
+	// "thread_count" at a time. Blocks for which "unused" returns true, and blocks of zeros, are left out. A copy of a
+	// differencing disk includes the data of its parents.
+	void copy_to(pio_file &target, const std::function<bool(uint64_t)> &unused = nullptr, uint32_t thread_count = 0);
+};
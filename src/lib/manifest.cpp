@@ -0,0 +1,333 @@
+#include "pch.h"
+#include "error.h"
+#include "manifest.h"
+#include "parallel.h"
+#include "utils.h"
+
+enum class entry_kind : uint8_t {
+	file,
+	hard_link
+};
+
+struct verify_item {
+	manifest_entry entry;
+	bool seen;
+};
+
+typedef std::unordered_map<std::string, verify_item> verify_index;
+
+static const char manifest_magic[8] = { 'L', 'X', 'R', 'O', 'M', 'F', 0, 1 };
+static const size_t output_buf_size = 1 << 16, max_string_len = 1 << 16;
+static const uint32_t hash_block_size = 1 << 20;
+
+static void put_varint(std::string &buf, uint64_t v) {
+	while (v >= 0x80) {
+		buf += static_cast<char>(v | 0x80);
+		v >>= 7;
+	}
+	buf += static_cast<char>(v);
+}
+
+static void put_string(std::string &buf, const std::string &s) {
+	put_varint(buf, s.size());
+	buf += s;
+}
+
+manifest_output::manifest_output(wstr path)
+	: f(_wfopen(path.c_str(), L"wb"), &fclose_safe), path(std::move(path)) {
+	if (!f.get()) throw lro_error::from_win32_last(err_msg::err_create_file, { this->path });
+	buf.assign(manifest_magic, sizeof manifest_magic);
+}
+
+void manifest_output::flush() {
+	if (buf.empty()) return;
+	if (fwrite(buf.data(), 1, buf.size(), f.get()) != buf.size()) {
+		throw lro_error::from_other(err_msg::err_write_file, { path });
+	}
+	buf.clear();
+}
+
+void manifest_output::write(const manifest_entry &e) {
+	put_string(buf, e.path);
+	if (e.link_target.empty()) {
+		buf += static_cast<char>(entry_kind::file);
+		put_varint(buf, e.mode);
+		put_varint(buf, e.uid);
+		put_varint(buf, e.gid);
+		put_varint(buf, e.size);
+		put_varint(buf, e.mt.sec);
+		put_varint(buf, e.mt.nsec);
+		buf.append(reinterpret_cast<const char *>(&e.hash), sizeof e.hash);
+	} else {
+		buf += static_cast<char>(entry_kind::hard_link);
+		put_string(buf, e.link_target);
+	}
+	if (buf.size() >= output_buf_size) flush();
+}
+
+void manifest_output::close() {
+	flush();
+	if (fclose(f.release())) throw lro_error::from_other(err_msg::err_write_file, { path });
+}
+
+manifest_input::manifest_input(wstr path)
+	: f(_wfopen(path.c_str(), L"rb"), &fclose_safe), path(std::move(path)) {
+	if (!f.get()) throw lro_error::from_win32_last(err_msg::err_open_file, { this->path });
+	char magic[sizeof manifest_magic];
+	if (fread(magic, 1, sizeof magic, f.get()) != sizeof magic || memcmp(magic, manifest_magic, sizeof magic)) {
+		throw lro_error::from_other(err_msg::err_manifest, { this->path });
+	}
+}
+
+uint64_t manifest_input::read_varint() {
+	uint64_t v = 0;
+	for (auto shift = 0; shift < 64; shift += 7) {
+		const auto c = getc(f.get());
+		if (c == EOF) break;
+		v |= static_cast<uint64_t>(c & 0x7f) << shift;
+		if (!(c & 0x80)) return v;
+	}
+	throw lro_error::from_other(err_msg::err_manifest, { path });
+}
+
+void manifest_input::read_string(std::string &s) {
+	const auto len = read_varint();
+	if (len > max_string_len) throw lro_error::from_other(err_msg::err_manifest, { path });
+	s.resize(static_cast<size_t>(len));
+	if (len && fread(&s[0], 1, s.size(), f.get()) != s.size()) {
+		throw lro_error::from_other(err_msg::err_manifest, { path });
+	}
+}
+
+bool manifest_input::read(manifest_entry &e) {
+	const auto c = getc(f.get());
+	if (c == EOF) {
+		if (ferror(f.get())) throw lro_error::from_other(err_msg::err_read_file, { path });
+		return false;
+	}
+	ungetc(c, f.get());
+	read_string(e.path);
+	const auto kind = getc(f.get());
+	if (kind == static_cast<int>(entry_kind::file)) {
+		e.link_target.clear();
+		e.mode = static_cast<uint32_t>(read_varint());
+		e.uid = static_cast<uint32_t>(read_varint());
+		e.gid = static_cast<uint32_t>(read_varint());
+		e.size = read_varint();
+		e.mt.sec = read_varint();
+		e.mt.nsec = static_cast<uint32_t>(read_varint());
+		if (fread(&e.hash, sizeof e.hash, 1, f.get()) != 1) {
+			throw lro_error::from_other(err_msg::err_manifest, { path });
+		}
+	} else if (kind == static_cast<int>(entry_kind::hard_link)) {
+		read_string(e.link_target);
+		if (e.link_target.empty()) throw lro_error::from_other(err_msg::err_manifest, { path });
+		e.mode = e.uid = e.gid = 0;
+		e.size = 0;
+		e.mt = {};
+		e.hash = 0;
+	} else {
+		throw lro_error::from_other(err_msg::err_manifest, { path });
+	}
+	return true;
+}
+
+bool get_manifest_path(const file_path &p, linux_path &buf, std::string &res) {
+	if (!p.convert(buf)) return false;
+	res = buf.get_utf8();
+	if (!res.empty() && res.back() == '/') res.pop_back();
+	return !res.empty();
+}
+
+uint64_t hash_file(crwstr path, const uint64_t size_hint) {
+	const auto hf = open_file(path, false, false);
+	const auto bs = static_cast<uint32_t>(std::max<uint64_t>(std::min<uint64_t>(size_hint, hash_block_size), 1));
+	const auto buf = std::make_unique<char[]>(bs);
+	content_hash h;
+	DWORD rc;
+	do {
+		if (!ReadFile(hf.get(), buf.get(), bs, &rc, nullptr)) {
+			throw lro_error::from_win32_last(err_msg::err_read_file, { path });
+		}
+		h.update(buf.get(), rc);
+	} while (rc);
+	return h.digest();
+}
+
+manifest_writer::manifest_writer(fs_writer &inner, crwstr manifest_path)
+	: inner(inner), output(manifest_path), entry(), pending(false) {
+	path = inner.path->clone();
+	target_path = inner.target_path->clone();
+}
+
+bool manifest_writer::write_new_file(const file_attr *attr) {
+	inner.path->data = path->data;
+	if (!inner.write_new_file(attr)) return false;
+	if (!attr || !get_manifest_path(*path, lp, entry.path)) return true;
+	const auto type = attr->mode & AE_IFMT;
+	entry.link_target.clear();
+	entry.mode = attr->mode;
+	entry.uid = attr->uid;
+	entry.gid = attr->gid;
+	entry.size = type == AE_IFREG ? attr->size : 0;
+	entry.mt = attr->mt;
+	if (type == AE_IFREG) {
+		hash.reset();
+		pending = true;
+	} else {
+		entry.hash = type == AE_IFLNK ? hash_content(attr->symlink, strlen(attr->symlink)) : 0;
+		output.write(entry);
+	}
+	return true;
+}
+
+void manifest_writer::write_file_data(const char *buf, const uint32_t size) {
+	inner.write_file_data(buf, size);
+	if (!pending) return;
+	if (size) {
+		hash.update(buf, size);
+	} else {
+		entry.hash = hash.digest();
+		output.write(entry);
+		pending = false;
+	}
+}
+
+void manifest_writer::write_hard_link() {
+	inner.path->data = path->data;
+	inner.target_path->data = target_path->data;
+	inner.write_hard_link();
+	if (get_manifest_path(*path, lp, entry.path) && get_manifest_path(*target_path, lp, entry.link_target)) {
+		output.write(entry);
+	}
+}
+
+void manifest_writer::check_path(const file_path &source_path) const {
+	inner.check_path(source_path);
+}
+
+void manifest_writer::close() {
+	output.close();
+}
+
+static const verify_item *resolve_item(const verify_index &index, const std::string &key) {
+	auto it = index.find(key);
+	// Hard links recorded by manifest_writer always point to a regular file, so one hop is enough unless the
+	// manifest is corrupted. The limit only guards against cycles.
+	for (auto i = 0; it != index.end() && !it->second.entry.link_target.empty(); i++) {
+		if (i == 16) return nullptr;
+		it = index.find(it->second.entry.link_target);
+	}
+	return it == index.end() ? nullptr : &it->second;
+}
+
+class verify_writer : public fs_writer {
+	verify_index &index;
+	task_pool &pool;
+	const std::function<void(crwstr, crwstr)> &report;
+	linux_path lp;
+	std::string key, target_key;
+public:
+	verify_writer(uint32_t, crwstr, verify_index &, task_pool &, const std::function<void(crwstr, crwstr)> &);
+	bool write_new_file(const file_attr *) override;
+	void write_file_data(const char *, uint32_t) override;
+	void write_hard_link() override;
+	void check_path(const file_path &) const override;
+};
+
+verify_writer::verify_writer(
+	const uint32_t version, crwstr dir, verify_index &index, task_pool &pool,
+	const std::function<void(crwstr, crwstr)> &report
+) : index(index), pool(pool), report(report) {
+	path = select_wsl_path(version, dir);
+	target_path = select_wsl_path(version, dir);
+}
+
+bool verify_writer::write_new_file(const file_attr *attr) {
+	if (!attr || !get_manifest_path(*path, lp, key)) return false;
+	const auto it = index.find(key);
+	if (it == index.end()) {
+		report(L"extra", lp.data);
+		return false;
+	}
+	it->second.seen = true;
+	const auto item = resolve_item(index, key);
+	if (!item) {
+		report(L"link", lp.data);
+		return false;
+	}
+	const auto &e = item->entry;
+	const auto type = attr->mode & AE_IFMT;
+	if (type != (e.mode & AE_IFMT)) {
+		report(L"type", lp.data);
+		return false;
+	}
+	if (attr->mode != e.mode) report(L"mode", lp.data);
+	if (attr->uid != e.uid || attr->gid != e.gid) report(L"owner", lp.data);
+	// Timestamps of WSL filesystem version 2 are stored as NTFS timestamps, which have a resolution of 100ns.
+	if (attr->mt.sec != e.mt.sec || attr->mt.nsec / 100 != e.mt.nsec / 100) report(L"mtime", lp.data);
+	if (type == AE_IFLNK) {
+		if (hash_content(attr->symlink, strlen(attr->symlink)) != e.hash) report(L"symlink", lp.data);
+	} else if (type == AE_IFREG) {
+		if (attr->size != e.size) {
+			report(L"size", lp.data);
+		} else {
+			pool.submit([&rep = report, file = path->data, display = lp.data, size = e.size, expected = e.hash] {
+				if (hash_file(file, size) != expected) rep(L"content", display);
+			});
+		}
+	}
+	return false;
+}
+
+void verify_writer::write_file_data(const char *, uint32_t) {}
+
+void verify_writer::write_hard_link() {
+	if (!get_manifest_path(*target_path, lp, target_key) || !get_manifest_path(*path, lp, key)) return;
+	const auto it = index.find(key);
+	if (it == index.end()) {
+		report(L"extra", lp.data);
+		return;
+	}
+	it->second.seen = true;
+	const auto item = resolve_item(index, key);
+	if (!item || item != resolve_item(index, target_key)) report(L"link", lp.data);
+}
+
+void verify_writer::check_path(const file_path &) const {}
+
+uint64_t verify_manifest(
+	const uint32_t version, crwstr dir, crwstr manifest_path, const uint32_t thread_count,
+	const std::function<void(crwstr, crwstr)> &report
+) {
+	verify_index index;
+	manifest_input input(manifest_path);
+	manifest_entry e;
+	while (input.read(e)) {
+		index[e.path] = verify_item { e, false };
+	}
+
+	std::mutex mtx;
+	uint64_t cnt = 0;
+	const std::function<void(crwstr, crwstr)> locked_report = [&](crwstr kind, crwstr path) {
+		std::lock_guard<std::mutex> lock(mtx);
+		cnt++;
+		report(kind, path);
+	};
+	// Only a few files are queued per worker, so at most one hashing buffer per thread is in use at any time.
+	const auto tc = thread_count ? thread_count : task_pool::default_thread_count();
+	task_pool pool(tc, static_cast<size_t>(tc) * 4);
+	verify_writer writer(version, dir, index, pool, locked_report);
+	select_wsl_reader(version, dir)->run(writer);
+	pool.wait();
+
+	std::vector<std::string> missing;
+	for (const auto &p : index) {
+		if (!p.second.seen) missing.push_back(p.first);
+	}
+	std::sort(missing.begin(), missing.end());
+	for (const auto &s : missing) {
+		locked_report(L"missing", from_utf8(s.c_str()));
+	}
+	return cnt;
+}
@@ -0,0 +1,155 @@
+#include "pch.h"
+#include "error.h"
+#include "move.h"
+
+// Batches are also handed to the worker after this many entries, so that deleting small files overlaps with copying.
+static constexpr size_t max_batch_entries = 4096;
+
+// Files are opened with full sharing, so that the reader and the writer can still open them at the same time.
+static unique_ptr_del<HANDLE> open_shared(crwstr path, const DWORD access) {
+	const auto h = CreateFile(
+		path.c_str(),
+		access, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+		OPEN_EXISTING, FILE_FLAG_OPEN_REPARSE_POINT, nullptr
+	);
+	if (h == INVALID_HANDLE_VALUE) throw lro_error::from_win32_last(err_msg::err_open_file, { path });
+	return unique_ptr_del<HANDLE>(h, &CloseHandle);
+}
+
+static uint32_t count_links(crwstr path) {
+	const auto hf = open_shared(path, FILE_READ_ATTRIBUTES);
+	BY_HANDLE_FILE_INFORMATION info;
+	if (!GetFileInformationByHandle(hf.get(), &info)) {
+		throw lro_error::from_win32_last(err_msg::err_file_info, { path });
+	}
+	return info.nNumberOfLinks;
+}
+
+move_writer::move_writer(fs_writer &inner, const file_path &source, const uint64_t window)
+	: inner(inner), source_base(source.data.substr(0, source.base_len)), window(window), last() {
+	path = inner.path->clone();
+	target_path = inner.target_path->clone();
+	worker = std::thread(&move_writer::run, this);
+}
+
+// Batches that have been handed to the worker are still deleted, as their copies are complete.
+move_writer::~move_writer() {
+	if (!worker.joinable()) return;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		finishing = true;
+	}
+	cv_batch.notify_all();
+	worker.join();
+}
+
+void move_writer::delete_source(crwstr path) {
+	if (!DeleteFile(path.c_str())) throw lro_error::from_win32_last(err_msg::err_delete_file, { path });
+}
+
+// Must be called with the mutex held.
+void move_writer::submit() {
+	if (batch.empty()) return;
+	outstanding += batch_size;
+	batches.push_back(std::move(batch));
+	batch.clear();
+	batch_size = 0;
+	cv_batch.notify_one();
+}
+
+// The reader has moved on to the next entry when this is called, so it no longer has the last source file open.
+void move_writer::end_entry() {
+	if (has_last) {
+		batch_size += last.size;
+		batch.push_back(std::move(last));
+		has_last = false;
+	}
+	std::unique_lock<std::mutex> lock(mutex);
+	if (batch_size >= window / 4 || batch.size() >= max_batch_entries) submit();
+	cv_done.wait(lock, [&] { return error || outstanding <= window - window / 4; });
+	if (error) std::rethrow_exception(error);
+}
+
+void move_writer::run() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		cv_batch.wait(lock, [&] { return finishing || !batches.empty(); });
+		if (batches.empty()) break;
+		const auto b = std::move(batches.front());
+		batches.pop_front();
+		lock.unlock();
+		uint64_t size = 0;
+		try {
+			for (const auto &e : b) {
+				if (e.flush && !FlushFileBuffers(open_shared(e.target, GENERIC_WRITE).get())) {
+					throw lro_error::from_win32_last(err_msg::err_write_file, { e.target });
+				}
+			}
+			for (const auto &e : b) {
+				size += e.size;
+				// The reader only recognizes the other names of a file as hard links while it has more than one
+				// name left, so these are deleted at the end.
+				if (count_links(e.source) > 1) deferred.push_back(e.source);
+				else delete_source(e.source);
+			}
+		} catch (...) {
+			lock.lock();
+			error = std::current_exception();
+			batches.clear();
+			lock.unlock();
+			cv_done.notify_all();
+			return;
+		}
+		lock.lock();
+		outstanding -= size;
+		cv_done.notify_all();
+	}
+	lock.unlock();
+	try {
+		for (const auto &p : deferred) delete_source(p);
+	} catch (...) {
+		lock.lock();
+		if (!error) error = std::current_exception();
+	}
+}
+
+bool move_writer::write_new_file(const file_attr *attr) {
+	end_entry();
+	inner.path->data = path->data;
+	if (!inner.write_new_file(attr)) return false;
+	if (attr && (attr->mode & AE_IFMT) == AE_IFDIR) return true;
+	last = { source_base + path->data.substr(path->base_len), path->data, 0, true };
+	has_last = true;
+	return true;
+}
+
+void move_writer::write_file_data(const char *buf, const uint32_t size) {
+	inner.write_file_data(buf, size);
+	if (has_last) last.size += size;
+}
+
+void move_writer::write_hard_link() {
+	end_entry();
+	inner.path->data = path->data;
+	inner.target_path->data = target_path->data;
+	inner.write_hard_link();
+	// The data is already on disk under the name the link points to.
+	last = { source_base + path->data.substr(path->base_len), path->data, 0, false };
+	has_last = true;
+}
+
+void move_writer::check_path(const file_path &source_path) const {
+	inner.check_path(source_path);
+}
+
+void move_writer::close() {
+	end_entry();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		submit();
+		finishing = true;
+	}
+	cv_batch.notify_all();
+	worker.join();
+	if (error) std::rethrow_exception(error);
+}
@@ -0,0 +1,79 @@
+#include "pch.h"
+#include "parallel.h"
+
+task_pool::task_pool(const uint32_t thread_count, const size_t max_queued)
+	: max_queued(max_queued), running(0), stopping(false) {
+	const auto n = thread_count ? thread_count : default_thread_count();
+	threads.reserve(n);
+	for (uint32_t i = 0; i < n; i++) {
+		threads.emplace_back(&task_pool::worker, this);
+	}
+}
+
+task_pool::~task_pool() {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stopping = true;
+		tasks.clear();
+	}
+	cv_task.notify_all();
+	cv_space.notify_all();
+	for (auto &t : threads) t.join();
+}
+
+void task_pool::worker() {
+	std::unique_lock<std::mutex> lock(mtx);
+	while (true) {
+		cv_task.wait(lock, [&] { return stopping || !tasks.empty(); });
+		if (tasks.empty()) return;
+		auto task = std::move(tasks.front());
+		tasks.pop_front();
+		running++;
+		lock.unlock();
+		cv_space.notify_one();
+		try {
+			task();
+		} catch (...) {
+			lock.lock();
+			if (!error) error = std::current_exception();
+			tasks.clear();
+			lock.unlock();
+			cv_space.notify_all();
+		}
+		task = nullptr;
+		lock.lock();
+		running--;
+		if (tasks.empty() && !running) cv_idle.notify_all();
+	}
+}
+
+void task_pool::submit(std::function<void()> task) {
+	{
+		std::unique_lock<std::mutex> lock(mtx);
+		if (max_queued) {
+			cv_space.wait(lock, [&] { return stopping || error || tasks.size() < max_queued; });
+		}
+		if (stopping || error) return;
+		tasks.push_back(std::move(task));
+	}
+	cv_task.notify_one();
+}
+
+void task_pool::wait() {
+	std::unique_lock<std::mutex> lock(mtx);
+	cv_idle.wait(lock, [&] { return tasks.empty() && !running; });
+	if (error) {
+		auto e = error;
+		error = nullptr;
+		std::rethrow_exception(e);
+	}
+}
+
+uint32_t task_pool::size() const {
+	return static_cast<uint32_t>(threads.size());
+}
+
+uint32_t task_pool::default_thread_count() {
+	const auto n = std::thread::hardware_concurrency();
+	return n ? n : 1;
+}
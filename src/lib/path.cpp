@@ -59,49 +59,76 @@ void file_path::reset() {
 linux_path::linux_path()
 	: file_path(L""), skip(false), matcher({ L"rootfs/" }) {}
 
-linux_path::linux_path(crwstr path, crwstr root_path) : linux_path() {
+// Removes "root_path", leading slashes and "." and ".." components. Returns false if the path isn't under "root_path".
+template<typename C>
+static bool normalize_linux_path(
+	const C *path, const size_t len, const std::basic_string<C> &root_path, std::basic_string<C> &res
+) {
+	res.clear();
 	size_t pos = 0;
 	if (!root_path.empty()) {
-		wstr root_path_slash;
-		const wstr *prefix;
-		if (root_path.back() != L'/') {
-			root_path_slash = root_path + L'/';
-			prefix = &root_path_slash;
-		} else {
-			prefix = &root_path;
-		}
-		if (path.compare(0, (*prefix).size(), *prefix)) {
-			skip = true;
-		} else {
-			pos += (*prefix).size();
-		}
-		if (skip) return;
+		const auto has_slash = root_path.back() == '/';
+		const auto prefix_len = root_path.size() + (has_slash ? 0 : 1);
+		if (len < prefix_len || root_path.compare(0, root_path.size(), path, root_path.size())) return false;
+		if (!has_slash && path[root_path.size()] != '/') return false;
+		pos += prefix_len;
 	}
+	const auto starts_with = [&](const char *s, const size_t n) {
+		if (len - pos < n) return false;
+		for (size_t i = 0; i < n; i++) {
+			if (path[pos + i] != static_cast<C>(s[i])) return false;
+		}
+		return true;
+	};
 	auto cb = true;
-	while (pos < path.size()) {
+	while (pos < len) {
 		if (cb) {
-			if (path[pos] == L'/') {
+			if (path[pos] == '/') {
 				pos++;
 				continue;
 			}
-			if (!path.compare(pos, 2, L"./")) {
+			if (starts_with("./", 2)) {
 				pos += 2;
 				continue;
 			}
-			if (!path.compare(pos, 3, L"../")) {
+			if (starts_with("../", 3)) {
 				pos += 3;
-				if (!data.empty()) {
-					const auto sp = data.rfind(L'/', data.size() - 2);
-					if (sp == wstr::npos) data.clear();
-					else data.resize(sp + 1);
+				if (!res.empty()) {
+					const auto sp = res.rfind('/', res.size() - 2);
+					if (sp == std::basic_string<C>::npos) res.clear();
+					else res.resize(sp + 1);
 				}
 				continue;
 			}
 		}
-		cb = path[pos] == L'/';
-		data += path[pos++];
+		cb = path[pos] == '/';
+		res += path[pos++];
 	}
-	skip = data.empty();
+	return true;
+}
+
+linux_path::linux_path(crwstr path, crwstr root_path) : linux_path() {
+	skip = !normalize_linux_path(path.c_str(), path.size(), root_path, data) || data.empty();
+}
+
+linux_path::linux_path(const std::string &path, const std::string &root_path) : linux_path() {
+	assign_utf8(path.c_str(), path.size(), root_path);
+}
+
+void linux_path::assign_utf8(const char *path, const size_t len, const std::string &root_path) {
+	matcher.reset();
+	skip = !normalize_linux_path(path, len, root_path, utf8) || utf8.empty();
+	if (skip) utf8.clear();
+	from_utf8(utf8.c_str(), utf8.size(), data);
+	utf8_for = data;
+}
+
+const std::string &linux_path::get_utf8() {
+	if (utf8_for != data) {
+		to_utf8(data.c_str(), data.size(), utf8);
+		utf8_for = data;
+	}
+	return utf8;
 }
 
 bool linux_path::append(const wchar_t c) {
@@ -120,6 +147,15 @@ bool linux_path::append(const wchar_t c) {
 
 bool linux_path::convert(file_path &output) const {
 	if (skip) return false;
+	// This is what appending the characters one by one would do, but the UTF-8 form is kept as well.
+	if (const auto lp = dynamic_cast<linux_path *>(&output)) {
+		lp->reset();
+		static_cast<file_path *>(lp)->append(L"rootfs/");
+		lp->data += data;
+		lp->utf8 = utf8;
+		lp->utf8_for = utf8_for;
+		return true;
+	}
 	output.reset();
 	return output.append(L"rootfs/") && output.append(data) && output.append(0);
 }
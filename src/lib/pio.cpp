@@ -0,0 +1,107 @@
+#include "pch.h"
+#include "error.h"
+#include "pio.h"
+
+win_pio_file::win_pio_file(wstr path, const bool writable, const bool create) : path(std::move(path)) {
+	const auto h = CreateFile(
+		this->path.c_str(),
+		writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, writable ? 0 : FILE_SHARE_READ, nullptr,
+		create ? CREATE_NEW : OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr
+	);
+	if (h == INVALID_HANDLE_VALUE) {
+		throw lro_error::from_win32_last(create ? err_msg::err_create_file : err_msg::err_open_file, { this->path });
+	}
+	hf = unique_ptr_del<HANDLE>(h, &CloseHandle);
+}
+
+crwstr win_pio_file::name() const {
+	return path;
+}
+
+uint64_t win_pio_file::size() const {
+	LARGE_INTEGER sz;
+	if (!GetFileSizeEx(hf.get(), &sz)) throw lro_error::from_win32_last(err_msg::err_file_size, { path });
+	return sz.QuadPart;
+}
+
+void win_pio_file::resize(const uint64_t size) {
+	FILE_END_OF_FILE_INFO info;
+	info.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+	if (!SetFileInformationByHandle(hf.get(), FileEndOfFileInfo, &info, sizeof(info))) {
+		throw lro_error::from_win32_last(err_msg::err_write_file, { path });
+	}
+}
+
+// The handle is opened for overlapped I/O, so every request carries its own offset and requests from different
+// threads don't wait for each other.
+void win_pio_file::transfer(uint64_t offset, char *buf, size_t size, const bool is_write) {
+	const auto err = is_write ? err_msg::err_write_file : err_msg::err_read_file;
+	unique_ptr_del<HANDLE> he(CreateEvent(nullptr, TRUE, FALSE, nullptr), &CloseHandle);
+	if (!he.get()) throw lro_error::from_win32_last(err, { path });
+	while (size) {
+		OVERLAPPED ov {};
+		ov.Offset = static_cast<DWORD>(offset);
+		ov.OffsetHigh = static_cast<DWORD>(offset >> 32);
+		ov.hEvent = he.get();
+		const auto cnt = static_cast<DWORD>(std::min(size, static_cast<size_t>(1 << 30)));
+		DWORD done;
+		const auto ok = is_write
+			? WriteFile(hf.get(), buf, cnt, nullptr, &ov)
+			: ReadFile(hf.get(), buf, cnt, nullptr, &ov);
+		if (!ok && GetLastError() != ERROR_IO_PENDING) throw lro_error::from_win32_last(err, { path });
+		if (!GetOverlappedResult(hf.get(), &ov, &done, TRUE)) throw lro_error::from_win32_last(err, { path });
+		if (!done) throw lro_error::from_win32(err, { path }, ERROR_HANDLE_EOF);
+		offset += done;
+		buf += done;
+		size -= done;
+	}
+}
+
+void win_pio_file::read(const uint64_t offset, char *buf, const size_t size) {
+	transfer(offset, buf, size, false);
+}
+
+void win_pio_file::write(const uint64_t offset, const char *buf, const size_t size) {
+	transfer(offset, const_cast<char *>(buf), size, true);
+}
+
+void win_pio_file::flush() {
+	if (!FlushFileBuffers(hf.get())) throw lro_error::from_win32_last(err_msg::err_write_file, { path });
+}
+
+memory_pio_file::memory_pio_file(wstr name, std::vector<char> data)
+	: file_name(std::move(name)), data(std::move(data)) {}
+
+crwstr memory_pio_file::name() const {
+	return file_name;
+}
+
+uint64_t memory_pio_file::size() const {
+	std::lock_guard<std::mutex> lock(mtx);
+	return data.size();
+}
+
+void memory_pio_file::resize(const uint64_t size) {
+	std::lock_guard<std::mutex> lock(mtx);
+	data.resize(size);
+}
+
+void memory_pio_file::read(const uint64_t offset, char *buf, const size_t size) {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (offset > data.size() || size > data.size() - offset) {
+		throw lro_error::from_win32(err_msg::err_read_file, { file_name }, ERROR_HANDLE_EOF);
+	}
+	memcpy(buf, data.data() + offset, size);
+}
+
+void memory_pio_file::write(const uint64_t offset, const char *buf, const size_t size) {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (offset + size > data.size()) data.resize(offset + size);
+	memcpy(data.data() + offset, buf, size);
+}
+
+void memory_pio_file::flush() {}
+
+const std::vector<char> &memory_pio_file::contents() const {
+	return data;
+}
@@ -26,13 +26,10 @@ static const wstr
 	vn_env = L"DefaultEnvironment",
 	vn_uid = L"DefaultUid",
 	vn_kernel_cmd = L"KernelCommandLine",
-	vn_flags = L"Flags";
+	vn_flags = L"Flags",
+	vn_parent = L"LxRunOfflineParent";
 static const auto guid_len = 38;
 
-void fclose_safe(FILE *f) {
-	if (f) fclose(f);
-}
-
 static bool is_guid(crwstr str) {
 	static const std::wregex guid_regex(
 		LR"#(\{[0-9a-f]{8}-([0-9a-f]{4}-){3}[0-9a-f]{12}\})#",
@@ -51,11 +48,11 @@ static wstr new_guid() {
 	return buf.get();
 }
 
-static std::unique_ptr<wchar_t[]> get_dynamic(crwstr path, crwstr value_name, const uint32_t type) {
+static std::unique_ptr<wchar_t[]> get_dynamic(crwstr path, crwstr value_name, const uint32_t types, DWORD &type) {
 	return probe_and_call<wchar_t, DWORD>([&](wchar_t *buf, DWORD len) {
 		const auto code = RegGetValue(
 			HKEY_CURRENT_USER, path.c_str(),
-			value_name.c_str(), type, nullptr, buf, &len
+			value_name.c_str(), types, &type, buf, &len
 		);
 		if (code) throw lro_error::from_win32(err_msg::err_get_key_value, { path, value_name }, code);
 		return len;
@@ -70,19 +67,8 @@ static void set_dynamic(crwstr path, crwstr value_name, const uint32_t type, con
 	if (code) throw lro_error::from_win32(err_msg::err_set_key_value, { path, value_name }, code);
 }
 
-template<typename T>
-static T get_value(crwstr, crwstr);
-
-template<>
-wstr get_value<wstr>(crwstr path, crwstr value_name) {
-	return get_dynamic(path, value_name, RRF_RT_REG_SZ).get();
-}
-
-template<>
-std::vector<wstr> get_value<std::vector<wstr>>(crwstr path, crwstr value_name) {
+static std::vector<wstr> parse_multi_sz(const wchar_t *ps) {
 	std::vector<wstr> v;
-	const auto buf = get_dynamic(path, value_name, RRF_RT_REG_MULTI_SZ);
-	auto ps = buf.get();
 	while (*ps) {
 		v.emplace_back(ps);
 		ps += wcslen(ps) + 1;
@@ -90,27 +76,7 @@ std::vector<wstr> get_value<std::vector<wstr>>(crwstr path, crwstr value_name) {
 	return v;
 }
 
-template<>
-uint32_t get_value<uint32_t>(crwstr path, crwstr value_name) {
-	DWORD res, rlen = sizeof res;
-	const auto code = RegGetValue(
-		HKEY_CURRENT_USER, path.c_str(),
-		value_name.c_str(), RRF_RT_REG_DWORD, nullptr, &res, &rlen
-	);
-	if (code) throw lro_error::from_win32(err_msg::err_get_key_value, { path, value_name }, code);
-	return res;
-}
-
-template<typename T>
-static void set_value(crwstr, crwstr, const T &);
-
-template<>
-void set_value<wstr>(crwstr path, crwstr value_name, crwstr value) {
-	set_dynamic(path, value_name, REG_SZ, value.c_str(), static_cast<uint32_t>(value.size() + 1) * sizeof(wchar_t));
-}
-
-template<>
-void set_value<std::vector<wstr>>(crwstr path, crwstr value_name, const std::vector<wstr> &value) {
+static void set_multi_sz(crwstr path, crwstr value_name, const std::vector<wstr> &value) {
 	const auto cnt = std::accumulate(
 		value.begin(), value.end(), 0,
 		[](const uint32_t cnt, crwstr s) { return cnt + static_cast<uint32_t>(s.size() + 1); }
@@ -127,12 +93,7 @@ void set_value<std::vector<wstr>>(crwstr path, crwstr value_name, const std::vec
 	set_dynamic(path, value_name, REG_MULTI_SZ, buf.get(), cnt * sizeof(wchar_t));
 }
 
-template<>
-void set_value<uint32_t>(crwstr path, crwstr value_name, const uint32_t &value) {
-	set_dynamic(path, value_name, REG_DWORD, &value, sizeof value);
-}
-
-static unique_ptr_del<HKEY> create_key(crwstr path) {
+static unique_ptr_del<HKEY> create_hkey(crwstr path) {
 	HKEY hk;
 	const auto code = RegCreateKeyEx(
 		HKEY_CURRENT_USER, path.c_str(),
@@ -142,22 +103,268 @@ static unique_ptr_del<HKEY> create_key(crwstr path) {
 	return unique_ptr_del<HKEY>(hk, &RegCloseKey);
 }
 
-static std::vector<wstr> list_distro_id() {
+class win32_reg_backend : public reg_backend {
+public:
+	std::vector<wstr> list_keys(crwstr path) override {
+		std::vector<wstr> res;
+		const auto hk = create_hkey(path);
+		DWORD cnt, max_len;
+		auto code = RegQueryInfoKey(
+			hk.get(), nullptr, nullptr, nullptr, &cnt, &max_len,
+			nullptr, nullptr, nullptr, nullptr, nullptr, nullptr
+		);
+		if (code) throw lro_error::from_win32(err_msg::err_enum_key, { path }, code);
+		const auto ib = std::make_unique<wchar_t[]>(max_len + 1);
+		for (DWORD i = 0; i < cnt; i++) {
+			DWORD bs = max_len + 1;
+			code = RegEnumKeyEx(hk.get(), i, ib.get(), &bs, nullptr, nullptr, nullptr, nullptr);
+			if (code == ERROR_NO_MORE_ITEMS) break;
+			if (code) throw lro_error::from_win32(err_msg::err_enum_key, { path }, code);
+			res.emplace_back(ib.get());
+		}
+		return res;
+	}
+
+	std::map<wstr, reg_value> get_values(crwstr path) override {
+		HKEY hkb;
+		auto code = RegOpenKeyEx(HKEY_CURRENT_USER, path.c_str(), 0, KEY_READ, &hkb);
+		if (code) throw lro_error::from_win32(err_msg::err_open_key, { path }, code);
+		const unique_ptr_del<HKEY> hk(hkb, &RegCloseKey);
+		DWORD cnt, max_name, max_data;
+		code = RegQueryInfoKey(
+			hk.get(), nullptr, nullptr, nullptr, nullptr, nullptr,
+			nullptr, &cnt, &max_name, &max_data, nullptr, nullptr
+		);
+		if (code) throw lro_error::from_win32(err_msg::err_open_key, { path }, code);
+		std::map<wstr, reg_value> res;
+		const auto name = std::make_unique<wchar_t[]>(max_name + 1);
+		// Stored strings don't always end with the terminators they should have, so room for two more is added.
+		std::vector<wchar_t> data(max_data / sizeof(wchar_t) + 2);
+		for (DWORD i = 0; i < cnt; i++) {
+			DWORD nl = max_name + 1, type, dl = max_data;
+			code = RegEnumValue(
+				hk.get(), i, name.get(), &nl, nullptr,
+				&type, reinterpret_cast<BYTE *>(data.data()), &dl
+			);
+			if (code == ERROR_NO_MORE_ITEMS) break;
+			if (code) throw lro_error::from_win32(err_msg::err_get_key_value, { path, name.get() }, code);
+			const auto chars = dl / sizeof(wchar_t);
+			data[chars] = data[chars + 1] = 0;
+			if (type == REG_DWORD && dl == sizeof(uint32_t)) {
+				uint32_t v;
+				memcpy(&v, data.data(), sizeof v);
+				res.emplace(name.get(), v);
+			} else if (type == REG_SZ) {
+				res.emplace(name.get(), wstr(data.data()));
+			} else if (type == REG_MULTI_SZ) {
+				res.emplace(name.get(), parse_multi_sz(data.data()));
+			}
+		}
+		return res;
+	}
+
+	reg_value get_value(crwstr path, crwstr value_name) override {
+		DWORD type;
+		const auto buf = get_dynamic(
+			path, value_name,
+			RRF_RT_REG_SZ | RRF_RT_REG_MULTI_SZ | RRF_RT_REG_DWORD, type
+		);
+		if (type == REG_DWORD) {
+			uint32_t v;
+			memcpy(&v, buf.get(), sizeof v);
+			return v;
+		}
+		if (type == REG_SZ) return wstr(buf.get());
+		return parse_multi_sz(buf.get());
+	}
+
+	void set_value(crwstr path, crwstr value_name, const reg_value &value) override {
+		if (const auto pv = std::get_if<uint32_t>(&value)) {
+			set_dynamic(path, value_name, REG_DWORD, pv, sizeof *pv);
+		} else if (const auto ps = std::get_if<wstr>(&value)) {
+			const auto len = static_cast<uint32_t>(ps->size() + 1) * sizeof(wchar_t);
+			set_dynamic(path, value_name, REG_SZ, ps->c_str(), len);
+		} else {
+			set_multi_sz(path, value_name, std::get<std::vector<wstr>>(value));
+		}
+	}
+
+	void create_key(crwstr path) override {
+		create_hkey(path);
+	}
+
+	void delete_key(crwstr path) override {
+		const auto code = RegDeleteTree(HKEY_CURRENT_USER, path.c_str());
+		if (code) throw lro_error::from_win32(err_msg::err_delete_key, { path }, code);
+	}
+
+	void delete_value(crwstr path, crwstr value_name) override {
+		const auto code = RegDeleteKeyValue(HKEY_CURRENT_USER, path.c_str(), value_name.c_str());
+		if (code) throw lro_error::from_win32(err_msg::err_delete_key_value, { path, value_name }, code);
+	}
+};
+
+static wstr normalize_key(crwstr path) {
+	auto p = path;
+	while (!p.empty() && p.back() == L'\\') p.pop_back();
+	return p;
+}
+
+std::vector<wstr> memory_reg_backend::list_keys(crwstr path) {
+	const auto prefix = normalize_key(path) + L'\\';
+	keys[prefix.substr(0, prefix.size() - 1)];
 	std::vector<wstr> res;
-	const auto hk = create_key(reg_base_path);
-	const auto ib = std::make_unique<wchar_t[]>(guid_len + 1);
-	for (auto i = 0;; i++) {
-		DWORD bs = guid_len + 1;
-		const auto code = RegEnumKeyEx(hk.get(), i, ib.get(), &bs, nullptr, nullptr, nullptr, nullptr);
-		if (code == ERROR_NO_MORE_ITEMS) break;
-		else if (code == ERROR_MORE_DATA) continue;
-		else if (code) throw lro_error::from_win32(err_msg::err_enum_key, { reg_base_path }, code);
-		if (is_guid(ib.get())) res.emplace_back(ib.get());
+	for (auto it = keys.lower_bound(prefix); it != keys.end(); ++it) {
+		if (it->first.compare(0, prefix.size(), prefix) != 0) break;
+		if (it->first.find(L'\\', prefix.size()) == wstr::npos) res.push_back(it->first.substr(prefix.size()));
 	}
 	return res;
 }
 
+std::map<wstr, reg_value> memory_reg_backend::get_values(crwstr path) {
+	const auto it = keys.find(normalize_key(path));
+	if (it == keys.end()) throw lro_error::from_win32(err_msg::err_open_key, { path }, ERROR_FILE_NOT_FOUND);
+	return it->second;
+}
+
+reg_value memory_reg_backend::get_value(crwstr path, crwstr value_name) {
+	const auto it = keys.find(normalize_key(path));
+	if (it != keys.end()) {
+		const auto vit = it->second.find(value_name);
+		if (vit != it->second.end()) return vit->second;
+	}
+	throw lro_error::from_win32(err_msg::err_get_key_value, { path, value_name }, ERROR_FILE_NOT_FOUND);
+}
+
+void memory_reg_backend::set_value(crwstr path, crwstr value_name, const reg_value &value) {
+	keys[normalize_key(path)][value_name] = value;
+}
+
+void memory_reg_backend::create_key(crwstr path) {
+	keys[normalize_key(path)];
+}
+
+void memory_reg_backend::delete_key(crwstr path) {
+	const auto key = normalize_key(path);
+	const auto it = keys.find(key);
+	if (it == keys.end()) throw lro_error::from_win32(err_msg::err_delete_key, { path }, ERROR_FILE_NOT_FOUND);
+	keys.erase(it);
+	const auto prefix = key + L'\\';
+	const auto begin = keys.lower_bound(prefix);
+	auto end = begin;
+	while (end != keys.end() && end->first.compare(0, prefix.size(), prefix) == 0) ++end;
+	keys.erase(begin, end);
+}
+
+void memory_reg_backend::delete_value(crwstr path, crwstr value_name) {
+	const auto it = keys.find(normalize_key(path));
+	if (it == keys.end() || !it->second.erase(value_name)) {
+		throw lro_error::from_win32(err_msg::err_delete_key_value, { path, value_name }, ERROR_FILE_NOT_FOUND);
+	}
+}
+
+namespace {
+	// The Lxss key and its distro keys. Key names are case-insensitive, so distro keys are indexed by lowercase ID.
+	struct reg_snapshot {
+		std::map<wstr, reg_value> base_values;
+		std::vector<wstr> ids;
+		std::unordered_map<wstr, std::map<wstr, reg_value>> values;
+		std::unordered_map<wstr, wstr> ids_by_name;
+	};
+}
+
+// The public functions below lock this, as commands of the "batch" action may run on several threads. It's recursive
+// because some of them call others.
+static std::recursive_mutex reg_mutex;
+static uint32_t cache_count = 0;
+static std::unique_ptr<reg_snapshot> snapshot;
+
+static win32_reg_backend win32_backend;
+static reg_backend *backend = &win32_backend;
+
+void set_reg_backend(reg_backend *new_backend) {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
+	backend = new_backend ? new_backend : &win32_backend;
+}
+
+reg_cache::reg_cache() {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
+	cache_count++;
+}
+
+reg_cache::~reg_cache() {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
+	if (!--cache_count) snapshot.reset();
+}
+
+static const reg_snapshot *get_snapshot() {
+	if (!cache_count) return nullptr;
+	if (snapshot) return snapshot.get();
+	auto s = std::make_unique<reg_snapshot>();
+	for (auto &id : backend->list_keys(reg_base_path)) {
+		if (!is_guid(id)) continue;
+		auto v = backend->get_values(reg_base_path + id);
+		const auto it = v.find(vn_distro_name);
+		if (it != v.end() && std::holds_alternative<wstr>(it->second)) {
+			// The first key wins if several have the same name, like a linear scan would find.
+			s->ids_by_name.emplace(std::get<wstr>(it->second), id);
+		}
+		s->values.emplace(boost::to_lower_copy(id), std::move(v));
+		s->ids.push_back(std::move(id));
+	}
+	s->base_values = backend->get_values(reg_base_path);
+	snapshot = std::move(s);
+	return snapshot.get();
+}
+
+// Every write goes through here, so that the snapshot is never stale. The arguments of the write mustn't read from the
+// registry, as they're evaluated after the reset and would build the snapshot again before the write.
+static reg_backend &write_backend() {
+	snapshot.reset();
+	return *backend;
+}
+
+static reg_value read_value(crwstr path, crwstr value_name) {
+	const auto s = get_snapshot();
+	if (!s) return backend->get_value(path, value_name);
+	const auto base_len = wcslen(reg_base_path);
+	const std::map<wstr, reg_value> *values = nullptr;
+	if (path == reg_base_path) {
+		values = &s->base_values;
+	} else if (path.compare(0, base_len, reg_base_path) == 0) {
+		const auto it = s->values.find(boost::to_lower_copy(path.substr(base_len)));
+		if (it != s->values.end()) values = &it->second;
+	} else {
+		return backend->get_value(path, value_name);
+	}
+	if (values) {
+		const auto it = values->find(value_name);
+		if (it != values->end()) return it->second;
+	}
+	throw lro_error::from_win32(err_msg::err_get_key_value, { path, value_name }, ERROR_FILE_NOT_FOUND);
+}
+
+template<typename T>
+static T get_value(crwstr path, crwstr value_name) {
+	auto v = read_value(path, value_name);
+	if (const auto p = std::get_if<T>(&v)) return std::move(*p);
+	throw lro_error::from_win32(err_msg::err_get_key_value, { path, value_name }, ERROR_UNSUPPORTED_TYPE);
+}
+
+template<typename T>
+static void set_value(crwstr path, crwstr value_name, const T &value) {
+	write_backend().set_value(path, value_name, value);
+}
+
+static std::vector<wstr> list_distro_id() {
+	if (const auto s = get_snapshot()) return s->ids;
+	auto res = backend->list_keys(reg_base_path);
+	res.erase(std::remove_if(res.begin(), res.end(), [](crwstr id) { return !is_guid(id); }), res.end());
+	return res;
+}
+
 std::vector<wstr> list_distros() {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
 	auto res = list_distro_id();
 	std::transform(
 		res.begin(), res.end(), res.begin(),
@@ -167,9 +374,14 @@ std::vector<wstr> list_distros() {
 }
 
 static wstr get_distro_id(crwstr name) {
-	for (crwstr id : list_distro_id()) {
-		auto cn = get_value<wstr>(reg_base_path + id, vn_distro_name);
-		if (name == cn) return id;
+	if (const auto s = get_snapshot()) {
+		const auto it = s->ids_by_name.find(name);
+		if (it != s->ids_by_name.end()) return it->second;
+	} else {
+		for (crwstr id : list_distro_id()) {
+			auto cn = get_value<wstr>(reg_base_path + id, vn_distro_name);
+			if (name == cn) return id;
+		}
 	}
 	throw lro_error::from_other(err_msg::err_distro_not_found, { name });
 }
@@ -179,6 +391,7 @@ static wstr get_distro_key(crwstr name) {
 }
 
 wstr get_default_distro() {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
 	try {
 		const auto p = reg_base_path + get_value<wstr>(reg_base_path, vn_default_distro);
 		return get_value<wstr>(p, vn_distro_name);
@@ -190,17 +403,19 @@ wstr get_default_distro() {
 }
 
 void set_default_distro(crwstr name) {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
 	set_value(reg_base_path, vn_default_distro, get_distro_id(name));
 }
 
 void register_distro(crwstr name, crwstr path, const uint32_t version) {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
 	auto l = list_distros();
 	if (count(l.begin(), l.end(), name)) {
 		throw lro_error::from_other(err_msg::err_distro_exists, { name });
 	}
 
 	const auto p = reg_base_path + new_guid();
-	create_key(p);
+	write_backend().create_key(p);
 	set_value(p, vn_distro_name, name);
 	set_value(p, vn_dir, get_full_path(path));
 	set_value(p, vn_state, static_cast<uint32_t>(1));
@@ -222,6 +437,7 @@ void register_distro(crwstr name, crwstr path, const uint32_t version) {
 }
 
 void unregister_distro(crwstr name) {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
 	bool d;
 	try {
 		d = get_default_distro() == name;
@@ -231,23 +447,13 @@ void unregister_distro(crwstr name) {
 	}
 
 	const auto p = get_distro_key(name);
-	const auto code = RegDeleteTree(HKEY_CURRENT_USER, p.c_str());
-	if (code) throw lro_error::from_win32(err_msg::err_delete_key, { p }, code);
+	write_backend().delete_key(p);
 
 	if (d) {
 		try {
 			auto l = list_distro_id();
 			if (l.empty()) {
-				const auto code2 = RegDeleteKeyValue(
-					HKEY_CURRENT_USER,
-					reg_base_path, vn_default_distro.c_str()
-				);
-				if (code2) {
-					throw lro_error::from_win32(
-						err_msg::err_delete_key_value,
-						{ reg_base_path, vn_default_distro }, code2
-					);
-				}
+				write_backend().delete_value(reg_base_path, vn_default_distro);
 			} else {
 				set_value(reg_base_path, vn_default_distro, l.front());
 			}
@@ -258,17 +464,70 @@ void unregister_distro(crwstr name) {
 }
 
 wstr get_distro_dir(crwstr name) {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
 	return get_value<wstr>(get_distro_key(name), vn_dir);
 }
 
 void set_distro_dir(crwstr name, crwstr value) {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
 	set_value(get_distro_key(name), vn_dir, get_full_path(value));
 }
 
 uint32_t get_distro_version(crwstr name) {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
 	return get_value<uint32_t>(get_distro_key(name), vn_version);
 }
 
+void set_distro_version(crwstr name, const uint32_t version) {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
+	set_value(get_distro_key(name), vn_version, version);
+}
+
+static wstr get_parent_id(crwstr id) {
+	try {
+		return get_value<wstr>(reg_base_path + id, vn_parent);
+	} catch (const lro_error &e) {
+		if (e.msg_code != err_msg::err_get_key_value || e.err_code != HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) {
+			throw;
+		}
+		return L"";
+	}
+}
+
+wstr get_distro_parent(crwstr name) {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
+	const auto id = get_parent_id(get_distro_id(name));
+	if (id.empty()) return L"";
+	for (crwstr i : list_distro_id()) {
+		if (boost::iequals(i, id)) return get_value<wstr>(reg_base_path + i, vn_distro_name);
+	}
+	return L"";
+}
+
+void set_distro_parent(crwstr name, crwstr parent) {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
+	const auto p = get_distro_key(name);
+	if (!parent.empty()) {
+		set_value(p, vn_parent, get_distro_id(parent));
+		return;
+	}
+	try {
+		write_backend().delete_value(p, vn_parent);
+	} catch (const lro_error &e) {
+		if (e.err_code != HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) throw;
+	}
+}
+
+std::vector<wstr> list_distro_children(crwstr name) {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
+	const auto id = get_distro_id(name);
+	std::vector<wstr> res;
+	for (crwstr i : list_distro_id()) {
+		if (boost::iequals(get_parent_id(i), id)) res.push_back(get_value<wstr>(reg_base_path + i, vn_distro_name));
+	}
+	return res;
+}
+
 reg_config::reg_config(const bool is_wsl2) {
 	env = {
 		L"HOSTTYPE=x86_64",
@@ -356,6 +615,7 @@ static void try_get_value(crwstr path, crwstr value_name, T &value) {
 }
 
 void reg_config::load_distro(crwstr name, const config_item_flags desired) {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
 	const auto p = get_distro_key(name);
 	if (desired & config_env) try_get_value(p, vn_env, env);
 	if (desired & config_uid) try_get_value(p, vn_uid, uid);
@@ -364,6 +624,7 @@ void reg_config::load_distro(crwstr name, const config_item_flags desired) {
 }
 
 void reg_config::configure_distro(crwstr name, const config_item_flags desired) const {
+	const std::lock_guard<std::recursive_mutex> lock(reg_mutex);
 	const auto p = get_distro_key(name);
 	if (desired & config_env) set_value(p, vn_env, env);
 	if (desired & config_uid) set_value(p, vn_uid, uid);
@@ -383,3 +644,7 @@ void reg_config::set_flags(const uint32_t value) {
 bool reg_config::is_wsl2() const {
 	return flags & flag_wsl2;
 }
+
+void reg_config::set_wsl2(const bool value) {
+	flags = value ? flags | flag_wsl2 : flags & ~flag_wsl2;
+}
@@ -0,0 +1,195 @@
+#include "pch.h"
+#include "error.h"
+#include "transform.h"
+#include "utils.h"
+
+// Whether "path" is "pattern" or below it. A "*" matches any part of a file name, but never a slash.
+static bool match_path(crwstr pattern, crwstr path) {
+	if (pattern.empty()) return true;
+	size_t i = 0, j = 0, star = wstr::npos, mark = 0;
+	while (true) {
+		if (i == pattern.size()) {
+			if (j == path.size() || path[j] == L'/') return true;
+		} else if (pattern[i] == L'*') {
+			star = i++;
+			mark = j;
+			continue;
+		} else if (j < path.size() && pattern[i] == path[j]) {
+			i++;
+			j++;
+			continue;
+		}
+		// Lets the last "*" match one more character and tries again from there.
+		if (star == wstr::npos || mark == path.size() || path[mark] == L'/') return false;
+		i = star + 1;
+		j = ++mark;
+	}
+}
+
+static wstr normalize_pattern(crwstr s) {
+	const auto b = s.find_first_not_of(L'/');
+	if (b == wstr::npos) return L"";
+	return s.substr(b, s.find_last_not_of(L'/') - b + 1);
+}
+
+static std::string read_local_file(crwstr path) {
+	const auto hf = open_file(path, false, false);
+	std::string res(get_file_size(hf.get()), 0);
+	DWORD rc;
+	if (!ReadFile(hf.get(), res.data(), static_cast<DWORD>(res.size()), &rc, nullptr) || rc != res.size()) {
+		throw lro_error::from_win32_last(err_msg::err_read_file, { path });
+	}
+	return res;
+}
+
+transform_rule parse_transform_rule(crwstr rule) {
+	const auto fail = [&] { return lro_error::from_other(err_msg::err_transform_rule, { rule }); };
+	size_t pos = 0;
+	const auto next = [&] {
+		const auto b = rule.find_first_not_of(L" \t", pos);
+		if (b == wstr::npos) throw fail();
+		pos = std::min(rule.find_first_of(L" \t", b), rule.size());
+		return rule.substr(b, pos - b);
+	};
+	const auto rest = [&] {
+		const auto b = rule.find_first_not_of(L" \t", pos);
+		if (b == wstr::npos) throw fail();
+		pos = rule.size();
+		return rule.substr(b);
+	};
+	const auto number = [&](crwstr s, const int base, const uint64_t max) {
+		if (s.empty() || s.size() > 10 || s.find_first_not_of(base == 8 ? L"01234567" : L"0123456789") != wstr::npos) {
+			throw fail();
+		}
+		const auto n = std::stoull(s, nullptr, base);
+		if (n > max) throw fail();
+		return static_cast<uint32_t>(n);
+	};
+	transform_rule r {};
+	const auto type = next();
+	if (type == L"drop") {
+		r.type = transform_type::drop;
+		r.pattern = normalize_pattern(next());
+	} else if (type == L"move") {
+		r.type = transform_type::move;
+		r.pattern = normalize_pattern(next());
+		r.target = normalize_pattern(next());
+		// The root itself can't be moved, and nothing can be moved onto it.
+		if (r.pattern.empty() || r.target.empty() || r.pattern.find(L'*') != wstr::npos) throw fail();
+	} else if (type == L"mode") {
+		r.type = transform_type::mode;
+		r.pattern = normalize_pattern(next());
+		r.mode = number(next(), 8, 07777);
+	} else if (type == L"owner") {
+		r.type = transform_type::owner;
+		r.pattern = normalize_pattern(next());
+		const auto ids = next();
+		const auto sp = ids.find(L':');
+		if (sp == wstr::npos) throw fail();
+		r.uid = number(ids.substr(0, sp), 10, UINT32_MAX);
+		r.gid = number(ids.substr(sp + 1), 10, UINT32_MAX);
+	} else if (type == L"content") {
+		r.type = transform_type::content;
+		r.pattern = normalize_pattern(next());
+		r.content = read_local_file(rest());
+	} else if (type == L"text") {
+		r.type = transform_type::content;
+		r.pattern = normalize_pattern(next());
+		const auto text = rest() + L'\n';
+		to_utf8(text.c_str(), text.size(), r.content);
+	} else {
+		throw fail();
+	}
+	if (rule.find_first_not_of(L" \t", pos) != wstr::npos) throw fail();
+	return r;
+}
+
+std::vector<transform_rule> read_transform_rules(crwstr path) {
+	const unique_ptr_del<FILE *> f(_wfopen(path.c_str(), L"rb"), &fclose_safe);
+	if (!f.get()) throw lro_error::from_win32_last(err_msg::err_open_file, { path });
+	std::vector<transform_rule> res;
+	std::string line;
+	wstr wline;
+	char buf[4096];
+	while (fgets(buf, sizeof buf, f.get())) {
+		line += buf;
+		if (line.back() != '\n' && !feof(f.get())) continue;
+		while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.pop_back();
+		from_utf8(line.c_str(), line.size(), wline);
+		const auto b = wline.find_first_not_of(L" \t");
+		if (b != wstr::npos && wline[b] != L'#') res.push_back(parse_transform_rule(wline));
+		line.clear();
+	}
+	return res;
+}
+
+transform_writer::transform_writer(fs_writer &inner, const std::vector<transform_rule> &rules)
+	: inner(inner), rules(rules), out_attr(), content(nullptr) {
+	path = std::make_unique<linux_path>();
+	target_path = std::make_unique<linux_path>();
+}
+
+// Applies a rule matching "cur", and returns false if it drops the entry. A moved path is kept in "out", which "cur"
+// then points to.
+bool transform_writer::apply_path(const transform_rule &r, const wstr *&cur, linux_path &out) const {
+	if (r.type == transform_type::drop) return false;
+	if (r.type == transform_type::move) {
+		out.data = r.target + cur->substr(r.pattern.size());
+		cur = &out.data;
+	}
+	return true;
+}
+
+bool transform_writer::write_new_file(const file_attr *attr) {
+	content = nullptr;
+	const wstr *cur = &path->data;
+	for (const auto &r : rules) {
+		if (!match_path(r.pattern, *cur)) continue;
+		if (!apply_path(r, cur, out_path)) return false;
+		if (!attr || r.type == transform_type::move) continue;
+		// Attributes are only copied once some rule changes them.
+		if (attr != &out_attr) {
+			out_attr = *attr;
+			attr = &out_attr;
+		}
+		if (r.type == transform_type::mode) {
+			out_attr.mode = (out_attr.mode & AE_IFMT) | r.mode;
+		} else if (r.type == transform_type::owner) {
+			out_attr.uid = r.uid;
+			out_attr.gid = r.gid;
+		} else if (r.type == transform_type::content && (out_attr.mode & AE_IFMT) == AE_IFREG) {
+			out_attr.size = r.content.size();
+			content = &r.content;
+		}
+	}
+	const file_path &p = cur == &path->data ? *path : out_path;
+	return p.convert(*inner.path) && inner.write_new_file(attr);
+}
+
+void transform_writer::write_file_data(const char *buf, const uint32_t size) {
+	if (!content) {
+		inner.write_file_data(buf, size);
+	} else if (!size) {
+		if (!content->empty()) inner.write_file_data(content->data(), static_cast<uint32_t>(content->size()));
+		inner.write_file_data(nullptr, 0);
+	}
+}
+
+void transform_writer::write_hard_link() {
+	const wstr *cur = &path->data, *target = &target_path->data;
+	for (const auto &r : rules) {
+		if (r.type != transform_type::drop && r.type != transform_type::move) continue;
+		if (match_path(r.pattern, *cur) && !apply_path(r, cur, out_path)) return;
+		if (match_path(r.pattern, *target) && !apply_path(r, target, out_target)) {
+			log_skipped(skip_reason::ignored_target, *cur);
+			return;
+		}
+	}
+	const file_path &p = cur == &path->data ? *path : out_path;
+	const file_path &t = target == &target_path->data ? *target_path : out_target;
+	if (p.convert(*inner.path) && t.convert(*inner.target_path)) inner.write_hard_link();
+}
+
+void transform_writer::check_path(const file_path &source_path) const {
+	inner.check_path(source_path);
+}
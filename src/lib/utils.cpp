@@ -2,15 +2,24 @@
 #include "error.h"
 #include "utils.h"
 
+#if defined(_M_X64) || defined(__SSE2__)
+#define LRO_SSE2
+#include <emmintrin.h>
+#endif
+
+// Directory walks ask for this once per directory, so it's only queried once.
 uint32_t get_win_build() {
-	OSVERSIONINFO ver;
-	ver.dwOSVersionInfoSize = sizeof(OSVERSIONINFO);
+	static const auto build = [] {
+		OSVERSIONINFO ver;
+		ver.dwOSVersionInfoSize = sizeof(OSVERSIONINFO);
 #pragma warning(disable:4996)
-	if (!GetVersionEx(&ver)) {
+		if (!GetVersionEx(&ver)) {
 #pragma warning(default:4996)
-		throw lro_error::from_other(err_msg::err_get_version, {});
-	}
-	return ver.dwBuildNumber;
+			throw lro_error::from_other(err_msg::err_get_version, {});
+		}
+		return ver.dwBuildNumber;
+	}();
+	return build;
 }
 
 static HANDLE get_hcon() {
@@ -20,13 +29,54 @@ static HANDLE get_hcon() {
 
 static bool progress_printed;
 
+namespace {
+	struct log_entry {
+		log_entry *next;
+		skip_reason reason;
+		uint32_t type;
+		wstr path;
+	};
+
+	struct skip_stats {
+		uint64_t count;
+		std::vector<wstr> examples;
+	};
+}
+
+static const wchar_t *const skip_messages[] = {
+	L"Ignoring an unsupported file \"%1%\" of type %2$07o.",
+	L"Ignoring the file \"%1%\" which doesn't have WSL attributes.",
+	L"Ignoring the hard link \"%1%\" whose target has been ignored.",
+	L"Ignoring an invalid symlink \"%1%\"."
+};
+
+static std::atomic<log_entry *> log_head;
+static std::atomic<bool> log_active;
+static size_t log_examples;
+static skip_stats log_stats[std::size(skip_messages)];
+static std::mutex log_mutex;
+static std::condition_variable log_cv;
+static bool log_stopping;
+static std::thread log_worker;
+static unique_ptr_del<FILE *> log_file(nullptr, &fclose_safe);
+
+static void write_log_file(crwstr msg) {
+	try {
+		const auto s = to_utf8(msg);
+		std::lock_guard<std::mutex> lock(log_mutex);
+		if (!log_file) return;
+		fputs(s.get(), log_file.get());
+		fputc('\n', log_file.get());
+	} catch (const lro_error &) {}
+}
+
 static void write(crwstr output, const uint16_t color) {
 	CONSOLE_SCREEN_BUFFER_INFO ci;
 	const auto hcon = get_hcon();
 	const auto ok = hcon != INVALID_HANDLE_VALUE && GetConsoleScreenBufferInfo(hcon, &ci);
 	if (ok) {
 		if (progress_printed && SetConsoleCursorPosition(hcon, { 0, ci.dwCursorPosition.Y })) {
-			for (auto i = 0; i < ci.dwSize.X - 1; i++) std::wcout << L' ';
+			for (auto i = 0; i < ci.dwSize.X - 1; i++) std::wcerr << L' ';
 			SetConsoleCursorPosition(hcon, { 0, ci.dwCursorPosition.Y });
 		}
 		SetConsoleTextAttribute(hcon, color);
@@ -34,6 +84,7 @@ static void write(crwstr output, const uint16_t color) {
 	std::wcerr << output << '\n';
 	if (ok) SetConsoleTextAttribute(hcon, ci.wAttributes);
 	progress_printed = false;
+	if (log_active) write_log_file(output);
 }
 
 void log_warning(crwstr msg) {
@@ -44,6 +95,96 @@ void log_error(crwstr msg) {
 	write(L"[ERROR] " + msg, FOREGROUND_INTENSITY | FOREGROUND_RED);
 }
 
+static wstr format_skipped(const log_entry &e) {
+	boost::wformat f(skip_messages[static_cast<size_t>(e.reason)]);
+	f % e.path;
+	if (e.reason == skip_reason::unsupported_type) f % e.type;
+	return f.str();
+}
+
+void log_skipped(const skip_reason reason, crwstr path, const uint32_t type) {
+	if (!log_active) {
+		log_warning(format_skipped({ nullptr, reason, type, path }));
+		return;
+	}
+	const auto e = new log_entry { log_head.load(std::memory_order_relaxed), reason, type, path };
+	while (!log_head.compare_exchange_weak(e->next, e, std::memory_order_release, std::memory_order_relaxed)) {}
+}
+
+// Takes everything from the queue at once and restores the order the entries have been added in.
+static void collect_skipped() {
+	auto p = log_head.exchange(nullptr, std::memory_order_acquire);
+	log_entry *first = nullptr;
+	while (p) {
+		const auto next = p->next;
+		p->next = first;
+		first = p;
+		p = next;
+	}
+	std::unique_lock<std::mutex> lock(log_mutex);
+	const auto to_file = log_file != nullptr;
+	lock.unlock();
+	std::string buf;
+	while (first) {
+		const std::unique_ptr<log_entry> e(first);
+		first = e->next;
+		auto &s = log_stats[static_cast<size_t>(e->reason)];
+		const auto msg = format_skipped(*e);
+		if (s.count++ < log_examples) s.examples.push_back(msg);
+		if (!to_file) continue;
+		try {
+			buf += "[WARNING] ";
+			buf += to_utf8(msg).get();
+			buf += '\n';
+		} catch (const lro_error &) {}
+	}
+	lock.lock();
+	if (log_file && !buf.empty()) fwrite(buf.data(), 1, buf.size(), log_file.get());
+}
+
+void set_log_file(crwstr path) {
+	unique_ptr_del<FILE *> f(_wfopen(path.c_str(), L"wb"), &fclose_safe);
+	if (!f) throw lro_error::from_win32_last(err_msg::err_open_file, { path });
+	std::lock_guard<std::mutex> lock(log_mutex);
+	log_file = std::move(f);
+}
+
+warning_log::warning_log(const size_t examples) {
+	log_examples = examples;
+	for (auto &s : log_stats) s = {};
+	log_stopping = false;
+	log_active = true;
+	log_worker = std::thread([] {
+		std::unique_lock<std::mutex> lock(log_mutex);
+		while (!log_stopping) {
+			log_cv.wait_for(lock, std::chrono::milliseconds(100));
+			lock.unlock();
+			collect_skipped();
+			lock.lock();
+		}
+	});
+}
+
+warning_log::~warning_log() {
+	{
+		std::lock_guard<std::mutex> lock(log_mutex);
+		log_stopping = true;
+	}
+	log_cv.notify_all();
+	log_worker.join();
+	collect_skipped();
+	log_active = false;
+	for (const auto &s : log_stats) {
+		for (crwstr msg : s.examples) log_warning(msg);
+		if (s.count > s.examples.size()) {
+			const auto more = s.count - s.examples.size();
+			log_warning((boost::wformat(L"%1% more files have been ignored for the same reason.") % more).str());
+		}
+	}
+	std::lock_guard<std::mutex> lock(log_mutex);
+	log_file.reset();
+}
+
 void print_progress(const double progress) {
 	static int lc;
 	const auto hcon = get_hcon();
@@ -63,20 +204,165 @@ void print_progress(const double progress) {
 	progress_printed = true;
 }
 
+void print_progress_bytes(const uint64_t bytes) {
+	static uint64_t lm;
+	const auto hcon = get_hcon();
+	if (hcon == INVALID_HANDLE_VALUE) return;
+	CONSOLE_SCREEN_BUFFER_INFO ci;
+	if (!GetConsoleScreenBufferInfo(hcon, &ci)) return;
+	const auto mib = bytes >> 20;
+	if (progress_printed && (mib == lm || !SetConsoleCursorPosition(hcon, { 0, ci.dwCursorPosition.Y }))) return;
+	lm = mib;
+	std::wcerr << L'[' << mib << L" MiB]";
+	progress_printed = true;
+}
+
+[[noreturn]] static void fail_encoding() {
+	throw lro_error::from_win32(err_msg::err_convert_encoding, {}, ERROR_NO_UNICODE_TRANSLATION);
+}
+
+// Surrogates, overlong forms and code points above U+10FFFF are rejected like MultiByteToWideChar does with
+// MB_ERR_INVALID_CHARS.
+void from_utf8(const char *s, const size_t len, wstr &out) {
+	// Each code unit of the result takes at least one byte of the input.
+	out.resize(len);
+	auto p = reinterpret_cast<const uint8_t *>(s);
+	const auto end = p + len;
+	auto o = out.data();
+	const auto cont = [&](const size_t i) {
+		if (end - p <= static_cast<ptrdiff_t>(i) || (p[i] & 0xC0) != 0x80) fail_encoding();
+		return static_cast<uint32_t>(p[i] & 0x3F);
+	};
+	while (p < end) {
+#ifdef LRO_SSE2
+		if (end - p >= 16) {
+			const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+			if (!_mm_movemask_epi8(v)) {
+				const auto zero = _mm_setzero_si128();
+				const auto lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+				if constexpr (sizeof(wchar_t) == 2) {
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(o), lo);
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(o + 8), hi);
+				} else {
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(o), _mm_unpacklo_epi16(lo, zero));
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(o + 4), _mm_unpackhi_epi16(lo, zero));
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(o + 8), _mm_unpacklo_epi16(hi, zero));
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(o + 12), _mm_unpackhi_epi16(hi, zero));
+				}
+				p += 16;
+				o += 16;
+				continue;
+			}
+		}
+#endif
+		const uint32_t c = *p;
+		uint32_t cp;
+		if (c < 0x80) {
+			*o++ = static_cast<wchar_t>(c);
+			p++;
+			continue;
+		} else if (c >= 0xC2 && c <= 0xDF) {
+			cp = (c & 0x1F) << 6 | cont(1);
+			p += 2;
+		} else if (c >= 0xE0 && c <= 0xEF) {
+			cp = (c & 0x0F) << 12 | cont(1) << 6 | cont(2);
+			if (cp < 0x800 || cp >= 0xD800 && cp <= 0xDFFF) fail_encoding();
+			p += 3;
+		} else if (c >= 0xF0 && c <= 0xF4) {
+			cp = (c & 0x07) << 18 | cont(1) << 12 | cont(2) << 6 | cont(3);
+			if (cp < 0x10000 || cp > 0x10FFFF) fail_encoding();
+			p += 4;
+		} else {
+			fail_encoding();
+		}
+		if (cp < 0x10000) {
+			*o++ = static_cast<wchar_t>(cp);
+		} else {
+			cp -= 0x10000;
+			*o++ = static_cast<wchar_t>(0xD800 | cp >> 10);
+			*o++ = static_cast<wchar_t>(0xDC00 | (cp & 0x3FF));
+		}
+	}
+	out.resize(o - out.data());
+}
+
+// Unpaired surrogates are rejected like WideCharToMultiByte does with WC_ERR_INVALID_CHARS.
+void to_utf8(const wchar_t *s, const size_t len, std::string &out) {
+	// A code unit takes at most 3 bytes, and a surrogate pair takes 4.
+	out.resize(len * 3);
+	auto p = s;
+	const auto end = s + len;
+	auto o = reinterpret_cast<uint8_t *>(out.data());
+	while (p < end) {
+#ifdef LRO_SSE2
+		if constexpr (sizeof(wchar_t) == 2) {
+			if (end - p >= 8) {
+				const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+				const auto high = _mm_and_si128(v, _mm_set1_epi16(static_cast<short>(0xFF80)));
+				if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) == 0xFFFF) {
+					_mm_storel_epi64(reinterpret_cast<__m128i *>(o), _mm_packus_epi16(v, v));
+					p += 8;
+					o += 8;
+					continue;
+				}
+			}
+		} else {
+			if (end - p >= 4) {
+				const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+				const auto high = _mm_and_si128(v, _mm_set1_epi32(static_cast<int>(0xFFFFFF80)));
+				if (_mm_movemask_epi8(_mm_cmpeq_epi32(high, _mm_setzero_si128())) == 0xFFFF) {
+					const auto w = _mm_packs_epi32(v, v);
+					const auto b = _mm_cvtsi128_si32(_mm_packus_epi16(w, w));
+					memcpy(o, &b, 4);
+					p += 4;
+					o += 4;
+					continue;
+				}
+			}
+		}
+#endif
+		auto c = static_cast<uint32_t>(*p++);
+		if (c < 0x80) {
+			*o++ = static_cast<uint8_t>(c);
+		} else if (c < 0x800) {
+			*o++ = static_cast<uint8_t>(0xC0 | c >> 6);
+			*o++ = static_cast<uint8_t>(0x80 | (c & 0x3F));
+		} else if (c < 0xD800 || c > 0xDFFF && c < 0x10000) {
+			*o++ = static_cast<uint8_t>(0xE0 | c >> 12);
+			*o++ = static_cast<uint8_t>(0x80 | (c >> 6 & 0x3F));
+			*o++ = static_cast<uint8_t>(0x80 | (c & 0x3F));
+		} else {
+			if (c <= 0xDBFF) {
+				if (p == end || *p < 0xDC00 || *p > 0xDFFF) fail_encoding();
+				c = 0x10000 + ((c & 0x3FF) << 10 | (*p++ & 0x3FF));
+			} else if (c <= 0xDFFF || c > 0x10FFFF) {
+				fail_encoding();
+			}
+			*o++ = static_cast<uint8_t>(0xF0 | c >> 18);
+			*o++ = static_cast<uint8_t>(0x80 | (c >> 12 & 0x3F));
+			*o++ = static_cast<uint8_t>(0x80 | (c >> 6 & 0x3F));
+			*o++ = static_cast<uint8_t>(0x80 | (c & 0x3F));
+		}
+	}
+	out.resize(o - reinterpret_cast<uint8_t *>(out.data()));
+}
+
 wstr from_utf8(const char *s) {
-	const auto res = probe_and_call<wchar_t, int>([&](wchar_t *buf, const int len) {
-		return MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, s, -1, buf, len);
-	});
-	if (!res.second) throw lro_error::from_win32_last(err_msg::err_convert_encoding, {});
-	return res.first.get();
+	wstr res;
+	from_utf8(s, strlen(s), res);
+	return res;
 }
 
 std::unique_ptr<char[]> to_utf8(wstr s) {
-	auto res = probe_and_call<char, int>([&](char *buf, const int len) {
-		return WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, s.c_str(), -1, buf, len, nullptr, nullptr);
-	});
-	if (!res.second) throw lro_error::from_win32_last(err_msg::err_convert_encoding, {});
-	return std::move(res.first);
+	std::string buf;
+	to_utf8(s.c_str(), wcslen(s.c_str()), buf);
+	auto res = std::make_unique<char[]>(buf.size() + 1);
+	memcpy(res.get(), buf.c_str(), buf.size() + 1);
+	return res;
+}
+
+void fclose_safe(FILE *f) {
+	if (f) fclose(f);
 }
 
 wstr get_full_path(crwstr path) {
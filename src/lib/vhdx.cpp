@@ -0,0 +1,663 @@
+#include "pch.h"
+#include "error.h"
+#include "hash.h"
+#include "parallel.h"
+#include "utils.h"
+#include "vhdx.h"
+
+static const uint64_t mib = 1 << 20;
+static const uint64_t header_offsets[] = { 64 << 10, 128 << 10 };
+static const uint64_t region_table_offsets[] = { 192 << 10, 256 << 10 };
+static const uint32_t header_size = 4096, region_table_size = 64 << 10, metadata_table_size = 64 << 10;
+
+static const uint64_t bat_state_mask = 7, bat_offset_mask = ~(mib - 1);
+static const uint64_t block_not_present = 0, block_fully_present = 6, block_partially_present = 7;
+
+static const uint32_t metadata_flag_virtual_disk = 2, metadata_flag_required = 4;
+static const uint32_t file_param_has_parent = 2;
+
+static const GUID guid_bat = { 0x2DC27766, 0xF623, 0x4200, { 0x9D, 0x64, 0x11, 0x5E, 0x9B, 0xFD, 0x4A, 0x08 } };
+static const GUID guid_metadata = { 0x8B7CA206, 0x4790, 0x4B9A, { 0xB8, 0xFE, 0x57, 0x5F, 0x05, 0x0F, 0x88, 0x6E } };
+static const GUID guid_file_params = { 0xCAA16737, 0xFA36, 0x4D43, { 0xB3, 0xB6, 0x33, 0xF0, 0xAA, 0x44, 0xE7, 0x6B } };
+static const GUID guid_disk_size = { 0x2FA54224, 0xCD1B, 0x4876, { 0xB2, 0x11, 0x5D, 0xBE, 0xD8, 0x3B, 0xF4, 0xB8 } };
+static const GUID guid_disk_id = { 0xBECA12AB, 0xB2E6, 0x4523, { 0x93, 0xEF, 0xC3, 0x09, 0xE0, 0x00, 0xC7, 0x46 } };
+static const GUID guid_sector_size = { 0x8141BF1D, 0xA96F, 0x4709, { 0xBA, 0x47, 0xF2, 0x33, 0xA8, 0xFA, 0xAB, 0x5F } };
+static const GUID guid_physical_sector_size = {
+	0xCDA348C7, 0x445D, 0x4471, { 0x9C, 0xC9, 0xE9, 0x88, 0x52, 0x51, 0xC5, 0x56 }
+};
+static const GUID guid_parent_locator = {
+	0xA8D35F2D, 0xB30B, 0x454D, { 0xAB, 0xF7, 0xD3, 0xD8, 0x48, 0x34, 0xAB, 0x0C }
+};
+static const GUID guid_vhdx_locator = {
+	0xB04AEFB7, 0xD19E, 0x4A81, { 0xB7, 0x89, 0x25, 0xB8, 0xE9, 0x44, 0x59, 0x13 }
+};
+static const wstr long_path_prefix = L"\\\\?\\";
+
+template<typename T>
+static T get(const char *p) {
+	T v;
+	memcpy(&v, p, sizeof v);
+	return v;
+}
+
+template<typename T>
+static void put(char *p, const T &v) {
+	memcpy(p, &v, sizeof v);
+}
+
+static uint64_t round_up(const uint64_t x, const uint64_t align) {
+	return (x + align - 1) / align * align;
+}
+
+// A sector bitmap entry follows every chunk of payload blocks. Only differencing disks need one after the last chunk.
+static uint64_t count_bat_entries(
+	const uint64_t blocks, const uint32_t block_size, const uint32_t sector_size, const bool differencing
+) {
+	const auto ratio = (uint64_t(1) << 23) * sector_size / block_size;
+	return differencing ? (blocks + ratio - 1) / ratio * (ratio + 1) : blocks + (blocks - 1) / ratio;
+}
+
+// The checksum is calculated with the checksum field itself (at offset 4 of all structures) set to zero.
+static bool check_checksum(char *buf, const size_t size) {
+	const auto expected = get<uint32_t>(buf + 4);
+	put<uint32_t>(buf + 4, 0);
+	const auto actual = crc32c(buf, size);
+	put(buf + 4, expected);
+	return actual == expected;
+}
+
+static void set_checksum(char *buf, const size_t size) {
+	put<uint32_t>(buf + 4, 0);
+	put(buf + 4, crc32c(buf, size));
+}
+
+static GUID new_guid() {
+	GUID g;
+	const auto hr = CoCreateGuid(&g);
+	if (FAILED(hr)) throw lro_error::from_hresult(err_msg::err_create_guid, {}, hr);
+	return g;
+}
+
+static wstr guid_string(const char *p) {
+	const auto g = get<GUID>(p);
+	wchar_t buf[39];
+	if (!StringFromGUID2(g, buf, 39)) throw lro_error::from_other(err_msg::err_convert_guid, {});
+	return buf;
+}
+
+static wstr strip_prefix(wstr path) {
+	if (!path.compare(0, long_path_prefix.size(), long_path_prefix)) path.erase(0, long_path_prefix.size());
+	return path;
+}
+
+// The path of "target" relative to the directory containing "base", or an empty string if there's no such path.
+static wstr relative_path(crwstr base, crwstr target) {
+	std::vector<wstr> a, b;
+	boost::split(a, strip_prefix(base), [](const wchar_t c) { return c == L'\\'; });
+	boost::split(b, strip_prefix(target), [](const wchar_t c) { return c == L'\\'; });
+	if (a.size() < 2 || b.size() < 2 || !boost::iequals(a[0], b[0])) return L"";
+	size_t common = 1;
+	while (common + 1 < a.size() && common + 1 < b.size() && boost::iequals(a[common], b[common])) common++;
+	wstr res;
+	for (auto i = common; i + 1 < a.size(); i++) res += L"..\\";
+	if (res.empty()) res = L".\\";
+	for (auto i = common; i < b.size(); i++) res += b[i] + (i + 1 < b.size() ? L"\\" : L"");
+	return res;
+}
+
+// The parent locator is a list of UTF-16 key-value pairs.
+static bool parse_locator(const char *p, const uint32_t length, std::map<wstr, wstr> &res) {
+	if (length < 20 || memcmp(p, &guid_vhdx_locator, sizeof(GUID))) return false;
+	const auto cnt = get<uint16_t>(p + 18);
+	if (20 + cnt * 12u > length) return false;
+	const auto read_str = [&](const uint32_t off, const uint16_t len, wstr &s) {
+		if (off > length || len > length - off) return false;
+		for (uint32_t i = 0; i + 1 < len; i += 2) s += static_cast<wchar_t>(get<uint16_t>(p + off + i));
+		return true;
+	};
+	for (uint32_t i = 0; i < cnt; i++) {
+		const auto pe = p + 20 + i * 12;
+		wstr key, value;
+		if (!read_str(get<uint32_t>(pe), get<uint16_t>(pe + 8), key)) return false;
+		if (!read_str(get<uint32_t>(pe + 4), get<uint16_t>(pe + 10), value)) return false;
+		res[key] = value;
+	}
+	return true;
+}
+
+static std::vector<char> build_locator(const std::vector<std::pair<wstr, wstr>> &entries) {
+	std::vector<char> res(20 + entries.size() * 12);
+	memcpy(res.data(), &guid_vhdx_locator, sizeof(GUID));
+	put(res.data() + 18, static_cast<uint16_t>(entries.size()));
+	const auto append = [&](crwstr s) {
+		const auto off = static_cast<uint32_t>(res.size());
+		for (const auto c : s) {
+			res.push_back(static_cast<char>(c & 0xFF));
+			res.push_back(static_cast<char>(c >> 8 & 0xFF));
+		}
+		return off;
+	};
+	for (size_t i = 0; i < entries.size(); i++) {
+		const auto key_off = append(entries[i].first);
+		const auto value_off = append(entries[i].second);
+		const auto pe = res.data() + 20 + i * 12;
+		put(pe, key_off);
+		put(pe + 4, value_off);
+		put(pe + 8, static_cast<uint16_t>(entries[i].first.size() * 2));
+		put(pe + 10, static_cast<uint16_t>(entries[i].second.size() * 2));
+	}
+	return res;
+}
+
+vhdx_file::vhdx_file(pio_file &file, vhdx_file *parent)
+	: file(file), disk_size(0), bat_offset(0), metadata_end(0), block_size(0), sector_size(0),
+	header_slot(0), header_seq(0), header(), header_updated(false), has_parent(false), parent(nullptr) {
+	char sig[8];
+	file.read(0, sig, sizeof sig);
+	if (memcmp(sig, "vhdxfile", sizeof sig)) fail(L"the file identifier is missing");
+	load_headers();
+	load_regions();
+	chunk_ratio = static_cast<uint32_t>((uint64_t(1) << 23) * sector_size / block_size);
+	block_count = (disk_size + block_size - 1) / block_size;
+	file_end = round_up(file.size(), mib);
+	open_parent(parent);
+}
+
+void vhdx_file::fail(crwstr reason) const {
+	throw lro_error::from_other(err_msg::err_vhdx, { file.name(), reason });
+}
+
+void vhdx_file::load_headers() {
+	char buf[2][header_size];
+	auto found = false;
+	for (uint32_t i = 0; i < 2; i++) {
+		file.read(header_offsets[i], buf[i], header_size);
+		if (memcmp(buf[i], "head", 4) || !check_checksum(buf[i], header_size)) continue;
+		const auto seq = get<uint64_t>(buf[i] + 8);
+		if (found && seq <= header_seq) continue;
+		found = true;
+		header_slot = i;
+		header_seq = seq;
+	}
+	if (!found) fail(L"no valid header is found");
+	memcpy(header, buf[header_slot], header_size);
+	if (get<uint16_t>(header + 66) != 1) fail(L"the format version isn't supported");
+	const GUID zero {};
+	if (memcmp(header + 48, &zero, sizeof zero)) {
+		fail(
+			L"the log isn't empty, which means the disk wasn't detached cleanly. "
+			L"Starting and stopping the distro once may help."
+		);
+	}
+}
+
+void vhdx_file::load_regions() {
+	std::vector<char> buf(region_table_size);
+	auto valid = false;
+	for (auto off : region_table_offsets) {
+		file.read(off, buf.data(), buf.size());
+		if (!memcmp(buf.data(), "regi", 4) && check_checksum(buf.data(), buf.size())) {
+			valid = true;
+			break;
+		}
+	}
+	if (!valid) fail(L"no valid region table is found");
+	const auto cnt = get<uint32_t>(buf.data() + 8);
+	if (cnt > (region_table_size - 16) / 32) fail(L"the region table is corrupted");
+	uint64_t bat_length = 0, metadata_offset = 0;
+	uint32_t metadata_length = 0;
+	for (uint32_t i = 0; i < cnt; i++) {
+		const auto pe = buf.data() + 16 + i * 32;
+		const auto off = get<uint64_t>(pe + 16);
+		const auto len = get<uint32_t>(pe + 24);
+		if (!memcmp(pe, &guid_bat, sizeof(GUID))) {
+			bat_offset = off;
+			bat_length = len;
+		} else if (!memcmp(pe, &guid_metadata, sizeof(GUID))) {
+			metadata_offset = off;
+			metadata_length = len;
+		} else if (get<uint32_t>(pe + 28) & 1) {
+			fail(L"an unknown required region is found");
+		}
+	}
+	if (!bat_offset || !metadata_offset) fail(L"the BAT or the metadata region is missing");
+	load_metadata(metadata_offset, metadata_length);
+
+	const auto cnt_blocks = (disk_size + block_size - 1) / block_size;
+	entry_count = count_bat_entries(cnt_blocks, block_size, sector_size, has_parent);
+	if (entry_count * 8 > bat_length) fail(L"the BAT is too small");
+	std::vector<uint64_t> entries(entry_count);
+	file.read(bat_offset, reinterpret_cast<char *>(entries.data()), entry_count * 8);
+	bat = std::make_unique<std::atomic<uint64_t>[]>(entry_count);
+	for (size_t i = 0; i < entry_count; i++) bat[i].store(entries[i], std::memory_order_relaxed);
+	// Payload blocks are never moved below the end of the other structures.
+	metadata_end = round_up(std::max({
+		mib, bat_offset + bat_length, metadata_offset + metadata_length,
+		get<uint64_t>(header + 72) + get<uint32_t>(header + 68)
+	}), mib);
+}
+
+void vhdx_file::load_metadata(const uint64_t offset, const uint32_t length) {
+	if (length < metadata_table_size) fail(L"the metadata region is too small");
+	std::vector<char> buf(length);
+	file.read(offset, buf.data(), buf.size());
+	if (memcmp(buf.data(), "metadata", 8)) fail(L"the metadata table is corrupted");
+	const auto cnt = get<uint16_t>(buf.data() + 10);
+	if (cnt > (metadata_table_size - 32) / 32) fail(L"the metadata table is corrupted");
+	uint32_t found = 0;
+	for (uint32_t i = 0; i < cnt; i++) {
+		const auto pe = buf.data() + 32 + i * 32;
+		const auto off = get<uint32_t>(pe + 16);
+		const auto len = get<uint32_t>(pe + 20);
+		if (off > length || len > length - off) fail(L"a metadata item is out of range");
+		const auto pi = buf.data() + off;
+		if (!memcmp(pe, &guid_file_params, sizeof(GUID)) && len >= 8) {
+			block_size = get<uint32_t>(pi);
+			has_parent = (get<uint32_t>(pi + 4) & file_param_has_parent) != 0;
+			found |= 1;
+		} else if (!memcmp(pe, &guid_disk_size, sizeof(GUID)) && len >= 8) {
+			disk_size = get<uint64_t>(pi);
+			found |= 2;
+		} else if (!memcmp(pe, &guid_sector_size, sizeof(GUID)) && len >= 4) {
+			sector_size = get<uint32_t>(pi);
+			found |= 4;
+		} else if (!memcmp(pe, &guid_parent_locator, sizeof(GUID))) {
+			if (!parse_locator(pi, len, parent_locator)) fail(L"the parent locator is invalid or unsupported");
+		} else if (
+			memcmp(pe, &guid_disk_id, sizeof(GUID)) && memcmp(pe, &guid_physical_sector_size, sizeof(GUID))
+			&& get<uint32_t>(pe + 24) & metadata_flag_required
+		) {
+			fail(L"an unknown required metadata item is found");
+		}
+	}
+	if (found != 7 || (has_parent && parent_locator.empty())) fail(L"a required metadata item is missing");
+	if (block_size < mib || block_size > 256 * mib || block_size & (block_size - 1)) {
+		fail(L"the block size is invalid");
+	}
+	if (sector_size != 512 && sector_size != 4096) fail(L"the sector size is invalid");
+	if (!disk_size || disk_size % sector_size) fail(L"the disk size is invalid");
+}
+
+// The parent is looked up by its relative path first, so that the disks can be moved together.
+void vhdx_file::open_parent(vhdx_file *given) {
+	if (!has_parent) return;
+	parent = given;
+	if (!parent) {
+		std::vector<wstr> paths;
+		const auto name = strip_prefix(file.name());
+		const auto sep = name.rfind(L'\\');
+		const auto rel = parent_locator.find(L"relative_path");
+		if (rel != parent_locator.end() && sep != wstr::npos) {
+			paths.push_back(long_path_prefix + get_full_path(name.substr(0, sep + 1) + rel->second));
+		}
+		const auto abs = parent_locator.find(L"absolute_win32_path");
+		if (abs != parent_locator.end()) paths.push_back(abs->second);
+		for (crwstr p : paths) {
+			try {
+				parent_file = std::make_unique<win_pio_file>(p, false, false);
+				break;
+			} catch (const lro_error &) {}
+		}
+		if (!parent_file) fail(L"the parent disk isn't found");
+		own_parent = std::make_unique<vhdx_file>(*parent_file);
+		parent = own_parent.get();
+	}
+	const auto linkage = parent_locator.find(L"parent_linkage");
+	if (linkage == parent_locator.end() || !boost::iequals(linkage->second, guid_string(parent->header + 32))) {
+		fail(L"the parent disk has been modified after this disk was created from it");
+	}
+	if (parent->disk_size != disk_size || parent->sector_size != sector_size) {
+		fail(L"the size of the parent disk doesn't match");
+	}
+}
+
+// The header is rewritten with new GUIDs before the first modification, as required by the specification. The new
+// header goes into the other slot, so that the current one stays valid if it can't be written completely.
+void vhdx_file::update_header() {
+	if (header_updated) return;
+	const auto fg = new_guid(), dg = new_guid();
+	put(header + 8, ++header_seq);
+	put(header + 16, fg);
+	put(header + 32, dg);
+	set_checksum(header, header_size);
+	header_slot = 1 - header_slot;
+	file.write(header_offsets[header_slot], header, header_size);
+	file.flush();
+	header_updated = true;
+}
+
+void vhdx_file::create(
+	pio_file &file, const uint64_t disk_size, const uint32_t block_size, const uint32_t sector_size
+) {
+	create(file, disk_size, block_size, sector_size, nullptr);
+}
+
+void vhdx_file::create_differencing(pio_file &file, const vhdx_file &parent) {
+	create(file, parent.disk_size, parent.block_size, parent.sector_size, &parent);
+}
+
+void vhdx_file::create(
+	pio_file &file, uint64_t disk_size, const uint32_t block_size, const uint32_t sector_size, const vhdx_file *parent
+) {
+	const uint32_t physical_sector_size = 4096;
+	disk_size = round_up(disk_size, sector_size);
+	const auto cnt_blocks = (disk_size + block_size - 1) / block_size;
+	const auto bat_length = round_up(count_bat_entries(cnt_blocks, block_size, sector_size, parent) * 8, mib);
+	const auto log_offset = mib, metadata_offset = 2 * mib, bat_offset = 3 * mib;
+	file.resize(bat_offset + bat_length);
+
+	std::vector<char> buf(mib);
+	memcpy(buf.data(), "vhdxfile", 8);
+	const wchar_t creator[] = L"LxRunOffline";
+	for (size_t i = 0; creator[i]; i++) put<uint16_t>(buf.data() + 8 + i * 2, creator[i]);
+	file.write(0, buf.data(), 64 << 10);
+
+	char header[header_size] {};
+	memcpy(header, "head", 4);
+	put(header + 16, new_guid());
+	put(header + 32, new_guid());
+	put<uint16_t>(header + 66, 1);
+	put(header + 68, static_cast<uint32_t>(mib));
+	put(header + 72, log_offset);
+	for (uint64_t i = 0; i < 2; i++) {
+		put(header + 8, i);
+		set_checksum(header, header_size);
+		file.write(header_offsets[i], header, header_size);
+	}
+
+	std::fill(buf.begin(), buf.end(), 0);
+	memcpy(buf.data(), "regi", 4);
+	put<uint32_t>(buf.data() + 8, 2);
+	put(buf.data() + 16, guid_bat);
+	put(buf.data() + 32, bat_offset);
+	put(buf.data() + 40, static_cast<uint32_t>(bat_length));
+	put<uint32_t>(buf.data() + 44, 1);
+	put(buf.data() + 48, guid_metadata);
+	put(buf.data() + 64, metadata_offset);
+	put(buf.data() + 72, static_cast<uint32_t>(mib));
+	put<uint32_t>(buf.data() + 76, 1);
+	set_checksum(buf.data(), region_table_size);
+	for (auto off : region_table_offsets) file.write(off, buf.data(), region_table_size);
+
+	std::fill(buf.begin(), buf.end(), 0);
+	memcpy(buf.data(), "metadata", 8);
+	const auto disk_id = new_guid();
+	std::vector<std::tuple<const GUID &, uint32_t, uint32_t>> items = {
+		{ guid_file_params, 8, metadata_flag_required },
+		{ guid_disk_size, 8, metadata_flag_virtual_disk | metadata_flag_required },
+		{ guid_disk_id, 16, metadata_flag_virtual_disk | metadata_flag_required },
+		{ guid_sector_size, 4, metadata_flag_virtual_disk | metadata_flag_required },
+		{ guid_physical_sector_size, 4, metadata_flag_virtual_disk | metadata_flag_required }
+	};
+	std::vector<char> locator;
+	if (parent) {
+		std::vector<std::pair<wstr, wstr>> entries = { { L"parent_linkage", guid_string(parent->header + 32) } };
+		const auto rel = relative_path(file.name(), parent->name());
+		if (!rel.empty()) entries.emplace_back(L"relative_path", rel);
+		entries.emplace_back(L"absolute_win32_path", strip_prefix(parent->name()));
+		locator = build_locator(entries);
+		items.emplace_back(guid_parent_locator, static_cast<uint32_t>(locator.size()), metadata_flag_required);
+	}
+	uint16_t cnt = 0;
+	uint32_t off = metadata_table_size;
+	for (const auto &item : items) {
+		const auto pe = buf.data() + 32 + cnt++ * 32;
+		put(pe, std::get<0>(item));
+		put(pe + 16, off);
+		put(pe + 20, std::get<1>(item));
+		put(pe + 24, std::get<2>(item));
+		off += std::get<1>(item);
+	}
+	put(buf.data() + 10, cnt);
+	off = metadata_table_size;
+	put(buf.data() + off, block_size);
+	if (parent) put(buf.data() + off + 4, file_param_has_parent);
+	put(buf.data() + off + 8, disk_size);
+	put(buf.data() + off + 16, disk_id);
+	put(buf.data() + off + 32, sector_size);
+	put(buf.data() + off + 36, physical_sector_size);
+	std::copy(locator.begin(), locator.end(), buf.begin() + off + 40);
+	file.write(metadata_offset, buf.data(), mib);
+	file.flush();
+}
+
+crwstr vhdx_file::name() const {
+	return file.name();
+}
+
+uint64_t vhdx_file::size() const {
+	return disk_size;
+}
+
+void vhdx_file::resize(uint64_t) {
+	fail(L"resizing isn't supported");
+}
+
+uint64_t vhdx_file::bat_index(const uint64_t block) const {
+	return block + block / chunk_ratio;
+}
+
+uint64_t vhdx_file::allocate_block(const uint64_t block) {
+	std::lock_guard<std::mutex> lock(alloc_mtx);
+	const auto idx = bat_index(block);
+	auto e = bat[idx].load(std::memory_order_acquire);
+	const auto state = e & bat_state_mask;
+	if (state == block_fully_present) return e & bat_offset_mask;
+	update_header();
+	// The parts of the block that the caller doesn't overwrite keep the data inherited from the parent.
+	std::vector<char> data;
+	if (parent && (state == block_not_present || state == block_partially_present)) {
+		data.resize(static_cast<size_t>(std::min<uint64_t>(block_size, disk_size - block * block_size)));
+		read(block * block_size, data.data(), data.size());
+	}
+	uint64_t off;
+	if (state == block_partially_present) {
+		off = e & bat_offset_mask;
+	} else {
+		off = file_end;
+		file_end += block_size;
+		file.resize(file_end);
+	}
+	if (!data.empty()) file.write(off, data.data(), data.size());
+	e = off | block_fully_present;
+	file.write(bat_offset + idx * 8, reinterpret_cast<const char *>(&e), 8);
+	bat[idx].store(e, std::memory_order_release);
+	return off;
+}
+
+void vhdx_file::write_bat() {
+	std::vector<uint64_t> entries(entry_count);
+	for (size_t i = 0; i < entry_count; i++) entries[i] = bat[i].load(std::memory_order_relaxed);
+	file.write(bat_offset, reinterpret_cast<const char *>(entries.data()), entry_count * 8);
+}
+
+void vhdx_file::read(uint64_t offset, char *buf, size_t size) {
+	if (offset > disk_size || size > disk_size - offset) {
+		throw lro_error::from_win32(err_msg::err_read_file, { file.name() }, ERROR_HANDLE_EOF);
+	}
+	while (size) {
+		const auto block = offset / block_size;
+		const auto in = offset % block_size;
+		const auto cnt = static_cast<size_t>(std::min<uint64_t>(size, block_size - in));
+		const auto e = bat[bat_index(block)].load(std::memory_order_acquire);
+		const auto state = e & bat_state_mask;
+		if (state == block_fully_present) file.read((e & bat_offset_mask) + in, buf, cnt);
+		else if (state == block_partially_present) read_partial(block, e, static_cast<uint32_t>(in), buf, cnt);
+		else if (state == block_not_present && parent) parent->read(offset, buf, cnt);
+		else memset(buf, 0, cnt);
+		offset += cnt;
+		buf += cnt;
+		size -= cnt;
+	}
+}
+
+// Sectors whose bits are set in the sector bitmap of the chunk are stored in this file, and the others are read from
+// the parent.
+void vhdx_file::read_partial(
+	const uint64_t block, const uint64_t entry, const uint32_t in, char *buf, const size_t size
+) {
+	const auto bitmap = bat[(block / chunk_ratio + 1) * (chunk_ratio + 1) - 1].load(std::memory_order_acquire);
+	if (!parent || (bitmap & bat_state_mask) != block_fully_present) fail(L"a sector bitmap is missing");
+	const auto first = in / sector_size;
+	const auto bit_base = (block % chunk_ratio) * (block_size / sector_size) + first;
+	std::vector<char> bits((bit_base % 8 + (in + size - 1) / sector_size - first) / 8 + 1);
+	file.read((bitmap & bat_offset_mask) + bit_base / 8, bits.data(), bits.size());
+	const auto is_set = [&](const uint64_t pos) {
+		const auto i = bit_base % 8 + pos / sector_size - first;
+		return (bits[i / 8] >> (i % 8) & 1) != 0;
+	};
+	const uint64_t end = in + size;
+	for (uint64_t pos = in; pos < end;) {
+		const auto set = is_set(pos);
+		auto next = (pos / sector_size + 1) * sector_size;
+		while (next < end && is_set(next) == set) next += sector_size;
+		next = std::min(next, end);
+		if (set) file.read((entry & bat_offset_mask) + pos, buf + (pos - in), next - pos);
+		else parent->read(block * block_size + pos, buf + (pos - in), next - pos);
+		pos = next;
+	}
+}
+
+void vhdx_file::write(uint64_t offset, const char *buf, size_t size) {
+	if (offset > disk_size || size > disk_size - offset) {
+		throw lro_error::from_win32(err_msg::err_write_file, { file.name() }, ERROR_HANDLE_EOF);
+	}
+	if (!header_updated) {
+		std::lock_guard<std::mutex> lock(alloc_mtx);
+		update_header();
+	}
+	while (size) {
+		const auto block = offset / block_size;
+		const auto in = offset % block_size;
+		const auto cnt = static_cast<size_t>(std::min<uint64_t>(size, block_size - in));
+		const auto e = bat[bat_index(block)].load(std::memory_order_acquire);
+		const auto base = (e & bat_state_mask) == block_fully_present ? e & bat_offset_mask : allocate_block(block);
+		file.write(base + in, buf, cnt);
+		offset += cnt;
+		buf += cnt;
+		size -= cnt;
+	}
+}
+
+void vhdx_file::flush() {
+	file.flush();
+}
+
+uint32_t vhdx_file::get_block_size() const {
+	return block_size;
+}
+
+uint32_t vhdx_file::get_sector_size() const {
+	return sector_size;
+}
+
+uint64_t vhdx_file::get_block_count() const {
+	return block_count;
+}
+
+bool vhdx_file::is_block_present(const uint64_t block) const {
+	const auto state = bat[bat_index(block)].load(std::memory_order_acquire) & bat_state_mask;
+	if (state == block_fully_present || state == block_partially_present) return true;
+	if (state != block_not_present || !parent) return false;
+	// The parent may use a different block size.
+	const auto first = block * block_size / parent->block_size;
+	const auto last = (std::min((block + 1) * block_size, disk_size) - 1) / parent->block_size;
+	for (auto b = first; b <= last; b++) {
+		if (parent->is_block_present(b)) return true;
+	}
+	return false;
+}
+
+bool vhdx_file::is_differencing() const {
+	return has_parent;
+}
+
+uint64_t vhdx_file::compact(const std::function<bool(uint64_t)> &unused, const uint32_t thread_count) {
+	// Partially present blocks and sector bitmaps would have to be moved as well.
+	if (has_parent) fail(L"compacting a differencing disk isn't supported");
+	std::lock_guard<std::mutex> lock(alloc_mtx);
+	update_header();
+	std::vector<std::pair<uint64_t, uint64_t>> live;
+	uint64_t dropped = 0;
+	for (uint64_t block = 0; block < block_count; block++) {
+		const auto idx = bat_index(block);
+		const auto e = bat[idx].load(std::memory_order_relaxed);
+		if ((e & bat_state_mask) != block_fully_present) continue;
+		if (unused(block)) {
+			bat[idx].store(0, std::memory_order_relaxed);
+			dropped++;
+		} else {
+			live.emplace_back(e & bat_offset_mask, block);
+		}
+	}
+	// The dropped blocks must be gone from the BAT on disk before anything is copied over them.
+	if (dropped) {
+		write_bat();
+		file.flush();
+	}
+
+	// Each gap between the live blocks is filled with the blocks taken from the end of the file, as long as they are
+	// placed before where they are now. The copies never overlap any live block, including their own sources.
+	std::sort(live.begin(), live.end());
+	std::vector<std::pair<uint64_t, uint64_t>> gaps;
+	auto pos = metadata_end;
+	for (const auto &b : live) {
+		if (b.first > pos) gaps.emplace_back(pos, b.first - pos);
+		pos = std::max(pos, b.first + block_size);
+	}
+	std::vector<std::pair<uint64_t, uint64_t>> moves;
+	size_t gap = 0;
+	while (!live.empty()) {
+		while (gap < gaps.size() && gaps[gap].second < block_size) gap++;
+		if (gap == gaps.size() || gaps[gap].first + block_size > live.back().first) break;
+		moves.emplace_back(live.back().second, gaps[gap].first);
+		gaps[gap].first += block_size;
+		gaps[gap].second -= block_size;
+		live.pop_back();
+	}
+	if (!moves.empty()) {
+		// Buffers are only allocated by running tasks, so at most one block per thread is held in memory.
+		task_pool pool(thread_count);
+		for (const auto &m : moves) {
+			const auto from = bat[bat_index(m.first)].load(std::memory_order_relaxed) & bat_offset_mask;
+			pool.submit([this, from, to = m.second] {
+				std::vector<char> buf(block_size);
+				file.read(from, buf.data(), block_size);
+				file.write(to, buf.data(), block_size);
+			});
+		}
+		pool.wait();
+		file.flush();
+		for (const auto &m : moves) {
+			bat[bat_index(m.first)].store(m.second | block_fully_present, std::memory_order_relaxed);
+		}
+		write_bat();
+		file.flush();
+	}
+
+	file_end = metadata_end;
+	for (const auto &b : live) file_end = std::max(file_end, b.first + block_size);
+	for (const auto &m : moves) file_end = std::max(file_end, m.second + block_size);
+	if (file_end < file.size()) file.resize(file_end);
+	return dropped;
+}
+
+void vhdx_file::copy_to(pio_file &target, const std::function<bool(uint64_t)> &unused, const uint32_t thread_count) {
+	create(target, disk_size, block_size, sector_size, nullptr);
+	vhdx_file out(target);
+	task_pool pool(thread_count);
+	for (uint64_t block = 0; block < block_count; block++) {
+		if (!is_block_present(block) || (unused && unused(block))) continue;
+		pool.submit([this, &out, block] {
+			const auto off = block * block_size;
+			const auto len = static_cast<size_t>(std::min<uint64_t>(block_size, disk_size - off));
+			std::vector<char> buf(len);
+			read(off, buf.data(), len);
+			if (std::any_of(buf.begin(), buf.end(), [](const char c) { return c != 0; })) {
+				out.write(off, buf.data(), len);
+			}
+		});
+	}
+	pool.wait();
+	out.flush();
+}
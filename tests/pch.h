@@ -3,8 +3,12 @@
 #include <cstdint>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <memory>
+#include <random>
+#include <thread>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -19,9 +23,20 @@
 #include <ShlObj.h>
 #include <malloc.h>
 
+#include <LxRunOffline/async.h>
+#include <LxRunOffline/batch.h>
+#include <LxRunOffline/diff.h>
 #include <LxRunOffline/error.h>
+#include <LxRunOffline/ext4.h>
 #include <LxRunOffline/fs.h>
+#include <LxRunOffline/hash.h>
+#include <LxRunOffline/manifest.h>
+#include <LxRunOffline/move.h>
+#include <LxRunOffline/parallel.h>
+#include <LxRunOffline/pio.h>
+#include <LxRunOffline/vhdx.h>
 #include <LxRunOffline/path.h>
 #include <LxRunOffline/reg.h>
 #include <LxRunOffline/shortcut.h>
+#include <LxRunOffline/transform.h>
 #include <LxRunOffline/utils.h>
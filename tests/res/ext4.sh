@@ -0,0 +1,39 @@
+#!/bin/sh
+# Regenerates ext4.tar.gz, which holds an ext4 image made by mkfs.ext4 for test_ext4/test_mkfs_image.
+# Needs e2fsprogs 1.43 or later for "mkfs.ext4 -d", and root for the file owners. The checked-in image was made with
+# e2fsprogs 1.47.0.
+set -eu
+out="$(cd "$(dirname "$0")" && pwd)/ext4.tar.gz"
+tmp="$(mktemp -d)"
+trap 'rm -rf "$tmp"' EXIT
+src="$tmp/src"
+
+mkdir -p "$src/dir" "$src/many"
+printf 'hello\n' > "$src/dir/file"
+ln "$src/dir/file" "$src/dir/hard"
+# A file with a hole between its first and last blocks.
+printf '%4096s' '' | tr ' ' a > "$src/dir/sparse"
+printf 'ccc' | dd of="$src/dir/sparse" bs=4096 seek=3 conv=notrunc status=none
+# Spans many blocks, so that it's mapped by a longer extent.
+i=0
+while [ $i -lt 10000 ]; do
+	printf '%031d\n' $i
+	i=$((i + 1))
+done > "$src/big"
+ln -s dir/file "$src/link"
+ln -s "$(printf '%0100d' 0 | tr 0 t)" "$src/longlink"
+# Enough entries for a directory of several blocks.
+i=0
+while [ $i -lt 300 ]; do
+	: > "$src/many/entry_$i"
+	i=$((i + 1))
+done
+chmod 0750 "$src/dir"
+chmod 0600 "$src/dir/sparse"
+chown -R 1000:1000 "$src/dir"
+find "$src" -exec touch -h -d @1600000000 {} +
+
+E2FSPROGS_FAKE_TIME=1600000000 mkfs.ext4 -q -F -b 4096 -U 5d7a7a62-1c3e-4f34-9e0e-2f6a3b7bd001 \
+	-E root_owner=0:0,hash_seed=5d7a7a62-1c3e-4f34-9e0e-2f6a3b7bd002 -d "$src" "$tmp/ext4.img" 16M
+e2fsck -fn "$tmp/ext4.img" > /dev/null
+tar -C "$tmp" --owner=0 --group=0 --mtime=@1600000000 -cf - ext4.img | gzip -9n > "$out"
@@ -0,0 +1,140 @@
+#include <boost/test/unit_test.hpp>
+#include "pch.h"
+#include "fixtures.h"
+#include "utils.h"
+
+using namespace boost::unit_test;
+
+namespace {
+	// Points a standard handle to a file while it exists.
+	class std_redirect {
+		const DWORD id;
+		const HANDLE old;
+		unique_ptr_del<HANDLE> hf;
+	public:
+		std_redirect(const DWORD id, crwstr path, const bool write)
+			: id(id), old(GetStdHandle(id)), hf(CreateFile(
+				path.c_str(), write ? GENERIC_WRITE : GENERIC_READ, 0, nullptr,
+				write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr
+			), &CloseHandle) {
+			BOOST_TEST_REQUIRE(hf.get() != INVALID_HANDLE_VALUE);
+			SetStdHandle(id, hf.get());
+		}
+
+		~std_redirect() {
+			SetStdHandle(id, old);
+		}
+	};
+}
+
+BOOST_AUTO_TEST_SUITE(test_archive)
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_round_trip) {
+	// Incompressible data larger than a mapped block, so that the input spans several reads.
+	std::string big(20 << 20, '\0');
+	uint64_t x = 0x9E3779B97F4A7C15ull;
+	for (auto &c : big) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		c = static_cast<char>(x);
+	}
+	{
+		archive_writer writer(L"test.tar.gz");
+		write_entry(writer, L"dir/", 0040755);
+		write_entry(writer, L"dir/small", 0100644, "abc");
+		write_entry(writer, L"dir/big", 0100600, big);
+	}
+
+	recording_writer writer;
+	archive_reader(L"test.tar.gz", L"").run(writer);
+	const auto &e = writer.entries;
+	BOOST_TEST_REQUIRE(e.size() == 4u);
+	BOOST_TEST(e[1].path.c_str() == L"dir/");
+	BOOST_TEST(e[2].path.c_str() == L"dir/small");
+	BOOST_TEST(e[2].mode == 0100644u);
+	BOOST_TEST(e[2].data == "abc");
+	BOOST_TEST(e[3].path.c_str() == L"dir/big");
+	BOOST_TEST(e[3].mode == 0100600u);
+	BOOST_TEST((e[3].data == big));
+}
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_std_streams) {
+	// Larger than the blocks passed between the pipe worker and libarchive.
+	std::string big(10 << 20, '\0');
+	for (size_t i = 0; i < big.size(); i++) big[i] = static_cast<char>(i * 7 + (i >> 12));
+	{
+		const std_redirect out(STD_OUTPUT_HANDLE, L"out.tar.gz", true);
+		archive_writer writer(L"-");
+		write_entry(writer, L"big", 0100644, big);
+	}
+	recording_writer writer;
+	{
+		const std_redirect in(STD_INPUT_HANDLE, L"out.tar.gz", false);
+		archive_reader(L"-", L"").run(writer);
+	}
+	BOOST_TEST_REQUIRE(writer.entries.size() == 2u);
+	BOOST_TEST(writer.entries[1].path.c_str() == L"big");
+	BOOST_TEST((writer.entries[1].data == big));
+}
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_scan) {
+	{
+		archive_writer writer(L"test.tar.xz");
+		write_entry(writer, L"dir/", 0040755);
+		write_entry(writer, L"dir/small", 0100644, "abc");
+		write_entry(writer, L"dir/big", 0100644, std::string(3 << 20, '\0'));
+		write_entry(writer, L"other", 0100644, "d");
+	}
+	auto res = scan_archive(L"test.tar.xz", L"");
+	BOOST_TEST(res.entries == 4u);
+	BOOST_TEST(res.bytes == (3u << 20) + 4);
+	res = scan_archive(L"test.tar.xz", L"dir");
+	BOOST_TEST(res.entries == 2u);
+	BOOST_TEST(res.bytes == (3u << 20) + 3);
+	check_free_space(L".", res);
+	BOOST_CHECK_THROW(check_free_space(L".", { 1, uint64_t(1) << 62 }), lro_error);
+	// Two copies of more than half of the free space fit one at a time, but not both on the same volume.
+	ULARGE_INTEGER avail;
+	BOOST_TEST_REQUIRE(GetDiskFreeSpaceEx(L".", &avail, nullptr, nullptr));
+	const scan_result half { 0, avail.QuadPart / 10 * 6 };
+	check_free_space(L"a", half);
+	BOOST_CHECK_THROW(check_free_space(std::vector<std::wstring> { L"a", L"b" }, half), lro_error);
+}
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_filter_ext) {
+	// Both .tgz and unknown extensions are written as gzip, which starts with 1f 8b.
+	for (const auto name : { L"test.tgz", L"test.unknown" }) {
+		{
+			archive_writer writer(name);
+			write_entry(writer, L"a", 0100644, "abc");
+		}
+		const auto f = _wfopen(name, L"rb");
+		BOOST_TEST_REQUIRE(f != nullptr);
+		unsigned char magic[2] = {};
+		BOOST_TEST(fread(magic, 1, 2, f) == 2u);
+		fclose(f);
+		BOOST_TEST(magic[0] == 0x1fu);
+		BOOST_TEST(magic[1] == 0x8bu);
+		recording_writer writer;
+		archive_reader(name, L"").run(writer);
+		BOOST_TEST_REQUIRE(writer.entries.size() == 2u);
+		BOOST_TEST(writer.entries[1].data == "abc");
+	}
+}
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_empty) {
+	const auto f = _wfopen(L"empty.tar", L"wb");
+	BOOST_TEST_REQUIRE(f != nullptr);
+	fclose(f);
+	recording_writer writer;
+	archive_reader(L"empty.tar", L"").run(writer);
+	BOOST_TEST(writer.entries.size() == 1u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
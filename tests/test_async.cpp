@@ -0,0 +1,95 @@
+#include <boost/test/unit_test.hpp>
+#include "pch.h"
+#include "utils.h"
+
+using namespace boost::unit_test;
+
+BOOST_AUTO_TEST_SUITE(test_async)
+
+BOOST_AUTO_TEST_CASE(test_order) {
+	const std::vector<char> data(3000);
+	recording_writer writer;
+	writer.files_only = true;
+	async_writer aw(writer, 10000);
+	for (auto i = 0; i < 1000; i++) {
+		aw.path->data = std::to_wstring(i);
+		file_attr attr { i % 10 ? 0100644u : 0020644u, 0, 0, 0, {}, {}, {}, 0, 0, nullptr };
+		aw.write_new_file(&attr);
+		aw.write_file_data(data.data(), static_cast<uint32_t>(data.size()));
+		aw.write_file_data(nullptr, 0);
+	}
+	aw.target_path->data = L"1";
+	aw.write_hard_link();
+	aw.close();
+	const auto &e = writer.entries;
+	BOOST_TEST_REQUIRE(e.size() == 1001u);
+	for (auto i = 0; i < 1000; i++) {
+		BOOST_TEST(e[i].path.c_str() == std::to_wstring(i).c_str());
+		// Data of skipped files must be dropped.
+		BOOST_TEST(e[i].data.size() == (i % 10 ? data.size() : 0u));
+	}
+	BOOST_TEST(e[1000].path.c_str() == L"999");
+	BOOST_TEST(e[1000].target.c_str() == L"1");
+}
+
+BOOST_AUTO_TEST_CASE(test_error) {
+	recording_writer writer;
+	writer.fail_at = 50;
+	const auto run = [&] {
+		async_writer aw(writer, 10000);
+		for (auto i = 0; i < 1000; i++) {
+			file_attr attr { 0100644, 0, 0, 0, {}, {}, {}, 0, 0, nullptr };
+			aw.write_new_file(&attr);
+			aw.write_file_data(nullptr, 0);
+		}
+		aw.close();
+	};
+	BOOST_CHECK_THROW(run(), lro_error);
+	BOOST_TEST(writer.entries.size() == 50u);
+}
+
+BOOST_AUTO_TEST_CASE(test_tee) {
+	const std::vector<char> data(3000);
+	recording_writer w1, w2;
+	w1.files_only = w2.files_only = true;
+	tee_writer tw({ &w1, &w2 }, 10000);
+	for (auto i = 0; i < 100; i++) {
+		BOOST_TEST_REQUIRE(linux_path(L"dir/" + std::to_wstring(i), L"").convert(*tw.path));
+		file_attr attr { i % 10 ? 0100644u : 0020644u, 0, 0, 0, {}, {}, {}, 0, 0, nullptr };
+		BOOST_TEST(tw.write_new_file(&attr));
+		tw.write_file_data(data.data(), static_cast<uint32_t>(data.size()));
+		tw.write_file_data(nullptr, 0);
+	}
+	BOOST_TEST_REQUIRE(linux_path(L"dir/1", L"").convert(*tw.target_path));
+	tw.write_hard_link();
+	tw.close();
+	for (const auto w : { &w1, &w2 }) {
+		const auto &e = w->entries;
+		BOOST_TEST_REQUIRE(e.size() == 101u);
+		for (auto i = 0; i < 100; i++) {
+			BOOST_TEST(e[i].path.c_str() == (L"dir/" + std::to_wstring(i)).c_str());
+			BOOST_TEST(e[i].data.size() == (i % 10 ? data.size() : 0u));
+		}
+		BOOST_TEST(e[100].path.c_str() == L"dir/99");
+		BOOST_TEST(e[100].target.c_str() == L"dir/1");
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_tee_error) {
+	recording_writer w1, w2;
+	w2.fail_at = 50;
+	const auto run = [&] {
+		tee_writer tw({ &w1, &w2 }, 10000);
+		for (auto i = 0; i < 1000; i++) {
+			BOOST_TEST_REQUIRE(linux_path(std::to_wstring(i), L"").convert(*tw.path));
+			file_attr attr { 0100644, 0, 0, 0, {}, {}, {}, 0, 0, nullptr };
+			tw.write_new_file(&attr);
+			tw.write_file_data(nullptr, 0);
+		}
+		tw.close();
+	};
+	BOOST_CHECK_THROW(run(), lro_error);
+	BOOST_TEST(w2.entries.size() == 50u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,85 @@
+#include <boost/test/unit_test.hpp>
+#include "pch.h"
+
+BOOST_AUTO_TEST_SUITE(test_batch)
+
+BOOST_AUTO_TEST_CASE(test_parse) {
+	auto cmd = parse_batch_command(
+		LR"( {"id": 42, "x": {"a": [1, true, null, "q"]}, "args": ["se", "-n", "dé\"", "-v", "A=1"]} )"
+	);
+	BOOST_TEST(cmd.id.c_str() == L"42");
+	BOOST_TEST_REQUIRE(cmd.args.size() == 5u);
+	BOOST_TEST(cmd.args[2].c_str() == L"dé\"");
+	cmd = parse_batch_command(LR"(["list"])");
+	BOOST_TEST(cmd.id.c_str() == L"null");
+	BOOST_TEST(cmd.args[0].c_str() == L"list");
+	// String IDs are echoed back with their escapes.
+	cmd = parse_batch_command(LR"({"args":["l"],"id":"a\nb"})");
+	BOOST_TEST(cmd.id.c_str() == LR"("a\nb")");
+}
+
+BOOST_AUTO_TEST_CASE(test_parse_invalid) {
+	for (const auto s : {
+		L"", L"{}", L"[]", LR"(["a",])", LR"({"args":["a"]} x)", LR"(["a\x"])", LR"({"id": foo, "args":["a"]})", LR"(["a)"
+	}) {
+		BOOST_CHECK_EXCEPTION(parse_batch_command(s), lro_error, [](const lro_error &e) {
+			return e.msg_code == err_msg::err_batch_command;
+		});
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_check) {
+	check_batch_command(parse_batch_command(LR"(["i", "-n", "a", "-d", "-dir", "-f", "a-"])"));
+	for (const auto s : {
+		LR"(["i", "-n", "a", "-f", "-"])", LR"(["e", "-n", "a", "-f-"])", LR"(["cv", "-f", "a", "--output=-"])"
+	}) {
+		BOOST_CHECK_EXCEPTION(check_batch_command(parse_batch_command(s)), lro_error, [](const lro_error &e) {
+			return e.msg_code == err_msg::err_batch_command;
+		});
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_format) {
+	BOOST_TEST(
+		format_batch_result(L"7", 1, L"a\"b\\\né", L"").c_str()
+			== LR"({"id":7,"status":1,"output":"a\"b\\\n\u00e9","error":""})"
+	);
+}
+
+BOOST_AUTO_TEST_CASE(test_runner) {
+	std::mutex mutex;
+	std::vector<wstr> order;
+	std::atomic<int> cur = 0, max = 0;
+	{
+		batch_runner runner(4, [&](const batch_command &cmd) {
+			const auto n = ++cur;
+			auto old = max.load();
+			while (n > old && !max.compare_exchange_weak(old, n)) {}
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			{
+				const std::lock_guard<std::mutex> lock(mutex);
+				order.push_back(cmd.id);
+			}
+			--cur;
+		});
+		for (auto i = 0; i < 8; i++) runner.submit({ std::to_wstring(i), { L"i", L"-n", L"d" + std::to_wstring(i % 4) } });
+		runner.submit({ L"list", { L"l" } });
+		runner.submit({ L"after", { L"gd", L"-nd0" } });
+		// The other distros of "install --also" are also waited for.
+		runner.submit({ L"also", { L"i", L"-n", L"d2", L"--also=d3=dir", L"--al", L"d1=dir" } });
+		runner.submit({ L"d1", { L"se", L"-n", L"d1" } });
+		runner.submit({ L"d3", { L"se", L"-n", L"d3" } });
+		runner.wait();
+	}
+	BOOST_TEST(max == 4);
+	BOOST_TEST_REQUIRE(order.size() == 13u);
+	const auto pos = [&](crwstr id) { return std::find(order.begin(), order.end(), id) - order.begin(); };
+	// Commands on the same distro keep their order, and one without a distro waits for all earlier ones.
+	for (auto i = 0; i < 4; i++) BOOST_TEST(pos(std::to_wstring(i)) < pos(std::to_wstring(i + 4)));
+	BOOST_TEST(pos(L"list") == 8);
+	BOOST_TEST(pos(L"after") == 9);
+	BOOST_TEST(pos(L"also") < pos(L"d1"));
+	BOOST_TEST(pos(L"also") < pos(L"d3"));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,138 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/test/data/monomorphic.hpp>
+#include <boost/test/data/test_case.hpp>
+#include "pch.h"
+#include "fixtures.h"
+#include "utils.h"
+
+using namespace boost::unit_test;
+
+BOOST_AUTO_TEST_SUITE(test_diff)
+
+static manifest_entry make_entry(const std::string &path, const uint64_t hash) {
+	return { path, "", 0100644, 0, 0, 0, {}, hash };
+}
+
+// The larger count forces the sorter to spill runs to temporary files.
+BOOST_DATA_TEST_CASE(test_sorter, data::make({ 1000, 600000 }), count) {
+	entry_sorter sorter;
+	for (auto i = 0; i < count; i++) {
+		sorter.add(make_entry(std::to_string((i * 7919) % count), i));
+	}
+	sorter.add(make_entry("0", 42));
+	sorter.add(make_entry("00", 43));
+	sorter.finish();
+	manifest_entry e, last;
+	auto n = 0;
+	while (sorter.next(e)) {
+		if (n > 0) BOOST_TEST_REQUIRE(last.path < e.path);
+		if (e.path == "0") BOOST_TEST(e.hash == 42u);
+		last = e;
+		n++;
+	}
+	BOOST_TEST(n == count + 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_sorter_empty) {
+	entry_sorter sorter;
+	sorter.finish();
+	manifest_entry e;
+	BOOST_TEST(!sorter.next(e));
+}
+
+// Writes the entries both sides of the diff tests have in common, including a pair of hard links.
+static void write_common(fs_writer &writer) {
+	write_entry(writer, L"", 0040755);
+	write_entry(writer, L"dir/", 0040755);
+	write_entry(writer, L"dir/same", 0100644, "same");
+	write_hard_link(writer, L"dir/same2", L"dir/same");
+	write_entry(writer, L"h1", 0100644, "h");
+	write_entry(writer, L"link", file_attr { 0120777, 0, 0, 0, {}, {}, {}, 0, 0, "dir/same" });
+}
+
+static std::map<wstr, std::pair<wchar_t, wstr>> run_diff(const diff_source &a, const diff_source &b) {
+	std::map<wstr, std::pair<wchar_t, wstr>> res;
+	const auto cnt = diff_trees(a, b, 4, [&](const wchar_t status, crwstr path, crwstr fields) {
+		BOOST_TEST(res.emplace(path, std::make_pair(status, fields)).second);
+	});
+	BOOST_TEST(cnt == res.size());
+	return res;
+}
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_diff_trees) {
+	const auto file = [](const uint32_t mode, const uint32_t uid, const uint64_t mt) {
+		return file_attr { mode, uid, 0, 0, {}, { mt, 0 }, {}, 0, 0, nullptr };
+	};
+	{
+		wsl_v2_writer writer(L"a");
+		write_common(writer);
+		write_entry(writer, L"removed", 0100644, "r");
+		write_entry(writer, L"mode", 0100644);
+		write_entry(writer, L"owner", 0100644);
+		write_entry(writer, L"content", file(0100644, 0, 1), "aaaa");
+		write_entry(writer, L"touched", file(0100644, 0, 1), "t");
+		write_entry(writer, L"size", 0100644, "a");
+		write_entry(writer, L"type", 0100644);
+		write_hard_link(writer, L"h2", L"h1");
+	}
+	{
+		wsl_v2_writer writer(L"b");
+		write_common(writer);
+		write_entry(writer, L"added/", 0040755);
+		write_entry(writer, L"mode", 0100600);
+		write_entry(writer, L"owner", file(0100644, 1000, 0));
+		write_entry(writer, L"content", file(0100644, 0, 2), "bbbb");
+		// Only the time has changed, so comparing the contents finds nothing else.
+		write_entry(writer, L"touched", file(0100644, 0, 2), "t");
+		write_entry(writer, L"size", 0100644, "ab");
+		write_entry(writer, L"type", 0040755);
+		// The same data, but no longer the same file.
+		write_entry(writer, L"h2", 0100644, "h");
+	}
+	const auto res = run_diff(diff_source::from_distro(2, L"a"), diff_source::from_distro(2, L"b"));
+	const std::map<wstr, std::pair<wchar_t, wstr>> expected {
+		{ L"added", { L'A', L"" } },
+		{ L"content", { L'M', L"mtime,content" } },
+		{ L"h2", { L'M', L"link" } },
+		{ L"mode", { L'M', L"mode" } },
+		{ L"owner", { L'M', L"owner" } },
+		{ L"removed", { L'D', L"" } },
+		{ L"size", { L'M', L"size" } },
+		{ L"touched", { L'M', L"mtime" } },
+		{ L"type", { L'M', L"type" } }
+	};
+	BOOST_TEST_REQUIRE(res.size() == expected.size());
+	for (const auto &p : expected) {
+		const auto it = res.find(p.first);
+		BOOST_TEST_REQUIRE((it != res.end()));
+		BOOST_TEST(it->second.first == p.second.first);
+		BOOST_TEST(it->second.second.c_str() == p.second.second.c_str());
+	}
+	BOOST_TEST(run_diff(diff_source::from_distro(2, L"b"), diff_source::from_distro(2, L"b")).empty());
+}
+
+// An archive exported from a distribution holds the same tree, with its hard links and its contents hashed inline.
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_diff_archive) {
+	{
+		wsl_v2_writer writer(L"a");
+		write_common(writer);
+	}
+	{
+		archive_writer writer(L"a.tar.gz");
+		wsl_v2_reader(L"a").run(writer);
+	}
+	BOOST_TEST(run_diff(diff_source::from_archive(L"a.tar.gz", L""), diff_source::from_distro(2, L"a")).empty());
+	{
+		archive_writer writer(L"b.tar.gz");
+		write_common(writer);
+		write_entry(writer, L"extra", 0100644, "e");
+	}
+	const auto res = run_diff(diff_source::from_archive(L"a.tar.gz", L""), diff_source::from_archive(L"b.tar.gz", L""));
+	BOOST_TEST_REQUIRE(res.size() == 1u);
+	BOOST_TEST(res.begin()->first.c_str() == L"extra");
+	BOOST_TEST(res.begin()->second.first == L'A');
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,272 @@
+#include <boost/test/unit_test.hpp>
+#include "pch.h"
+#include "fixtures.h"
+#include "utils.h"
+
+using namespace boost::unit_test;
+
+namespace {
+	// A minimal ext4 filesystem with 1 KiB blocks and a single block group.
+	class image_builder {
+		static const uint32_t block_size = 1024, inode_size = 256, inode_table = 3;
+	public:
+		std::vector<char> data = std::vector<char>(64 * block_size);
+
+		template<typename T>
+		void put(const size_t off, const T v) {
+			memcpy(data.data() + off, &v, sizeof v);
+		}
+
+		image_builder() {
+			const auto sb = 1024;
+			put<uint32_t>(sb + 0x0, 16);
+			put<uint32_t>(sb + 0x4, 64);
+			put<uint32_t>(sb + 0x14, 1);
+			put<uint32_t>(sb + 0x20, 8192);
+			put<uint32_t>(sb + 0x28, 16);
+			put<uint16_t>(sb + 0x38, 0xEF53);
+			put<uint32_t>(sb + 0x4C, 1);
+			put<uint16_t>(sb + 0x58, inode_size);
+			put<uint32_t>(sb + 0x60, 0x42);
+			put<uint32_t>(2 * block_size + 0x8, inode_table);
+		}
+
+		size_t inode(const uint32_t ino, const uint32_t mode, const uint64_t size, const uint16_t links) {
+			const size_t p = inode_table * block_size + (ino - 1) * inode_size;
+			put<uint16_t>(p, mode);
+			put<uint16_t>(p + 0x2, 1000);
+			put<uint32_t>(p + 0x4, static_cast<uint32_t>(size));
+			put<uint32_t>(p + 0x10, 1600000000);
+			put<uint16_t>(p + 0x1A, links);
+			put<uint16_t>(p + 0x80, 32);
+			return p;
+		}
+
+		// Maps the given (logical, physical) blocks with an extent tree stored in the inode.
+		void extents(const size_t inode, const std::vector<std::pair<uint32_t, uint32_t>> &blocks) {
+			put<uint32_t>(inode + 0x20, 0x80000);
+			const auto p = inode + 0x28;
+			put<uint16_t>(p, 0xF30A);
+			put<uint16_t>(p + 2, static_cast<uint16_t>(blocks.size()));
+			put<uint16_t>(p + 4, 4);
+			for (size_t i = 0; i < blocks.size(); i++) {
+				put<uint32_t>(p + 12 + i * 12, blocks[i].first);
+				put<uint16_t>(p + 16 + i * 12, 1);
+				put<uint32_t>(p + 20 + i * 12, blocks[i].second);
+			}
+		}
+
+		void dir_block(const uint32_t block, const std::vector<std::pair<std::string, uint32_t>> &entries) {
+			size_t p = block * block_size;
+			for (size_t i = 0; i < entries.size(); i++) {
+				const auto &name = entries[i].first;
+				const auto rec_len = i + 1 == entries.size()
+					? block_size - (p - block * block_size)
+					: (8 + name.size() + 3) / 4 * 4;
+				put<uint32_t>(p, entries[i].second);
+				put<uint16_t>(p + 4, static_cast<uint16_t>(rec_len));
+				data[p + 6] = static_cast<char>(name.size());
+				memcpy(data.data() + p + 8, name.data(), name.size());
+				p += rec_len;
+			}
+		}
+	};
+}
+
+BOOST_AUTO_TEST_SUITE(test_ext4)
+
+BOOST_AUTO_TEST_CASE(test_read) {
+	image_builder img;
+	img.extents(img.inode(2, 0040755, 1024, 3), { { 0, 7 } });
+	img.dir_block(7, { { ".", 2 }, { "..", 2 }, { "file", 12 }, { "link", 13 }, { "dir", 14 } });
+	// A file with a hole in its second block.
+	img.extents(img.inode(12, 0100644, 2100, 2), { { 0, 8 }, { 2, 9 } });
+	memset(img.data.data() + 8 * 1024, 'a', 1024);
+	memset(img.data.data() + 9 * 1024, 'c', 1024);
+	// A fast symlink stores its target in i_block.
+	memcpy(img.data.data() + img.inode(13, 0120777, 4, 1) + 0x28, "file", 4);
+	img.extents(img.inode(14, 0040700, 1024, 2), { { 0, 10 } });
+	img.dir_block(10, { { ".", 14 }, { "..", 2 }, { "same", 12 } });
+
+	memory_pio_file mf;
+	vhdx_file::create(mf, 16 << 20, 1 << 20);
+	vhdx_file vf(mf);
+	vf.write(0, img.data.data(), img.data.size());
+
+	recording_writer writer;
+	ext4_reader(vf).run(writer);
+	const auto &e = writer.entries;
+	BOOST_TEST_REQUIRE(e.size() == 5u);
+	BOOST_TEST(e[0].path.c_str() == L"");
+	BOOST_TEST(e[0].mode == 0040755u);
+	BOOST_TEST(e[1].path.c_str() == L"file");
+	BOOST_TEST(e[1].uid == 1000u);
+	BOOST_TEST(e[1].mt.sec == 1600000000u);
+	BOOST_TEST((e[1].data == std::string(1024, 'a') + std::string(1024, '\0') + std::string(52, 'c')));
+	BOOST_TEST(e[2].path.c_str() == L"link");
+	BOOST_TEST(e[2].symlink == "file");
+	BOOST_TEST(e[3].path.c_str() == L"dir/");
+	BOOST_TEST(e[3].mode == 0040700u);
+	BOOST_TEST(e[4].path.c_str() == L"dir/same");
+	BOOST_TEST(e[4].target.c_str() == L"file");
+}
+
+BOOST_AUTO_TEST_CASE(test_write) {
+	memory_pio_file mf;
+	vhdx_file::create(mf, 256 << 20, 1 << 20);
+	vhdx_file vf(mf);
+	std::string big(5 << 20, '\0');
+	for (size_t i = 0; i < big.size(); i += 4096) big[i] = static_cast<char>(i / 4096);
+	const std::string target(100, 't');
+	{
+		ext4_writer writer(vf);
+		const auto add = [&](crwstr p, const uint32_t mode, const std::string &data, const char *symlink) {
+			file_attr attr { mode, 1000, 1000, 0, { 1, 2 }, { 5000000000, 3 }, { 4, 5 }, 0, 0, symlink };
+			BOOST_TEST_REQUIRE(write_entry(writer, p, attr, data));
+		};
+		add(L"dir/", 0040750, "", nullptr);
+		add(L"dir/big", 0100644, big, nullptr);
+		// The parent directory of this file doesn't exist in the archive.
+		add(L"a/b/small", 0100600, "abc", nullptr);
+		add(L"dir/short", 0120777, "", "big");
+		add(L"long", 0120777, "", target.c_str());
+		write_hard_link(writer, L"dir/hard", L"dir/big");
+		BOOST_CHECK_THROW(write_entry(writer, L"dir/big", 0100644), lro_error);
+		writer.close();
+	}
+	// Only the blocks holding metadata and non-zero data have been written.
+	BOOST_TEST(mf.size() < 24u << 20);
+
+	recording_writer writer;
+	ext4_reader(vf).run(writer);
+	std::map<wstr, recorded_entry> entries;
+	for (const auto &e : writer.entries) entries[e.path] = e;
+	BOOST_TEST(entries.size() == 10u);
+	BOOST_TEST(entries[L"lost+found/"].mode == 0040700u);
+	BOOST_TEST(entries[L"dir/"].mode == 0040750u);
+	BOOST_TEST(entries[L"dir/big"].uid == 1000u);
+	BOOST_TEST(entries[L"dir/big"].mt.sec == 5000000000u);
+	BOOST_TEST((entries[L"dir/big"].data == big));
+	BOOST_TEST(entries[L"a/"].mode == 0040755u);
+	BOOST_TEST(entries[L"a/b/small"].data == "abc");
+	BOOST_TEST(entries[L"dir/short"].symlink == "big");
+	BOOST_TEST(entries[L"long"].symlink == target);
+	BOOST_TEST(entries[L"dir/hard"].target.c_str() == L"dir/big");
+}
+
+BOOST_AUTO_TEST_CASE(test_write_short) {
+	memory_pio_file mf;
+	vhdx_file::create(mf, 256 << 20, 1 << 20);
+	vhdx_file vf(mf);
+	ext4_writer writer(vf);
+	// The data is shorter than the size in the attributes.
+	BOOST_TEST_REQUIRE(linux_path(L"short", L"").convert(*writer.path));
+	const file_attr attr { 0100644, 0, 0, 10, {}, {}, {}, 0, 0, nullptr };
+	BOOST_TEST_REQUIRE(writer.write_new_file(&attr));
+	writer.write_file_data("abc", 3);
+	BOOST_CHECK_THROW(writer.write_file_data(nullptr, 0), lro_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_block_bitmap) {
+	memory_pio_file mf;
+	vhdx_file::create(mf, 256 << 20, 1 << 20);
+	vhdx_file vf(mf);
+	{
+		ext4_writer writer(vf);
+		BOOST_TEST_REQUIRE(write_entry(writer, L"file", 0100644, std::string(4 << 20, 'x')));
+		writer.close();
+	}
+	// The writer allocates blocks from the start of the disk, and most groups are left uninitialized.
+	const auto used = ext4_volume(vf).read_block_bitmap();
+	BOOST_TEST(used.size() == 65536u);
+	const auto cnt = static_cast<size_t>(std::count(used.begin(), used.end(), true));
+	BOOST_TEST(cnt > 1024u);
+	BOOST_TEST(cnt < 16384u);
+	BOOST_TEST(std::all_of(used.begin(), used.begin() + cnt, [](const bool b) { return b; }));
+}
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_differencing_disk) {
+	BOOST_TEST_REQUIRE(CreateDirectory(L"base", nullptr));
+	{
+		win_pio_file f(L"base\\ext4.vhdx", true, true);
+		vhdx_file::create(f, 16 << 20, 1 << 20);
+	}
+	const auto read_only = [] {
+		const auto attr = GetFileAttributes(L"base\\ext4.vhdx");
+		BOOST_TEST_REQUIRE(attr != INVALID_FILE_ATTRIBUTES);
+		return (attr & FILE_ATTRIBUTE_READONLY) != 0;
+	};
+	create_differencing_wsl2_disk(L"base", L"child");
+	BOOST_TEST(read_only());
+	{
+		win_pio_file f(L"child\\ext4.vhdx", false, false);
+		BOOST_TEST(vhdx_file(f).is_differencing());
+	}
+	flatten_wsl2_disk(L"child\\ext4.vhdx");
+	{
+		win_pio_file f(L"child\\ext4.vhdx", false, false);
+		BOOST_TEST(!vhdx_file(f).is_differencing());
+	}
+	unlock_wsl2_disk(L"base");
+	BOOST_TEST(!read_only());
+	BOOST_TEST(DeleteFile(L"base\\ext4.vhdx"));
+}
+
+// The image is made by mkfs.ext4 with res/ext4.sh and embedded into the test program as a .tar.gz.
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_mkfs_image) {
+	const auto hr = FindResource(nullptr, MAKEINTRESOURCE(2), RT_RCDATA);
+	BOOST_TEST_REQUIRE(hr != nullptr);
+	const auto res = static_cast<const char *>(LockResource(LoadResource(nullptr, hr)));
+	BOOST_TEST_REQUIRE(res != nullptr);
+	const auto f = _wfopen(L"ext4.tar.gz", L"wb");
+	BOOST_TEST_REQUIRE(f != nullptr);
+	BOOST_TEST_REQUIRE(fwrite(res, 1, SizeofResource(nullptr, hr), f) == SizeofResource(nullptr, hr));
+	fclose(f);
+	recording_writer tar;
+	archive_reader(L"ext4.tar.gz", L"").run(tar);
+	const auto img = tar.files().at(L"ext4.img").data;
+	memory_pio_file mf(L"ext4.img", std::vector<char>(img.begin(), img.end()));
+
+	recording_writer writer;
+	ext4_reader(mf).run(writer);
+	const auto entries = writer.files();
+	BOOST_TEST(entries.size() == 309u);
+	BOOST_TEST(entries.at(L"").mode == 0040755u);
+	BOOST_TEST(entries.at(L"lost+found/").mode == 0040700u);
+	const auto &dir = entries.at(L"dir/");
+	BOOST_TEST(dir.mode == 0040750u);
+	BOOST_TEST(dir.uid == 1000u);
+	BOOST_TEST(dir.gid == 1000u);
+	const auto &file = entries.at(L"dir/file");
+	BOOST_TEST(file.data == "hello\n");
+	BOOST_TEST(file.mt.sec == 1600000000u);
+	BOOST_TEST(entries.at(L"dir/sparse").mode == 0100600u);
+	BOOST_TEST((entries.at(L"dir/sparse").data == std::string(4096, 'a') + std::string(8192, '\0') + "ccc"));
+	std::string big;
+	for (int i = 0; i < 10000; i++) {
+		const auto s = std::to_string(i);
+		big += std::string(31 - s.size(), '0') + s + "\n";
+	}
+	BOOST_TEST((entries.at(L"big").data == big));
+	BOOST_TEST(entries.at(L"link").symlink == "dir/file");
+	BOOST_TEST(entries.at(L"longlink").symlink == std::string(100, 't'));
+	BOOST_TEST(entries.at(L"many/entry_299").data.empty());
+	const auto hard = std::find_if(writer.entries.begin(), writer.entries.end(), [](const recorded_entry &e) {
+		return !e.target.empty();
+	});
+	BOOST_TEST_REQUIRE((hard != writer.entries.end()));
+	BOOST_TEST((hard->path == L"dir/hard" ? hard->target == L"dir/file" : hard->target == L"dir/hard"));
+}
+
+BOOST_AUTO_TEST_CASE(test_invalid) {
+	memory_pio_file mf(L"zeros", std::vector<char>(64 << 10));
+	BOOST_CHECK_THROW(ext4_volume v(mf), lro_error);
+	image_builder img;
+	img.put<uint32_t>(1024 + 0x60, 0x46);
+	memory_pio_file mf2(L"needs recovery", img.data);
+	BOOST_CHECK_THROW(ext4_volume v(mf2), lro_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,195 @@
+#include <boost/test/unit_test.hpp>
+#include "pch.h"
+#include "fixtures.h"
+#include "utils.h"
+
+using namespace boost::unit_test;
+namespace fs = std::filesystem;
+
+BOOST_AUTO_TEST_SUITE(test_fs)
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_delete_directory) {
+	const auto touch = [](const fs::path &p) {
+		const auto f = _wfopen(p.c_str(), L"wb");
+		BOOST_TEST_REQUIRE(f != nullptr);
+		fclose(f);
+	};
+	// Several levels of directories, so that subtrees are deleted by different workers.
+	for (int i = 0; i < 8; i++) {
+		for (int j = 0; j < 8; j++) {
+			const auto dir = fs::path(L"tree") / std::to_wstring(i) / std::to_wstring(j) / L"leaf";
+			BOOST_TEST_REQUIRE(fs::create_directories(dir));
+			for (int k = 0; k < 4; k++) {
+				touch(dir.parent_path() / std::to_wstring(k));
+			}
+		}
+		touch(fs::path(L"tree") / (std::to_wstring(i) + L".txt"));
+	}
+	delete_directory(L"tree", 4);
+	BOOST_TEST(!fs::exists(L"tree"));
+	BOOST_CHECK_THROW(delete_directory(L"tree"), lro_error);
+}
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_remap_ids) {
+	{
+		wsl_v2_writer writer(L"distro");
+		const auto write = [&](crwstr p, const uint32_t mode, const uint32_t uid, const uint32_t gid) {
+			BOOST_TEST_REQUIRE(write_entry(writer, p, file_attr { mode, uid, gid, 0, {}, {}, {}, 0, 0, nullptr }));
+		};
+		write(L"", 0040755, 0, 0);
+		write(L"a", 0100644, 1000, 1000);
+		write(L"d/", 0040755, 1000, 100);
+		write(L"d/b", 0100644, 1001, 1000);
+		write_hard_link(writer, L"d/l", L"a");
+	}
+	// The mappings are chained, so a hard link mapped twice would end up with the wrong owner.
+	const std::map<uint32_t, uint32_t> uids { { 1000, 1001 }, { 1001, 1002 } }, gids { { 1000, 2000 } };
+	BOOST_TEST(remap_ids(2, L"distro", uids, gids, 4) == 3);
+	recording_writer writer;
+	wsl_v2_reader(L"distro").run(writer);
+	std::map<wstr, std::pair<uint32_t, uint32_t>> owners;
+	for (const auto &p : writer.files()) owners[p.first] = { p.second.uid, p.second.gid };
+	const std::map<wstr, std::pair<uint32_t, uint32_t>> expected {
+		{ L"", { 0, 0 } },
+		{ L"a", { 1001, 2000 } },
+		{ L"d/", { 1001, 100 } },
+		{ L"d/b", { 1002, 2000 } }
+	};
+	BOOST_TEST((owners == expected));
+	BOOST_TEST(remap_ids(2, L"distro", {}, {}) == 0);
+}
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_scan_wsl) {
+	{
+		wsl_v2_writer writer(L"distro");
+		write_entry(writer, L"", 0040755);
+		for (int i = 0; i < 4; i++) {
+			const auto dir = L"d" + std::to_wstring(i) + L"/";
+			write_entry(writer, dir, 0040755);
+			write_entry(writer, dir + L"a", 0100644, std::string(1000, 'a'));
+			write_entry(writer, dir + L"e", 0100644);
+		}
+		write_entry(writer, L"b", 0100644, "bb");
+	}
+	const auto res = scan_wsl(2, L"distro", 4);
+	BOOST_TEST(res.entries == 13u);
+	BOOST_TEST(res.bytes == 4002u);
+}
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_upgrade_wsl_fs) {
+	{
+		wsl_v1_writer writer(L"distro");
+		// Different times for each entry, which the upgrade mustn't change.
+		uint64_t t = 1000000000;
+		const auto write = [&](crwstr p, const uint32_t mode, const char *symlink = nullptr) {
+			t += 1000;
+			const file_attr attr { mode, 1000, 100, 0, { t, 100 }, { t + 1, 200 }, { t + 2, 300 }, 0, 0, symlink };
+			BOOST_TEST_REQUIRE(write_entry(writer, p, attr));
+		};
+		write(L"", 0040755);
+		// Both characters are escaped differently in version 1.
+		write(L"a:b", 0100644);
+		write(L"d#/", 0040755);
+		write(L"d#/l", 0120777, "../a:b");
+		write(L"d#/p", 0010644);
+		write_hard_link(writer, L"d#/h", L"a:b");
+	}
+	recording_writer v1;
+	wsl_v1_reader(L"distro").run(v1);
+	// Nothing has been changed yet, so rolling back only removes the journal.
+	const fs::path journal = L"distro/upgrade.journal";
+	const auto f = _wfopen(journal.c_str(), L"wb");
+	BOOST_TEST_REQUIRE(f != nullptr);
+	fputs("upgrade 1\n", f);
+	fclose(f);
+	rollback_wsl_upgrade(L"distro");
+	BOOST_TEST(!fs::exists(journal));
+	BOOST_CHECK_THROW(rollback_wsl_upgrade(L"distro"), lro_error);
+	// Interrupted after the commit, which can't be rolled back but is finished by running the upgrade again.
+	const auto interrupt = [] { throw std::runtime_error("interrupted"); };
+	BOOST_CHECK_THROW(upgrade_wsl_fs(1, L"distro", 4, interrupt), std::runtime_error);
+	BOOST_TEST(fs::exists(journal));
+	BOOST_CHECK_THROW(rollback_wsl_upgrade(L"distro"), lro_error);
+	auto committed = false;
+	BOOST_TEST(upgrade_wsl_fs(2, L"distro", 4, [&] { committed = true; }));
+	BOOST_TEST(committed);
+	BOOST_TEST(!fs::exists(journal));
+	BOOST_TEST(detect_version(L"distro") == 2);
+	recording_writer v2;
+	wsl_v2_reader(L"distro").run(v2);
+	const auto f1 = v1.files(), f2 = v2.files();
+	BOOST_TEST_REQUIRE(f2.size() == f1.size());
+	for (const auto &p : f1) {
+		const auto it = f2.find(p.first);
+		BOOST_TEST_REQUIRE((it != f2.end()));
+		const auto &e1 = p.second, &e2 = it->second;
+		BOOST_TEST(e2.uid == e1.uid);
+		BOOST_TEST(e2.gid == e1.gid);
+		BOOST_TEST(e2.mode == e1.mode);
+		BOOST_TEST(e2.symlink == e1.symlink);
+		for (const auto tp : { &recorded_entry::at, &recorded_entry::mt, &recorded_entry::ct }) {
+			BOOST_TEST((e2.*tp).sec == (e1.*tp).sec);
+			BOOST_TEST((e2.*tp).nsec == (e1.*tp).nsec);
+		}
+	}
+	BOOST_TEST(f2.at(L"d#/l").symlink == "../a:b");
+	BOOST_TEST(!upgrade_wsl_fs(2, L"distro", 4, [] {}));
+}
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_wsl_writer_order) {
+	{
+		wsl_v2_writer writer(L"distro");
+		const auto write = [&](crwstr p, const uint32_t mode) {
+			const file_attr attr { mode, 1000, 100, 0, {}, { 1000000000, 0 }, {}, 0, 0, nullptr };
+			BOOST_TEST_REQUIRE(write_entry(writer, p, attr));
+		};
+		write(L"", 0040755);
+		write(L"a/", 0040755);
+		write(L"a/b/", 0040700);
+		write(L"a/b/c/", 0040755);
+		write(L"d", 0100644);
+		// Archives may go back to directories they have already left.
+		write(L"a/b/f", 0100600);
+		write(L"a/b/c/g", 0100644);
+		write_hard_link(writer, L"a/h", L"a/b/f");
+		write(L"k/", 0040755);
+		write(L"k/l", 0100644);
+		write(L"m", 0100644);
+		// Missing parents are created, and writing them later only sets their attributes.
+		write(L"x/y/z", 0100644);
+		write(L"x/", 0040750);
+	}
+	BOOST_TEST(fs::hard_link_count(L"distro/rootfs/a/h") == 2u);
+	recording_writer writer;
+	wsl_v2_reader(L"distro").run(writer);
+	std::map<wstr, uint32_t> modes;
+	for (const auto &p : writer.files()) modes[p.first] = p.second.mode;
+	const std::map<wstr, uint32_t> expected {
+		{ L"", 0040755 },
+		{ L"a/", 0040755 },
+		{ L"a/b/", 0040700 },
+		{ L"a/b/c/", 0040755 },
+		{ L"a/b/c/g", 0100644 },
+		{ L"a/b/f", 0100600 },
+		{ L"d", 0100644 },
+		{ L"k/", 0040755 },
+		{ L"k/l", 0100644 },
+		{ L"m", 0100644 },
+		{ L"x/", 0040750 },
+		{ L"x/y/", 0040755 },
+		{ L"x/y/z", 0100644 }
+	};
+	BOOST_TEST((modes == expected));
+	// The times of a directory are set when the writer leaves it, including after going back to it.
+	const auto mt = fs::last_write_time(L"distro/rootfs/d");
+	for (const auto p : { L"distro/rootfs/a", L"distro/rootfs/a/b", L"distro/rootfs/a/b/c", L"distro/rootfs/k" }) {
+		BOOST_TEST((fs::last_write_time(p) == mt));
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
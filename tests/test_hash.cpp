@@ -0,0 +1,35 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/test/data/monomorphic.hpp>
+#include <boost/test/data/test_case.hpp>
+#include "pch.h"
+
+using namespace boost::unit_test;
+
+BOOST_AUTO_TEST_SUITE(test_hash)
+
+BOOST_AUTO_TEST_CASE(test_known_values) {
+	BOOST_TEST(hash_content("", 0) == 0xEF46DB3751D8E999ull);
+	BOOST_TEST(hash_content("abc", 3) == 0x44BC2CF5AD770999ull);
+	const char s[] = "Nobody inspects the spammish repetition";
+	BOOST_TEST(hash_content(s, sizeof s - 1) == 0xFBCEA83C8A378BF1ull);
+}
+
+BOOST_AUTO_TEST_CASE(test_crc) {
+	BOOST_TEST(crc32c("123456789", 9) == 0xE3069283u);
+	BOOST_TEST(crc32c("56789", 5, crc32c("1234", 4)) == 0xE3069283u);
+	BOOST_TEST(crc16("123456789", 9, 0) == 0xBB3Du);
+}
+
+BOOST_DATA_TEST_CASE(test_incremental, data::make({ 1, 7, 31, 32, 33, 100, 4096 }), chunk_size) {
+	std::vector<char> buf(10000);
+	for (size_t i = 0; i < buf.size(); i++) buf[i] = static_cast<char>(i * 7 + i / 256);
+	content_hash h;
+	for (size_t off = 0; off < buf.size(); off += chunk_size) {
+		h.update(buf.data() + off, std::min(buf.size() - off, static_cast<size_t>(chunk_size)));
+	}
+	BOOST_TEST(h.digest() == hash_content(buf.data(), buf.size()));
+	h.reset();
+	BOOST_TEST(h.digest() == hash_content("", 0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,47 @@
+#include <boost/test/unit_test.hpp>
+#include "pch.h"
+#include "fixtures.h"
+
+using namespace boost::unit_test;
+
+BOOST_AUTO_TEST_SUITE(test_manifest)
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_round_trip) {
+	const manifest_entry entries[] = {
+		{ "usr", "", 0040755, 0, 0, 0, { 1600000000, 123456789 }, 0 },
+		{ u8"usr/测试", "", 0100644, 1000, 1000, 1ull << 40, { 1600000001, 0 }, 0x0123456789abcdefull },
+		{ "usr/link", "usr/测试", 0, 0, 0, 0, {}, 0 }
+	};
+	manifest_output output(L"test.manifest");
+	for (const auto &e : entries) output.write(e);
+	output.close();
+
+	manifest_input input(L"test.manifest");
+	manifest_entry e;
+	for (const auto &expected : entries) {
+		BOOST_TEST_REQUIRE(input.read(e));
+		BOOST_TEST(e.path == expected.path);
+		BOOST_TEST(e.link_target == expected.link_target);
+		BOOST_TEST(e.mode == expected.mode);
+		BOOST_TEST(e.uid == expected.uid);
+		BOOST_TEST(e.gid == expected.gid);
+		BOOST_TEST(e.size == expected.size);
+		BOOST_TEST(e.mt.sec == expected.mt.sec);
+		BOOST_TEST(e.mt.nsec == expected.mt.nsec);
+		BOOST_TEST(e.hash == expected.hash);
+	}
+	BOOST_TEST(!input.read(e));
+}
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_invalid) {
+	const auto f = _wfopen(L"test.manifest", L"wb");
+	BOOST_TEST_REQUIRE(f != nullptr);
+	fputs("foobar", f);
+	fclose(f);
+	BOOST_CHECK_THROW(manifest_input(L"test.manifest"), lro_error);
+	BOOST_CHECK_THROW(manifest_input(L"nonexistent.manifest"), lro_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
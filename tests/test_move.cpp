@@ -0,0 +1,75 @@
+#include <boost/test/unit_test.hpp>
+#include "pch.h"
+#include "fixtures.h"
+
+using namespace boost::unit_test;
+namespace fs = std::filesystem;
+
+namespace {
+	void touch(const fs::path &p, const size_t size) {
+		const auto f = _wfopen(p.c_str(), L"wb");
+		BOOST_TEST_REQUIRE(f != nullptr);
+		const std::vector<char> data(size, 'a');
+		fwrite(data.data(), 1, data.size(), f);
+		fclose(f);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE(test_move)
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_window) {
+	BOOST_TEST_REQUIRE(fs::create_directories(L"src\\d"));
+	for (auto i = 0; i < 100; i++) touch(fs::path(L"src\\d") / std::to_wstring(i), 1000);
+	fs::create_hard_link(L"src\\d\\5", L"src\\d\\l5");
+	wsl_v2_writer writer(L"dst");
+	const wsl_v2_path source(L"src");
+	const std::vector<char> data(1000, 'a');
+	{
+		move_writer mw(writer, source, 4096);
+		const auto base = mw.path->data;
+		file_attr dir { 0040755, 0, 0, 0, {}, {}, {}, 0, 0, nullptr };
+		mw.path->data = base + L"d\\";
+		mw.write_new_file(&dir);
+		for (auto i = 0; i < 100; i++) {
+			if (i == 60) {
+				mw.path->data = base + L"d\\l5";
+				mw.target_path->data = base + L"d\\5";
+				mw.write_hard_link();
+			}
+			mw.path->data = base + L"d\\" + std::to_wstring(i);
+			file_attr attr { 0100644, 0, 0, data.size(), {}, {}, {}, 0, 0, nullptr };
+			mw.write_new_file(&attr);
+			mw.write_file_data(data.data(), static_cast<uint32_t>(data.size()));
+			mw.write_file_data(nullptr, 0);
+			if (i == 50) {
+				// Copying waits for the worker once more than the window hasn't been deleted yet.
+				BOOST_TEST(!fs::exists(L"src\\d\\0"));
+				BOOST_TEST(fs::exists(L"src\\d\\50"));
+				// Files with other names are kept until the end.
+				BOOST_TEST(fs::exists(L"src\\d\\5"));
+			}
+		}
+		mw.close();
+	}
+	BOOST_TEST(fs::is_empty(L"src\\d"));
+	for (auto i = 0; i < 100; i++) BOOST_TEST(fs::file_size(fs::path(L"dst\\d") / std::to_wstring(i)) == 1000u);
+	BOOST_TEST(fs::hard_link_count(L"dst\\d\\l5") == 2u);
+}
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_missing_source) {
+	BOOST_TEST_REQUIRE(fs::create_directory(L"src"));
+	wsl_v2_writer writer(L"dst");
+	const auto run = [&] {
+		move_writer mw(writer, wsl_v2_path(L"src"), 0);
+		file_attr attr { 0100644, 0, 0, 0, {}, {}, {}, 0, 0, nullptr };
+		mw.path->data += L"x";
+		mw.write_new_file(&attr);
+		mw.write_file_data(nullptr, 0);
+		mw.close();
+	};
+	BOOST_CHECK_THROW(run(), lro_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,63 @@
+#include <boost/test/unit_test.hpp>
+#include "pch.h"
+
+using namespace boost::unit_test;
+
+BOOST_AUTO_TEST_SUITE(test_parallel)
+
+BOOST_AUTO_TEST_CASE(test_run_all) {
+	std::atomic<int> sum(0);
+	task_pool pool(4);
+	for (auto i = 1; i <= 1000; i++) {
+		pool.submit([&sum, i] { sum += i; });
+	}
+	pool.wait();
+	BOOST_TEST(sum == 500500);
+	pool.submit([&sum] { sum = 0; });
+	pool.wait();
+	BOOST_TEST(sum == 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_bounded_queue) {
+	std::atomic<int> cnt(0);
+	task_pool pool(2, 1);
+	for (auto i = 0; i < 100; i++) {
+		pool.submit([&cnt] {
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			cnt++;
+		});
+	}
+	pool.wait();
+	BOOST_TEST(cnt == 100);
+}
+
+BOOST_AUTO_TEST_CASE(test_nested_submit) {
+	std::atomic<int> cnt(0);
+	task_pool pool(3);
+	std::function<void(int)> spawn = [&](const int depth) {
+		cnt++;
+		if (depth == 0) return;
+		for (auto i = 0; i < 3; i++) {
+			pool.submit([&spawn, depth] { spawn(depth - 1); });
+		}
+	};
+	pool.submit([&spawn] { spawn(4); });
+	pool.wait();
+	BOOST_TEST(cnt == 121);
+}
+
+BOOST_AUTO_TEST_CASE(test_exception) {
+	task_pool pool(2);
+	for (auto i = 0; i < 10; i++) {
+		pool.submit([i] {
+			if (i == 5) throw lro_error::from_other(err_msg::err_test, { L"foo" });
+		});
+	}
+	BOOST_CHECK_THROW(pool.wait(), lro_error);
+	auto done = false;
+	pool.submit([&done] { done = true; });
+	pool.wait();
+	BOOST_TEST(done);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -28,6 +28,30 @@ BOOST_AUTO_TEST_CASE(test_ctor_linux) {
 	BOOST_TEST(linux_path(L"foo/bar/../", L"").data.c_str() == L"foo/");
 }
 
+BOOST_AUTO_TEST_CASE(test_ctor_linux_utf8) {
+	const std::pair<const char *, const char *> cases[] = {
+		{ "foobar", "foo" }, { "foo/", "foo" }, { "foo/bar", "foo" }, { "foo/bar", "foo/" }, { "//foo", "" },
+		{ "./foo/./bar/./", "" }, { "foo/../../bar", "" }, { "foo/bar/../", "" }, { u8"测试/../文件", "" }
+	};
+	for (const auto &c : cases) {
+		linux_path p(std::string(c.first), c.second);
+		BOOST_TEST(p.data.c_str() == linux_path(from_utf8(c.first), from_utf8(c.second)).data.c_str());
+		BOOST_TEST(p.get_utf8() == to_utf8(p.data).get());
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_utf8_linux) {
+	linux_path src;
+	src.assign_utf8(u8"dir/测试", strlen(u8"dir/测试"), "");
+	linux_path dst;
+	BOOST_TEST_REQUIRE(src.convert(dst));
+	BOOST_TEST(dst.data.c_str() == L"dir/测试");
+	BOOST_TEST(dst.get_utf8() == u8"dir/测试");
+	// Changing the wide form directly must not leave a stale UTF-8 form behind.
+	dst.data = L"other";
+	BOOST_TEST(dst.get_utf8() == "other");
+}
+
 BOOST_AUTO_TEST_CASE(test_clone_linux) {
 	const linux_path path(L"foo", L"");
 	const auto cloned_path = path.clone();
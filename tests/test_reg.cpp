@@ -244,6 +244,142 @@ BOOST_FIXTURE_TEST_CASE(test_unregister_non_default, fixture_tmp_reg) {
 
 BOOST_AUTO_TEST_SUITE_END()
 
+BOOST_AUTO_TEST_SUITE(test_reg_cache)
+
+namespace {
+	class counting_backend : public memory_reg_backend {
+	public:
+		size_t reads = 0;
+
+		std::vector<std::wstring> list_keys(const std::wstring &path) override {
+			reads++;
+			return memory_reg_backend::list_keys(path);
+		}
+
+		std::map<std::wstring, reg_value> get_values(const std::wstring &path) override {
+			reads++;
+			return memory_reg_backend::get_values(path);
+		}
+
+		reg_value get_value(const std::wstring &path, const std::wstring &value_name) override {
+			reads++;
+			return memory_reg_backend::get_value(path, value_name);
+		}
+	};
+
+	struct fixture_memory_reg {
+		counting_backend backend;
+
+		fixture_memory_reg() {
+			set_reg_backend(&backend);
+			for (auto i = 0; i < 1000; i++) {
+				const auto key = std::wstring(fixture_tmp_reg::PATH) + new_guid();
+				backend.set_value(key, L"DistributionName", L"foo" + std::to_wstring(i));
+				backend.set_value(key, L"BasePath", L"C:\\bar" + std::to_wstring(i));
+				backend.set_value(key, L"Version", 2u);
+			}
+			backend.create_key(std::wstring(fixture_tmp_reg::PATH) + L"AppxInstallerCache");
+		}
+
+		~fixture_memory_reg() {
+			set_reg_backend(nullptr);
+		}
+	};
+
+	// Distros can only be unregistered if there's a default one.
+	struct fixture_memory_reg_default : fixture_memory_reg {
+		fixture_memory_reg_default() {
+			set_default_distro(L"foo0");
+		}
+	};
+}
+
+BOOST_FIXTURE_TEST_CASE(test_uncached, fixture_memory_reg) {
+	BOOST_TEST(list_distros().size() == 1000u);
+	BOOST_TEST(get_distro_dir(L"foo999").c_str() == L"C:\\bar999");
+	backend.reads = 0;
+	BOOST_TEST(get_distro_version(L"foo999") == 2u);
+	BOOST_TEST(backend.reads > 1000u);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_cached, fixture_memory_reg) {
+	reg_cache cache;
+	BOOST_TEST(get_distro_dir(L"foo999").c_str() == L"C:\\bar999");
+	backend.reads = 0;
+	for (auto i = 0; i < 1000; i++) {
+		BOOST_TEST(get_distro_dir(L"foo" + std::to_wstring(i)).c_str() == (L"C:\\bar" + std::to_wstring(i)).c_str());
+	}
+	BOOST_TEST(list_distros().size() == 1000u);
+	BOOST_TEST(backend.reads == 0u);
+	BOOST_CHECK_THROW(get_distro_dir(L"bar"), lro_error);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_invalidate, fixture_memory_reg) {
+	reg_cache cache;
+	BOOST_CHECK_THROW(get_default_distro(), lro_error);
+	register_distro(L"new", L"C:\\new", 2);
+	BOOST_TEST(get_default_distro().c_str() == L"new");
+	BOOST_CHECK_THROW(register_distro(L"new", L"C:\\other", 2), lro_error);
+	set_distro_dir(L"foo1", L"C:\\moved");
+	BOOST_TEST(get_distro_dir(L"foo1").c_str() == L"C:\\moved");
+	reg_config conf;
+	conf.uid = 1000;
+	conf.configure_distro(L"foo2", config_uid);
+	reg_config conf2;
+	conf2.load_distro(L"foo2", config_all);
+	BOOST_TEST(conf2.uid == 1000u);
+	unregister_distro(L"new");
+	BOOST_CHECK_THROW(get_distro_dir(L"new"), lro_error);
+	BOOST_TEST(list_distros().size() == 1000u);
+	BOOST_TEST(get_default_distro().c_str() != L"new");
+}
+
+BOOST_AUTO_TEST_CASE(test_unregister_default) {
+	memory_reg_backend backend;
+	backend.create_key(fixture_tmp_reg::PATH);
+	set_reg_backend(&backend);
+	{
+		reg_cache cache;
+		register_distro(L"a", L"C:\\a", 2);
+		register_distro(L"b", L"C:\\b", 2);
+		BOOST_TEST(get_default_distro().c_str() == L"a");
+		unregister_distro(L"a");
+		BOOST_TEST((list_distros() == std::vector<std::wstring> { L"b" }));
+		BOOST_TEST(get_default_distro().c_str() == L"b");
+		unregister_distro(L"b");
+		BOOST_TEST(list_distros().empty());
+		BOOST_CHECK_THROW(get_default_distro(), lro_error);
+	}
+	set_reg_backend(nullptr);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_parent, fixture_memory_reg_default) {
+	reg_cache cache;
+	BOOST_TEST(get_distro_parent(L"foo1").empty());
+	BOOST_TEST(list_distro_children(L"foo1").empty());
+	set_distro_parent(L"foo2", L"foo1");
+	set_distro_parent(L"foo3", L"foo1");
+	BOOST_TEST(get_distro_parent(L"foo2").c_str() == L"foo1");
+	auto children = list_distro_children(L"foo1");
+	std::sort(children.begin(), children.end());
+	BOOST_TEST((children == std::vector<std::wstring> { L"foo2", L"foo3" }));
+	// The link is kept by ID, so it survives a move.
+	set_distro_dir(L"foo1", L"C:\\moved");
+	BOOST_TEST(get_distro_parent(L"foo3").c_str() == L"foo1");
+	set_distro_parent(L"foo2", L"");
+	set_distro_parent(L"foo2", L"");
+	BOOST_TEST(get_distro_parent(L"foo2").empty());
+	BOOST_TEST((list_distro_children(L"foo1") == std::vector<std::wstring> { L"foo3" }));
+	// Uninstalling the last child leaves the parent without children, so that its disk is unlocked.
+	unregister_distro(L"foo3");
+	BOOST_TEST(list_distro_children(L"foo1").empty());
+	set_distro_parent(L"foo4", L"foo1");
+	unregister_distro(L"foo1");
+	BOOST_TEST(get_distro_parent(L"foo4").empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
 BOOST_AUTO_TEST_SUITE(test_reg_config)
 
 BOOST_AUTO_TEST_CASE(test_default_value) {
@@ -0,0 +1,101 @@
+#include <boost/test/unit_test.hpp>
+#include "pch.h"
+#include "fixtures.h"
+#include "utils.h"
+
+using namespace boost::unit_test;
+
+namespace {
+	struct expected_entry {
+		wstr path, target;
+		uint32_t mode, uid, gid;
+		std::string data;
+	};
+}
+
+BOOST_AUTO_TEST_SUITE(test_transform)
+
+BOOST_AUTO_TEST_CASE(test_rules) {
+	std::vector<transform_rule> rules;
+	for (const auto r : {
+		L"drop /usr/share/doc", L"move /opt/app/ /srv/app", L"mode /etc/*.conf 600",
+		L"owner /home/user 1000:100", L"text /etc/hostname  my host"
+	}) {
+		rules.push_back(parse_transform_rule(r));
+	}
+	recording_writer writer;
+	{
+		transform_writer tw(writer, rules);
+		write_entry(tw, L"", 0040755);
+		write_entry(tw, L"etc/", 0040755);
+		write_entry(tw, L"etc/hostname", 0100644, "old\n");
+		write_entry(tw, L"etc/a.conf", 0100644, "a");
+		write_entry(tw, L"etc/sub/b.conf", 0100644);
+		write_entry(tw, L"usr/share/doc/", 0040755);
+		write_entry(tw, L"usr/share/doc/x", 0100644);
+		write_entry(tw, L"usr/share/docs", 0100644);
+		write_entry(tw, L"opt/app/", 0040755);
+		write_entry(tw, L"opt/app/bin", 0100755, "bin");
+		write_entry(tw, L"home/user/", 0040700);
+		write_hard_link(tw, L"opt/app/link", L"opt/app/bin");
+		write_hard_link(tw, L"link", L"usr/share/doc/x");
+	}
+	const std::vector<expected_entry> expected {
+		{ L"", L"", 0040755, 0, 0, "" },
+		{ L"etc/", L"", 0040755, 0, 0, "" },
+		{ L"etc/hostname", L"", 0100644, 0, 0, "my host\n" },
+		{ L"etc/a.conf", L"", 0100600, 0, 0, "a" },
+		{ L"etc/sub/b.conf", L"", 0100644, 0, 0, "" },
+		{ L"usr/share/docs", L"", 0100644, 0, 0, "" },
+		{ L"srv/app/", L"", 0040755, 0, 0, "" },
+		{ L"srv/app/bin", L"", 0100755, 0, 0, "bin" },
+		{ L"home/user/", L"", 0040700, 1000, 100, "" },
+		{ L"srv/app/link", L"srv/app/bin", 0, 0, 0, "" }
+	};
+	BOOST_TEST_REQUIRE(writer.entries.size() == expected.size());
+	for (size_t i = 0; i < expected.size(); i++) {
+		const auto &e = expected[i], &a = writer.entries[i];
+		BOOST_TEST(a.path.c_str() == e.path.c_str());
+		BOOST_TEST(a.target.c_str() == e.target.c_str());
+		BOOST_TEST(a.mode == e.mode);
+		BOOST_TEST(a.uid == e.uid);
+		BOOST_TEST(a.gid == e.gid);
+		BOOST_TEST(a.data == e.data);
+	}
+}
+
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_move_new_parent) {
+	const std::vector<transform_rule> rules { parse_transform_rule(L"move /opt/app /srv/app") };
+	{
+		wsl_v2_writer writer(L"distro");
+		transform_writer tw(writer, rules);
+		BOOST_TEST_REQUIRE(write_entry(tw, L"", 0040755));
+		BOOST_TEST_REQUIRE(write_entry(tw, L"opt/", 0040755));
+		BOOST_TEST_REQUIRE(write_entry(tw, L"opt/app/", 0040700));
+		BOOST_TEST_REQUIRE(write_entry(tw, L"opt/app/bin", 0100755, "bin"));
+	}
+	recording_writer writer;
+	wsl_v2_reader(L"distro").run(writer);
+	std::map<wstr, uint32_t> modes;
+	for (const auto &p : writer.files()) modes[p.first] = p.second.mode;
+	const std::map<wstr, uint32_t> expected {
+		{ L"", 0040755 },
+		{ L"opt/", 0040755 },
+		{ L"srv/", 0040755 },
+		{ L"srv/app/", 0040700 },
+		{ L"srv/app/bin", 0100755 }
+	};
+	BOOST_TEST((modes == expected));
+}
+
+BOOST_AUTO_TEST_CASE(test_invalid_rules) {
+	for (const auto r : {
+		L"", L"drop", L"drop /a /b", L"move / /a", L"move /a /", L"move /a* /b", L"mode /a 800", L"mode /a 17777",
+		L"owner /a 1000", L"owner /a x:1", L"text /a", L"rename /a /b"
+	}) {
+		BOOST_CHECK_THROW(parse_transform_rule(r), lro_error);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -23,6 +23,60 @@ BOOST_AUTO_TEST_CASE(test_utf8_conversion) {
 	BOOST_CHECK_THROW(to_utf8(L"\xd800"), lro_error);
 }
 
+BOOST_AUTO_TEST_CASE(test_utf8_buffer) {
+	// Long enough for both the 16-byte ASCII runs and the code after them.
+	const wstr u16_str = L"usr/share/locale/zh_CN/测试/\U0001F600/abcdefghijklmnopqrstuvwxyz";
+	const std::string u8_str = u8"usr/share/locale/zh_CN/测试/\U0001F600/abcdefghijklmnopqrstuvwxyz";
+	wstr w = L"previous contents";
+	from_utf8(u8_str.data(), u8_str.size(), w);
+	BOOST_TEST(w.c_str() == u16_str.c_str());
+	std::string s = "previous contents";
+	to_utf8(u16_str.data(), u16_str.size(), s);
+	BOOST_TEST(s == u8_str);
+	for (const auto bad : { "\xc0\x80", "\xe0\x80\x80", "\xed\xa0\x80", "\xf4\x90\x80\x80", "abcdefghijklmnop\xe6\xb5" }) {
+		BOOST_CHECK_THROW(from_utf8(bad, strlen(bad), w), lro_error);
+	}
+	BOOST_CHECK_THROW(to_utf8(L"abcdefgh\xdc00", 9, s), lro_error);
+	BOOST_CHECK_THROW(to_utf8(L"\xd800" L"a", 2, s), lro_error);
+}
+
+// The transcoder must accept and reject exactly what the strict Win32 conversions do.
+BOOST_AUTO_TEST_CASE(test_utf8_random) {
+	std::mt19937 rng(42);
+	wstr w;
+	std::string s;
+	for (auto i = 0; i < 100000; i++) {
+		// Short strings of arbitrary non-zero bytes, so that valid multi-byte sequences come up often enough.
+		std::string in(rng() % 8 + 1, '\0');
+		for (auto &c : in) c = static_cast<char>(rng() % 255 + 1);
+		const auto len = static_cast<int>(in.size());
+		const auto n = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, in.data(), len, nullptr, 0);
+		if (!n) {
+			BOOST_CHECK_THROW(from_utf8(in.data(), in.size(), w), lro_error);
+			continue;
+		}
+		wstr expected(n, L'\0');
+		MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, in.data(), len, expected.data(), n);
+		from_utf8(in.data(), in.size(), w);
+		BOOST_TEST(w.c_str() == expected.c_str());
+	}
+	for (auto i = 0; i < 100000; i++) {
+		// Three in four units are surrogates, so that both pairs and unpaired ones come up often.
+		wstr in(rng() % 6 + 1, L'\0');
+		for (auto &c : in) c = static_cast<wchar_t>(rng() % 4 ? 0xD800 + rng() % 0x800 : rng() % 0xFFFF + 1);
+		const auto len = static_cast<int>(in.size());
+		const auto n = WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, in.data(), len, nullptr, 0, nullptr, nullptr);
+		if (!n) {
+			BOOST_CHECK_THROW(to_utf8(in.data(), in.size(), s), lro_error);
+			continue;
+		}
+		std::string expected(n, '\0');
+		WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, in.data(), len, expected.data(), n, nullptr, nullptr);
+		to_utf8(in.data(), in.size(), s);
+		BOOST_TEST(s == expected);
+	}
+}
+
 BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
 BOOST_AUTO_TEST_CASE(test_get_full_path) {
 	namespace fs = std::filesystem;
@@ -77,4 +131,26 @@ BOOST_DATA_TEST_CASE(test_probe_and_call,
 	BOOST_TEST(res_len == expected_ret);
 }
 
+BOOST_TEST_DECORATOR(*fixture<fixture_tmp_dir>())
+BOOST_AUTO_TEST_CASE(test_warning_log) {
+	{
+		warning_log log(2);
+		set_log_file(L"log.txt");
+		std::vector<std::thread> threads;
+		for (auto t = 0; t < 4; t++) {
+			threads.emplace_back([t] {
+				for (auto i = 0; i < 10000; i++) log_skipped(skip_reason::no_attr, std::to_wstring(t * 10000 + i));
+			});
+		}
+		for (auto &t : threads) t.join();
+		log_skipped(skip_reason::unsupported_type, L"sock", 0140755);
+	}
+	// Every warning is in the log file, not only the ones printed in the summary.
+	const unique_ptr_del<FILE *> f(_wfopen(L"log.txt", L"rb"), &fclose_safe);
+	BOOST_TEST_REQUIRE(f.get() != nullptr);
+	size_t lines = 0;
+	for (int c; (c = fgetc(f.get())) != EOF;) lines += c == '\n';
+	BOOST_TEST(lines == 40001u);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
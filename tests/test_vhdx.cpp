@@ -0,0 +1,224 @@
+#include <boost/test/unit_test.hpp>
+#include "pch.h"
+
+using namespace boost::unit_test;
+
+BOOST_AUTO_TEST_SUITE(test_vhdx)
+
+static std::vector<char> make_pattern(const size_t size, const uint32_t seed) {
+	std::vector<char> buf(size);
+	for (size_t i = 0; i < size; i++) buf[i] = static_cast<char>(i * 31 + seed);
+	return buf;
+}
+
+BOOST_AUTO_TEST_CASE(test_read_write) {
+	memory_pio_file mf;
+	vhdx_file::create(mf, 100 << 20, 1 << 20);
+	const auto empty_size = mf.size();
+	const auto data = make_pattern(3 << 20, 7);
+	{
+		vhdx_file vf(mf);
+		BOOST_TEST(vf.size() == 100u << 20);
+		BOOST_TEST(vf.get_block_count() == 100u);
+		vf.write((5 << 20) + 123, data.data(), data.size());
+		task_pool pool(4);
+		for (uint32_t i = 20; i < 60; i++) {
+			pool.submit([&vf, i] {
+				const auto block = make_pattern(1 << 20, i);
+				vf.write(static_cast<uint64_t>(i) << 20, block.data(), block.size());
+			});
+		}
+		pool.wait();
+		vf.flush();
+	}
+	// Only the 44 blocks that have been written are stored in the file.
+	BOOST_TEST(mf.size() == empty_size + (44u << 20));
+
+	vhdx_file vf(mf);
+	std::vector<char> buf(data.size());
+	vf.read((5 << 20) + 123, buf.data(), buf.size());
+	BOOST_TEST((buf == data));
+	buf.resize(1 << 20);
+	vf.read(0, buf.data(), buf.size());
+	BOOST_TEST(std::all_of(buf.begin(), buf.end(), [](const char c) { return c == 0; }));
+	for (uint32_t i = 20; i < 60; i++) {
+		vf.read(static_cast<uint64_t>(i) << 20, buf.data(), buf.size());
+		BOOST_TEST((buf == make_pattern(1 << 20, i)));
+	}
+	uint32_t present = 0;
+	for (uint64_t i = 0; i < vf.get_block_count(); i++) present += vf.is_block_present(i);
+	BOOST_TEST(present == 44u);
+	BOOST_CHECK_THROW(vf.read((100 << 20) - 1, buf.data(), 2), lro_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_headers) {
+	memory_pio_file mf;
+	vhdx_file::create(mf, 10 << 20);
+	{
+		// Writing switches to the other header with a higher sequence number.
+		vhdx_file vf(mf);
+		vf.write(0, "x", 1);
+	}
+	auto data = mf.contents();
+	data[(64 << 10) + 100] ^= 1;
+	memory_pio_file mf1(L"one header", data);
+	char c;
+	vhdx_file(mf1).read(0, &c, 1);
+	BOOST_TEST(c == 'x');
+	data[(128 << 10) + 100] ^= 1;
+	memory_pio_file mf2(L"no header", data);
+	BOOST_CHECK_THROW(vhdx_file vf(mf2), lro_error);
+	memory_pio_file mf3(L"not vhdx", std::vector<char>(1 << 20));
+	BOOST_CHECK_THROW(vhdx_file vf(mf3), lro_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_compact) {
+	memory_pio_file mf;
+	vhdx_file::create(mf, 100 << 20, 1 << 20);
+	const auto empty_size = mf.size();
+	{
+		vhdx_file vf(mf);
+		for (uint32_t i = 0; i < 40; i++) {
+			const auto block = make_pattern(1 << 20, i);
+			vf.write(static_cast<uint64_t>(i) << 20, block.data(), block.size());
+		}
+		// Every block but the last five of each ten is dropped, so most of the remaining ones have to be moved.
+		BOOST_TEST(vf.compact([](const uint64_t block) { return block % 10 < 5; }, 4) == 20u);
+	}
+	BOOST_TEST(mf.size() == empty_size + (20u << 20));
+
+	vhdx_file vf(mf);
+	std::vector<char> buf(1 << 20);
+	for (uint32_t i = 0; i < 40; i++) {
+		vf.read(static_cast<uint64_t>(i) << 20, buf.data(), buf.size());
+		if (i % 10 < 5) {
+			BOOST_TEST(!vf.is_block_present(i));
+			BOOST_TEST(std::all_of(buf.begin(), buf.end(), [](const char c) { return c == 0; }));
+		} else {
+			BOOST_TEST((buf == make_pattern(1 << 20, i)));
+		}
+	}
+	// New blocks go after the compacted ones.
+	vf.write(99 << 20, buf.data(), buf.size());
+	BOOST_TEST(mf.size() == empty_size + (21u << 20));
+	BOOST_TEST(vf.compact([](uint64_t) { return false; }) == 0u);
+	BOOST_TEST(mf.size() == empty_size + (21u << 20));
+}
+
+BOOST_AUTO_TEST_CASE(test_copy) {
+	memory_pio_file mf;
+	vhdx_file::create(mf, 100 << 20, 1 << 20);
+	const auto empty_size = mf.size();
+	vhdx_file vf(mf);
+	for (uint32_t i = 10; i < 20; i++) {
+		const auto block = make_pattern(1 << 20, i);
+		vf.write(static_cast<uint64_t>(i) << 20, block.data(), block.size());
+	}
+	const std::vector<char> zeros(1 << 20);
+	vf.write(50 << 20, zeros.data(), zeros.size());
+
+	memory_pio_file target;
+	vf.copy_to(target, [](const uint64_t block) { return block == 12; }, 4);
+	// The block of zeros and the unused block aren't copied.
+	BOOST_TEST(target.size() == empty_size + (9u << 20));
+	vhdx_file copy(target);
+	BOOST_TEST(copy.size() == vf.size());
+	BOOST_TEST(copy.get_block_size() == vf.get_block_size());
+	std::vector<char> buf(1 << 20);
+	for (uint32_t i = 10; i < 20; i++) {
+		copy.read(static_cast<uint64_t>(i) << 20, buf.data(), buf.size());
+		BOOST_TEST((buf == (i == 12 ? zeros : make_pattern(1 << 20, i))));
+	}
+	BOOST_TEST(!copy.is_block_present(50));
+}
+
+BOOST_AUTO_TEST_CASE(test_copy_sector_size) {
+	memory_pio_file mf;
+	vhdx_file::create(mf, 100 << 20, 1 << 20, 4096);
+	vhdx_file vf(mf);
+	BOOST_TEST(vf.get_sector_size() == 4096u);
+	const auto block = make_pattern(1 << 20, 3);
+	vf.write(3 << 20, block.data(), block.size());
+
+	// The copy keeps the sector size of the source.
+	memory_pio_file target;
+	vf.copy_to(target);
+	vhdx_file copy(target);
+	BOOST_TEST(copy.get_sector_size() == 4096u);
+	BOOST_TEST(copy.size() == vf.size());
+	std::vector<char> buf(1 << 20);
+	copy.read(3 << 20, buf.data(), buf.size());
+	BOOST_TEST((buf == block));
+}
+
+BOOST_AUTO_TEST_CASE(test_differencing) {
+	memory_pio_file pf;
+	vhdx_file::create(pf, 100 << 20, 1 << 20);
+	vhdx_file parent(pf);
+	for (uint32_t i = 0; i < 4; i++) {
+		const auto block = make_pattern(1 << 20, i);
+		parent.write(static_cast<uint64_t>(i) << 20, block.data(), block.size());
+	}
+	memory_pio_file cf;
+	vhdx_file::create_differencing(cf, parent);
+	const auto empty_size = cf.size();
+	{
+		vhdx_file child(cf, &parent);
+		BOOST_TEST(child.is_differencing());
+		BOOST_TEST(child.size() == parent.size());
+		// Writing to part of a block copies the rest of it from the parent.
+		child.write((1 << 20) + 100, "abc", 3);
+		child.write(10 << 20, "xyz", 3);
+	}
+	BOOST_TEST(cf.size() == empty_size + (2u << 20));
+
+	// Hyper-V may store only some sectors of a block, which are marked in the sector bitmap of its chunk.
+	const uint64_t bat_offset = 3 << 20, chunk_ratio = 4096, payload = cf.size();
+	cf.write(payload, std::vector<char>(1 << 20, 'p').data(), 1 << 20);
+	std::vector<char> bitmap(1 << 20);
+	bitmap[2 * 2048 / 8] = 3;
+	cf.write(payload + (1 << 20), bitmap.data(), bitmap.size());
+	const auto entry = payload | 7, bitmap_entry = (payload + (1 << 20)) | 6;
+	cf.write(bat_offset + 2 * 8, reinterpret_cast<const char *>(&entry), 8);
+	cf.write(bat_offset + chunk_ratio * 8, reinterpret_cast<const char *>(&bitmap_entry), 8);
+
+	vhdx_file child(cf, &parent);
+	auto expected = make_pattern(1 << 20, 1);
+	memcpy(expected.data() + 100, "abc", 3);
+	std::vector<char> buf(1 << 20);
+	child.read(1 << 20, buf.data(), buf.size());
+	BOOST_TEST((buf == expected));
+	child.read(0, buf.data(), buf.size());
+	BOOST_TEST((buf == make_pattern(1 << 20, 0)));
+	child.read(2 << 20, buf.data(), buf.size());
+	expected = make_pattern(1 << 20, 2);
+	std::fill(expected.begin(), expected.begin() + 1024, 'p');
+	BOOST_TEST((buf == expected));
+	child.write((2 << 20) + 2000, "q", 1);
+	child.read(2 << 20, buf.data(), buf.size());
+	expected[2000] = 'q';
+	BOOST_TEST((buf == expected));
+	BOOST_TEST(child.is_block_present(3));
+	BOOST_TEST(child.is_block_present(10));
+	BOOST_TEST(!child.is_block_present(50));
+	parent.read(1 << 20, buf.data(), buf.size());
+	BOOST_TEST((buf == make_pattern(1 << 20, 1)));
+	BOOST_CHECK_THROW(child.compact([](uint64_t) { return true; }), lro_error);
+
+	// Copying merges the data of the parent into a standalone disk.
+	memory_pio_file ff;
+	child.copy_to(ff);
+	vhdx_file flat(ff);
+	BOOST_TEST(!flat.is_differencing());
+	flat.read(2 << 20, buf.data(), buf.size());
+	BOOST_TEST((buf == expected));
+	flat.read(3 << 20, buf.data(), buf.size());
+	BOOST_TEST((buf == make_pattern(1 << 20, 3)));
+
+	// Any change to the parent breaks the link.
+	vhdx_file modified(pf);
+	modified.write(0, "x", 1);
+	BOOST_CHECK_THROW(vhdx_file vf(cf, &modified), lro_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
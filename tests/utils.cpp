@@ -1,5 +1,6 @@
 #include <boost/test/unit_test.hpp>
 #include "pch.h"
+#include "utils.h"
 
 std::wstring new_guid() {
 	GUID guid;
@@ -8,3 +9,74 @@ std::wstring new_guid() {
 	BOOST_TEST_REQUIRE(StringFromGUID2(guid, buf.get(), 39) != 0);
 	return buf.get();
 }
+
+recording_writer::recording_writer() {
+	path = std::make_unique<linux_path>();
+	target_path = std::make_unique<linux_path>();
+}
+
+bool recording_writer::write_new_file(const file_attr *attr) {
+	if (entries.size() == fail_at) throw lro_error::from_other(err_msg::err_archive, { L"test" });
+	recorded_entry e {};
+	e.path = path->data;
+	if (attr) {
+		e.mode = attr->mode;
+		e.uid = attr->uid;
+		e.gid = attr->gid;
+		e.at = attr->at;
+		e.mt = attr->mt;
+		e.ct = attr->ct;
+		if (attr->symlink) e.symlink = attr->symlink;
+	}
+	entries.push_back(std::move(e));
+	return !files_only || (attr && (attr->mode & AE_IFMT) == AE_IFREG);
+}
+
+void recording_writer::write_file_data(const char *buf, const uint32_t size) {
+	entries.back().data.append(buf, size);
+}
+
+void recording_writer::write_hard_link() {
+	recorded_entry e {};
+	e.path = path->data;
+	e.target = target_path->data;
+	entries.push_back(std::move(e));
+}
+
+void recording_writer::check_path(const file_path &) const {}
+
+std::map<wstr, recorded_entry> recording_writer::files() const {
+	std::map<wstr, recorded_entry> res;
+	for (const auto &e : entries) {
+		if (e.target.empty()) res[e.path] = e;
+	}
+	return res;
+}
+
+static linux_path make_path(crwstr path) {
+	return path.empty() ? linux_path() : linux_path(path, L"");
+}
+
+bool write_entry(fs_writer &writer, crwstr path, file_attr attr, const std::string &data) {
+	BOOST_TEST_REQUIRE(make_path(path).convert(*writer.path));
+	const auto is_file = (attr.mode & AE_IFMT) == AE_IFREG;
+	if (is_file) attr.size = data.size();
+	if (!writer.write_new_file(&attr)) return false;
+	if (!is_file) return true;
+	for (size_t off = 0; off < data.size(); off += 1 << 16) {
+		const auto size = std::min<size_t>(data.size() - off, 1 << 16);
+		writer.write_file_data(data.data() + off, static_cast<uint32_t>(size));
+	}
+	writer.write_file_data(nullptr, 0);
+	return true;
+}
+
+bool write_entry(fs_writer &writer, crwstr path, const uint32_t mode, const std::string &data) {
+	return write_entry(writer, path, file_attr { mode, 0, 0, 0, {}, {}, {}, 0, 0, nullptr }, data);
+}
+
+void write_hard_link(fs_writer &writer, crwstr path, crwstr target) {
+	BOOST_TEST_REQUIRE(make_path(path).convert(*writer.path));
+	BOOST_TEST_REQUIRE(make_path(target).convert(*writer.target_path));
+	writer.write_hard_link();
+}
@@ -2,3 +2,36 @@
 #include "pch.h"
 
 std::wstring new_guid();
+
+// Something passed to a recording_writer. Hard links only have their paths set.
+struct recorded_entry {
+	wstr path, target;
+	uint32_t mode, uid, gid;
+	unix_time at, mt, ct;
+	std::string symlink, data;
+};
+
+// Keeps everything written to it in memory, with Linux paths relative to the root.
+class recording_writer : public fs_writer {
+public:
+	std::vector<recorded_entry> entries;
+	// Makes write_new_file return false for anything but regular files, as if they were skipped.
+	bool files_only = false;
+	// Makes write_new_file throw once this many entries have been recorded.
+	size_t fail_at = SIZE_MAX;
+
+	recording_writer();
+	bool write_new_file(const file_attr *) override;
+	void write_file_data(const char *, uint32_t) override;
+	void write_hard_link() override;
+	void check_path(const file_path &) const override;
+	// The entries other than hard links by path. Later entries replace earlier ones with the same path.
+	[[nodiscard]] std::map<wstr, recorded_entry> files() const;
+};
+
+// Writes an entry the way readers do, with its Linux path relative to the root, where an empty path is the root itself.
+// The size of a regular file is taken from its data, which is passed in blocks of 64 KiB. Returns false if the writer
+// skips the entry.
+bool write_entry(fs_writer &, crwstr path, file_attr attr, const std::string &data = "");
+bool write_entry(fs_writer &, crwstr path, uint32_t mode, const std::string &data = "");
+void write_hard_link(fs_writer &, crwstr path, crwstr target);